@@ -0,0 +1,106 @@
+#ifndef ANTI_ENTROPY_H__
+#define ANTI_ENTROPY_H__
+
+#include "timer_handler.h"
+#include "timer_digest.h"
+#include "replicator.h"
+#include "dns_cache.h"
+
+#include <curl/curl.h>
+#include <pthread.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+// The level of the hash tree that's compared after the root, which splits the
+// tree into 32 subtrees of 32 leaves.
+#define ANTI_ENTROPY_SPLIT_LEVEL 5
+
+// Maximum number of leaves that are repaired for each node in each round, so
+// a node that has lost all its timers is brought up to date over several
+// rounds rather than all at once.
+#define ANTI_ENTROPY_MAX_LEAVES 64
+
+// Repairs timers that replicas disagree about, which can happen if a node
+// misses replication requests (because it was down, or partitioned from the
+// other replicas).  Without this, replicas are only brought back in line when
+// the timers pop.
+//
+// Every so often, this node compares the digest of the timers it shares with
+// each other node (see TimerDigest) with that node's digest of the same
+// timers.  It walks down the hash trees from the roots, fetching only the
+// hashes of the parts that differ, until it finds the leaves that differ.  It
+// then fetches the timers in those leaves, and sends the other node any of
+// them that this node has a newer version of.  The other node does the same
+// in return.
+class AntiEntropy
+{
+public:
+  AntiEntropy(TimerHandler* handler,
+              Replicator* replicator,
+              DnsCache* dns_cache,
+              int interval_s);
+  ~AntiEntropy();
+
+  // Start comparing with the other nodes (unless the interval is 0, which
+  // disables the repairs).
+  void start();
+  void stop();
+
+  // Repair the timers this node shares with another node.
+  void repair(NodeID node, const std::string& address);
+
+  // Add the indexes of the hashes that differ between two ranges of hashes
+  // starting at the given index.
+  static void differing(const std::vector<uint64_t>& local,
+                        const std::vector<uint64_t>& remote,
+                        uint32_t first,
+                        std::vector<uint32_t>& indexes);
+
+  // Get the timers that this node has and the other node doesn't, or that
+  // this node has a newer version of (from the timers and their start times).
+  static void newer_timers(const std::map<TimerID, uint64_t>& local,
+                           const std::map<TimerID, uint64_t>& remote,
+                           std::vector<TimerID>& ids);
+
+  // Parse a response to a digest request into its list of numbers (with the
+  // pairs in a list of timers flattened).  Returns false if it can't be
+  // parsed.
+  static bool parse_digest(const std::string& body,
+                           const char* key,
+                           std::vector<uint64_t>& values);
+
+private:
+  static void* thread_entry_point(void*);
+  void run();
+
+  bool get_hashes(const std::string& address,
+                  int level,
+                  uint32_t first,
+                  uint32_t count,
+                  std::vector<uint64_t>& hashes);
+  bool get_timers(const std::string& address,
+                  uint32_t leaf,
+                  std::map<TimerID, uint64_t>& timers);
+  bool get(const std::string& address,
+           const std::string& params,
+           std::string& body);
+  static size_t string_store(void*, size_t, size_t, void*);
+
+  TimerHandler* _handler;
+  Replicator* _replicator;
+  DnsCache* _dns_cache;
+  int _interval_s;
+
+  // Only used on the repair thread.
+  CURL* _curl;
+
+  pthread_t _thread;
+  bool _running;
+  bool _terminate;
+  pthread_mutex_t _mutex;
+  pthread_cond_t _cond;
+};
+
+#endif
@@ -20,6 +20,11 @@ public:
   //
   // Returns true if the callback was successful, false otherwise.
   virtual void perform(Timer*) = 0;
+
+  // Called once a set of timers that popped together have all been passed to
+  // `perform()`, so that any callbacks being held back to be sent together
+  // can be sent.
+  virtual void flush() {};
 };
 
 #endif
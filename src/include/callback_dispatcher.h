@@ -0,0 +1,28 @@
+#ifndef CALLBACK_DISPATCHER_H__
+#define CALLBACK_DISPATCHER_H__
+
+#include "callback.h"
+
+#include <map>
+#include <string>
+
+// Passes each timer to the callback that handles the timer's callback
+// protocol.  The dispatcher owns the callbacks added to it.
+class CallbackDispatcher : public Callback
+{
+public:
+  CallbackDispatcher();
+  ~CallbackDispatcher();
+
+  // Add a callback, which will be used for timers with its protocol.
+  void add_callback(Callback*);
+
+  std::string protocol() { return ""; };
+  void perform(Timer*);
+  void flush();
+
+private:
+  std::map<std::string, Callback*> _callbacks;
+};
+
+#endif
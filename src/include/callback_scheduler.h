@@ -0,0 +1,170 @@
+#ifndef CALLBACK_SCHEDULER_H__
+#define CALLBACK_SCHEDULER_H__
+
+#include "timer.h"
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <map>
+#include <queue>
+#include <string>
+#include <vector>
+
+// Number of callbacks an origin may have in progress when we first send it
+// callbacks.
+#define CALLBACK_SCHEDULER_INITIAL_LIMIT 4
+
+// Callbacks that take longer than this (or fail) count as a sign that the
+// origin is overloaded.
+#define CALLBACK_SCHEDULER_LATENCY_TARGET_MS 500
+
+// How long we remember the limit for an origin that we haven't sent any
+// callbacks to.
+#define CALLBACK_SCHEDULER_IDLE_EXPIRY_MS 60000
+
+// Most callbacks that may be queued for an origin.  Further callbacks for the
+// origin are refused, rather than queueing behind callbacks it can't keep up
+// with.
+#define CALLBACK_SCHEDULER_MAX_QUEUED 10000
+
+// Schedules the callbacks waiting to be sent, so that one slow or failing
+// callback host can't take up all the worker threads.
+//
+// Timers are queued per origin (see `ConnectionPool::origin()`), in order of
+// the deadline for their callbacks, and workers take them from each origin in
+// turn.  A batch of timers whose callbacks are sent in a single request is
+// queued in the same way, and counts as one callback.  Each origin may only
+// have a limited number of callbacks in progress, and a limited number
+// queued.  Callbacks that miss their deadline while queued are handed back
+// straight away, to be failed rather than sent.
+// The limit adapts to how the origin is coping (additive increase,
+// multiplicative decrease): it grows by one for each full window of callbacks
+// that succeed quickly, and halves when a callback fails or is slow.  It only
+// halves once for the callbacks that were in progress together, so a burst of
+// failures doesn't collapse the limit.
+class CallbackScheduler
+{
+public:
+
+  // `max_limit` is the most callbacks any origin may have in progress.
+  CallbackScheduler(int max_limit);
+  ~CallbackScheduler();
+
+  // Add a timer for an origin, with the deadline (in ms since the epoch) for
+  // its callback.  Returns false (leaving the caller with the timer) if the
+  // origin's queue is full.
+  bool push(const std::string& origin, Timer* timer, uint64_t deadline_ms);
+
+  // Add a batch of timers for an origin, with the deadline for the request
+  // that sends their callbacks.  The scheduler owns the batch until it's
+  // taken, unless the origin's queue is full, when this returns false.
+  bool push(const std::string& origin,
+            std::vector<Timer*>* batch,
+            uint64_t deadline_ms);
+
+  // Take the next callback to send, waiting until there is one for an origin
+  // that's below its limit.  This is either a single timer (and `batch` is
+  // NULL) or a batch (and `timer` is NULL).  Returns false once the
+  // scheduler has been terminated.  The callback must be reported to
+  // `complete()`, unless `expired` is set: a callback that has already
+  // missed its deadline is handed out whatever the origin's limit, doesn't
+  // take up one of its slots, and should be failed without being sent.
+  bool pop(std::string& origin,
+           Timer*& timer,
+           std::vector<Timer*>*& batch,
+           uint64_t& deadline_ms,
+           bool& expired);
+
+  // As `pop()`, but returns false rather than waiting if there's nothing to
+  // send.
+  bool try_pop(std::string& origin,
+               Timer*& timer,
+               std::vector<Timer*>*& batch,
+               uint64_t& deadline_ms,
+               bool& expired);
+
+  // Report a callback for an origin that has finished, and how long it took.
+  void complete(const std::string& origin, uint64_t latency_ms, bool succeeded);
+
+  // Report a callback for an origin that was never sent (for example because
+  // no connection was free in time).  This frees up its slot without
+  // counting against the origin.
+  void abandon(const std::string& origin);
+
+  // Wake any threads waiting on the scheduler, and stop handing out timers.
+  void terminate();
+
+  // The current limit for an origin.
+  int limit(const std::string& origin);
+
+private:
+  struct Entry
+  {
+    uint64_t deadline_ms;
+    uint64_t order;
+    Timer* timer;
+    std::vector<Timer*>* batch;
+
+    // Entries compare so that the earliest deadline is at the top of a
+    // priority queue.
+    bool operator<(const Entry& other) const
+    {
+      return (deadline_ms != other.deadline_ms) ?
+             (deadline_ms > other.deadline_ms) :
+             (order > other.order);
+    }
+  };
+
+  struct Origin
+  {
+    Origin() :
+      entries(),
+      in_flight(0),
+      limit(CALLBACK_SCHEDULER_INITIAL_LIMIT),
+      last_decrease_ms(0),
+      last_active_ms(0)
+    {}
+    std::priority_queue<Entry> entries;
+    int in_flight;
+    double limit;
+
+    // When the limit was last decreased, and when the origin was last given
+    // a callback to send or had one complete (on the monotonic clock).
+    uint64_t last_decrease_ms;
+    uint64_t last_active_ms;
+  };
+
+  bool push_entry(const std::string& origin, Entry& entry);
+  void release(std::map<std::string, Origin>::iterator it);
+  void sweep(uint64_t now);
+  bool take(std::string& origin,
+            Timer*& timer,
+            std::vector<Timer*>*& batch,
+            uint64_t& deadline_ms,
+            bool& expired);
+
+  static uint64_t monotonic_time_ms();
+  static uint64_t wall_time_ms();
+
+  // For testing purposes.
+  friend class TestCallbackScheduler;
+
+  int _max_limit;
+  std::map<std::string, Origin> _origins;
+
+  // The origin that was last given a timer.  The next timer comes from the
+  // next origin after it that can take one.
+  std::string _last_origin;
+
+  uint64_t _next_order;
+  bool _terminated;
+
+  // When idle origins were last looked for.
+  uint64_t _last_sweep_ms;
+
+  pthread_mutex_t _mutex;
+  pthread_cond_t _cond;
+};
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef CIRCUIT_BREAKER_H__
+#define CIRCUIT_BREAKER_H__
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <map>
+#include <string>
+
+// Tracks the health of a set of peers, so that requests to a peer that has
+// stopped responding can fail immediately rather than each waiting to time
+// out.
+//
+// Each peer's circuit starts closed (requests are sent).  It opens after a
+// number of consecutive failed requests, after which requests to the peer
+// are refused.  Once the probe interval has passed, a single request is let
+// through as a probe: if it succeeds the circuit closes again, otherwise it
+// stays open for another interval.
+class CircuitBreaker
+{
+public:
+  CircuitBreaker(int failure_threshold, int probe_interval_ms);
+  ~CircuitBreaker();
+
+  // Check whether a request may be sent to the peer.  If this returns true,
+  // the outcome of the request must be passed to `record()`.
+  bool allow(const std::string& peer);
+
+  // Record whether a request to the peer succeeded.
+  void record(const std::string& peer, bool succeeded);
+
+  // Whether the peer's circuit is open (or being probed).
+  bool is_open(const std::string& peer);
+
+private:
+  enum State { CLOSED, OPEN, PROBING };
+
+  struct Peer
+  {
+    Peer() : state(CLOSED), failures(0), probe_time_ms(0) {}
+    State state;
+    int failures;
+    uint64_t probe_time_ms;
+  };
+
+  static uint64_t monotonic_time_ms();
+
+  int _failure_threshold;
+  int _probe_interval_ms;
+
+  std::map<std::string, Peer> _peers;
+  pthread_mutex_t _mutex;
+};
+
+#endif
@@ -0,0 +1,108 @@
+#ifndef CLUSTER_VIEW_H__
+#define CLUSTER_VIEW_H__
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "replica_filter.h"
+#include "replica_set.h"
+
+// An immutable snapshot of the cluster configuration.
+//
+// A new view is built each time the config is reloaded and published through
+// `Globals::set_cluster_view()`.  Readers hold a reference to the view they
+// fetched, so they see a consistent cluster for as long as they need it,
+// without taking a lock or copying the configuration.
+class ClusterView
+{
+public:
+  // Nodes are identified within a view by their position in `addresses()`.
+  typedef uint16_t NodeIndex;
+
+  // How replicas are placed on the nodes.
+  //
+  // - MODULO picks consecutive nodes starting from the timer's hash modulo the
+  //   cluster size.  Changing the cluster size moves most timers.
+  // - RENDEZVOUS picks the nodes that score highest for the timer (optionally
+  //   weighted per node).  Adding a node to an N node cluster only moves about
+  //   1/(N+1) of the replicas, onto the new node.
+  enum Placement { MODULO, RENDEZVOUS };
+
+  ClusterView(const std::string& local_ip,
+              const std::vector<std::string>& addresses,
+              const std::map<std::string, uint64_t>& hashes,
+              Placement placement = MODULO,
+              const std::map<std::string, double>& weights =
+                                              std::map<std::string, double>(),
+              int filter_bits = ReplicaFilter::LEGACY_BITS,
+              int filter_hashes = ReplicaFilter::LEGACY_HASHES);
+
+  // The address of this node.
+  const std::string& local_ip() const { return _local_ip; }
+  NodeID local_id() const { return _local_id; }
+
+  // The addresses of the nodes in the cluster (in config order).
+  const std::vector<std::string>& addresses() const { return _addresses; }
+
+  // The bloom filter hash for each node in the cluster.
+  const std::map<std::string, uint64_t>& hashes() const { return _hashes; }
+
+  // The legacy bloom filter hash for a node (or 0 if it's not in the
+  // cluster).
+  uint64_t hash(const std::string& address) const;
+
+  // The replica filter for a node, in the configured format (or an empty
+  // filter if it's not in the cluster).
+  ReplicaFilter filter(NodeID node) const;
+
+  // An empty replica filter in the configured format.
+  const ReplicaFilter& empty_filter() const { return _empty_filter; }
+
+  size_t size() const { return _addresses.size(); }
+  const std::string& address(NodeIndex node) const { return _addresses[node]; }
+  NodeID node_id(NodeIndex node) const { return _node_ids[node]; }
+
+  // Find the nodes whose hashes are all present in a timer's replica filter
+  // (see `Timer::url()`), these are probably the timer's replicas.  The
+  // filter may be in any format, not just the configured one.
+  void match_hash(const ReplicaFilter& filter,
+                  std::vector<NodeIndex>& nodes) const;
+
+  // Pick the nodes to hold `count` replicas of a timer, given the hash of the
+  // timer's ID.
+  void place(uint32_t timer_hash,
+             unsigned int count,
+             std::vector<NodeIndex>& nodes) const;
+
+private:
+  const std::string _local_ip;
+  const NodeID _local_id;
+  const std::vector<std::string> _addresses;
+  const std::map<std::string, uint64_t> _hashes;
+
+  // The node hashes packed in the same order as the addresses, so matching a
+  // bloom filter is a scan of a few cache lines.  The legacy hashes are kept
+  // as well as the configured format, as legacy URLs may still be in use.
+  std::vector<uint64_t> _node_hashes;
+  std::vector<ReplicaFilter> _node_filters;
+  std::vector<NodeID> _node_ids;
+  std::map<NodeID, NodeIndex> _node_indexes;
+  ReplicaFilter _empty_filter;
+
+  // Rendezvous placement state, in the same order as the addresses.  A node's
+  // score for a timer is derived from its seed and the timer's hash.  Nodes
+  // without a configured weight have weight 1.
+  Placement _placement;
+  bool _weighted;
+  std::vector<uint32_t> _node_seeds;
+  std::vector<double> _node_weights;
+
+  void place_modulo(uint32_t, unsigned int, std::vector<NodeIndex>&) const;
+  void place_rendezvous(uint32_t, unsigned int, std::vector<NodeIndex>&) const;
+};
+
+typedef std::shared_ptr<const ClusterView> ClusterViewPtr;
+
+#endif
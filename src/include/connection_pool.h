@@ -0,0 +1,78 @@
+#ifndef CONNECTION_POOL_H__
+#define CONNECTION_POOL_H__
+
+#include <pthread.h>
+#include <time.h>
+#include <curl/curl.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+// A pool of cURL handles, kept per origin (scheme, host and port) so that a
+// handle's cached connection can be reused by whichever thread next needs to
+// talk to that origin.  Every handle shares a DNS cache.
+//
+// The number of handles in use for an origin (and so the number of
+// connections to it) is limited, and threads wait for a handle to be
+// returned once the limit is reached.  Idle handles are discarded once
+// they've not been used for the keepalive period (checked for every origin at
+// most once a second as handles are returned), along with the record of any
+// origin that then has no handles.
+class ConnectionPool
+{
+public:
+  ConnectionPool(int max_connections_per_host, int keepalive_s);
+  ~ConnectionPool();
+
+  // Borrow a handle for the given origin (see `origin()`).  The handle must be
+  // returned through `release()`.  If `timeout_ms` is non-zero, this gives up
+  // (and returns NULL) if no handle is free within that time.
+  CURL* acquire(const std::string& origin, int timeout_ms = 0);
+
+  // Return a borrowed handle.  If the handle's connection is no longer usable
+  // (e.g. because the request failed) pass `reuse` as false to discard it.
+  void release(const std::string& origin, CURL* curl, bool reuse);
+
+  // Return the origin of a URL (e.g. "http://host:80" for
+  // "http://host:80/path").
+  static std::string origin(const std::string& url);
+
+private:
+  struct IdleHandle
+  {
+    CURL* curl;
+    time_t last_used;
+  };
+
+  struct Origin
+  {
+    Origin() : in_use(0) {}
+    std::vector<IdleHandle> idle;
+    int in_use;
+  };
+
+  CURL* create_handle();
+  void sweep(time_t now, std::vector<CURL*>& expired);
+  static time_t now_s();
+
+  // For testing purposes.
+  friend class TestConnectionPool;
+
+  // Lock functions for the shared DNS cache.
+  static void lock_share(CURL*, curl_lock_data, curl_lock_access, void*);
+  static void unlock_share(CURL*, curl_lock_data, void*);
+
+  int _max_connections_per_host;
+  int _keepalive_s;
+
+  std::map<std::string, Origin> _origins;
+  time_t _last_sweep;
+  pthread_mutex_t _mutex;
+  pthread_cond_t _cond;
+
+  CURLSH* _share;
+  pthread_mutex_t _share_mutex;
+};
+
+#endif
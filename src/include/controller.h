@@ -24,6 +24,9 @@ private:
   Replicator* _replicator;
   TimerHandler* _handler;
 
+  void handle_bulk_request(struct evhttp_request*);
+  void handle_digest_request(struct evhttp_request*, const std::string&);
+  void handle_update_request(struct evhttp_request*, TimerID, const ReplicaFilter&);
   void send_error(struct evhttp_request*, int, const char*);
   std::string get_req_body(struct evhttp_request*);
 };
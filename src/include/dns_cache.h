@@ -0,0 +1,114 @@
+#ifndef DNS_CACHE_H__
+#define DNS_CACHE_H__
+
+#include <pthread.h>
+#include <time.h>
+#include <ares.h>
+#include <curl/curl.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+// How long addresses are cached for.  Lookups go through the hosts file as
+// well as DNS, so there isn't a TTL to go by.
+#define DNS_CACHE_TTL_S 300
+
+// How long to wait before retrying a lookup that failed.
+#define DNS_CACHE_RETRY_S 5
+
+// How long a request for a host that isn't cached yet waits for it to be
+// looked up, before leaving it to cURL's resolver.
+#define DNS_CACHE_MISS_WAIT_MS 100
+
+// Hosts that no request has asked for in this long are forgotten about.
+#define DNS_CACHE_IDLE_EXPIRY_S 600
+
+// A cache of the addresses of the hosts we send requests to (callback hosts
+// and other Chronos nodes), shared by every thread that sends requests.
+//
+// Lookups don't block.  If a host isn't in the cache, or its address has
+// expired, it is looked up in the background (using c-ares, on a dedicated
+// thread, checking the hosts file before DNS) and any expired address is used
+// in the meantime.  Requests for a host that isn't cached yet wait briefly
+// for it to be looked up, then fall back to cURL's own resolver.
+class DnsCache
+{
+public:
+  DnsCache();
+  ~DnsCache();
+
+  // Get the cached address for a host.  Returns false if there isn't one (in
+  // which case the host will be looked up).
+  bool lookup(const std::string& host, std::string& address);
+
+  // Get the list to pass to CURLOPT_RESOLVE to send a request to the URL
+  // using the cached address for its host, or NULL if there isn't one (or the
+  // host is already an IP address).  If the host isn't cached yet this waits
+  // for up to DNS_CACHE_MISS_WAIT_MS for it to be looked up.  The caller must
+  // free the list with `curl_slist_free_all()`.
+  struct curl_slist* resolve_list(const std::string& url);
+
+  // Add an address to the cache, as if it had been looked up.
+  void add(const std::string& host, const std::string& address, int ttl_s);
+
+  // Split the host and port out of a URL.  Returns false if the URL has no
+  // host.
+  static bool parse_url(const std::string& url, std::string& host, int& port);
+
+private:
+  struct Entry
+  {
+    Entry() : address(), expires(0), last_used(0), pending(false) {}
+
+    // The address for the host, or empty if it's not been found yet.
+    std::string address;
+    time_t expires;
+
+    // When a request last asked for the host.
+    time_t last_used;
+
+    // Whether the host is being looked up.
+    bool pending;
+  };
+
+  struct Query
+  {
+    DnsCache* cache;
+    std::string host;
+  };
+
+  static void* thread_entry_point(void*);
+  void run();
+  void wake();
+  bool wait_for_lookup(const std::string& host, std::string& address);
+  void prune(time_t now);
+  static void query_cb(void*, int, int, struct hostent*);
+  void query_complete(const std::string& host, int status, struct hostent* hostent);
+  static bool is_ip_address(const std::string& host);
+  static time_t now_s();
+
+  ares_channel _channel;
+  bool _channel_ok;
+
+  std::map<std::string, Entry> _entries;
+
+  // When unused entries were last looked for.
+  time_t _last_prune;
+
+  // Hosts waiting to be looked up by the resolver thread (which owns the
+  // c-ares channel).
+  std::vector<std::string> _new_queries;
+  bool _terminate;
+
+  pthread_mutex_t _mutex;
+
+  // Signalled when a lookup completes.
+  pthread_cond_t _cond;
+  pthread_t _thread;
+
+  // Pipe used to wake the resolver thread when there are new lookups.
+  int _wake_pipe[2];
+};
+
+#endif
@@ -7,6 +7,7 @@
 #include <vector>
 #include <boost/program_options.hpp>
 #include "updater.h"
+#include "cluster_view.h"
 
 // Defines a global variable and it's associated get and set
 // functions.  Note that, although get functions are protected
@@ -40,10 +41,21 @@ public:
 
   GLOBAL(bind_address, std::string);
   GLOBAL(bind_port, int);
-  GLOBAL(cluster_local_ip, std::string);
-  GLOBAL(cluster_hashes, std::map<std::string, uint64_t>);
-  GLOBAL(cluster_addresses, std::vector<std::string>);
+  GLOBAL(bind_unix_socket, std::string);
   GLOBAL(alarms_enabled, bool);
+  GLOBAL(callback_max_connections, int);
+  GLOBAL(callback_keepalive, int);
+  GLOBAL(callback_http2, bool);
+  GLOBAL(replication_threads, int);
+  GLOBAL(replication_max_in_flight_per_peer, int);
+  GLOBAL(replication_anti_entropy_interval, int);
+
+public:
+  // The cluster configuration is read far more often than it changes, so
+  // rather than copying it out under the lock, it's published as an immutable
+  // view that readers pick up with a single atomic load.
+  ClusterViewPtr get_cluster_view() { return std::atomic_load(&_cluster_view); }
+  void set_cluster_view(ClusterViewPtr view) { std::atomic_store(&_cluster_view, view); }
 
 public:
   void update_config();
@@ -51,8 +63,7 @@ public:
   void unlock() { pthread_rwlock_unlock(&_lock); }
 
 private:
-  uint64_t generate_hash(std::string);
-
+  ClusterViewPtr _cluster_view;
   pthread_rwlock_t _lock;
   Updater<void, Globals>* _updater;
   boost::program_options::options_description _desc;
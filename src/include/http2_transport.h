@@ -0,0 +1,57 @@
+#ifndef HTTP2_TRANSPORT_H__
+#define HTTP2_TRANSPORT_H__
+
+#include <pthread.h>
+#include <curl/curl.h>
+
+#include <vector>
+
+// Sends requests over HTTP/2 (h2c, with prior knowledge), so that requests to
+// the same origin from many threads are multiplexed as streams on a single
+// connection.
+//
+// Callers set up an easy handle as they would for `curl_easy_perform()` and
+// pass it to `perform()`, which blocks until the request completes.  All
+// handles are driven by one cURL multi handle on a dedicated thread, which
+// owns the connections.  If that thread can't be started, each request is
+// sent on the calling thread instead (without multiplexing).
+class Http2Transport
+{
+public:
+  Http2Transport();
+  ~Http2Transport();
+
+  // Send the request set up on the handle.
+  CURLcode perform(CURL* curl);
+
+  // Whether the version of cURL we're built and running with supports HTTP/2
+  // with prior knowledge.
+  static bool supported();
+
+private:
+  struct Request
+  {
+    CURL* curl;
+    CURLcode rc;
+    bool done;
+  };
+
+  static void* thread_entry_point(void*);
+  void run();
+  void wake();
+
+  CURLM* _multi;
+  pthread_t _thread;
+  bool _running;
+  pthread_mutex_t _mutex;
+  pthread_cond_t _cond;
+
+  // Requests waiting to be added to the multi handle.
+  std::vector<Request*> _new_requests;
+  bool _terminate;
+
+  // Pipe used to wake the transport thread when there are new requests.
+  int _wake_pipe[2];
+};
+
+#endif
@@ -2,22 +2,48 @@
 #define HTTP_CALLBACK_H__
 
 #include "callback.h"
-#include "eventq.h"
+#include "callback_scheduler.h"
 #include "timer_handler.h"
 #include "replicator.h"
 #include "timer.h"
 #include "alarm.h"
+#include "connection_pool.h"
+#include "http2_transport.h"
+#include "dns_cache.h"
 
 #include <string>
+#include <map>
+#include <vector>
+#include <unordered_set>
 #include <curl/curl.h>
 
 #define HTTPCALLBACK_THREAD_COUNT 50
 
+// Each callback must complete before the next replica of the timer pops it,
+// which is 2s after this replica does.  Callbacks for each host are sent in
+// order of this deadline (see CallbackScheduler), and time out when it passes
+// (though callbacks that are already late are given a short time to
+// complete).
+#define HTTPCALLBACK_DEADLINE_MS 2000
+#define HTTPCALLBACK_MIN_TIMEOUT_MS 200
+
+// Each worker thread re-arms recurring timers in batches, of up to this many
+// timers, held for about this many ms.  (Batches are flushed before sending a
+// callback once they've been held this long, and whenever the worker runs
+// out of callbacks to make.)
+#define HTTPCALLBACK_REARM_BATCH_SIZE 32
+#define HTTPCALLBACK_REARM_DELAY_MS 10
+
+// Timers that ask for batched callbacks are sent in batches of up to this
+// many timers.  Each batch is scheduled as a single callback to its origin.
+#define HTTPCALLBACK_MAX_BATCH_SIZE 100
+
 class HTTPCallback : public Callback
 {
 public:
   HTTPCallback(Replicator*,
-               Alarm* timer_pop_alarm);
+               Alarm* timer_pop_alarm,
+               DnsCache* dns_cache);
   ~HTTPCallback();
 
   void start(TimerHandler*);
@@ -25,19 +51,63 @@ public:
 
   std::string protocol() { return "http"; };
   void perform(Timer*);
+  void flush();
 
   static void* worker_thread_entry_point(void*);
   void worker_thread_entry_point();
 
+  static std::string batch_json(const std::vector<Timer*>& timers);
+  static bool parse_unix_uri(const std::string& uri,
+                             std::string& socket_path,
+                             std::string& url);
+  static void apply_response(Timer* timer,
+                             const std::string& content_type,
+                             const std::string& response);
+  static uint64_t callback_deadline(Timer* timer);
+  static long request_timeout_ms(uint64_t deadline_ms, uint64_t now_ms);
+  static bool parse_batch_response(const std::string& response,
+                                   std::vector<bool>& succeeded);
+
 private:
+  void send_batch(const std::string& origin,
+                  std::vector<Timer*>* timers,
+                  uint64_t deadline_ms);
+  void callback_succeeded(Timer* timer);
+  void callback_failed(Timer* timer);
+  void batch_failed(std::vector<Timer*>* timers);
+  void rearm_timers(std::unordered_set<Timer*>& timers);
+  CURLcode send_request(CURL* curl);
+  static std::string callback_origin(const std::string& uri);
+  struct curl_slist* set_callback_uri(CURL* curl, const std::string& uri);
+  static uint64_t monotonic_time_ms();
+  static uint64_t current_time_ms();
+  static size_t string_store(void* ptr, size_t size, size_t nmemb, void* stream);
+
   pthread_t _worker_threads[HTTPCALLBACK_THREAD_COUNT];
-  eventq<Timer*> _q;
+  CallbackScheduler* _scheduler;
+
+  // Timers waiting to be sent in a batch, by callback URL.  Only used from
+  // the timer handler's thread (through `perform()` and `flush()`).
+  std::map<std::string, std::vector<Timer*>> _pending_batches;
 
   bool _running;
   TimerHandler* _handler;
   Replicator* _replicator;
 
   Alarm* _timer_pop_alarm;
+
+  // Addresses of callback hosts, shared with the replicators.
+  DnsCache* _dns_cache;
+
+  // Connections to callback hosts, shared between the worker threads.
+  ConnectionPool* _pool;
+
+  // Transport for sending callbacks over HTTP/2, or NULL if callbacks are
+  // sent over HTTP/1.1.
+  Http2Transport* _http2;
+
+  // Headers common to every callback.
+  struct curl_slist* _headers;
 };
 
 #endif
@@ -0,0 +1,76 @@
+#ifndef REPLICA_FILTER_H__
+#define REPLICA_FILTER_H__
+
+#include <string>
+#include <stdint.h>
+
+// A bloom filter of the replicas for a timer, as encoded in the timer's URL
+// (see `Timer::url()`).  Each node has its own filter with `num_hashes` bits
+// set, and a timer's filter is the union of the filters of its replicas.
+//
+// Filters are 64, 128 or 256 bits wide.  A 64-bit filter always has 6 hashes
+// and is the legacy format, which is encoded as 16 hex digits.  Wider filters
+// are encoded as 2 hex digits giving the number of hashes, followed by the
+// filter itself (most significant bits first).
+class ReplicaFilter
+{
+public:
+  static const int LEGACY_BITS = 64;
+  static const int LEGACY_HASHES = 6;
+  static const int MAX_WORDS = 4;
+
+  // An empty legacy filter.
+  ReplicaFilter();
+
+  // An empty filter with the given parameters.
+  ReplicaFilter(int bits, int num_hashes);
+
+  // A legacy 64-bit filter.  This allows a legacy replica hash to be passed
+  // wherever a filter is expected.
+  ReplicaFilter(uint64_t legacy_filter);
+
+  // The filter for a single node.
+  static ReplicaFilter for_node(const std::string& address,
+                                int bits = LEGACY_BITS,
+                                int num_hashes = LEGACY_HASHES);
+
+  // Check whether filters with the given parameters can be encoded.  Only
+  // 64-bit filters with the legacy number of hashes can be, since the hex
+  // encoding of a 64-bit filter doesn't include the number of hashes.
+  static bool valid_format(int bits, int num_hashes);
+
+  // Parse a filter from its hex encoding.  Returns false if the encoding is
+  // invalid.
+  static bool from_hex(const std::string& hex, ReplicaFilter& filter);
+  std::string to_hex() const;
+
+  int bits() const { return _bits; }
+  int num_hashes() const { return _num_hashes; }
+  bool is_legacy() const;
+  bool empty() const;
+
+  // Check whether two filters have the same width and number of hashes (and
+  // so can be combined or compared).
+  bool same_format(const ReplicaFilter& other) const;
+
+  // Add the bits of another filter to this one.
+  void add(const ReplicaFilter& other);
+
+  // Check whether all the bits of another filter are set in this one.
+  bool contains(const ReplicaFilter& other) const;
+
+  // The low 64 bits of the filter (all of a legacy filter).
+  uint64_t low_word() const { return _words[0]; }
+
+  bool operator==(const ReplicaFilter& other) const;
+  bool operator!=(const ReplicaFilter& other) const { return !(*this == other); }
+
+private:
+  int _bits;
+  int _num_hashes;
+  uint64_t _words[MAX_WORDS];
+
+  int num_words() const { return _bits / 64; }
+};
+
+#endif
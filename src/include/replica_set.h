@@ -0,0 +1,95 @@
+#ifndef REPLICA_SET_H__
+#define REPLICA_SET_H__
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <stdint.h>
+
+// Node addresses are interned as small integer IDs, so timers can refer to
+// nodes cheaply and compare them with a single integer compare.  IDs are
+// stable for the life of the process (an ID is never reused, even if its node
+// leaves the cluster).
+typedef uint16_t NodeID;
+
+class NodeTable
+{
+public:
+  // Get the ID for an address, allocating one if it's new.
+  static NodeID intern(const std::string& address);
+
+  // Get the ID for an address without allocating one.  Returns false if the
+  // address has never been interned.
+  static bool find(const std::string& address, NodeID& id);
+
+  // Get the address for an ID.  The ID must have come from `intern()`.
+  static const std::string& address(NodeID id);
+
+private:
+  // Addresses are stored in chunks that are never moved or freed, so they can
+  // be read without a lock.
+  static const int CHUNK_SIZE = 256;
+  static const int MAX_CHUNKS = 256;
+
+  static pthread_mutex_t _lock;
+  static std::map<std::string, NodeID> _ids;
+  static std::atomic<const std::string**> _chunks[MAX_CHUNKS];
+};
+
+class ReplicaSet;
+typedef std::shared_ptr<const ReplicaSet> ReplicaSetPtr;
+
+// An immutable set of replicas for a timer (in order), plus any extra nodes
+// that updates to the timer must be sent to (see
+// `Timer::calculate_replicas()`).
+//
+// There are only a handful of distinct replica sets in a cluster, so they're
+// shared between all the timers with the same replicas.  Equal replica sets
+// are the same object, so can be compared by pointer.
+class ReplicaSet
+{
+public:
+  // Get the shared replica set for the given nodes.
+  static ReplicaSetPtr get(const std::vector<NodeID>& replicas,
+                           const std::vector<NodeID>& extra_replicas =
+                                                        std::vector<NodeID>());
+
+  // Get the shared replica set for the given addresses, without interning
+  // them (the addresses come from other nodes, so may not be trusted).
+  // Returns false if any of the addresses isn't a known node.
+  static bool find(const std::vector<std::string>& replicas,
+                   ReplicaSetPtr& set);
+
+  // The shared empty replica set.
+  static ReplicaSetPtr empty_set();
+
+  const std::vector<NodeID>& replicas() const { return _replicas; }
+  const std::vector<NodeID>& extra_replicas() const { return _extra_replicas; }
+  size_t size() const { return _replicas.size(); }
+  bool empty() const { return _replicas.empty(); }
+
+  // The position of a node in the replicas, or the number of replicas if it
+  // isn't one.
+  size_t index(NodeID node) const;
+  bool contains(NodeID node) const { return (index(node) < _replicas.size()); }
+
+  // The addresses of the replicas, in order.
+  std::vector<std::string> addresses() const;
+
+  ReplicaSet(const std::vector<NodeID>& replicas,
+             const std::vector<NodeID>& extra_replicas);
+
+private:
+  const std::vector<NodeID> _replicas;
+  const std::vector<NodeID> _extra_replicas;
+
+  typedef std::pair<std::vector<NodeID>, std::vector<NodeID> > Key;
+  static pthread_mutex_t _lock;
+  static std::map<Key, std::weak_ptr<const ReplicaSet> > _sets;
+  static size_t _sweep_size;
+};
+
+#endif
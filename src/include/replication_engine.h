@@ -0,0 +1,114 @@
+#ifndef REPLICATION_ENGINE_H__
+#define REPLICATION_ENGINE_H__
+
+#include "shared_string.h"
+#include "dns_cache.h"
+#include "circuit_breaker.h"
+
+#include <pthread.h>
+#include <curl/curl.h>
+
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+// Replication requests time out after this long, so a node that isn't
+// responding can't hold on to the worker threads.
+#define REPLICATOR_CONNECT_TIMEOUT_MS 1000
+#define REPLICATOR_TIMEOUT_MS 2000
+
+// Replication to a node stops after this many consecutive requests to it
+// have failed, and is retried by sending a single request once each probe
+// interval.
+#define REPLICATOR_BREAKER_FAILURES 3
+#define REPLICATOR_BREAKER_PROBE_MS 5000
+
+// The most requests that can be waiting for a node.  Once a node's queue is
+// full, the oldest request following a pop is dropped to make room.
+#define REPLICATOR_MAX_QUEUED_PER_PEER 10000
+
+struct ReplicationRequest
+{
+  const char* method;
+  std::string url;
+  SharedString body;
+
+  // The node the request is for (the origin of the URL).
+  std::string peer;
+
+  // Whether the request is on behalf of a client (rather than following a
+  // pop), in which case it's sent ahead of other requests to the node.
+  bool high_priority;
+};
+
+// Sends replication requests to the other nodes, for every Replicator in the
+// process.
+//
+// Requests are queued per node, and a shared pool of worker threads takes
+// them from each node in turn, with a limit on the number of requests in
+// progress to each node.  A slow or dead node therefore only holds up
+// requests to itself.  Within a node's queue, requests from clients are sent
+// before those following pops, and requests following pops are dropped first
+// if the queue is full.
+class ReplicationEngine
+{
+public:
+  // Start the given number of worker threads (which may be 0, in which case
+  // requests must be taken from the queues with `pop()`).
+  ReplicationEngine(int thread_count,
+                    int max_in_flight_per_peer,
+                    DnsCache* dns_cache);
+  ~ReplicationEngine();
+
+  // Queue a request, dropping a request for the node if its queue is full.
+  // Takes ownership of the request.
+  void push(ReplicationRequest* request);
+
+  // Take the next request to send, waiting for one if there aren't any.
+  // Returns false once the engine has been terminated.  Once it has been
+  // sent, the request must be passed to `complete()`.
+  bool pop(ReplicationRequest*& request);
+
+  // As `pop()`, but returns false straight away if there's no request that
+  // can be sent.
+  bool try_pop(ReplicationRequest*& request);
+
+  // Finish with a request, freeing up its node for another.
+  void complete(ReplicationRequest* request);
+
+  // Stop the worker threads.
+  void terminate();
+
+private:
+  struct Peer
+  {
+    Peer() : high_priority(), low_priority(), in_flight(0) {}
+    std::deque<ReplicationRequest*> high_priority;
+    std::deque<ReplicationRequest*> low_priority;
+    int in_flight;
+  };
+
+  static void* worker_thread_entry_point(void*);
+  void worker_thread_entry_point();
+  bool take(ReplicationRequest*& request);
+
+  int _max_in_flight_per_peer;
+  DnsCache* _dns_cache;
+  struct curl_slist* _headers;
+
+  // The health of the other nodes.
+  CircuitBreaker _breaker;
+
+  // The queue for each node with requests waiting or in progress, and the
+  // node that was last given a request.
+  std::map<std::string, Peer> _peers;
+  std::string _last_peer;
+  bool _terminated;
+
+  pthread_mutex_t _mutex;
+  pthread_cond_t _cond;
+  std::vector<pthread_t> _worker_threads;
+};
+
+#endif
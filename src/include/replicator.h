@@ -1,37 +1,39 @@
 #ifndef REPLICATOR_H__
 #define REPLICATOR_H__
 
-#include <curl/curl.h>
-
 #include "timer.h"
-#include "eventq.h"
-
-#define REPLICATOR_THREAD_COUNT 50
+#include "shared_string.h"
+#include "replication_engine.h"
 
-struct ReplicationRequest
-{
-  std::string url;
-  std::string body;
-};
-
-// This class is used to replicate timers to the specified replicas, using cURL
-// to handle the HTTP construction and sending.
+// This class is used to replicate timers to the specified replicas.  The
+// requests are sent by the process's replication engine, which is shared by
+// every Replicator.
 class Replicator
 {
 public:
-  Replicator();
+  // Create a replicator whose requests are sent by the given engine.  Requests
+  // are marked as high priority if the replicator is used for requests from
+  // clients (rather than for pops).  Requests are dropped if there's no
+  // engine.
+  Replicator(ReplicationEngine* engine = NULL, bool high_priority = false);
   virtual ~Replicator();
 
-  void worker_thread_entry_point();
   virtual void replicate(Timer*);
+  virtual void replicate_timing(Timer*);
+
+  // Replicate the timer to just one of its replicas.
+  virtual void replicate_to(Timer*, NodeID);
 
-  static void* worker_thread_entry_point(void*);
+  // Replicate many timers, with a single bulk request to each of the nodes
+  // that are replicas for any of them.
+  virtual void replicate_bulk(const std::vector<Timer*>&);
 
 private:
-  void replicate_int(const std::string&, const std::string&);
-  eventq<ReplicationRequest *> _q;
-  pthread_t _worker_threads[REPLICATOR_THREAD_COUNT];
-  struct curl_slist* _headers;
+  void replicate_to_all(Timer*, const char*, const SharedString&);
+  void replicate_int(const char*, const SharedString&, const std::string&);
+
+  ReplicationEngine* _engine;
+  bool _high_priority;
 };
 
 #endif
@@ -0,0 +1,62 @@
+#ifndef SHARED_STRING_H__
+#define SHARED_STRING_H__
+
+#include <map>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <pthread.h>
+
+// An immutable, reference counted string.  Copying a SharedString just
+// shares the underlying buffer, so large values (such as a timer's opaque
+// callback body) are never duplicated as the timer is copied, re-armed,
+// replicated or popped.
+//
+// Frequently repeated values (such as callback URLs) can also be interned so
+// that all the timers with the same value share a single buffer.
+class SharedString
+{
+public:
+  SharedString();
+  SharedString(const char* str);
+  SharedString(const std::string& str);
+  SharedString(std::string&& str);
+
+  // Get the shared buffer holding the given value, creating it if needed.
+  static SharedString intern(const std::string& str);
+
+  const std::string& str() const { return *_str; }
+  operator const std::string&() const { return *_str; }
+  const char* c_str() const { return _str->c_str(); }
+  const char* data() const { return _str->data(); }
+  size_t length() const { return _str->length(); }
+  bool empty() const { return _str->empty(); }
+
+  // Check whether two strings share the same buffer.
+  bool shares(const SharedString& other) const { return (_str == other._str); }
+
+  bool operator==(const SharedString& other) const
+  {
+    return (shares(other) || (*_str == *other._str));
+  }
+  bool operator!=(const SharedString& other) const { return !(*this == other); }
+
+private:
+  std::shared_ptr<const std::string> _str;
+
+  static pthread_mutex_t _lock;
+  static std::map<std::string, std::weak_ptr<const std::string> > _interned;
+  static size_t _sweep_size;
+};
+
+inline bool operator==(const SharedString& lhs, const std::string& rhs) { return (lhs.str() == rhs); }
+inline bool operator==(const std::string& lhs, const SharedString& rhs) { return (lhs == rhs.str()); }
+inline bool operator==(const SharedString& lhs, const char* rhs) { return (lhs.str() == rhs); }
+inline bool operator==(const char* lhs, const SharedString& rhs) { return (lhs == rhs.str()); }
+
+inline std::ostream& operator<<(std::ostream& os, const SharedString& str)
+{
+  return os << str.str();
+}
+
+#endif
@@ -0,0 +1,145 @@
+#ifndef STREAM_CALLBACK_H__
+#define STREAM_CALLBACK_H__
+
+#include "callback.h"
+#include "timer_handler.h"
+#include "replicator.h"
+#include "timer.h"
+#include "alarm.h"
+
+#include <event2/event.h>
+#include <event2/http.h>
+#include <pthread.h>
+
+#include <map>
+#include <set>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+// Maximum number of popped timers waiting to be streamed to each consumer.
+// Further pops for the consumer fail until it catches up.
+#define STREAMCALLBACK_RING_SIZE 10000
+
+// Time a consumer has to acknowledge a pop before it fails.  This matches the
+// time allowed for an HTTP callback.
+#define STREAMCALLBACK_ACK_TIMEOUT_MS 2000
+
+// How often to check for pops that haven't been acknowledged in time.
+#define STREAMCALLBACK_TICK_MS 100
+
+// Delivers callbacks to consumers that have opened a stream to us, rather than
+// sending a request per pop.  A consumer opens a long-lived chunked stream
+// with `GET /pops?consumer=<name>`, and the timers that use the "stream"
+// protocol with that consumer as their URI are written to it as newline
+// delimited JSON records.  The consumer acknowledges the records (in batches)
+// with `POST /pops/ack?consumer=<name>`.
+//
+// Timers are passed from the timer handler into a ring buffer per consumer,
+// and streamed from the HTTP server's event loop (which owns the streams, as
+// libevent isn't thread-safe).
+class StreamCallback : public Callback
+{
+public:
+  StreamCallback(Replicator*,
+                 Alarm* timer_pop_alarm);
+  ~StreamCallback();
+
+  // Start streaming on the given event loop (which must be the one serving
+  // the HTTP API).
+  void start(TimerHandler*, struct event_base*);
+  void stop();
+
+  std::string protocol() { return "stream"; };
+  void perform(Timer*);
+  void flush();
+
+  // Handlers for the `/pops` and `/pops/ack` paths.
+  static void pops_cb(struct evhttp_request*, void*);
+  static void ack_cb(struct evhttp_request*, void*);
+
+  static std::string record_json(uint64_t id, Timer* timer);
+  static bool parse_ack(const std::string& body,
+                        uint64_t& ack,
+                        std::set<uint64_t>& failed);
+
+  // A fixed size ring buffer of timers.
+  class TimerRing
+  {
+  public:
+    TimerRing(size_t capacity) : _timers(capacity), _head(0), _count(0) {}
+
+    bool empty() const { return (_count == 0); }
+    size_t size() const { return _count; }
+
+    // Add a timer to the back of the ring.  Returns false if the ring is full.
+    bool push(Timer* timer);
+
+    // Remove the timer at the front of the ring.  Returns NULL if the ring is
+    // empty.
+    Timer* pop();
+
+  private:
+    std::vector<Timer*> _timers;
+    size_t _head;
+    size_t _count;
+  };
+
+private:
+  struct Unacked
+  {
+    Timer* timer;
+    uint64_t deadline_ms;
+  };
+
+  struct Consumer
+  {
+    Consumer() :
+      stream(NULL), pending(STREAMCALLBACK_RING_SIZE), unacked(), next_id(1)
+    {}
+
+    // The consumer's stream, or NULL once it has been closed.
+    struct evhttp_request* stream;
+
+    // Timers waiting to be streamed.
+    TimerRing pending;
+
+    // Timers that have been streamed, by the ID of their record.
+    std::map<uint64_t, Unacked> unacked;
+    uint64_t next_id;
+  };
+
+  void handle_pops(struct evhttp_request*);
+  void handle_ack(struct evhttp_request*);
+  void stream_closed(struct evhttp_connection*);
+  void deliver();
+  void expire();
+
+  static void stream_closed_cb(struct evhttp_connection*, void*);
+  static void wake_cb(evutil_socket_t, short, void*);
+  static void tick_cb(evutil_socket_t, short, void*);
+
+  static bool get_consumer(struct evhttp_request*, std::string&);
+  static std::string get_req_body(struct evhttp_request*);
+  void callback_succeeded(Timer* timer);
+  void callback_failed(Timer* timer);
+  static uint64_t monotonic_time_ms();
+
+  TimerHandler* _handler;
+  Replicator* _replicator;
+
+  Alarm* _timer_pop_alarm;
+
+  // The consumers with open streams.  Protected by the mutex, as timers are
+  // added to them from the timer handler's thread.
+  std::map<std::string, Consumer*> _consumers;
+  pthread_mutex_t _mutex;
+
+  // Events on the HTTP server's event loop.  The wake pipe is written to when
+  // there are new timers to stream.
+  struct event* _wake_event;
+  struct event* _tick_event;
+  int _wake_pipe[2];
+};
+
+#endif
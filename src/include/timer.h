@@ -4,8 +4,24 @@
 #include <vector>
 #include <string>
 
+#include "replica_filter.h"
+#include "replica_set.h"
+#include "shared_string.h"
+
 typedef uint64_t TimerID;
 
+struct TimerJSON;
+
+// The timing of a timer, as set by a timing update (see
+// `Timer::timing_from_json()`).
+struct TimerTiming
+{
+  uint64_t start_time;
+  uint32_t sequence_number;
+  uint32_t interval;
+  uint32_t repeat_for;
+};
+
 class Timer
 {
 public:
@@ -24,8 +40,19 @@ public:
   // Convert this timer to JSON to be sent to replicas
   std::string to_json();
 
+  // Convert this timer to JSON to be sent to replicas in a bulk request,
+  // which also carries the timer's ID
+  std::string bulk_json();
+
+  // Convert the timing of this timer to JSON to be sent to replicas as a
+  // timing update
+  std::string timing_json();
+
+  // Apply a timing update to this timer
+  void set_timing(const TimerTiming&);
+
   // Check if the timer is owned by the specified node.
-  bool is_local(std::string);
+  bool is_local(NodeID);
 
   // Check if this node is the last replica for the timer
   bool is_last_replica();
@@ -37,7 +64,7 @@ public:
   void become_tombstone();
 
   // Calculate/Guess at the replicas for this timer (using the replica hash if present)
-  void calculate_replicas(uint64_t);
+  void calculate_replicas(const ReplicaFilter&);
 
   // Member variables (mostly public since this is pretty much a struct with utility
   // functions, rather than a full-blown object).
@@ -46,19 +73,51 @@ public:
   uint32_t interval;
   uint32_t repeat_for;
   uint32_t sequence_number;
-  std::vector<std::string> replicas;
-  std::vector<std::string> extra_replicas;
-  std::string callback_url;
-  std::string callback_body;
+
+  // The timer's replicas and callback.  These are rendered once into the
+  // timer's JSON (see `to_json()`), so are only changed through the setters,
+  // which discard the rendered JSON.
+  const ReplicaSetPtr& replicas() const { return _replicas; }
+  const SharedString& callback_protocol() const { return _callback_protocol; }
+  const SharedString& callback_url() const { return _callback_url; }
+  const SharedString& callback_body() const { return _callback_body; }
+
+  // Whether the callback may be delivered in a batch with other timers
+  // popping for the same URL.
+  bool callback_batch() const { return _callback_batch; }
+
+  void set_replicas(const ReplicaSetPtr& replicas);
+  void set_callback_protocol(const SharedString& protocol);
+  void set_callback_url(const SharedString& url);
+  void set_callback_body(const SharedString& body);
+  void set_callback_batch(bool batch);
 
 private:
   unsigned int _replication_factor;
 
+  ReplicaSetPtr _replicas;
+  SharedString _callback_protocol;
+  SharedString _callback_url;
+  SharedString _callback_body;
+  bool _callback_batch;
+
+  // The rendered callback and reliability blocks of the timer's JSON (see
+  // `to_json()`), or empty if they've not been rendered yet.  Cleared by the
+  // setters for the callback and replicas.
+  std::string _static_json;
+  std::string static_json();
+  std::string render_json(bool include_id);
+
+  static Timer* from_parsed_json(TimerID, const ReplicaFilter&, TimerJSON&, std::string&, bool&);
+
   // Class functions
 public:
   static TimerID generate_timer_id();
-  static Timer* create_tombstone(TimerID, uint64_t);
-  static Timer* from_json(TimerID, uint64_t, std::string, std::string&, bool&);
+  static Timer* create_tombstone(TimerID, const ReplicaFilter&);
+  static Timer* from_json(TimerID, const ReplicaFilter&, const std::string&, std::string&, bool&);
+  static bool from_json_array(const std::string&, std::vector<Timer*>&, std::vector<bool>&, std::string&);
+  static bool timing_from_json(const std::string&, TimerTiming&, ReplicaSetPtr&, std::string&, bool&);
+  static bool callback_response_from_json(const std::string&, TimerTiming&, bool&, bool&, std::string&);
 
   // Class variables
   static uint32_t deployment_id;
@@ -0,0 +1,80 @@
+#ifndef TIMER_DIGEST_H__
+#define TIMER_DIGEST_H__
+
+#include "timer.h"
+#include "replica_set.h"
+
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// The depth of each hash tree.  The trees have 1024 leaves.
+#define TIMER_DIGEST_DEPTH 10
+#define TIMER_DIGEST_LEAVES (1 << TIMER_DIGEST_DEPTH)
+
+// Hash trees summarising the live timers in the store, so that replicas can
+// find out which timers they disagree about without swapping them all (see
+// AntiEntropy).
+//
+// There's a tree for each node that's a replica for any of the timers, which
+// covers the timers that node is a replica for.  Timers are spread over the
+// leaves of the tree by ID, and a leaf's hash is the XOR of the hashes of its
+// timers' IDs and start times (the start time changing whenever a client
+// changes the timer, but not as it pops).  Every other node in the tree is the
+// XOR of its children, so a tree is updated in a single walk from a leaf to
+// the root, and two nodes that hold the same timers have the same trees.
+class TimerDigest
+{
+public:
+  TimerDigest();
+  ~TimerDigest();
+
+  // Record a timer, replacing any previous version of it.
+  void add(TimerID id, uint64_t start_time, const ReplicaSetPtr& replicas);
+
+  // Forget a timer.
+  void remove(TimerID id);
+
+  // Get the hashes of a range of the nodes at the given level (from 0 for the
+  // root to TIMER_DIGEST_DEPTH for the leaves) of the tree for a node.  The
+  // range is truncated at the end of the level.
+  void hashes(NodeID node,
+              int level,
+              uint32_t first,
+              uint32_t count,
+              std::vector<uint64_t>& hashes) const;
+
+  // Get the timers (and their start times) in a leaf of the tree for a node.
+  void timers(NodeID node,
+              uint32_t leaf,
+              std::map<TimerID, uint64_t>& timers) const;
+
+  // The leaf a timer belongs in.
+  static uint32_t leaf(TimerID id);
+
+private:
+  struct Entry
+  {
+    uint64_t start_time;
+    ReplicaSetPtr replicas;
+  };
+
+  typedef std::vector<uint64_t> Tree;
+
+  void update(const Entry& entry, TimerID id);
+  static uint64_t hash(TimerID id, uint64_t start_time);
+
+  // The version of each timer.
+  std::unordered_map<TimerID, Entry> _entries;
+
+  // The IDs of the timers in each leaf (which is the same for every tree).
+  std::vector<std::unordered_set<TimerID> > _leaves;
+
+  // The tree for each node.  The root is at index 1, and the children of the
+  // node at index i are at 2i and 2i + 1, so the leaves start at index
+  // TIMER_DIGEST_LEAVES.
+  std::map<NodeID, Tree> _trees;
+};
+
+#endif
@@ -18,6 +18,14 @@ public:
   TimerHandler(TimerStore*, Callback*);
   ~TimerHandler();
   void add_timer(Timer*);
+  void add_timers(std::unordered_set<Timer*>&);
+  Timer* update_timer(TimerID, const TimerTiming&, const ReplicaSetPtr&, const ReplicaFilter&, bool&);
+  void rearm_timer(Timer*);
+  void rearm_timers(std::unordered_set<Timer*>&);
+  void release_timer(TimerID);
+  Timer* get_timer(TimerID);
+  void get_digest_hashes(NodeID, int, uint32_t, uint32_t, std::vector<uint64_t>&);
+  void get_digest_timers(NodeID, uint32_t, std::map<TimerID, uint64_t>&);
   void run();
 
   friend class TestTimerHandler;
@@ -2,8 +2,10 @@
 #define TIMER_STORE_H__
 
 #include "timer.h"
+#include "timer_digest.h"
 
 #include <unordered_set>
+#include <unordered_map>
 #include <map>
 #include <string>
 
@@ -20,9 +22,33 @@ public:
   // Remove a timer by ID from the store.
   virtual void delete_timer(TimerID);
 
+  // Update the timing and replicas of a timer in the store.  Sets the flag if
+  // the timer can't be updated because it has popped and not yet been
+  // re-armed.
+  virtual Timer* update_timer(TimerID,
+                              const TimerTiming&,
+                              const ReplicaSetPtr& replicas,
+                              const ReplicaFilter& replica_hash,
+                              bool& popping);
+
   // Get the next bucket of timers to pop.
   virtual void get_next_timers(std::unordered_set<Timer*>&);
 
+  // Re-arm timers that have popped, for their next pop.
+  virtual void rearm_timer(Timer*);
+  virtual void rearm_timers(std::unordered_set<Timer*>&);
+
+  // Give up on a popped timer that won't be re-armed.
+  virtual void release_timer(TimerID);
+
+  // Get a live timer (still owned by the store), or NULL if the store doesn't
+  // hold one with this ID (including if it has popped).
+  virtual Timer* get_timer(TimerID);
+
+  // Get the digest of the live timers in the store (including any that have
+  // popped and are due to be re-armed).
+  const TimerDigest& digest() const { return _digest; }
+
   // Give the UT test fixture access to our member variables
   friend class TestTimerStore;
 
@@ -78,10 +104,35 @@ private:
   // This does mean that when removing a timer, the overdue set, both wheels and
   // the heap may need to be searched, although the timer is guaranteed to be in
   // only one of them (and the heap is searched last for efficiency).
-
-  // A table of all known timers
+  //
+  // Tombstones are not stored as timers.  A node that isn't a replica for a
+  // timer only needs to know enough about it to reject out of date versions, so
+  // tombstones are reduced to a compact record (start time, sequence number and
+  // expiry) when they're added, and the Timer object is freed.  The records
+  // have their own coarse (1s) expiry wheel and are never handed back by
+  // `get_next_timers()`, they're simply discarded once they expire.
+
+  // A table of all known timers.  When a timer pops its entry is kept (with
+  // a NULL timer) until the timer is re-armed or released, so re-arming a
+  // recurring timer doesn't need to rebuild the entry.  While the entry is
+  // NULL, the store behaves as though it doesn't hold the timer.
   std::map<TimerID, Timer *> _timer_lookup_table;
 
+  // The information kept for a tombstone.  The expiry is stored in seconds.
+  struct Tombstone
+  {
+    uint64_t start_time;
+    uint32_t sequence_number;
+    uint32_t expiry;
+  };
+
+  // A table of all known tombstones.
+  std::unordered_map<TimerID, Tombstone> _tombstone_table;
+
+  // The digest of the live timers, kept up to date as timers are added and
+  // removed.
+  TimerDigest _digest;
+
   // Constants controlling the size and resolution of the timer wheels.
   static const int SHORT_WHEEL_RESOLUTION_MS = 10;
   static const int SHORT_WHEEL_NUM_BUCKETS = 100;
@@ -112,6 +163,16 @@ private:
   // a multiple of SHORT_WHEEL_RESOLUTION_MS.
   uint64_t _tick_timestamp;
 
+  // The tombstone expiry wheel, consisting of 3600 1s buckets.  Each bucket
+  // holds the IDs of the tombstones that expire in it, (possibly after several
+  // rotations of the wheel).  Entries for tombstones that have since been
+  // replaced or removed are skipped when the bucket is processed.
+  static const int TOMBSTONE_WHEEL_NUM_BUCKETS = 3600;
+  std::vector<TimerID> _tombstone_wheel[TOMBSTONE_WHEEL_NUM_BUCKETS];
+
+  // The next second of the tombstone wheel to process.
+  uint64_t _tombstone_tick;
+
   // Return the current wall time in ms.
   static uint64_t wall_time_ms();
 
@@ -148,6 +209,23 @@ private:
   // store's consistency.
   void purge_timer_from_wheels(Timer* timer);
 
+  // Place a timer in, or remove it from, the timer wheels/heap (but not the
+  // lookup table).
+  void insert_timer(Timer* timer);
+  void unlink_timer(Timer* timer);
+
+  // Record a tombstone in the tombstone table (freeing the timer).
+  void add_tombstone(Timer* tombstone);
+
+  // Discard any tombstones that have expired by the given time (in seconds).
+  void expire_tombstones(uint64_t now_s);
+
+  // Compare timers for precedence, start-time then sequence-number.
+  static bool is_older(uint64_t start_time,
+                       uint32_t sequence_number,
+                       uint64_t other_start_time,
+                       uint32_t other_sequence_number);
+
   // Pop a single timer bucket into the set.
   void pop_bucket(TimerStore::Bucket* bucket,
                   std::unordered_set<Timer*>& set);
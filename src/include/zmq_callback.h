@@ -0,0 +1,70 @@
+#ifndef ZMQ_CALLBACK_H__
+#define ZMQ_CALLBACK_H__
+
+#include "callback.h"
+#include "eventq.h"
+#include "timer_handler.h"
+#include "replicator.h"
+#include "timer.h"
+#include "alarm.h"
+
+#include <map>
+#include <string>
+#include <unordered_set>
+
+// Maximum number of callbacks queued for each endpoint before further
+// callbacks to it fail.
+#define ZMQCALLBACK_SEND_HWM 10000
+
+// Timers are re-armed in batches, as for HTTPCallback.
+#define ZMQCALLBACK_REARM_BATCH_SIZE 32
+#define ZMQCALLBACK_REARM_DELAY_MS 10
+
+// Delivers callbacks as ZeroMQ messages on a PUSH socket per endpoint (the
+// callback URI, e.g. "tcp://127.0.0.1:5555" or "ipc:///var/run/client").
+// Each message has two frames, the sequence number (as a decimal string) and
+// the opaque data.
+//
+// PUSH sockets don't acknowledge messages, so a callback succeeds once the
+// message is queued for the endpoint.  Sockets aren't thread-safe so all
+// callbacks are sent from a single worker thread, which owns the sockets.
+class ZmqCallback : public Callback
+{
+public:
+  ZmqCallback(Replicator*,
+              Alarm* timer_pop_alarm);
+  ~ZmqCallback();
+
+  void start(TimerHandler*);
+  void stop();
+
+  std::string protocol() { return "zmq"; };
+  void perform(Timer*);
+
+  static void* worker_thread_entry_point(void*);
+  void worker_thread_entry_point();
+
+private:
+  bool send(Timer* timer);
+  void* get_socket(const std::string& uri);
+  void callback_succeeded(Timer* timer);
+  void callback_failed(Timer* timer);
+  void rearm_timers(std::unordered_set<Timer*>& timers);
+  static uint64_t monotonic_time_ms();
+
+  pthread_t _worker_thread;
+  eventq<Timer*> _q;
+
+  bool _running;
+  TimerHandler* _handler;
+  Replicator* _replicator;
+
+  Alarm* _timer_pop_alarm;
+
+  // The ZeroMQ context and the socket for each endpoint (only used from the
+  // worker thread).
+  void* _context;
+  std::map<std::string, void*> _sockets;
+};
+
+#endif
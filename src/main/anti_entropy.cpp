@@ -0,0 +1,442 @@
+#include "anti_entropy.h"
+#include "globals.h"
+#include "log.h"
+
+#include "rapidjson/reader.h"
+
+#include <algorithm>
+#include <cstring>
+#include <sstream>
+#include <time.h>
+
+AntiEntropy::AntiEntropy(TimerHandler* handler,
+                         Replicator* replicator,
+                         DnsCache* dns_cache,
+                         int interval_s) :
+  _handler(handler),
+  _replicator(replicator),
+  _dns_cache(dns_cache),
+  _interval_s(interval_s),
+  _curl(NULL),
+  _running(false),
+  _terminate(false)
+{
+  pthread_mutex_init(&_mutex, NULL);
+  pthread_cond_init(&_cond, NULL);
+
+  _curl = curl_easy_init();
+  curl_easy_setopt(_curl, CURLOPT_NOSIGNAL, 1L);
+  curl_easy_setopt(_curl, CURLOPT_CONNECTTIMEOUT_MS, (long)REPLICATOR_CONNECT_TIMEOUT_MS);
+  curl_easy_setopt(_curl, CURLOPT_TIMEOUT_MS, (long)REPLICATOR_TIMEOUT_MS);
+  curl_easy_setopt(_curl, CURLOPT_WRITEFUNCTION, &AntiEntropy::string_store);
+}
+
+AntiEntropy::~AntiEntropy()
+{
+  if (_running)
+  {
+    stop();
+  }
+
+  curl_easy_cleanup(_curl);
+  pthread_cond_destroy(&_cond);
+  pthread_mutex_destroy(&_mutex);
+}
+
+void AntiEntropy::start()
+{
+  if (_interval_s <= 0)
+  {
+    LOG_STATUS("Anti-entropy repair is disabled");
+    return;
+  }
+
+  int thread_rc = pthread_create(&_thread,
+                                 NULL,
+                                 AntiEntropy::thread_entry_point,
+                                 (void*)this);
+  if (thread_rc != 0)
+  {
+    LOG_ERROR("Failed to start anti-entropy thread: %s", strerror(thread_rc));
+    return;
+  }
+
+  _running = true;
+}
+
+void AntiEntropy::stop()
+{
+  pthread_mutex_lock(&_mutex);
+  _terminate = true;
+  pthread_cond_signal(&_cond);
+  pthread_mutex_unlock(&_mutex);
+
+  if (_running)
+  {
+    pthread_join(_thread, NULL);
+    _running = false;
+  }
+}
+
+void AntiEntropy::repair(NodeID node, const std::string& address)
+{
+  // Nothing to do if the roots match.
+  std::vector<uint64_t> local;
+  std::vector<uint64_t> remote;
+  _handler->get_digest_hashes(node, 0, 0, 1, local);
+  if ((!get_hashes(address, 0, 0, 1, remote)) || (local == remote))
+  {
+    return;
+  }
+
+  // Find the subtrees that differ.
+  uint32_t subtrees = (1 << ANTI_ENTROPY_SPLIT_LEVEL);
+  std::vector<uint32_t> differing_subtrees;
+  _handler->get_digest_hashes(node, ANTI_ENTROPY_SPLIT_LEVEL, 0, subtrees, local);
+  if (!get_hashes(address, ANTI_ENTROPY_SPLIT_LEVEL, 0, subtrees, remote))
+  {
+    return;
+  }
+  differing(local, remote, 0, differing_subtrees);
+
+  // And the leaves that differ within them.
+  uint32_t span = (TIMER_DIGEST_LEAVES >> ANTI_ENTROPY_SPLIT_LEVEL);
+  std::vector<uint32_t> differing_leaves;
+  for (auto it = differing_subtrees.begin();
+       (it != differing_subtrees.end()) &&
+       (differing_leaves.size() < ANTI_ENTROPY_MAX_LEAVES);
+       ++it)
+  {
+    uint32_t first = *it * span;
+    _handler->get_digest_hashes(node, TIMER_DIGEST_DEPTH, first, span, local);
+    if (!get_hashes(address, TIMER_DIGEST_DEPTH, first, span, remote))
+    {
+      return;
+    }
+    differing(local, remote, first, differing_leaves);
+  }
+
+  if (differing_leaves.size() > ANTI_ENTROPY_MAX_LEAVES)
+  {
+    differing_leaves.resize(ANTI_ENTROPY_MAX_LEAVES);
+  }
+
+  // Send the other node the timers we have newer versions of.  Timers that
+  // the other node has newer versions of are left for it to send to us.
+  int repaired = 0;
+  for (auto it = differing_leaves.begin(); it != differing_leaves.end(); ++it)
+  {
+    std::map<TimerID, uint64_t> local_timers;
+    std::map<TimerID, uint64_t> remote_timers;
+    _handler->get_digest_timers(node, *it, local_timers);
+    if (!get_timers(address, *it, remote_timers))
+    {
+      return;
+    }
+
+    std::vector<TimerID> ids;
+    newer_timers(local_timers, remote_timers, ids);
+    for (auto id = ids.begin(); id != ids.end(); ++id)
+    {
+      // Skip timers that have popped, as they're replicated once they've
+      // been processed anyway.
+      Timer* timer = _handler->get_timer(*id);
+      if (timer != NULL)
+      {
+        _replicator->replicate_to(timer, node);
+        delete timer;
+        repaired++;
+      }
+    }
+  }
+
+  LOG_INFO("Anti-entropy found %lu differing leaves with %s, sent %d timers",
+           differing_leaves.size(),
+           address.c_str(),
+           repaired);
+}
+
+void AntiEntropy::differing(const std::vector<uint64_t>& local,
+                            const std::vector<uint64_t>& remote,
+                            uint32_t first,
+                            std::vector<uint32_t>& indexes)
+{
+  // A node with no tree for us sends zero hashes, so treat missing hashes the
+  // same way.
+  size_t count = std::max(local.size(), remote.size());
+  for (size_t ii = 0; ii < count; ++ii)
+  {
+    uint64_t local_hash = (ii < local.size()) ? local[ii] : 0;
+    uint64_t remote_hash = (ii < remote.size()) ? remote[ii] : 0;
+    if (local_hash != remote_hash)
+    {
+      indexes.push_back(first + ii);
+    }
+  }
+}
+
+void AntiEntropy::newer_timers(const std::map<TimerID, uint64_t>& local,
+                               const std::map<TimerID, uint64_t>& remote,
+                               std::vector<TimerID>& ids)
+{
+  ids.clear();
+  for (auto it = local.begin(); it != local.end(); ++it)
+  {
+    auto remote_it = remote.find(it->first);
+    if ((remote_it == remote.end()) || (remote_it->second < it->second))
+    {
+      ids.push_back(it->first);
+    }
+  }
+}
+
+// SAX handler for a response to a digest request, which collects the numbers
+// in the list with the given key:
+// {
+//     "hashes": [Uint64, ...]
+// }
+// or
+// {
+//     "timers": [[Uint64, Uint64], ...]
+// }
+class DigestHandler :
+  public rapidjson::BaseReaderHandler<rapidjson::UTF8<>, DigestHandler>
+{
+public:
+  DigestHandler(const char* key, std::vector<uint64_t>& values) :
+    _key(key),
+    _values(values),
+    _depth(0),
+    _in_list(false),
+    _has_list(false),
+    _valid(true)
+  {}
+
+  bool valid() const { return _valid && _has_list; }
+
+  bool Default() { return other(); }
+  bool Int(int i) { return (i >= 0) ? value(i) : other(); }
+  bool Uint(unsigned u) { return value(u); }
+  bool Int64(int64_t i) { return (i >= 0) ? value(i) : other(); }
+  bool Uint64(uint64_t u) { return value(u); }
+
+  bool Key(const char* str, rapidjson::SizeType length, bool)
+  {
+    _current_key.assign(str, length);
+    return true;
+  }
+
+  bool StartObject()
+  {
+    _valid = _valid && (_depth == 0);
+    _depth++;
+    return true;
+  }
+
+  bool StartArray()
+  {
+    if ((_depth == 1) && (_current_key == _key))
+    {
+      _in_list = true;
+      _has_list = true;
+    }
+    _depth++;
+    return true;
+  }
+
+  bool EndObject(rapidjson::SizeType) { _depth--; return true; }
+
+  bool EndArray(rapidjson::SizeType)
+  {
+    _depth--;
+    if (_depth == 1)
+    {
+      _in_list = false;
+    }
+    return true;
+  }
+
+private:
+  bool value(uint64_t value)
+  {
+    if (_in_list)
+    {
+      _values.push_back(value);
+    }
+    return true;
+  }
+
+  bool other()
+  {
+    if (_in_list)
+    {
+      _valid = false;
+    }
+    return true;
+  }
+
+  std::string _key;
+  std::vector<uint64_t>& _values;
+  int _depth;
+  bool _in_list;
+  bool _has_list;
+  bool _valid;
+  std::string _current_key;
+};
+
+bool AntiEntropy::parse_digest(const std::string& body,
+                               const char* key,
+                               std::vector<uint64_t>& values)
+{
+  values.clear();
+
+  DigestHandler handler(key, values);
+  rapidjson::Reader reader;
+  rapidjson::StringStream stream(body.c_str());
+  reader.Parse<0>(stream, handler);
+  return ((!reader.HasParseError()) && (handler.valid()));
+}
+
+/*****************************************************************************/
+/* Private functions.                                                        */
+/*****************************************************************************/
+
+void* AntiEntropy::thread_entry_point(void* arg)
+{
+  ((AntiEntropy*)arg)->run();
+  return NULL;
+}
+
+// Compare with each of the other nodes in turn, once each interval.
+void AntiEntropy::run()
+{
+  pthread_mutex_lock(&_mutex);
+
+  while (!_terminate)
+  {
+    struct timespec next_round;
+    clock_gettime(CLOCK_REALTIME, &next_round);
+    next_round.tv_sec += _interval_s;
+
+    while ((!_terminate) &&
+           (pthread_cond_timedwait(&_cond, &_mutex, &next_round) != ETIMEDOUT))
+    {
+    }
+
+    if (_terminate)
+    {
+      break;
+    }
+
+    pthread_mutex_unlock(&_mutex);
+
+    ClusterViewPtr cluster = __globals->get_cluster_view();
+    for (size_t ii = 0; ii < cluster->size(); ++ii)
+    {
+      NodeID node = cluster->node_id(ii);
+      if (node != cluster->local_id())
+      {
+        repair(node, cluster->address(ii));
+      }
+    }
+
+    pthread_mutex_lock(&_mutex);
+  }
+
+  pthread_mutex_unlock(&_mutex);
+}
+
+bool AntiEntropy::get_hashes(const std::string& address,
+                             int level,
+                             uint32_t first,
+                             uint32_t count,
+                             std::vector<uint64_t>& hashes)
+{
+  std::stringstream params;
+  params << "level=" << level << "&first=" << first << "&count=" << count;
+
+  std::string body;
+  if ((!get(address, params.str(), body)) ||
+      (!parse_digest(body, "hashes", hashes)))
+  {
+    return false;
+  }
+
+  return true;
+}
+
+bool AntiEntropy::get_timers(const std::string& address,
+                             uint32_t leaf,
+                             std::map<TimerID, uint64_t>& timers)
+{
+  std::string body;
+  std::vector<uint64_t> values;
+  if ((!get(address, "leaf=" + std::to_string(leaf), body)) ||
+      (!parse_digest(body, "timers", values)) ||
+      ((values.size() % 2) != 0))
+  {
+    return false;
+  }
+
+  timers.clear();
+  for (size_t ii = 0; ii < values.size(); ii += 2)
+  {
+    timers[values[ii]] = values[ii + 1];
+  }
+
+  return true;
+}
+
+// Get part of another node's digest of the timers it shares with us.
+bool AntiEntropy::get(const std::string& address,
+                      const std::string& params,
+                      std::string& body)
+{
+  ClusterViewPtr cluster = __globals->get_cluster_view();
+  int bind_port;
+  __globals->get_bind_port(bind_port);
+
+  char* local_address = curl_easy_escape(_curl,
+                                         NodeTable::address(cluster->local_id()).c_str(),
+                                         0);
+  std::stringstream url;
+  url << "http://" << address << ":" << bind_port
+      << "/timers/_digest?node=" << local_address << "&" << params;
+  curl_free(local_address);
+
+  curl_easy_setopt(_curl, CURLOPT_URL, url.str().c_str());
+  curl_easy_setopt(_curl, CURLOPT_WRITEDATA, &body);
+
+  struct curl_slist* resolve = NULL;
+  if (_dns_cache != NULL)
+  {
+    resolve = _dns_cache->resolve_list(url.str());
+    curl_easy_setopt(_curl, CURLOPT_RESOLVE, resolve);
+  }
+
+  CURLcode rc = curl_easy_perform(_curl);
+  long http_rc = 0;
+  curl_easy_getinfo(_curl, CURLINFO_RESPONSE_CODE, &http_rc);
+
+  curl_easy_setopt(_curl, CURLOPT_WRITEDATA, NULL);
+  curl_easy_setopt(_curl, CURLOPT_RESOLVE, NULL);
+  curl_slist_free_all(resolve);
+
+  if ((rc != CURLE_OK) || (http_rc != 200))
+  {
+    LOG_DEBUG("Failed to get digest from %s: %s (HTTP %ld)",
+              address.c_str(),
+              curl_easy_strerror(rc),
+              http_rc);
+    return false;
+  }
+
+  return true;
+}
+
+// Callback used by cURL to collect the body of a response.
+size_t AntiEntropy::string_store(void* ptr, size_t size, size_t nmemb, void* stream)
+{
+  ((std::string*)stream)->append((char*)ptr, size * nmemb);
+  return (size * nmemb);
+}
@@ -0,0 +1,46 @@
+#include "callback_dispatcher.h"
+#include "log.h"
+
+CallbackDispatcher::CallbackDispatcher() : _callbacks()
+{
+}
+
+CallbackDispatcher::~CallbackDispatcher()
+{
+  for (auto it = _callbacks.begin(); it != _callbacks.end(); ++it)
+  {
+    delete it->second;
+  }
+  _callbacks.clear();
+}
+
+void CallbackDispatcher::add_callback(Callback* callback)
+{
+  _callbacks[callback->protocol()] = callback;
+}
+
+void CallbackDispatcher::perform(Timer* timer)
+{
+  auto it = _callbacks.find(timer->callback_protocol());
+  if (it != _callbacks.end())
+  {
+    it->second->perform(timer);
+  }
+  else
+  {
+    // The protocol is checked when the timer is created, so this can only
+    // happen if the callback for it hasn't been set up.
+    LOG_ERROR("No callback for protocol %s, dropping timer %lu",
+              timer->callback_protocol().c_str(),
+              timer->id);
+    delete timer;
+  }
+}
+
+void CallbackDispatcher::flush()
+{
+  for (auto it = _callbacks.begin(); it != _callbacks.end(); ++it)
+  {
+    it->second->flush();
+  }
+}
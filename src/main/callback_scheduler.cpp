@@ -0,0 +1,294 @@
+#include "callback_scheduler.h"
+
+#include <algorithm>
+#include <time.h>
+
+CallbackScheduler::CallbackScheduler(int max_limit) :
+  _max_limit(std::max(max_limit, 1)),
+  _origins(),
+  _last_origin(),
+  _next_order(0),
+  _terminated(false),
+  _last_sweep_ms(0)
+{
+  pthread_mutex_init(&_mutex, NULL);
+  pthread_cond_init(&_cond, NULL);
+}
+
+CallbackScheduler::~CallbackScheduler()
+{
+  // Anything left in the queues will never get its callback.
+  for (auto it = _origins.begin(); it != _origins.end(); ++it)
+  {
+    std::priority_queue<Entry>& entries = it->second.entries;
+    while (!entries.empty())
+    {
+      const Entry& entry = entries.top();
+      delete entry.timer;
+      if (entry.batch != NULL)
+      {
+        for (auto timer = entry.batch->begin(); timer != entry.batch->end(); ++timer)
+        {
+          delete *timer;
+        }
+        delete entry.batch;
+      }
+      entries.pop();
+    }
+  }
+  _origins.clear();
+
+  pthread_cond_destroy(&_cond);
+  pthread_mutex_destroy(&_mutex);
+}
+
+bool CallbackScheduler::push(const std::string& origin,
+                             Timer* timer,
+                             uint64_t deadline_ms)
+{
+  Entry entry;
+  entry.deadline_ms = deadline_ms;
+  entry.timer = timer;
+  entry.batch = NULL;
+  return push_entry(origin, entry);
+}
+
+bool CallbackScheduler::push(const std::string& origin,
+                             std::vector<Timer*>* batch,
+                             uint64_t deadline_ms)
+{
+  Entry entry;
+  entry.deadline_ms = deadline_ms;
+  entry.timer = NULL;
+  entry.batch = batch;
+  return push_entry(origin, entry);
+}
+
+bool CallbackScheduler::pop(std::string& origin,
+                            Timer*& timer,
+                            std::vector<Timer*>*& batch,
+                            uint64_t& deadline_ms,
+                            bool& expired)
+{
+  pthread_mutex_lock(&_mutex);
+  while ((!take(origin, timer, batch, deadline_ms, expired)) && (!_terminated))
+  {
+    pthread_cond_wait(&_cond, &_mutex);
+  }
+  bool rc = !_terminated;
+
+  // Only one waiter is woken at a time, so pass the wake-up on.  If we took
+  // a callback there may be another that can be sent, and if we've been
+  // terminated the other waiters need to find out.
+  pthread_cond_signal(&_cond);
+  pthread_mutex_unlock(&_mutex);
+
+  return rc;
+}
+
+bool CallbackScheduler::try_pop(std::string& origin,
+                                Timer*& timer,
+                                std::vector<Timer*>*& batch,
+                                uint64_t& deadline_ms,
+                                bool& expired)
+{
+  pthread_mutex_lock(&_mutex);
+  bool rc = take(origin, timer, batch, deadline_ms, expired);
+  pthread_mutex_unlock(&_mutex);
+
+  return rc;
+}
+
+void CallbackScheduler::complete(const std::string& origin,
+                                 uint64_t latency_ms,
+                                 bool succeeded)
+{
+  uint64_t now = monotonic_time_ms();
+
+  pthread_mutex_lock(&_mutex);
+  auto it = _origins.find(origin);
+  if (it != _origins.end())
+  {
+    Origin& state = it->second;
+    state.last_active_ms = now;
+
+    if ((succeeded) && (latency_ms <= CALLBACK_SCHEDULER_LATENCY_TARGET_MS))
+    {
+      state.limit = std::min(state.limit + (1 / state.limit), (double)_max_limit);
+    }
+    else if (now >= state.last_decrease_ms + latency_ms)
+    {
+      // Only decrease the limit for a callback that was sent after the last
+      // decrease, so the callbacks that were in progress together only
+      // halve it once.
+      state.limit = std::max(state.limit / 2, 1.0);
+      state.last_decrease_ms = now;
+    }
+
+    release(it);
+  }
+  pthread_mutex_unlock(&_mutex);
+}
+
+void CallbackScheduler::abandon(const std::string& origin)
+{
+  pthread_mutex_lock(&_mutex);
+  auto it = _origins.find(origin);
+  if (it != _origins.end())
+  {
+    release(it);
+  }
+  pthread_mutex_unlock(&_mutex);
+}
+
+void CallbackScheduler::terminate()
+{
+  pthread_mutex_lock(&_mutex);
+  _terminated = true;
+  pthread_cond_signal(&_cond);
+  pthread_mutex_unlock(&_mutex);
+}
+
+int CallbackScheduler::limit(const std::string& origin)
+{
+  pthread_mutex_lock(&_mutex);
+  auto it = _origins.find(origin);
+  int limit = (it != _origins.end()) ?
+              (int)it->second.limit :
+              std::min(CALLBACK_SCHEDULER_INITIAL_LIMIT, _max_limit);
+  pthread_mutex_unlock(&_mutex);
+
+  return limit;
+}
+
+uint64_t CallbackScheduler::monotonic_time_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+// The time in ms since the epoch, for comparing with callback deadlines.
+uint64_t CallbackScheduler::wall_time_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+// Queue an entry for an origin, unless its queue is full.
+bool CallbackScheduler::push_entry(const std::string& origin, Entry& entry)
+{
+  uint64_t now = monotonic_time_ms();
+
+  pthread_mutex_lock(&_mutex);
+  sweep(now);
+
+  auto it = _origins.find(origin);
+  if (it == _origins.end())
+  {
+    it = _origins.insert(std::make_pair(origin, Origin())).first;
+    it->second.limit = std::min(it->second.limit, (double)_max_limit);
+  }
+
+  bool queued = (it->second.entries.size() < CALLBACK_SCHEDULER_MAX_QUEUED);
+  if (queued)
+  {
+    entry.order = _next_order++;
+    it->second.entries.push(entry);
+    it->second.last_active_ms = now;
+    pthread_cond_signal(&_cond);
+  }
+  pthread_mutex_unlock(&_mutex);
+
+  return queued;
+}
+
+// Free up a slot for an origin.  The origin is kept (along with its limit)
+// until it's been idle for a while, see `sweep()`.  Must be called with the
+// mutex held.
+void CallbackScheduler::release(std::map<std::string, Origin>::iterator it)
+{
+  it->second.in_flight--;
+
+  // A waiting worker may now be able to take a callback for this origin.
+  pthread_cond_signal(&_cond);
+}
+
+// Forget about origins that have been idle for a while, checking at most
+// once a second.  Must be called with the mutex held.
+void CallbackScheduler::sweep(uint64_t now)
+{
+  if (now < _last_sweep_ms + 1000)
+  {
+    return;
+  }
+  _last_sweep_ms = now;
+
+  for (auto it = _origins.begin(); it != _origins.end();)
+  {
+    const Origin& state = it->second;
+    if ((state.entries.empty()) &&
+        (state.in_flight == 0) &&
+        (now - state.last_active_ms >= CALLBACK_SCHEDULER_IDLE_EXPIRY_MS))
+    {
+      _origins.erase(it++);
+    }
+    else
+    {
+      ++it;
+    }
+  }
+}
+
+// Take the timer (or batch) with the earliest deadline from the next origin
+// (after the last one served) that has timers waiting and is below its limit,
+// or whose earliest timer has already missed its deadline.  Must be called
+// with the mutex held.
+bool CallbackScheduler::take(std::string& origin,
+                             Timer*& timer,
+                             std::vector<Timer*>*& batch,
+                             uint64_t& deadline_ms,
+                             bool& expired)
+{
+  if ((_terminated) || (_origins.empty()))
+  {
+    return false;
+  }
+
+  uint64_t now = wall_time_ms();
+  auto it = _origins.upper_bound(_last_origin);
+  for (size_t ii = 0; ii < _origins.size(); ++ii, ++it)
+  {
+    if (it == _origins.end())
+    {
+      it = _origins.begin();
+    }
+
+    Origin& state = it->second;
+    if (state.entries.empty())
+    {
+      continue;
+    }
+
+    const Entry& entry = state.entries.top();
+    bool missed = (entry.deadline_ms <= now);
+    if ((missed) || (state.in_flight < (int)state.limit))
+    {
+      origin = it->first;
+      timer = entry.timer;
+      batch = entry.batch;
+      deadline_ms = entry.deadline_ms;
+      expired = missed;
+      state.entries.pop();
+      if (!missed)
+      {
+        state.in_flight++;
+      }
+      _last_origin = origin;
+      return true;
+    }
+  }
+
+  return false;
+}
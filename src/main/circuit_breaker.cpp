@@ -0,0 +1,100 @@
+#include "circuit_breaker.h"
+#include "log.h"
+
+#include <time.h>
+
+CircuitBreaker::CircuitBreaker(int failure_threshold, int probe_interval_ms) :
+  _failure_threshold(failure_threshold),
+  _probe_interval_ms(probe_interval_ms),
+  _peers()
+{
+  pthread_mutex_init(&_mutex, NULL);
+}
+
+CircuitBreaker::~CircuitBreaker()
+{
+  pthread_mutex_destroy(&_mutex);
+}
+
+bool CircuitBreaker::allow(const std::string& peer)
+{
+  bool allowed = true;
+
+  pthread_mutex_lock(&_mutex);
+  auto it = _peers.find(peer);
+  if (it != _peers.end())
+  {
+    Peer& state = it->second;
+    if (state.state == PROBING)
+    {
+      // Only one probe at a time.
+      allowed = false;
+    }
+    else if (state.state == OPEN)
+    {
+      allowed = (monotonic_time_ms() >= state.probe_time_ms);
+      if (allowed)
+      {
+        LOG_DEBUG("Probing %s", peer.c_str());
+        state.state = PROBING;
+      }
+    }
+  }
+  pthread_mutex_unlock(&_mutex);
+
+  return allowed;
+}
+
+void CircuitBreaker::record(const std::string& peer, bool succeeded)
+{
+  pthread_mutex_lock(&_mutex);
+  if (succeeded)
+  {
+    // Healthy peers needn't be tracked.
+    auto it = _peers.find(peer);
+    if (it != _peers.end())
+    {
+      if (it->second.state != CLOSED)
+      {
+        LOG_STATUS("%s is responding again, closing its circuit", peer.c_str());
+      }
+      _peers.erase(it);
+    }
+  }
+  else
+  {
+    Peer& state = _peers[peer];
+    state.failures++;
+
+    if ((state.state == PROBING) ||
+        ((state.state == CLOSED) && (state.failures >= _failure_threshold)))
+    {
+      if (state.state == CLOSED)
+      {
+        LOG_WARNING("%s has failed %d requests in a row, opening its circuit",
+                    peer.c_str(),
+                    state.failures);
+      }
+      state.state = OPEN;
+      state.probe_time_ms = monotonic_time_ms() + _probe_interval_ms;
+    }
+  }
+  pthread_mutex_unlock(&_mutex);
+}
+
+bool CircuitBreaker::is_open(const std::string& peer)
+{
+  pthread_mutex_lock(&_mutex);
+  auto it = _peers.find(peer);
+  bool open = ((it != _peers.end()) && (it->second.state != CLOSED));
+  pthread_mutex_unlock(&_mutex);
+
+  return open;
+}
+
+uint64_t CircuitBreaker::monotonic_time_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
@@ -0,0 +1,182 @@
+#include "cluster_view.h"
+#include "murmur/MurmurHash3.h"
+
+#include <algorithm>
+#include <cmath>
+
+ClusterView::ClusterView(const std::string& local_ip,
+                         const std::vector<std::string>& addresses,
+                         const std::map<std::string, uint64_t>& hashes,
+                         Placement placement,
+                         const std::map<std::string, double>& weights,
+                         int filter_bits,
+                         int filter_hashes) :
+  _local_ip(local_ip),
+  _local_id(NodeTable::intern(local_ip)),
+  _addresses(addresses),
+  _hashes(hashes),
+  _node_hashes(addresses.size()),
+  _node_filters(addresses.size()),
+  _node_ids(addresses.size()),
+  _empty_filter(filter_bits, filter_hashes),
+  _placement(placement),
+  _weighted(false),
+  _node_seeds(addresses.size()),
+  _node_weights(addresses.size(), 1.0)
+{
+  for (size_t ii = 0; ii < _addresses.size(); ++ii)
+  {
+    _node_hashes[ii] = hash(_addresses[ii]);
+    _node_filters[ii] = _empty_filter.is_legacy() ?
+                          ReplicaFilter(_node_hashes[ii]) :
+                          ReplicaFilter::for_node(_addresses[ii],
+                                                  filter_bits,
+                                                  filter_hashes);
+    _node_ids[ii] = NodeTable::intern(_addresses[ii]);
+    _node_indexes[_node_ids[ii]] = ii;
+    MurmurHash3_x86_32(_addresses[ii].data(),
+                       _addresses[ii].length(),
+                       0x0,
+                       &_node_seeds[ii]);
+
+    auto weight_it = weights.find(_addresses[ii]);
+    if (weight_it != weights.end())
+    {
+      _node_weights[ii] = weight_it->second;
+      _weighted = _weighted || (weight_it->second != 1.0);
+    }
+  }
+}
+
+uint64_t ClusterView::hash(const std::string& address) const
+{
+  auto it = _hashes.find(address);
+  return (it != _hashes.end()) ? it->second : 0;
+}
+
+ReplicaFilter ClusterView::filter(NodeID node) const
+{
+  auto it = _node_indexes.find(node);
+  return (it != _node_indexes.end()) ? _node_filters[it->second] : _empty_filter;
+}
+
+void ClusterView::match_hash(const ReplicaFilter& filter,
+                             std::vector<NodeIndex>& nodes) const
+{
+  size_t num_nodes = _addresses.size();
+
+  if (filter.is_legacy())
+  {
+    uint64_t legacy_filter = filter.low_word();
+    const uint64_t* node_hashes = _node_hashes.data();
+
+    for (size_t ii = 0; ii < num_nodes; ++ii)
+    {
+      if ((legacy_filter & node_hashes[ii]) == node_hashes[ii])
+      {
+        nodes.push_back(ii);
+      }
+    }
+  }
+  else if (filter.same_format(_empty_filter))
+  {
+    for (size_t ii = 0; ii < num_nodes; ++ii)
+    {
+      if (filter.contains(_node_filters[ii]))
+      {
+        nodes.push_back(ii);
+      }
+    }
+  }
+  else
+  {
+    // The filter was created by a node with a different configuration (for
+    // example, while a config change is rolled out), so generate the node
+    // filters to match.
+    for (size_t ii = 0; ii < num_nodes; ++ii)
+    {
+      if (filter.contains(ReplicaFilter::for_node(_addresses[ii],
+                                                  filter.bits(),
+                                                  filter.num_hashes())))
+      {
+        nodes.push_back(ii);
+      }
+    }
+  }
+}
+
+void ClusterView::place(uint32_t timer_hash,
+                        unsigned int count,
+                        std::vector<NodeIndex>& nodes) const
+{
+  if (_placement == RENDEZVOUS)
+  {
+    place_rendezvous(timer_hash, count, nodes);
+  }
+  else
+  {
+    place_modulo(timer_hash, count, nodes);
+  }
+}
+
+// Replicas are placed on consecutive nodes, starting from the node picked by
+// the timer's hash.  A timer can't have more replicas than there are nodes.
+void ClusterView::place_modulo(uint32_t timer_hash,
+                               unsigned int count,
+                               std::vector<NodeIndex>& nodes) const
+{
+  size_t num_nodes = _addresses.size();
+  if (num_nodes == 0)
+  {
+    return;
+  }
+
+  size_t first_node = timer_hash % num_nodes;
+  for (size_t ii = 0; (ii < count) && (ii < num_nodes); ++ii)
+  {
+    nodes.push_back((first_node + ii) % num_nodes);
+  }
+}
+
+// Replicas are placed on the highest scoring nodes, in order of score.  Each
+// node's score for the timer is a uniform value in (0, 1), mixed from the
+// timer's hash and the node's seed.  Weighted nodes use the score
+// -weight / ln(score) instead, which picks each node in proportion to its
+// weight.
+void ClusterView::place_rendezvous(uint32_t timer_hash,
+                                   unsigned int count,
+                                   std::vector<NodeIndex>& nodes) const
+{
+  size_t num_nodes = _addresses.size();
+  std::vector<std::pair<double, NodeIndex> > scores(num_nodes);
+
+  for (size_t ii = 0; ii < num_nodes; ++ii)
+  {
+    // The 64-bit finalizer from MurmurHash3.
+    uint64_t mix = ((uint64_t)timer_hash << 32) | _node_seeds[ii];
+    mix ^= mix >> 33;
+    mix *= 0xff51afd7ed558ccdULL;
+    mix ^= mix >> 33;
+    mix *= 0xc4ceb9fe1a85ec53ULL;
+    mix ^= mix >> 33;
+
+    double score = ((mix >> 11) + 0.5) / 9007199254740992.0;
+    if (_weighted)
+    {
+      score = -_node_weights[ii] / std::log(score);
+    }
+
+    scores[ii] = std::make_pair(score, (NodeIndex)ii);
+  }
+
+  size_t num_replicas = std::min((size_t)count, num_nodes);
+  std::partial_sort(scores.begin(),
+                    scores.begin() + num_replicas,
+                    scores.end(),
+                    std::greater<std::pair<double, NodeIndex> >());
+
+  for (size_t ii = 0; ii < num_replicas; ++ii)
+  {
+    nodes.push_back(scores[ii].second);
+  }
+}
@@ -0,0 +1,241 @@
+#include "connection_pool.h"
+#include "log.h"
+
+#include <errno.h>
+
+ConnectionPool::ConnectionPool(int max_connections_per_host,
+                               int keepalive_s) :
+  _max_connections_per_host(max_connections_per_host),
+  _keepalive_s(keepalive_s),
+  _origins(),
+  _last_sweep(now_s())
+{
+  pthread_mutex_init(&_mutex, NULL);
+  pthread_cond_init(&_cond, NULL);
+  pthread_mutex_init(&_share_mutex, NULL);
+
+  // All handles share a DNS cache.  The handles are used from many threads so
+  // access to the shared data must be locked.
+  _share = curl_share_init();
+  curl_share_setopt(_share, CURLSHOPT_LOCKFUNC, ConnectionPool::lock_share);
+  curl_share_setopt(_share, CURLSHOPT_UNLOCKFUNC, ConnectionPool::unlock_share);
+  curl_share_setopt(_share, CURLSHOPT_USERDATA, (void*)this);
+  curl_share_setopt(_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+}
+
+ConnectionPool::~ConnectionPool()
+{
+  // All borrowed handles should have been returned by now, so just tidy up
+  // the idle ones.
+  for (auto it = _origins.begin(); it != _origins.end(); ++it)
+  {
+    std::vector<IdleHandle>& idle = it->second.idle;
+    for (auto handle = idle.begin(); handle != idle.end(); ++handle)
+    {
+      curl_easy_cleanup(handle->curl);
+    }
+  }
+  _origins.clear();
+
+  curl_share_cleanup(_share);
+  pthread_mutex_destroy(&_share_mutex);
+  pthread_cond_destroy(&_cond);
+  pthread_mutex_destroy(&_mutex);
+}
+
+CURL* ConnectionPool::acquire(const std::string& origin, int timeout_ms)
+{
+  CURL* curl = NULL;
+  std::vector<CURL*> expired;
+
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += timeout_ms / 1000;
+  deadline.tv_nsec += (timeout_ms % 1000) * 1000000;
+  if (deadline.tv_nsec >= 1000000000)
+  {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+
+  pthread_mutex_lock(&_mutex);
+  Origin* pool = &_origins[origin];
+
+  while ((_max_connections_per_host > 0) &&
+         (pool->in_use >= _max_connections_per_host))
+  {
+    if (timeout_ms == 0)
+    {
+      pthread_cond_wait(&_cond, &_mutex);
+    }
+    else if (pthread_cond_timedwait(&_cond, &_mutex, &deadline) == ETIMEDOUT)
+    {
+      pthread_mutex_unlock(&_mutex);
+      return NULL;
+    }
+
+    // The origin may have been swept away while we were waiting.
+    pool = &_origins[origin];
+  }
+
+  // Use the most recently returned handle, as it's the most likely to still
+  // have an open connection.  Anything that's been idle for longer than the
+  // keepalive period is discarded.
+  time_t now = now_s();
+  while ((curl == NULL) && (!pool->idle.empty()))
+  {
+    IdleHandle handle = pool->idle.back();
+    pool->idle.pop_back();
+
+    if (now - handle.last_used > _keepalive_s)
+    {
+      expired.push_back(handle.curl);
+    }
+    else
+    {
+      curl = handle.curl;
+    }
+  }
+
+  pool->in_use++;
+  pthread_mutex_unlock(&_mutex);
+
+  // Handles are created and destroyed outside the lock, since closing a
+  // connection can block.
+  for (auto it = expired.begin(); it != expired.end(); ++it)
+  {
+    curl_easy_cleanup(*it);
+  }
+
+  if (curl == NULL)
+  {
+    curl = create_handle();
+  }
+
+  return curl;
+}
+
+void ConnectionPool::release(const std::string& origin, CURL* curl, bool reuse)
+{
+  std::vector<CURL*> expired;
+  time_t now = now_s();
+
+  pthread_mutex_lock(&_mutex);
+  Origin& pool = _origins[origin];
+  pool.in_use--;
+
+  if (reuse)
+  {
+    IdleHandle handle;
+    handle.curl = curl;
+    handle.last_used = now;
+    pool.idle.push_back(handle);
+    curl = NULL;
+  }
+  else
+  {
+    expired.push_back(curl);
+  }
+
+  if (now != _last_sweep)
+  {
+    sweep(now, expired);
+  }
+
+  pthread_cond_broadcast(&_cond);
+  pthread_mutex_unlock(&_mutex);
+
+  for (auto it = expired.begin(); it != expired.end(); ++it)
+  {
+    curl_easy_cleanup(*it);
+  }
+}
+
+std::string ConnectionPool::origin(const std::string& url)
+{
+  size_t host_start = url.find("://");
+  host_start = (host_start == std::string::npos) ? 0 : host_start + 3;
+  return url.substr(0, url.find('/', host_start));
+}
+
+/*****************************************************************************/
+/* Private functions.                                                        */
+/*****************************************************************************/
+
+CURL* ConnectionPool::create_handle()
+{
+  CURL* curl = curl_easy_init();
+  curl_easy_setopt(curl, CURLOPT_SHARE, _share);
+
+  // Each handle only talks to one origin, so only needs to cache a single
+  // connection.
+  curl_easy_setopt(curl, CURLOPT_MAXCONNECTS, 1L);
+
+  // Callbacks have timeouts, which cURL mustn't enforce with signals as the
+  // handles are used from many threads.
+  curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+
+#if LIBCURL_VERSION_NUM >= 0x071900
+  // Use TCP keepalives so that idle connections aren't silently dropped by
+  // anything between us and the origin.
+  curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+  curl_easy_setopt(curl, CURLOPT_TCP_KEEPIDLE, (long)_keepalive_s);
+#endif
+
+  return curl;
+}
+
+// Discard the handles that have been idle for longer than the keepalive
+// period, for every origin, and forget the origins that are left with no
+// handles.  The discarded handles are added to `expired` so they can be
+// cleaned up outside the lock (which must be held to call this).
+void ConnectionPool::sweep(time_t now, std::vector<CURL*>& expired)
+{
+  _last_sweep = now;
+
+  auto it = _origins.begin();
+  while (it != _origins.end())
+  {
+    // Handles are returned to the back of the idle list, so the ones that
+    // have been idle the longest are at the front.
+    std::vector<IdleHandle>& idle = it->second.idle;
+    auto fresh = idle.begin();
+    while ((fresh != idle.end()) && (now - fresh->last_used > _keepalive_s))
+    {
+      expired.push_back(fresh->curl);
+      ++fresh;
+    }
+    idle.erase(idle.begin(), fresh);
+
+    if ((idle.empty()) && (it->second.in_use == 0))
+    {
+      _origins.erase(it++);
+    }
+    else
+    {
+      ++it;
+    }
+  }
+}
+
+time_t ConnectionPool::now_s()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+void ConnectionPool::lock_share(CURL* handle,
+                                curl_lock_data data,
+                                curl_lock_access access,
+                                void* userptr)
+{
+  pthread_mutex_lock(&((ConnectionPool*)userptr)->_share_mutex);
+}
+
+void ConnectionPool::unlock_share(CURL* handle,
+                                  curl_lock_data data,
+                                  void* userptr)
+{
+  pthread_mutex_unlock(&((ConnectionPool*)userptr)->_share_mutex);
+}
@@ -4,9 +4,15 @@
 #include "log.h"
 
 #include "murmur/MurmurHash3.h"
+#include "rapidjson/writer.h"
+#include "rapidjson/stringbuffer.h"
+
+#include <event2/keyvalq_struct.h>
 
 #include <boost/regex.hpp>
 
+#include <algorithm>
+
 Controller::Controller(Replicator* replicator,
                        TimerHandler* handler) :
                        _replicator(replicator),
@@ -24,7 +30,9 @@ void Controller::handle_request(struct evhttp_request* req)
   //
   // /timers
   // /timers/
-  // /timers/<timerid>
+  // /timers/_bulk
+  // /timers/_digest
+  // /timers/<timerid><replica hash>
   const char *uri = evhttp_request_get_uri(req);
   struct evhttp_uri* decoded = evhttp_uri_parse(uri);
   if (!decoded)
@@ -48,6 +56,8 @@ void Controller::handle_request(struct evhttp_request* req)
   }
 
   std::string path(path_str, path_len);
+  const char* query_str = evhttp_uri_get_query(decoded);
+  std::string query = (query_str != NULL) ? query_str : "";
 
   // At this point, we're done with the URI and can free the C objects (we'll use
   // the string from now on).
@@ -61,14 +71,37 @@ void Controller::handle_request(struct evhttp_request* req)
   // Also need to check the user has supplied a valid method:
   //
   //  * POST to the collection
+  //  * POST to the bulk collection
+  //  * GET of the digest
   //  * PUT to a specific ID
+  //  * PATCH to a specific ID
   //  * DELETE to a specific ID
   evhttp_cmd_type method = evhttp_request_get_command(req);
 
   boost::smatch matches;
   TimerID timer_id;
-  uint64_t replica_hash = 0;
-  if ((path == "/timers") || (path == "/timers/"))
+  ReplicaFilter replica_hash;
+  if ((path == "/timers/_bulk") || (path == "/timers/_bulk/"))
+  {
+    if (method != EVHTTP_REQ_POST)
+    {
+      send_error(req, HTTP_BADMETHOD, NULL);
+      return;
+    }
+    handle_bulk_request(req);
+    return;
+  }
+  else if ((path == "/timers/_digest") || (path == "/timers/_digest/"))
+  {
+    if (method != EVHTTP_REQ_GET)
+    {
+      send_error(req, HTTP_BADMETHOD, NULL);
+      return;
+    }
+    handle_digest_request(req, query);
+    return;
+  }
+  else if ((path == "/timers") || (path == "/timers/"))
   {
     if (method != EVHTTP_REQ_POST)
     {
@@ -77,15 +110,27 @@ void Controller::handle_request(struct evhttp_request* req)
     }
     timer_id = Timer::generate_timer_id();
   }
-  else if (boost::regex_match(path, matches, boost::regex("/timers/([[:xdigit:]]{16})([[:xdigit:]]{16})")))
+  else if (boost::regex_match(path, matches, boost::regex("/timers/([[:xdigit:]]{16})([[:xdigit:]]{16}|[[:xdigit:]]{34}|[[:xdigit:]]{66})")))
   {
-    if ((method != EVHTTP_REQ_PUT) && (method != EVHTTP_REQ_DELETE))
+    if ((method != EVHTTP_REQ_PUT) &&
+        (method != EVHTTP_REQ_PATCH) &&
+        (method != EVHTTP_REQ_DELETE))
     {
       send_error(req, HTTP_BADMETHOD, NULL);
       return;
     }
     timer_id = std::stoul(matches[1].str(), NULL, 16);
-    replica_hash = std::stoull(matches[2].str(), NULL, 16);
+    if (!ReplicaFilter::from_hex(matches[2].str(), replica_hash))
+    {
+      send_error(req, HTTP_BADREQUEST, "Invalid replica hash");
+      return;
+    }
+
+    if (method == EVHTTP_REQ_PATCH)
+    {
+      handle_update_request(req, timer_id, replica_hash);
+      return;
+    }
   }
   else
   {
@@ -133,10 +178,9 @@ void Controller::handle_request(struct evhttp_request* req)
 
   // If the timer belongs to the local node, store it. Otherwise, turn it into
   // a tombstone.
-  std::string localhost;
-  __globals->get_cluster_local_ip(localhost);
+  ClusterViewPtr cluster = __globals->get_cluster_view();
 
-  if (!timer->is_local(localhost))
+  if (!timer->is_local(cluster->local_id()))
   {
     timer->become_tombstone();
   }
@@ -159,6 +203,264 @@ void Controller::controller_ping_cb(struct evhttp_request* req, void* controller
 /* PRIVATE FUNCTIONS                                                         */
 /*****************************************************************************/
 
+// Handle a POST to the bulk API, which creates each of the timers defined in
+// the body.  The response body is a JSON array of the Location of each new
+// timer, in the order they were defined.  The timers from the client are
+// replicated with a single request to each of the other nodes involved (which
+// send their replicas back to this API, with the timers' IDs), and then all
+// the timers are stored with a single pass through the timer handler.
+void Controller::handle_bulk_request(struct evhttp_request* req)
+{
+  std::string body = get_req_body(req);
+  std::string error_str;
+  std::vector<Timer*> timers;
+  std::vector<bool> replicated;
+  if (!Timer::from_json_array(body, timers, replicated, error_str))
+  {
+    send_error(req, HTTP_BADREQUEST, error_str.c_str());
+    return;
+  }
+
+  LOG_DEBUG("Accepted %lu timer definitions", timers.size());
+
+  rapidjson::StringBuffer sb;
+  rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+  writer.StartArray();
+  for (auto it = timers.begin(); it != timers.end(); ++it)
+  {
+    std::string location = (*it)->url();
+    writer.String(location.data(), location.length());
+  }
+  writer.EndArray();
+
+  struct evbuffer* evbuf = evbuffer_new();
+  evbuffer_add(evbuf, sb.GetString(), sb.GetSize());
+  evhttp_add_header(evhttp_request_get_output_headers(req),
+                    "Content-Type", "application/json");
+  evhttp_send_reply(req, 200, "OK", evbuf);
+  evbuffer_free(evbuf);
+
+  // Replicate the client's timers, then store the ones that belong to the
+  // local node and tombstones for the rest.
+  std::vector<Timer*> client_timers;
+  for (unsigned int ii = 0; ii < timers.size(); ++ii)
+  {
+    if (!replicated[ii])
+    {
+      client_timers.push_back(timers[ii]);
+    }
+  }
+
+  if (!client_timers.empty())
+  {
+    _replicator->replicate_bulk(client_timers);
+  }
+
+  ClusterViewPtr cluster = __globals->get_cluster_view();
+  NodeID localhost = cluster->local_id();
+
+  std::unordered_set<Timer*> store_timers;
+  for (auto it = timers.begin(); it != timers.end(); ++it)
+  {
+    Timer* timer = *it;
+    if (!timer->is_local(localhost))
+    {
+      timer->become_tombstone();
+    }
+
+    store_timers.insert(timer);
+  }
+
+  _handler->add_timers(store_timers);
+}
+
+// Get an unsigned integer parameter from a query.  Returns false if the
+// parameter is missing or isn't a number.
+static bool get_uint_param(struct evkeyvalq* params,
+                           const char* name,
+                           uint64_t& value)
+{
+  const char* str = evhttp_find_header(params, name);
+  if ((str == NULL) || (*str == '\0'))
+  {
+    return false;
+  }
+
+  char* end;
+  value = strtoull(str, &end, 10);
+  return (*end == '\0');
+}
+
+// Handle a GET of the digest of the timers this node shares with another node
+// (see AntiEntropy).  The other node's address is given by the `node`
+// parameter, and either:
+//
+//  * `level`, `first` and `count` select a range of the nodes at one level of
+//    the hash tree, and the response is {"hashes": [Uint64, ...]}, or
+//  * `leaf` selects a leaf of the tree, and the response lists the timers in
+//    it with their start times {"timers": [[Uint64, Uint64], ...]}.
+void Controller::handle_digest_request(struct evhttp_request* req,
+                                       const std::string& query)
+{
+  struct evkeyvalq params;
+  if (evhttp_parse_query_str(query.c_str(), &params) != 0)
+  {
+    send_error(req, HTTP_BADREQUEST, "Invalid query");
+    return;
+  }
+
+  const char* node_str = evhttp_find_header(&params, "node");
+  uint64_t level;
+  uint64_t first;
+  uint64_t count;
+  uint64_t leaf;
+  bool get_hashes = (get_uint_param(&params, "level", level) &&
+                     get_uint_param(&params, "first", first) &&
+                     get_uint_param(&params, "count", count) &&
+                     (level <= TIMER_DIGEST_DEPTH) &&
+                     (first < TIMER_DIGEST_LEAVES) &&
+                     (count <= TIMER_DIGEST_LEAVES));
+  bool get_timers = ((!get_hashes) &&
+                     get_uint_param(&params, "leaf", leaf) &&
+                     (leaf < TIMER_DIGEST_LEAVES));
+  std::string address = (node_str != NULL) ? node_str : "";
+  evhttp_clear_headers(&params);
+
+  if ((address.empty()) || ((!get_hashes) && (!get_timers)))
+  {
+    send_error(req, HTTP_BADREQUEST, "Invalid digest request");
+    return;
+  }
+
+  // Only give out digests for the nodes in the cluster.  The address comes
+  // from the client, so mustn't be interned (which would let a client use up
+  // the node IDs).
+  ClusterViewPtr cluster = __globals->get_cluster_view();
+  const std::vector<std::string>& members = cluster->addresses();
+  NodeID node;
+  if ((std::find(members.begin(), members.end(), address) == members.end()) ||
+      (!NodeTable::find(address, node)))
+  {
+    send_error(req, HTTP_NOTFOUND, "Unknown node");
+    return;
+  }
+
+  rapidjson::StringBuffer sb;
+  rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+  writer.StartObject();
+
+  if (get_hashes)
+  {
+    std::vector<uint64_t> hashes;
+    _handler->get_digest_hashes(node, level, first, count, hashes);
+
+    writer.Key("hashes");
+    writer.StartArray();
+    for (auto it = hashes.begin(); it != hashes.end(); ++it)
+    {
+      writer.Uint64(*it);
+    }
+    writer.EndArray();
+  }
+  else
+  {
+    std::map<TimerID, uint64_t> timers;
+    _handler->get_digest_timers(node, leaf, timers);
+
+    writer.Key("timers");
+    writer.StartArray();
+    for (auto it = timers.begin(); it != timers.end(); ++it)
+    {
+      writer.StartArray();
+      writer.Uint64(it->first);
+      writer.Uint64(it->second);
+      writer.EndArray();
+    }
+    writer.EndArray();
+  }
+
+  writer.EndObject();
+
+  struct evbuffer* evbuf = evbuffer_new();
+  evbuffer_add(evbuf, sb.GetString(), sb.GetSize());
+  evhttp_add_header(evhttp_request_get_output_headers(req),
+                    "Content-Type", "application/json");
+  evhttp_send_reply(req, 200, "OK", evbuf);
+  evbuffer_free(evbuf);
+}
+
+// Handle a PATCH to a specific timer, which updates the timing of the timer
+// (leaving its callback alone).  Only the new timing is replicated, rather
+// than the whole timer, along with the timer's replicas, which are worked out
+// again (as for a PUT) in case the cluster has changed.
+void Controller::handle_update_request(struct evhttp_request* req,
+                                       TimerID timer_id,
+                                       const ReplicaFilter& replica_hash)
+{
+  std::string body = get_req_body(req);
+  std::string error_str;
+  TimerTiming timing;
+  ReplicaSetPtr replicas;
+  bool replicated_update;
+  if (!Timer::timing_from_json(body, timing, replicas, error_str, replicated_update))
+  {
+    send_error(req, HTTP_BADREQUEST, error_str.c_str());
+    return;
+  }
+
+  LOG_DEBUG("Accepted timing update, update is%s a replica",
+            replicated_update ? "" : " not");
+
+  bool popping;
+  Timer* timer = _handler->update_timer(timer_id,
+                                        timing,
+                                        replicas,
+                                        replica_hash,
+                                        popping);
+
+  if (popping)
+  {
+    // The timer is popping, so can't be updated until it has been re-armed.
+    // The client can retry the update (or PUT the whole timer).
+    send_error(req, 409, "Timer is popping");
+    return;
+  }
+
+  if (timer == NULL)
+  {
+    // We don't hold a live copy of the timer.  If this node should own it
+    // (or this is a replicated update) then there's nothing to update.
+    // Otherwise, pass the update on to the replicas (working out who they are
+    // from the replica hash, as for a DELETE).
+    ClusterViewPtr cluster = __globals->get_cluster_view();
+
+    if (!replicated_update)
+    {
+      timer = Timer::create_tombstone(timer_id, replica_hash);
+      timer->set_timing(timing);
+    }
+
+    if ((timer == NULL) || (timer->is_local(cluster->local_id())))
+    {
+      delete timer;
+      send_error(req, HTTP_NOTFOUND, NULL);
+      return;
+    }
+  }
+
+  evhttp_add_header(evhttp_request_get_output_headers(req),
+                    "Location", timer->url().c_str());
+  evhttp_send_reply(req, 200, "OK", NULL);
+
+  // Replicate the new timing to the other replicas if this is a client request
+  if (!replicated_update)
+  {
+    _replicator->replicate_timing(timer);
+  }
+
+  delete timer;
+}
+
 void Controller::send_error(struct evhttp_request* req, int error, const char* reason)
 {
   LOG_ERROR("Rejecting request with %d %s", error, reason);
@@ -0,0 +1,371 @@
+#include "dns_cache.h"
+#include "log.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <cstring>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/select.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+DnsCache::DnsCache() :
+  _channel_ok(false),
+  _entries(),
+  _last_prune(0),
+  _new_queries(),
+  _terminate(false)
+{
+  pthread_mutex_init(&_mutex, NULL);
+  pthread_cond_init(&_cond, NULL);
+
+  if (pipe(_wake_pipe) != 0)
+  {
+    // LCOV_EXCL_START
+    LOG_ERROR("Failed to create DNS cache wake pipe: %s", strerror(errno));
+    _wake_pipe[0] = -1;
+    _wake_pipe[1] = -1;
+    // LCOV_EXCL_STOP
+  }
+  else
+  {
+    fcntl(_wake_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(_wake_pipe[1], F_SETFL, O_NONBLOCK);
+  }
+
+  // Check the hosts file before DNS, as the system resolver would.
+  ares_library_init(ARES_LIB_INIT_ALL);
+  struct ares_options options;
+  options.lookups = (char*)"fb";
+  int rc = ares_init_options(&_channel, &options, ARES_OPT_LOOKUPS);
+  if (rc != ARES_SUCCESS)
+  {
+    // LCOV_EXCL_START
+    LOG_ERROR("Failed to create DNS resolver, lookups will be left to cURL: %s",
+              ares_strerror(rc));
+    // LCOV_EXCL_STOP
+  }
+  else
+  {
+    _channel_ok = true;
+  }
+
+  rc = pthread_create(&_thread,
+                      NULL,
+                      &DnsCache::thread_entry_point,
+                      (void*)this);
+  if (rc != 0)
+  {
+    // LCOV_EXCL_START
+    LOG_ERROR("Failed to start DNS resolver thread: %s", strerror(rc));
+    // LCOV_EXCL_STOP
+  }
+}
+
+DnsCache::~DnsCache()
+{
+  pthread_mutex_lock(&_mutex);
+  _terminate = true;
+  pthread_mutex_unlock(&_mutex);
+  wake();
+  pthread_join(_thread, NULL);
+
+  if (_channel_ok)
+  {
+    // This fails any outstanding lookups, which frees their queries.
+    ares_destroy(_channel);
+  }
+  ares_library_cleanup();
+
+  close(_wake_pipe[0]);
+  close(_wake_pipe[1]);
+  pthread_cond_destroy(&_cond);
+  pthread_mutex_destroy(&_mutex);
+}
+
+bool DnsCache::lookup(const std::string& host, std::string& address)
+{
+  bool start_query = false;
+  time_t now = now_s();
+
+  pthread_mutex_lock(&_mutex);
+  prune(now);
+
+  Entry& entry = _entries[host];
+  entry.last_used = now;
+  if ((!entry.pending) && (now >= entry.expires))
+  {
+    // Look the host up again, but keep using the old address until we have
+    // a new one.
+    entry.pending = true;
+    _new_queries.push_back(host);
+    start_query = true;
+  }
+  address = entry.address;
+  pthread_mutex_unlock(&_mutex);
+
+  if (start_query)
+  {
+    wake();
+  }
+
+  return !address.empty();
+}
+
+struct curl_slist* DnsCache::resolve_list(const std::string& url)
+{
+  std::string host;
+  int port;
+  std::string address;
+  if ((!parse_url(url, host, port)) ||
+      (is_ip_address(host)) ||
+      ((!lookup(host, address)) && (!wait_for_lookup(host, address))))
+  {
+    return NULL;
+  }
+
+  // Remove any entry we added for an earlier request (which cURL would
+  // otherwise keep using), then add the current address.
+  std::string host_port = host + ":" + std::to_string(port);
+  struct curl_slist* resolve = NULL;
+  resolve = curl_slist_append(resolve, ("-" + host_port).c_str());
+  resolve = curl_slist_append(resolve, (host_port + ":" + address).c_str());
+  return resolve;
+}
+
+void DnsCache::add(const std::string& host, const std::string& address, int ttl_s)
+{
+  pthread_mutex_lock(&_mutex);
+  Entry& entry = _entries[host];
+  entry.address = address;
+  entry.expires = now_s() + ttl_s;
+  entry.last_used = now_s();
+  pthread_mutex_unlock(&_mutex);
+}
+
+bool DnsCache::parse_url(const std::string& url, std::string& host, int& port)
+{
+  size_t host_start = url.find("://");
+  std::string scheme = (host_start == std::string::npos) ?
+                       "http" :
+                       url.substr(0, host_start);
+  host_start = (host_start == std::string::npos) ? 0 : host_start + 3;
+  size_t host_end = url.find('/', host_start);
+  std::string authority = url.substr(host_start, host_end - host_start);
+
+  // Strip any user info.
+  size_t at = authority.rfind('@');
+  if (at != std::string::npos)
+  {
+    authority = authority.substr(at + 1);
+  }
+
+  // IPv6 addresses are bracketed, so the port comes after the closing
+  // bracket.
+  size_t colon = authority.rfind(':');
+  if ((colon != std::string::npos) &&
+      (authority.find(']', colon) == std::string::npos))
+  {
+    host = authority.substr(0, colon);
+    port = atoi(authority.substr(colon + 1).c_str());
+  }
+  else
+  {
+    host = authority;
+    port = (scheme == "https") ? 443 : 80;
+  }
+
+  return (!host.empty()) && (port > 0);
+}
+
+/*****************************************************************************/
+/* Private functions.                                                        */
+/*****************************************************************************/
+
+void* DnsCache::thread_entry_point(void* arg)
+{
+  ((DnsCache*)arg)->run();
+  return NULL;
+}
+
+void DnsCache::run()
+{
+  while (true)
+  {
+    // Pick up any new lookups.
+    std::vector<std::string> new_queries;
+    pthread_mutex_lock(&_mutex);
+    bool terminate = _terminate;
+    new_queries.swap(_new_queries);
+    pthread_mutex_unlock(&_mutex);
+
+    if (terminate)
+    {
+      break;
+    }
+
+    for (auto it = new_queries.begin(); it != new_queries.end(); ++it)
+    {
+      if (_channel_ok)
+      {
+        Query* query = new Query();
+        query->cache = this;
+        query->host = *it;
+        ares_gethostbyname(_channel, it->c_str(), AF_INET, &DnsCache::query_cb, query);
+      }
+      else
+      {
+        query_complete(*it, ARES_ENOTINITIALIZED, NULL);
+      }
+    }
+
+    // Wait for responses, or for new lookups.
+    fd_set read_fds;
+    fd_set write_fds;
+    FD_ZERO(&read_fds);
+    FD_ZERO(&write_fds);
+    int nfds = (_channel_ok) ? ares_fds(_channel, &read_fds, &write_fds) : 0;
+    FD_SET(_wake_pipe[0], &read_fds);
+    nfds = std::max(nfds, _wake_pipe[0] + 1);
+
+    struct timeval max_wait;
+    max_wait.tv_sec = 1;
+    max_wait.tv_usec = 0;
+    struct timeval wait;
+    struct timeval* timeout = (_channel_ok) ?
+                              ares_timeout(_channel, &max_wait, &wait) :
+                              &max_wait;
+    select(nfds, &read_fds, &write_fds, NULL, timeout);
+
+    char buf[64];
+    while (read(_wake_pipe[0], buf, sizeof(buf)) > 0)
+    {
+    }
+
+    if (_channel_ok)
+    {
+      ares_process(_channel, &read_fds, &write_fds);
+    }
+  }
+}
+
+void DnsCache::wake()
+{
+  char c = 0;
+  if (write(_wake_pipe[1], &c, 1) < 0)
+  {
+    // The pipe is full, so the thread is going to wake up anyway.
+  }
+}
+
+// Wait for a host that isn't cached yet to be looked up (see `lookup()`),
+// for up to DNS_CACHE_MISS_WAIT_MS.  Returns false if it's still not cached.
+bool DnsCache::wait_for_lookup(const std::string& host, std::string& address)
+{
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_nsec += DNS_CACHE_MISS_WAIT_MS * 1000000;
+  deadline.tv_sec += deadline.tv_nsec / 1000000000;
+  deadline.tv_nsec %= 1000000000;
+
+  pthread_mutex_lock(&_mutex);
+  auto it = _entries.find(host);
+  while ((it != _entries.end()) &&
+         (it->second.pending) &&
+         (it->second.address.empty()))
+  {
+    if (pthread_cond_timedwait(&_cond, &_mutex, &deadline) == ETIMEDOUT)
+    {
+      break;
+    }
+    it = _entries.find(host);
+  }
+  address = (it != _entries.end()) ? it->second.address : "";
+  pthread_mutex_unlock(&_mutex);
+
+  return !address.empty();
+}
+
+// Forget about hosts that no request has asked for in a while, checking at
+// most once a minute.  Must be called with the mutex held.
+void DnsCache::prune(time_t now)
+{
+  if (now < _last_prune + 60)
+  {
+    return;
+  }
+  _last_prune = now;
+
+  for (auto it = _entries.begin(); it != _entries.end();)
+  {
+    if ((!it->second.pending) &&
+        (now >= it->second.last_used + DNS_CACHE_IDLE_EXPIRY_S))
+    {
+      _entries.erase(it++);
+    }
+    else
+    {
+      ++it;
+    }
+  }
+}
+
+void DnsCache::query_cb(void* arg,
+                        int status,
+                        int timeouts,
+                        struct hostent* hostent)
+{
+  Query* query = (Query*)arg;
+  if ((status != ARES_EDESTRUCTION) && (status != ARES_ECANCELLED))
+  {
+    query->cache->query_complete(query->host, status, hostent);
+  }
+  delete query;
+}
+
+// Record the result of looking up a host.
+void DnsCache::query_complete(const std::string& host,
+                              int status,
+                              struct hostent* hostent)
+{
+  pthread_mutex_lock(&_mutex);
+  Entry& entry = _entries[host];
+  entry.pending = false;
+
+  if ((status == ARES_SUCCESS) &&
+      (hostent != NULL) &&
+      (hostent->h_addrtype == AF_INET) &&
+      (hostent->h_addr_list[0] != NULL))
+  {
+    char address[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, hostent->h_addr_list[0], address, sizeof(address));
+    entry.address = address;
+    entry.expires = now_s() + DNS_CACHE_TTL_S;
+  }
+  else
+  {
+    // Keep any address we already had, and try again later.
+    LOG_WARNING("Failed to look up %s: %s", host.c_str(), ares_strerror(status));
+    entry.expires = now_s() + DNS_CACHE_RETRY_S;
+  }
+
+  // Wake any requests waiting for the host.
+  pthread_cond_broadcast(&_cond);
+  pthread_mutex_unlock(&_mutex);
+}
+
+bool DnsCache::is_ip_address(const std::string& host)
+{
+  struct in_addr addr;
+  return ((!host.empty()) && (host[0] == '[')) ||
+         (inet_pton(AF_INET, host.c_str(), &addr) == 1);
+}
+
+time_t DnsCache::now_s()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
@@ -1,8 +1,8 @@
 #include "globals.h"
-#include "murmur/MurmurHash3.h"
 #include "log.h"
 
 #include <fstream>
+#include <cstdlib>
 
 // Shorten the imported namespace for ease of use.  Notice we don't do this in the 
 // header file to avoid infecting other compilation units' namespaces.
@@ -20,8 +20,19 @@ Globals::Globals()
   _desc.add_options()
     ("http.bind-address", po::value<std::string>()->default_value("0.0.0.0"), "Address to bind the HTTP server to")
     ("http.bind-port", po::value<int>()->default_value(7253), "Port to bind the HTTP server to")
+    ("http.bind-unix-socket", po::value<std::string>()->default_value(""), "Path of a Unix domain socket to also serve the HTTP API on (optional)")
     ("cluster.localhost", po::value<std::string>()->default_value("localhost"), "The address of the local host")
     ("cluster.node", po::value<std::vector<std::string>>()->multitoken()->default_value(std::vector<std::string>(1, "localhost"), "HOST"), "The addresses of a node in the cluster")
+    ("cluster.placement", po::value<std::string>()->default_value("modulo"), "How to place replicas on nodes: modulo or rendezvous")
+    ("cluster.replica-filter-bits", po::value<int>()->default_value(ReplicaFilter::LEGACY_BITS), "Width of the replica filter in timer URLs: 64, 128 or 256")
+    ("cluster.replica-filter-hashes", po::value<int>()->default_value(ReplicaFilter::LEGACY_HASHES), "Number of bits set per node in the replica filter (1-255, must be 6 for 64-bit filters)")
+    ("cluster.node-weight", po::value<std::vector<std::string>>()->multitoken()->default_value(std::vector<std::string>(), "HOST=WEIGHT"), "The relative weight of a node for rendezvous placement (default 1)")
+    ("callback.max-connections-per-host", po::value<int>()->default_value(50), "Maximum number of connections to each callback host")
+    ("callback.keepalive", po::value<int>()->default_value(60), "Time (in seconds) to keep idle connections to callback hosts open")
+    ("callback.http2", po::value<std::string>()->default_value("false"), "Whether to send callbacks over HTTP/2 (h2c) so they can be multiplexed")
+    ("replication.threads", po::value<int>()->default_value(20), "Number of threads sending replication requests to other nodes")
+    ("replication.max-in-flight-per-node", po::value<int>()->default_value(4), "Maximum number of replication requests in progress to each node")
+    ("replication.anti-entropy-interval", po::value<int>()->default_value(60), "Time (in seconds) between checks that the other nodes hold the same timers as this one, or 0 to disable the checks")
     ("logging.folder", po::value<std::string>()->default_value("/var/log/chronos"), "Location to output logs to")
     ("logging.level", po::value<int>()->default_value(2), "Logging level: 1(lowest) - 5(highest)")
     ("alarms.enabled", po::value<std::string>()->default_value("false"), "Whether SNMP alarms are enabled")
@@ -64,46 +75,125 @@ void Globals::update_config()
   set_bind_port(bind_port);
   LOG_STATUS("Bind port: %d", bind_port);
 
+  std::string bind_unix_socket = conf_map["http.bind-unix-socket"].as<std::string>();
+  set_bind_unix_socket(bind_unix_socket);
+  if (!bind_unix_socket.empty())
+  {
+    LOG_STATUS("Bind Unix socket: %s", bind_unix_socket.c_str());
+  }
+
   std::string cluster_local_address = conf_map["cluster.localhost"].as<std::string>();
-  set_cluster_local_ip(cluster_local_address);
   LOG_STATUS("Cluster local address: %s", cluster_local_address.c_str());
   
   std::vector<std::string> cluster_addresses = conf_map["cluster.node"].as<std::vector<std::string>>();
-  set_cluster_addresses(cluster_addresses);
   std::map<std::string, uint64_t> cluster_hashes;
   LOG_STATUS("Cluster nodes:");
   for (auto it = cluster_addresses.begin(); it != cluster_addresses.end(); ++it)
   {
     LOG_STATUS(" - %s", it->c_str());
-    cluster_hashes[*it] = generate_hash(*it);
+    cluster_hashes[*it] = ReplicaFilter::for_node(*it).low_word();
   }
-  set_cluster_hashes(cluster_hashes);
 
-  bool alarms_enabled = (conf_map["alarms.enabled"].as<std::string>().compare("true") == 0);
-  set_alarms_enabled(alarms_enabled);
-  LOG_STATUS("Alarms enabled: %d", alarms_enabled);
-
-  unlock();
-}
+  std::string placement_name = conf_map["cluster.placement"].as<std::string>();
+  ClusterView::Placement placement = ClusterView::MODULO;
+  if (placement_name == "rendezvous")
+  {
+    placement = ClusterView::RENDEZVOUS;
+  }
+  else if (placement_name != "modulo")
+  {
+    LOG_ERROR("Unknown replica placement '%s', using modulo", placement_name.c_str());
+  }
+  LOG_STATUS("Replica placement: %s", (placement == ClusterView::RENDEZVOUS) ? "rendezvous" : "modulo");
 
-// Generates the pre-calculated bloom filter for the given string.
-//
-// Create 3 128-bit hashes, modulo each half down to 0..63 and set those
-// bits in the returned value.  In general this will set ~6 bits in the 
-// returned hash.
-uint64_t Globals::generate_hash(std::string data)
-{
-  uint64_t hash[2];
-  uint64_t rc = 0;
-  for (int ii = 0; ii < 3; ++ii)
+  std::vector<std::string> node_weights = conf_map["cluster.node-weight"].as<std::vector<std::string>>();
+  std::map<std::string, double> cluster_weights;
+  for (auto it = node_weights.begin(); it != node_weights.end(); ++it)
   {
-    MurmurHash3_x86_128(data.c_str(), data.length(), ii, (void*)hash);
-    for (int jj = 0; jj < 2; ++jj)
+    size_t sep = it->rfind('=');
+    double weight = (sep != std::string::npos) ? atof(it->c_str() + sep + 1) : 0.0;
+    if (weight <= 0.0)
     {
-      int bit = hash[jj] % 64;
-      rc |= ((uint64_t)1 << bit);
+      LOG_ERROR("Ignoring invalid node weight '%s'", it->c_str());
+      continue;
     }
+    LOG_STATUS("Node weight: %s", it->c_str());
+    cluster_weights[it->substr(0, sep)] = weight;
   }
 
-  return rc;
+  int filter_bits = conf_map["cluster.replica-filter-bits"].as<int>();
+  int filter_hashes = conf_map["cluster.replica-filter-hashes"].as<int>();
+  if (!ReplicaFilter::valid_format(filter_bits, filter_hashes))
+  {
+    LOG_ERROR("Invalid replica filter (%d bits, %d hashes), using %d bits, %d hashes",
+              filter_bits, filter_hashes,
+              ReplicaFilter::LEGACY_BITS, ReplicaFilter::LEGACY_HASHES);
+    filter_bits = ReplicaFilter::LEGACY_BITS;
+    filter_hashes = ReplicaFilter::LEGACY_HASHES;
+  }
+  LOG_STATUS("Replica filter: %d bits, %d hashes", filter_bits, filter_hashes);
+
+  // Publish the new cluster view, any readers still using the old view keep
+  // it alive until they're done with it.
+  set_cluster_view(ClusterViewPtr(new ClusterView(cluster_local_address,
+                                                  cluster_addresses,
+                                                  cluster_hashes,
+                                                  placement,
+                                                  cluster_weights,
+                                                  filter_bits,
+                                                  filter_hashes)));
+
+  int callback_max_connections = conf_map["callback.max-connections-per-host"].as<int>();
+  if (callback_max_connections < 1)
+  {
+    LOG_ERROR("Invalid maximum number of callback connections %d, using 50",
+              callback_max_connections);
+    callback_max_connections = 50;
+  }
+  set_callback_max_connections(callback_max_connections);
+  LOG_STATUS("Max connections per callback host: %d", callback_max_connections);
+
+  int callback_keepalive = conf_map["callback.keepalive"].as<int>();
+  if ((callback_keepalive < 1) || (callback_keepalive > 3600))
+  {
+    LOG_ERROR("Invalid callback connection keepalive %d, using 60",
+              callback_keepalive);
+    callback_keepalive = 60;
+  }
+  set_callback_keepalive(callback_keepalive);
+  LOG_STATUS("Callback connection keepalive: %ds", callback_keepalive);
+
+  bool callback_http2 = (conf_map["callback.http2"].as<std::string>().compare("true") == 0);
+  set_callback_http2(callback_http2);
+  LOG_STATUS("Callbacks over HTTP/2: %d", callback_http2);
+
+  int replication_threads = conf_map["replication.threads"].as<int>();
+  if (replication_threads < 1)
+  {
+    LOG_ERROR("Invalid number of replication threads %d, using 20",
+              replication_threads);
+    replication_threads = 20;
+  }
+  set_replication_threads(replication_threads);
+  LOG_STATUS("Replication threads: %d", replication_threads);
+
+  int replication_max_in_flight = conf_map["replication.max-in-flight-per-node"].as<int>();
+  if (replication_max_in_flight < 1)
+  {
+    LOG_ERROR("Invalid maximum number of replication requests in progress per node %d, using 4",
+              replication_max_in_flight);
+    replication_max_in_flight = 4;
+  }
+  set_replication_max_in_flight_per_peer(replication_max_in_flight);
+  LOG_STATUS("Maximum replication requests in progress per node: %d", replication_max_in_flight);
+
+  int anti_entropy_interval = conf_map["replication.anti-entropy-interval"].as<int>();
+  set_replication_anti_entropy_interval(anti_entropy_interval);
+  LOG_STATUS("Anti-entropy interval: %d", anti_entropy_interval);
+
+  bool alarms_enabled = (conf_map["alarms.enabled"].as<std::string>().compare("true") == 0);
+  set_alarms_enabled(alarms_enabled);
+  LOG_STATUS("Alarms enabled: %d", alarms_enabled);
+
+  unlock();
 }
@@ -0,0 +1,203 @@
+#include "http2_transport.h"
+#include "log.h"
+
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+// HTTP/2 prior knowledge was added in cURL 7.49.0.
+#define HTTP2_PRIOR_KNOWLEDGE_SUPPORTED (LIBCURL_VERSION_NUM >= 0x073100)
+
+Http2Transport::Http2Transport() :
+  _multi(NULL),
+  _running(false),
+  _new_requests(),
+  _terminate(false)
+{
+  pthread_mutex_init(&_mutex, NULL);
+  pthread_cond_init(&_cond, NULL);
+
+  if (pipe(_wake_pipe) != 0)
+  {
+    // LCOV_EXCL_START
+    LOG_ERROR("Failed to create HTTP/2 transport wake pipe: %s", strerror(errno));
+    _wake_pipe[0] = -1;
+    _wake_pipe[1] = -1;
+    // LCOV_EXCL_STOP
+  }
+  else
+  {
+    fcntl(_wake_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(_wake_pipe[1], F_SETFL, O_NONBLOCK);
+  }
+
+  _multi = curl_multi_init();
+#if HTTP2_PRIOR_KNOWLEDGE_SUPPORTED
+  curl_multi_setopt(_multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+#endif
+
+  int rc = pthread_create(&_thread,
+                          NULL,
+                          &Http2Transport::thread_entry_point,
+                          (void*)this);
+  if (rc != 0)
+  {
+    // LCOV_EXCL_START
+    LOG_ERROR("Failed to start HTTP/2 transport thread: %s", strerror(rc));
+    // LCOV_EXCL_STOP
+  }
+  else
+  {
+    _running = true;
+  }
+}
+
+Http2Transport::~Http2Transport()
+{
+  if (_running)
+  {
+    pthread_mutex_lock(&_mutex);
+    _terminate = true;
+    pthread_mutex_unlock(&_mutex);
+    wake();
+    pthread_join(_thread, NULL);
+  }
+
+  curl_multi_cleanup(_multi);
+  close(_wake_pipe[0]);
+  close(_wake_pipe[1]);
+  pthread_cond_destroy(&_cond);
+  pthread_mutex_destroy(&_mutex);
+}
+
+bool Http2Transport::supported()
+{
+#if HTTP2_PRIOR_KNOWLEDGE_SUPPORTED
+  // The cURL library we're running with must support HTTP/2.  cURL 7.88
+  // fails every request after the first on a connection opened with prior
+  // knowledge (with CURLE_HTTP2), so can't be used either.
+  curl_version_info_data* version = curl_version_info(CURLVERSION_NOW);
+  return ((version->features & CURL_VERSION_HTTP2) &&
+          ((version->version_num < 0x075800) ||
+           (version->version_num >= 0x080000)));
+#else
+  return false;
+#endif
+}
+
+CURLcode Http2Transport::perform(CURL* curl)
+{
+#if HTTP2_PRIOR_KNOWLEDGE_SUPPORTED
+  curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE);
+
+  // Wait for an existing connection to the origin rather than opening another
+  // one, so that requests are multiplexed.
+  curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+#endif
+
+  if (!_running)
+  {
+    // There's no thread to drive the request, so send it ourselves.
+    return curl_easy_perform(curl);
+  }
+
+  Request request;
+  request.curl = curl;
+  request.rc = CURLE_OK;
+  request.done = false;
+  curl_easy_setopt(curl, CURLOPT_PRIVATE, &request);
+
+  pthread_mutex_lock(&_mutex);
+  _new_requests.push_back(&request);
+  pthread_mutex_unlock(&_mutex);
+  wake();
+
+  pthread_mutex_lock(&_mutex);
+  while (!request.done)
+  {
+    pthread_cond_wait(&_cond, &_mutex);
+  }
+  pthread_mutex_unlock(&_mutex);
+
+  curl_easy_setopt(curl, CURLOPT_PRIVATE, NULL);
+  return request.rc;
+}
+
+/*****************************************************************************/
+/* Private functions.                                                        */
+/*****************************************************************************/
+
+void* Http2Transport::thread_entry_point(void* arg)
+{
+  ((Http2Transport*)arg)->run();
+  return NULL;
+}
+
+void Http2Transport::run()
+{
+  while (true)
+  {
+    // Pick up any new requests.
+    std::vector<Request*> new_requests;
+    pthread_mutex_lock(&_mutex);
+    bool terminate = _terminate;
+    new_requests.swap(_new_requests);
+    pthread_mutex_unlock(&_mutex);
+
+    if (terminate)
+    {
+      break;
+    }
+
+    for (auto it = new_requests.begin(); it != new_requests.end(); ++it)
+    {
+      curl_multi_add_handle(_multi, (*it)->curl);
+    }
+
+    // Drive the transfers, and complete any that have finished.
+    int running;
+    curl_multi_perform(_multi, &running);
+
+    CURLMsg* msg;
+    int msgs_left;
+    while ((msg = curl_multi_info_read(_multi, &msgs_left)) != NULL)
+    {
+      if (msg->msg == CURLMSG_DONE)
+      {
+        CURL* curl = msg->easy_handle;
+        CURLcode rc = msg->data.result;
+        Request* request = NULL;
+        curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char**)&request);
+        curl_multi_remove_handle(_multi, curl);
+
+        pthread_mutex_lock(&_mutex);
+        request->rc = rc;
+        request->done = true;
+        pthread_cond_broadcast(&_cond);
+        pthread_mutex_unlock(&_mutex);
+      }
+    }
+
+    // Wait for activity on the connections, or for new requests.
+    struct curl_waitfd wake_fd;
+    wake_fd.fd = _wake_pipe[0];
+    wake_fd.events = CURL_WAIT_POLLIN;
+    wake_fd.revents = 0;
+    int numfds;
+    curl_multi_wait(_multi, &wake_fd, 1, 1000, &numfds);
+
+    char buf[64];
+    while (read(_wake_pipe[0], buf, sizeof(buf)) > 0)
+    {
+    }
+  }
+}
+
+void Http2Transport::wake()
+{
+  char c = 0;
+  if (write(_wake_pipe[1], &c, 1) < 0)
+  {
+    // The pipe is full, so the thread is going to wake up anyway.
+  }
+}
@@ -1,15 +1,55 @@
 #include "http_callback.h"
 #include "log.h"
+#include "globals.h"
+#include "rapidjson/reader.h"
+#include "rapidjson/writer.h"
+#include "rapidjson/stringbuffer.h"
 
 #include <cstring>
+#include <algorithm>
+#include <time.h>
 
 HTTPCallback::HTTPCallback(Replicator* replicator,
-                           Alarm* timer_pop_alarm) :
-  _q(),
+                           Alarm* timer_pop_alarm,
+                           DnsCache* dns_cache) :
+  _scheduler(NULL),
+  _pending_batches(),
   _running(false),
   _replicator(replicator),
-  _timer_pop_alarm(timer_pop_alarm)
+  _timer_pop_alarm(timer_pop_alarm),
+  _dns_cache(dns_cache),
+  _pool(NULL),
+  _http2(NULL),
+  _headers(NULL)
 {
+  int max_connections;
+  int keepalive;
+  __globals->get_callback_max_connections(max_connections);
+  __globals->get_callback_keepalive(keepalive);
+  _pool = new ConnectionPool(max_connections, keepalive);
+
+  // Each callback host can have at most as many callbacks in progress as it
+  // has connections (or as there are workers, if that's unlimited).
+  _scheduler = new CallbackScheduler((max_connections > 0) ?
+                                     std::min(max_connections, HTTPCALLBACK_THREAD_COUNT) :
+                                     HTTPCALLBACK_THREAD_COUNT);
+
+  bool http2;
+  __globals->get_callback_http2(http2);
+  if (http2)
+  {
+    if (Http2Transport::supported())
+    {
+      _http2 = new Http2Transport();
+    }
+    else
+    {
+      LOG_ERROR("HTTP/2 callbacks aren't supported by this version of cURL, using HTTP/1.1");
+    }
+  }
+
+  // Set up a content type header descriptor to use for our requests.
+  _headers = curl_slist_append(_headers, "Content-Type: application/octet-stream");
 }
 
 HTTPCallback::~HTTPCallback()
@@ -18,6 +58,11 @@ HTTPCallback::~HTTPCallback()
   {
     stop();
   }
+
+  delete _http2; _http2 = NULL;
+  delete _scheduler; _scheduler = NULL;
+  delete _pool; _pool = NULL;
+  curl_slist_free_all(_headers);
 }
 
 void HTTPCallback::start(TimerHandler* handler)
@@ -44,7 +89,7 @@ void HTTPCallback::start(TimerHandler* handler)
 
 void HTTPCallback::stop()
 {
-  _q.terminate();
+  _scheduler->terminate();
   for (int ii = 0; ii < HTTPCALLBACK_THREAD_COUNT; ++ii)
   {
     pthread_join(_worker_threads[ii], NULL);
@@ -54,7 +99,53 @@ void HTTPCallback::stop()
 
 void HTTPCallback::perform(Timer* timer)
 {
-  _q.push(timer);
+  if (timer->callback_batch())
+  {
+    // Hold the timer until the rest of the timers that popped with it have
+    // been passed in, so it can be sent with any others for the same URL.
+    _pending_batches[timer->callback_url()].push_back(timer);
+  }
+  else if (!_scheduler->push(callback_origin(timer->callback_url()),
+                              timer,
+                              callback_deadline(timer)))
+  {
+    LOG_WARNING("Failed to process callback for %lu: URL %s, too many callbacks queued for the host",
+                timer->id,
+                timer->callback_url().c_str());
+    callback_failed(timer);
+  }
+}
+
+// Pass the pending batches to the scheduler, splitting any that are too
+// large.  Each batch must be sent by the earliest deadline of its timers.
+void HTTPCallback::flush()
+{
+  for (auto it = _pending_batches.begin(); it != _pending_batches.end(); ++it)
+  {
+    std::vector<Timer*>& timers = it->second;
+    std::string origin = callback_origin(it->first);
+    for (size_t start = 0; start < timers.size(); start += HTTPCALLBACK_MAX_BATCH_SIZE)
+    {
+      size_t end = std::min(start + HTTPCALLBACK_MAX_BATCH_SIZE, timers.size());
+      std::vector<Timer*>* batch = new std::vector<Timer*>(timers.begin() + start,
+                                                           timers.begin() + end);
+
+      uint64_t deadline_ms = callback_deadline(batch->front());
+      for (auto timer = batch->begin(); timer != batch->end(); ++timer)
+      {
+        deadline_ms = std::min(deadline_ms, callback_deadline(*timer));
+      }
+
+      if (!_scheduler->push(origin, batch, deadline_ms))
+      {
+        LOG_WARNING("Failed to process batch callback of %lu timers: URL %s, too many callbacks queued for the host",
+                    batch->size(),
+                    it->first.c_str());
+        batch_failed(batch);
+      }
+    }
+  }
+  _pending_batches.clear();
 }
 
 void* HTTPCallback::worker_thread_entry_point(void* arg)
@@ -66,72 +157,631 @@ void* HTTPCallback::worker_thread_entry_point(void* arg)
 
 void HTTPCallback::worker_thread_entry_point()
 {
-  CURL* curl = curl_easy_init();
-  curl_easy_setopt(curl, CURLOPT_POST, 1);
-  curl_easy_setopt(curl, CURLOPT_VERBOSE, 1);
+  // Timers to return to the store, and when the oldest of them was added.
+  std::unordered_set<Timer*> rearm_batch;
+  uint64_t batch_start_ms = 0;
 
-  Timer* timer;
-  while (_q.pop(timer))
+  while (true)
   {
+    std::string origin;
+    Timer* timer = NULL;
+    std::vector<Timer*>* batch = NULL;
+    uint64_t deadline_ms = 0;
+    bool expired = false;
+
+    if (rearm_batch.empty())
+    {
+      if (!_scheduler->pop(origin, timer, batch, deadline_ms, expired))
+      {
+        break;
+      }
+    }
+    else
+    {
+      // Don't wait for more work while holding timers that need re-arming.
+      // Once they've been returned to the store, go back to waiting (which
+      // also notices if the queue has been terminated).
+      if (!_scheduler->try_pop(origin, timer, batch, deadline_ms, expired))
+      {
+        rearm_timers(rearm_batch);
+        continue;
+      }
+    }
+
+    if (expired)
+    {
+      // The callback waited too long for its turn, and the next replica will
+      // already have popped the timer, so don't send it.
+      if (batch != NULL)
+      {
+        LOG_WARNING("Failed to process batch callback of %lu timers: URL %s, missed its deadline",
+                    batch->size(),
+                    batch->front()->callback_url().c_str());
+        batch_failed(batch);
+      }
+      else
+      {
+        LOG_WARNING("Failed to process callback for %lu: URL %s, missed its deadline",
+                    timer->id,
+                    timer->callback_url().c_str());
+        callback_failed(timer);
+      }
+      continue;
+    }
+
+    // Sending the callback may take until its deadline, so return the timers
+    // waiting to be re-armed first if they've already been held for long
+    // enough.
+    if ((!rearm_batch.empty()) &&
+        (monotonic_time_ms() >= batch_start_ms + HTTPCALLBACK_REARM_DELAY_MS))
+    {
+      rearm_timers(rearm_batch);
+    }
+
+    if (batch != NULL)
+    {
+      send_batch(origin, batch, deadline_ms);
+      continue;
+    }
+
+    // Borrow a connection to the callback host.  If the host already has as
+    // many requests in progress as it's allowed, only wait for as long as the
+    // callback has left, so a slow host can't hold up this worker.
+    long timeout_ms = request_timeout_ms(deadline_ms, current_time_ms());
+    CURL* curl = _pool->acquire(origin, timeout_ms);
+    if (curl == NULL)
+    {
+      LOG_WARNING("Failed to process callback for %lu: URL %s, no connection available in time",
+                  timer->id,
+                  timer->callback_url().c_str());
+      // The callback was never sent, so this says nothing about how the host
+      // is coping.
+      _scheduler->abandon(origin);
+      callback_failed(timer);
+      continue;
+    }
+
     // Set up the request details.
-    curl_easy_setopt(curl, CURLOPT_URL, timer->callback_url.c_str());
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, timer->callback_body.data());
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, timer->callback_body.length());
+    curl_easy_setopt(curl, CURLOPT_POST, 1);
+    curl_easy_setopt(curl, CURLOPT_VERBOSE, 1);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, timeout_ms);
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, timeout_ms);
+    struct curl_slist* resolve = set_callback_uri(curl, timer->callback_url());
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, timer->callback_body().data());
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, timer->callback_body().length());
 
-    // Include the sequence number header.
-    struct curl_slist* headers = NULL;
-    headers = curl_slist_append(headers, (std::string("X-Sequence-Number: ") +
-                                          std::to_string(timer->sequence_number)).c_str());
-    headers = curl_slist_append(headers, "Content-Type: application/octet-stream");
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    // Include the sequence number header, in front of the common headers.
+    // cURL only reads the list while the request is sent, so the extra entry
+    // can live on the stack.
+    std::string sequence_header = std::string("X-Sequence-Number: ") +
+                                  std::to_string(timer->sequence_number);
+    struct curl_slist headers;
+    headers.data = (char*)sequence_header.c_str();
+    headers.next = _headers;
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, &headers);
+
+    // Keep the response, which may change the timer.
+    std::string response;
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &HTTPCallback::string_store);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
 
     // Send the request
-    CURLcode curl_rc = curl_easy_perform(curl);
+    uint64_t start_ms = monotonic_time_ms();
+    CURLcode curl_rc = send_request(curl);
+    uint64_t latency_ms = monotonic_time_ms() - start_ms;
+    long http_rc = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_rc);
+    char* content_type = NULL;
+    curl_easy_getinfo(curl, CURLINFO_CONTENT_TYPE, &content_type);
+
     if (curl_rc == CURLE_OK)
     {
-      // Check if the next pop occurs before the repeat-for interval and,
-      // if not, convert to a tombstone to indicate the timer is dead.
-      if ((timer->sequence_number + 1) * timer->interval > timer->repeat_for)
+      if ((http_rc >= 200) && (http_rc < 300))
+      {
+        apply_response(timer,
+                       (content_type != NULL) ? content_type : "",
+                       response);
+      }
+
+      callback_succeeded(timer);
+
+      if (rearm_batch.empty())
       {
-        timer->become_tombstone();
+        batch_start_ms = monotonic_time_ms();
       }
-      _replicator->replicate(timer);
-      _handler->add_timer(timer);
+      rearm_batch.insert(timer);
       timer = NULL; // We relinquish control of the timer when we give
                     // it to the store.
-      if (_timer_pop_alarm)
+
+      if ((rearm_batch.size() >= HTTPCALLBACK_REARM_BATCH_SIZE) ||
+          (monotonic_time_ms() >= batch_start_ms + HTTPCALLBACK_REARM_DELAY_MS))
       {
-        _timer_pop_alarm->clear();
+        rearm_timers(rearm_batch);
       }
     }
     else
     {
       if (curl_rc == CURLE_HTTP_RETURNED_ERROR)
       {
-        long http_rc = 0;
-        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_rc);
-        LOG_WARNING("Got HTTP error %d from %s", http_rc, timer->callback_url.c_str());
+        LOG_WARNING("Got HTTP error %ld from %s", http_rc, timer->callback_url().c_str());
       }
 
       LOG_WARNING("Failed to process callback for %lu: URL %s, curl error was: %s", timer->id,
-                  timer->callback_url.c_str(),
+                  timer->callback_url().c_str(),
                   curl_easy_strerror(curl_rc));
 
-      if (_timer_pop_alarm && timer->is_last_replica())
+      callback_failed(timer);
+    }
+
+    // Return the connection to the pool, unless it failed.
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, NULL);
+    curl_easy_setopt(curl, CURLOPT_RESOLVE, NULL);
+    curl_slist_free_all(resolve);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, NULL);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, NULL);
+    _pool->release(origin,
+                   curl,
+                   ((curl_rc == CURLE_OK) ||
+                    (curl_rc == CURLE_HTTP_RETURNED_ERROR)));
+
+    // Let the scheduler know how the host coped, counting server errors as a
+    // sign it's overloaded.
+    _scheduler->complete(origin,
+                         latency_ms,
+                         ((curl_rc == CURLE_OK) && (http_rc < 500)));
+  }
+
+  // Return any timers still waiting to be re-armed.
+  rearm_timers(rearm_batch);
+
+  return;
+}
+
+// Send the callbacks for a batch of timers in a single request, which must
+// complete by the given deadline.  The batch is deleted once it's been sent.
+void HTTPCallback::send_batch(const std::string& origin,
+                              std::vector<Timer*>* timers,
+                              uint64_t deadline_ms)
+{
+  const SharedString& url = timers->front()->callback_url();
+  std::string body = batch_json(*timers);
+  std::string response;
+  long timeout_ms = request_timeout_ms(deadline_ms, current_time_ms());
+
+  // Borrow a connection to the callback host, only waiting for as long as
+  // the batch has left (as for a single callback).  If none is free in time
+  // the whole batch fails.
+  CURL* curl = _pool->acquire(origin, timeout_ms);
+  if (curl == NULL)
+  {
+    LOG_WARNING("Failed to process batch callback of %lu timers: URL %s, no connection available in time",
+                timers->size(),
+                url.c_str());
+    _scheduler->abandon(origin);
+    batch_failed(timers);
+    return;
+  }
+
+  // Set up the request details.
+  struct curl_slist headers;
+  headers.data = (char*)"Content-Type: application/json";
+  headers.next = NULL;
+  curl_easy_setopt(curl, CURLOPT_POST, 1);
+  curl_easy_setopt(curl, CURLOPT_VERBOSE, 1);
+  curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, timeout_ms);
+  curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, timeout_ms);
+  struct curl_slist* resolve = set_callback_uri(curl, url);
+  curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body.data());
+  curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, body.length());
+  curl_easy_setopt(curl, CURLOPT_HTTPHEADER, &headers);
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &HTTPCallback::string_store);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+
+  // Send the request.  The whole batch fails unless the request gets a 2xx
+  // response, otherwise the response says which items failed.
+  std::vector<bool> succeeded(timers->size(), false);
+  uint64_t start_ms = monotonic_time_ms();
+  CURLcode curl_rc = send_request(curl);
+  uint64_t latency_ms = monotonic_time_ms() - start_ms;
+  long http_rc = 0;
+  if (curl_rc == CURLE_OK)
+  {
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_rc);
+    if ((http_rc < 200) || (http_rc >= 300))
+    {
+      LOG_WARNING("Got HTTP error %ld from %s", http_rc, url.c_str());
+    }
+    else if (!parse_batch_response(response, succeeded))
+    {
+      LOG_WARNING("Invalid batch callback response from %s: %s",
+                  url.c_str(),
+                  response.c_str());
+    }
+  }
+  else
+  {
+    LOG_WARNING("Failed to process batch callback of %lu timers: URL %s, curl error was: %s",
+                timers->size(),
+                url.c_str(),
+                curl_easy_strerror(curl_rc));
+  }
+
+  // Return the connection to the pool, unless it failed.
+  curl_easy_setopt(curl, CURLOPT_HTTPHEADER, NULL);
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, NULL);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, NULL);
+  curl_easy_setopt(curl, CURLOPT_RESOLVE, NULL);
+  curl_slist_free_all(resolve);
+  _pool->release(origin, curl, (curl_rc == CURLE_OK));
+
+  // Let the scheduler know how the host coped with the batch, as for a
+  // single callback.
+  _scheduler->complete(origin,
+                       latency_ms,
+                       ((curl_rc == CURLE_OK) && (http_rc < 500)));
+
+  // Handle each item in the batch.  `callback_succeeded()` may turn the
+  // timer into a tombstone (which changes its URL) so this must be done
+  // after we're finished with the request.
+  std::unordered_set<Timer*> rearm_batch;
+  for (size_t ii = 0; ii < timers->size(); ++ii)
+  {
+    Timer* timer = (*timers)[ii];
+    if (succeeded[ii])
+    {
+      callback_succeeded(timer);
+      rearm_batch.insert(timer);
+    }
+    else
+    {
+      LOG_WARNING("Failed to process callback for %lu in batch", timer->id);
+      callback_failed(timer);
+    }
+  }
+  rearm_timers(rearm_batch);
+
+  delete timers;
+}
+
+// Build the body of a batch callback.  This takes the form:
+// [
+//     {
+//         "sequence-number": Int,
+//         "opaque": "string"
+//     },
+//     ...
+// ]
+std::string HTTPCallback::batch_json(const std::vector<Timer*>& timers)
+{
+  rapidjson::StringBuffer sb;
+  rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+
+  writer.StartArray();
+  for (auto it = timers.begin(); it != timers.end(); ++it)
+  {
+    writer.StartObject();
+    writer.Key("sequence-number");
+    writer.Int((*it)->sequence_number);
+    writer.Key("opaque");
+    writer.String((*it)->callback_body().data(), (*it)->callback_body().length());
+    writer.EndObject();
+  }
+  writer.EndArray();
+
+  return std::string(sb.GetString(), sb.GetSize());
+}
+
+// SAX handler for the response to a batch callback, which may list the
+// (0-based) positions of any items in the batch that failed:
+// {
+//     "failed": [Int, ...]
+// }
+class BatchResponseHandler :
+  public rapidjson::BaseReaderHandler<rapidjson::UTF8<>, BatchResponseHandler>
+{
+public:
+  BatchResponseHandler(std::vector<bool>& succeeded) :
+    _succeeded(succeeded), _depth(0), _in_failed(false), _valid(true)
+  {}
+
+  bool valid() const { return _valid; }
+
+  bool Default() { return other(); }
+  bool Int(int i) { return (i >= 0) ? index(i) : other(); }
+  bool Uint(unsigned u) { return index(u); }
+  bool Int64(int64_t i) { return (i >= 0) ? index(i) : other(); }
+  bool Uint64(uint64_t u) { return index(u); }
+
+  bool Key(const char* str, rapidjson::SizeType length, bool)
+  {
+    _key.assign(str, length);
+    return true;
+  }
+
+  bool StartObject()
+  {
+    _valid = _valid && (_depth == 0);
+    _depth++;
+    return true;
+  }
+
+  bool StartArray()
+  {
+    _in_failed = ((_depth == 1) && (_key == "failed"));
+    _depth++;
+    return true;
+  }
+
+  bool EndObject(rapidjson::SizeType) { _depth--; return true; }
+  bool EndArray(rapidjson::SizeType) { _depth--; _in_failed = false; return true; }
+
+private:
+  bool index(uint64_t ii)
+  {
+    if (_in_failed)
+    {
+      if (ii < _succeeded.size())
+      {
+        _succeeded[ii] = false;
+      }
+      else
       {
-        _timer_pop_alarm->set();
+        _valid = false;
       }
+    }
+    return true;
+  }
 
-      delete timer;
+  bool other()
+  {
+    if (_in_failed)
+    {
+      _valid = false;
     }
+    return true;
+  }
+
+  std::vector<bool>& _succeeded;
+  int _depth;
+  bool _in_failed;
+  bool _valid;
+  std::string _key;
+};
+
+// Parse the response to a batch callback, marking which items succeeded.  An
+// empty response means every item succeeded.  Returns false (with every item
+// marked as failed) if the response can't be parsed.
+bool HTTPCallback::parse_batch_response(const std::string& response,
+                                        std::vector<bool>& succeeded)
+{
+  succeeded.assign(succeeded.size(), true);
 
-    // Tidy up request-speciifc objects
-    curl_slist_free_all(headers);
-    headers = NULL;
+  if (response.find_first_not_of(" \t\r\n") == std::string::npos)
+  {
+    return true;
   }
 
-  // Tidy up thread-specific objects
-  curl_easy_cleanup(curl);
+  BatchResponseHandler handler(succeeded);
+  rapidjson::Reader reader;
+  rapidjson::StringStream stream(response.c_str());
+  reader.Parse<0>(stream, handler);
+  if ((reader.HasParseError()) || (!handler.valid()))
+  {
+    succeeded.assign(succeeded.size(), false);
+    return false;
+  }
 
-  return;
+  return true;
+}
+
+// Apply any changes to the timer asked for in the response to its callback
+// (see `Timer::callback_response_from_json()`).  This is done before the timer
+// is replicated, so the new timing (or the cancellation) reaches the replicas
+// without the client having to update the timer separately.
+//
+// Most clients just return a plain acknowledgement, so the response is only
+// parsed if it's JSON (by its Content-Type, or failing that because it's an
+// object).  Any other response leaves the timer alone.
+void HTTPCallback::apply_response(Timer* timer,
+                                  const std::string& content_type,
+                                  const std::string& response)
+{
+  size_t start = response.find_first_not_of(" \t\r\n");
+  if (start == std::string::npos)
+  {
+    return;
+  }
+
+  if ((strncasecmp(content_type.c_str(), "application/json", 16) != 0) &&
+      (response[start] != '{'))
+  {
+    LOG_DEBUG("Ignoring non-JSON callback response for %lu", timer->id);
+    return;
+  }
+
+  TimerTiming timing;
+  bool reschedule;
+  bool cancel;
+  std::string error;
+  if (!Timer::callback_response_from_json(response, timing, reschedule, cancel, error))
+  {
+    LOG_WARNING("Ignoring invalid callback response for %lu: %s",
+                timer->id,
+                error.c_str());
+    return;
+  }
+
+  if (cancel)
+  {
+    LOG_DEBUG("Callback response cancelled timer %lu", timer->id);
+    timer->become_tombstone();
+  }
+  else if (reschedule)
+  {
+    LOG_DEBUG("Callback response rescheduled timer %lu", timer->id);
+    timer->set_timing(timing);
+  }
+}
+
+// The time (in ms since the epoch) by which a popped timer's callback must
+// complete, which is when the next replica will pop the timer.
+uint64_t HTTPCallback::callback_deadline(Timer* timer)
+{
+  // The timer's sequence number has already moved on, so this pop was one
+  // interval before its next pop.
+  return timer->next_pop_time() - timer->interval + HTTPCALLBACK_DEADLINE_MS;
+}
+
+// The timeout for a callback request, given its deadline.
+long HTTPCallback::request_timeout_ms(uint64_t deadline_ms, uint64_t now_ms)
+{
+  if (deadline_ms < now_ms + HTTPCALLBACK_MIN_TIMEOUT_MS)
+  {
+    return HTTPCALLBACK_MIN_TIMEOUT_MS;
+  }
+
+  return std::min((long)(deadline_ms - now_ms), (long)HTTPCALLBACK_DEADLINE_MS);
+}
+
+// Handle a successful callback, before the timer is re-armed.
+void HTTPCallback::callback_succeeded(Timer* timer)
+{
+  // Check if the next pop occurs before the repeat-for interval and,
+  // if not, convert to a tombstone to indicate the timer is dead.
+  if ((timer->sequence_number + 1) * timer->interval > timer->repeat_for)
+  {
+    timer->become_tombstone();
+  }
+  _replicator->replicate(timer);
+
+  if (_timer_pop_alarm)
+  {
+    _timer_pop_alarm->clear();
+  }
+}
+
+// Handle a failed callback.  This deletes the timer.
+void HTTPCallback::callback_failed(Timer* timer)
+{
+  if (_timer_pop_alarm && timer->is_last_replica())
+  {
+    _timer_pop_alarm->set();
+  }
+
+  _handler->release_timer(timer->id);
+  delete timer;
+}
+
+// Handle a batch whose callback failed.  This deletes the timers and the
+// batch.
+void HTTPCallback::batch_failed(std::vector<Timer*>* timers)
+{
+  for (auto it = timers->begin(); it != timers->end(); ++it)
+  {
+    callback_failed(*it);
+  }
+  delete timers;
+}
+
+// Callback used by cURL to collect the body of a response.
+size_t HTTPCallback::string_store(void* ptr, size_t size, size_t nmemb, void* stream)
+{
+  ((std::string*)stream)->append((char*)ptr, size * nmemb);
+  return (size * nmemb);
+}
+
+// Return a batch of timers to the store.  The batch is emptied, as the store
+// now owns the timers.
+void HTTPCallback::rearm_timers(std::unordered_set<Timer*>& timers)
+{
+  if (!timers.empty())
+  {
+    _handler->rearm_timers(timers);
+  }
+}
+
+// Split a callback URI for a Unix domain socket, of the form
+// `unix:<socket path>[:<request path>]` (e.g.
+// `unix:/var/run/client.sock:/callback`), into the socket path and the URL
+// to request over it.  Returns false if this isn't a Unix socket URI.
+bool HTTPCallback::parse_unix_uri(const std::string& uri,
+                                  std::string& socket_path,
+                                  std::string& url)
+{
+  if (uri.compare(0, 5, "unix:") != 0)
+  {
+    return false;
+  }
+
+  size_t path_start = uri.find(':', 5);
+  socket_path = uri.substr(5, path_start - 5);
+  url = "http://localhost" + ((path_start != std::string::npos) ?
+                              uri.substr(path_start + 1) :
+                              std::string("/"));
+  return true;
+}
+
+// The origin of a callback URI, for pooling connections.  Each Unix socket is
+// its own origin.
+std::string HTTPCallback::callback_origin(const std::string& uri)
+{
+  std::string socket_path;
+  std::string url;
+  return (parse_unix_uri(uri, socket_path, url)) ?
+         "unix:" + socket_path :
+         ConnectionPool::origin(uri);
+}
+
+// Point a handle at a callback URI.  Returns the list of cached addresses
+// passed to the handle (see `DnsCache::resolve_list()`), which must be freed
+// once the request is complete.
+struct curl_slist* HTTPCallback::set_callback_uri(CURL* curl, const std::string& uri)
+{
+  struct curl_slist* resolve = NULL;
+  std::string socket_path;
+  std::string url;
+  if (parse_unix_uri(uri, socket_path, url))
+  {
+#if LIBCURL_VERSION_NUM >= 0x072800
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_UNIX_SOCKET_PATH, socket_path.c_str());
+#else
+    // Unix sockets need cURL 7.40.0, so leave the URL as it is, which will
+    // fail the callback.
+    LOG_ERROR("Unix socket callbacks aren't supported by this version of cURL");
+    curl_easy_setopt(curl, CURLOPT_URL, uri.c_str());
+#endif
+  }
+  else
+  {
+    curl_easy_setopt(curl, CURLOPT_URL, uri.c_str());
+
+    if (_dns_cache != NULL)
+    {
+      resolve = _dns_cache->resolve_list(uri);
+      curl_easy_setopt(curl, CURLOPT_RESOLVE, resolve);
+    }
+  }
+
+  return resolve;
+}
+
+// Send the request set up on a handle, over HTTP/2 if it's enabled.
+CURLcode HTTPCallback::send_request(CURL* curl)
+{
+  return (_http2 != NULL) ? _http2->perform(curl) : curl_easy_perform(curl);
+}
+
+uint64_t HTTPCallback::monotonic_time_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+uint64_t HTTPCallback::current_time_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
 }
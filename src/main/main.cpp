@@ -2,14 +2,24 @@
 #include "timer_store.h"
 #include "timer_handler.h"
 #include "replicator.h"
+#include "replication_engine.h"
 #include "callback.h"
 #include "http_callback.h"
+#include "zmq_callback.h"
+#include "stream_callback.h"
+#include "callback_dispatcher.h"
+#include "dns_cache.h"
+#include "anti_entropy.h"
 #include "controller.h"
 #include "globals.h"
 #include "alarm.h"
 
 #include <iostream>
 #include <cassert>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 #include "time.h"
 
@@ -31,6 +41,42 @@ void exception_handler(int sig)
   abort();
 }
 
+// Serve HTTP requests on a Unix domain socket, in addition to the TCP socket.
+// Any existing file at the path is replaced.
+bool bind_unix_socket(struct evhttp* http, const std::string& path)
+{
+  struct sockaddr_un addr;
+  if (path.length() >= sizeof(addr.sun_path))
+  {
+    LOG_ERROR("Unix socket path %s is too long", path.c_str());
+    return false;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+  {
+    LOG_ERROR("Failed to create Unix socket: %s", strerror(errno));
+    return false;
+  }
+
+  unlink(path.c_str());
+  if ((bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) ||
+      (listen(fd, SOMAXCONN) < 0) ||
+      (evutil_make_socket_nonblocking(fd) < 0) ||
+      (evhttp_accept_socket(http, fd) < 0))
+  {
+    LOG_ERROR("Failed to listen on Unix socket %s: %s", path.c_str(), strerror(errno));
+    close(fd);
+    return false;
+  }
+
+  return true;
+}
+
 int main(int argc, char** argv)
 {
   Alarm* timer_pop_alarm = NULL;
@@ -67,13 +113,39 @@ int main(int argc, char** argv)
 
   // Create components
   TimerStore *store = new TimerStore();
-  Replicator* controller_rep = new Replicator();
-  Replicator* handler_rep = new Replicator();
-  HTTPCallback* callback = new HTTPCallback(handler_rep, timer_pop_alarm);
+  DnsCache* dns_cache = new DnsCache();
+  int replication_threads;
+  int replication_max_in_flight;
+  __globals->get_replication_threads(replication_threads);
+  __globals->get_replication_max_in_flight_per_peer(replication_max_in_flight);
+  ReplicationEngine* replication_engine =
+    new ReplicationEngine(replication_threads, replication_max_in_flight, dns_cache);
+
+  // Replication of timers from clients is sent ahead of replication following
+  // pops.
+  Replicator* controller_rep = new Replicator(replication_engine, true);
+  Replicator* handler_rep = new Replicator(replication_engine, false);
+  HTTPCallback* http_callback = new HTTPCallback(handler_rep, timer_pop_alarm, dns_cache);
+  ZmqCallback* zmq_callback = new ZmqCallback(handler_rep, timer_pop_alarm);
+  StreamCallback* stream_callback = new StreamCallback(handler_rep, timer_pop_alarm);
+  CallbackDispatcher* callback = new CallbackDispatcher();
+  callback->add_callback(http_callback);
+  callback->add_callback(zmq_callback);
+  callback->add_callback(stream_callback);
   TimerHandler* handler = new TimerHandler(store, callback);
-  callback->start(handler);
+  http_callback->start(handler);
+  zmq_callback->start(handler);
   Controller* controller = new Controller(controller_rep, handler);
 
+  // Periodically repair any timers the other replicas have missed.
+  int anti_entropy_interval;
+  __globals->get_replication_anti_entropy_interval(anti_entropy_interval);
+  AntiEntropy* anti_entropy = new AntiEntropy(handler,
+                                              handler_rep,
+                                              dns_cache,
+                                              anti_entropy_interval);
+  anti_entropy->start();
+
   // Create an event reactor.
   struct event_base* base = event_base_new();
   if (!base) {
@@ -91,6 +163,12 @@ int main(int argc, char** argv)
   // Register a callback for the "/ping" path.
   evhttp_set_cb(http, "/ping", Controller::controller_ping_cb, NULL);
 
+  // Register callbacks for consumers streaming popped timers, which are
+  // delivered from the reactor.
+  stream_callback->start(handler, base);
+  evhttp_set_cb(http, "/pops", StreamCallback::pops_cb, stream_callback);
+  evhttp_set_cb(http, "/pops/ack", StreamCallback::ack_cb, stream_callback);
+
   // Register a callback for the "/timers" path, we have to do this with the
   // generic callback as libevent doesn't support regex paths.
   evhttp_set_gencb(http, Controller::controller_cb, controller);
@@ -102,12 +180,29 @@ int main(int argc, char** argv)
   __globals->get_bind_port(bind_port);
   evhttp_bind_socket(http, bind_address.c_str(), bind_port);
 
+  // And to the Unix socket, if there is one.
+  std::string unix_socket;
+  __globals->get_bind_unix_socket(unix_socket);
+  if (!unix_socket.empty())
+  {
+    bind_unix_socket(http, unix_socket);
+  }
+
   // Start the reactor, this blocks the current thread
   event_base_dispatch(base);
 
   // Event loop is completed, terminate.
   //
 
+  if (!unix_socket.empty())
+  {
+    unlink(unix_socket.c_str());
+  }
+
+  // Stop repairing timers before the globals go away.
+  anti_entropy->stop();
+  delete anti_entropy;
+
   if (alarms_enabled)
   { 
     // Stop the alarm request agent
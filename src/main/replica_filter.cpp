@@ -0,0 +1,169 @@
+#include "replica_filter.h"
+#include "murmur/MurmurHash3.h"
+
+#include <cstdio>
+#include <cstring>
+
+const int ReplicaFilter::LEGACY_BITS;
+const int ReplicaFilter::LEGACY_HASHES;
+const int ReplicaFilter::MAX_WORDS;
+
+ReplicaFilter::ReplicaFilter() :
+  _bits(LEGACY_BITS),
+  _num_hashes(LEGACY_HASHES)
+{
+  memset(_words, 0, sizeof(_words));
+}
+
+ReplicaFilter::ReplicaFilter(int bits, int num_hashes) :
+  _bits(bits),
+  _num_hashes(num_hashes)
+{
+  memset(_words, 0, sizeof(_words));
+}
+
+ReplicaFilter::ReplicaFilter(uint64_t legacy_filter) :
+  _bits(LEGACY_BITS),
+  _num_hashes(LEGACY_HASHES)
+{
+  memset(_words, 0, sizeof(_words));
+  _words[0] = legacy_filter;
+}
+
+// Generate the filter for a node.
+//
+// Create a 128-bit hash for every 2 hashes needed, modulo each half down to
+// the filter width and set those bits in the filter.  With the legacy
+// parameters this creates 3 hashes and in general sets ~6 bits.
+ReplicaFilter ReplicaFilter::for_node(const std::string& address,
+                                      int bits,
+                                      int num_hashes)
+{
+  ReplicaFilter filter(bits, num_hashes);
+  uint64_t hash[2];
+  for (int ii = 0; ii < num_hashes; ++ii)
+  {
+    if ((ii % 2) == 0)
+    {
+      MurmurHash3_x86_128(address.c_str(), address.length(), ii / 2, (void*)hash);
+    }
+
+    int bit = hash[ii % 2] % bits;
+    filter._words[bit / 64] |= ((uint64_t)1 << (bit % 64));
+  }
+
+  return filter;
+}
+
+bool ReplicaFilter::valid_format(int bits, int num_hashes)
+{
+  if (bits == LEGACY_BITS)
+  {
+    return (num_hashes == LEGACY_HASHES);
+  }
+
+  return (((bits == 128) || (bits == 256)) &&
+          (num_hashes >= 1) &&
+          (num_hashes <= 255));
+}
+
+bool ReplicaFilter::from_hex(const std::string& hex, ReplicaFilter& filter)
+{
+  int bits;
+  size_t offset = 0;
+  if (hex.length() == 16)
+  {
+    filter = ReplicaFilter();
+    bits = LEGACY_BITS;
+  }
+  else if ((hex.length() == 34) || (hex.length() == 66))
+  {
+    bits = (hex.length() - 2) * 4;
+    int num_hashes = std::stoi(hex.substr(0, 2), NULL, 16);
+    if (num_hashes == 0)
+    {
+      return false;
+    }
+    filter = ReplicaFilter(bits, num_hashes);
+    offset = 2;
+  }
+  else
+  {
+    return false;
+  }
+
+  for (int ii = (bits / 64) - 1; ii >= 0; --ii, offset += 16)
+  {
+    filter._words[ii] = std::stoull(hex.substr(offset, 16), NULL, 16);
+  }
+
+  return true;
+}
+
+std::string ReplicaFilter::to_hex() const
+{
+  // 2 digits for the number of hashes, then 16 digits per word.
+  char buf[2 + (16 * MAX_WORDS) + 1];
+  char* pos = buf;
+  if (!is_legacy())
+  {
+    pos += snprintf(pos, 3, "%02x", _num_hashes);
+  }
+
+  for (int ii = num_words() - 1; ii >= 0; --ii)
+  {
+    pos += snprintf(pos, 17, "%016lx", (unsigned long)_words[ii]);
+  }
+
+  return std::string(buf, pos - buf);
+}
+
+bool ReplicaFilter::is_legacy() const
+{
+  return ((_bits == LEGACY_BITS) && (_num_hashes == LEGACY_HASHES));
+}
+
+bool ReplicaFilter::empty() const
+{
+  for (int ii = 0; ii < num_words(); ++ii)
+  {
+    if (_words[ii] != 0)
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool ReplicaFilter::same_format(const ReplicaFilter& other) const
+{
+  return ((_bits == other._bits) && (_num_hashes == other._num_hashes));
+}
+
+void ReplicaFilter::add(const ReplicaFilter& other)
+{
+  for (int ii = 0; ii < num_words(); ++ii)
+  {
+    _words[ii] |= other._words[ii];
+  }
+}
+
+bool ReplicaFilter::contains(const ReplicaFilter& other) const
+{
+  for (int ii = 0; ii < num_words(); ++ii)
+  {
+    if ((_words[ii] & other._words[ii]) != other._words[ii])
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool ReplicaFilter::operator==(const ReplicaFilter& other) const
+{
+  return (same_format(other) &&
+          (memcmp(_words, other._words, num_words() * sizeof(uint64_t)) == 0));
+}
@@ -0,0 +1,160 @@
+#include "replica_set.h"
+#include "log.h"
+
+#include <algorithm>
+
+/*****************************************************************************/
+/* NodeTable                                                                 */
+/*****************************************************************************/
+
+pthread_mutex_t NodeTable::_lock = PTHREAD_MUTEX_INITIALIZER;
+std::map<std::string, NodeID> NodeTable::_ids;
+std::atomic<const std::string**> NodeTable::_chunks[NodeTable::MAX_CHUNKS];
+
+NodeID NodeTable::intern(const std::string& address)
+{
+  pthread_mutex_lock(&_lock);
+
+  NodeID id;
+  auto it = _ids.find(address);
+  if (it != _ids.end())
+  {
+    id = it->second;
+  }
+  else if (_ids.size() < (size_t)(CHUNK_SIZE * MAX_CHUNKS))
+  {
+    id = _ids.size();
+    const std::string** chunk = _chunks[id / CHUNK_SIZE].load();
+    if (chunk == NULL)
+    {
+      chunk = new const std::string*[CHUNK_SIZE];
+    }
+
+    // Fill in the address before publishing the chunk (or the ID), so readers
+    // never see a missing address.
+    chunk[id % CHUNK_SIZE] = new std::string(address);
+    _chunks[id / CHUNK_SIZE].store(chunk);
+    _ids[address] = id;
+  }
+  else
+  {
+    // LCOV_EXCL_START
+    LOG_ERROR("Too many node addresses, treating %s as %s",
+              address.c_str(), NodeTable::address(0).c_str());
+    id = 0;
+    // LCOV_EXCL_STOP
+  }
+
+  pthread_mutex_unlock(&_lock);
+  return id;
+}
+
+bool NodeTable::find(const std::string& address, NodeID& id)
+{
+  pthread_mutex_lock(&_lock);
+  auto it = _ids.find(address);
+  bool found = (it != _ids.end());
+  if (found)
+  {
+    id = it->second;
+  }
+  pthread_mutex_unlock(&_lock);
+
+  return found;
+}
+
+const std::string& NodeTable::address(NodeID id)
+{
+  return *(_chunks[id / CHUNK_SIZE].load()[id % CHUNK_SIZE]);
+}
+
+/*****************************************************************************/
+/* ReplicaSet                                                                */
+/*****************************************************************************/
+
+pthread_mutex_t ReplicaSet::_lock = PTHREAD_MUTEX_INITIALIZER;
+std::map<ReplicaSet::Key, std::weak_ptr<const ReplicaSet> > ReplicaSet::_sets;
+size_t ReplicaSet::_sweep_size = 64;
+
+ReplicaSet::ReplicaSet(const std::vector<NodeID>& replicas,
+                       const std::vector<NodeID>& extra_replicas) :
+  _replicas(replicas),
+  _extra_replicas(extra_replicas)
+{
+}
+
+ReplicaSetPtr ReplicaSet::get(const std::vector<NodeID>& replicas,
+                              const std::vector<NodeID>& extra_replicas)
+{
+  Key key(replicas, extra_replicas);
+  ReplicaSetPtr set;
+
+  pthread_mutex_lock(&_lock);
+
+  std::weak_ptr<const ReplicaSet>& entry = _sets[key];
+  set = entry.lock();
+  if (!set)
+  {
+    set = std::make_shared<const ReplicaSet>(replicas, extra_replicas);
+    entry = set;
+
+    // Forget the replica sets that are no longer used whenever the table has
+    // doubled in size.
+    if (_sets.size() >= _sweep_size)
+    {
+      for (auto it = _sets.begin(); it != _sets.end(); )
+      {
+        if (it->second.expired())
+        {
+          _sets.erase(it++);
+        }
+        else
+        {
+          ++it;
+        }
+      }
+      _sweep_size = std::max((size_t)64, _sets.size() * 2);
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+  return set;
+}
+
+bool ReplicaSet::find(const std::vector<std::string>& replicas,
+                      ReplicaSetPtr& set)
+{
+  std::vector<NodeID> ids(replicas.size());
+  for (size_t ii = 0; ii < replicas.size(); ++ii)
+  {
+    if (!NodeTable::find(replicas[ii], ids[ii]))
+    {
+      return false;
+    }
+  }
+  set = get(ids);
+  return true;
+}
+
+ReplicaSetPtr ReplicaSet::empty_set()
+{
+  static ReplicaSetPtr empty =
+    std::make_shared<const ReplicaSet>(std::vector<NodeID>(),
+                                       std::vector<NodeID>());
+  return empty;
+}
+
+size_t ReplicaSet::index(NodeID node) const
+{
+  return std::find(_replicas.begin(), _replicas.end(), node) - _replicas.begin();
+}
+
+std::vector<std::string> ReplicaSet::addresses() const
+{
+  std::vector<std::string> rc;
+  for (auto it = _replicas.begin(); it != _replicas.end(); ++it)
+  {
+    rc.push_back(NodeTable::address(*it));
+  }
+  return rc;
+}
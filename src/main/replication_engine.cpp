@@ -0,0 +1,292 @@
+#include "replication_engine.h"
+#include "log.h"
+
+#include <algorithm>
+#include <cstring>
+
+ReplicationEngine::ReplicationEngine(int thread_count,
+                                     int max_in_flight_per_peer,
+                                     DnsCache* dns_cache) :
+  _max_in_flight_per_peer(std::max(max_in_flight_per_peer, 1)),
+  _dns_cache(dns_cache),
+  _headers(NULL),
+  _breaker(REPLICATOR_BREAKER_FAILURES, REPLICATOR_BREAKER_PROBE_MS),
+  _peers(),
+  _last_peer(),
+  _terminated(false),
+  _worker_threads()
+{
+  pthread_mutex_init(&_mutex, NULL);
+  pthread_cond_init(&_cond, NULL);
+
+  // Set up a content type header descriptor to use for our requests.
+  _headers = curl_slist_append(_headers, "Content-Type: application/json");
+
+  // Create a pool of replicator threads
+  for (int ii = 0; ii < thread_count; ++ii)
+  {
+    pthread_t thread;
+    int thread_rc = pthread_create(&thread,
+                                   NULL,
+                                   ReplicationEngine::worker_thread_entry_point,
+                                   (void*)this);
+    if (thread_rc != 0)
+    {
+      LOG_ERROR("Failed to start replicator thread: %s", strerror(thread_rc));
+    }
+    else
+    {
+      _worker_threads.push_back(thread);
+    }
+  }
+}
+
+ReplicationEngine::~ReplicationEngine()
+{
+  terminate();
+  for (auto it = _worker_threads.begin(); it != _worker_threads.end(); ++it)
+  {
+    pthread_join(*it, NULL);
+  }
+
+  // Drop anything that wasn't sent.
+  for (auto it = _peers.begin(); it != _peers.end(); ++it)
+  {
+    Peer& peer = it->second;
+    for (auto req = peer.high_priority.begin(); req != peer.high_priority.end(); ++req)
+    {
+      delete *req;
+    }
+    for (auto req = peer.low_priority.begin(); req != peer.low_priority.end(); ++req)
+    {
+      delete *req;
+    }
+  }
+  _peers.clear();
+
+  curl_slist_free_all(_headers);
+  pthread_cond_destroy(&_cond);
+  pthread_mutex_destroy(&_mutex);
+}
+
+void ReplicationEngine::push(ReplicationRequest* request)
+{
+  pthread_mutex_lock(&_mutex);
+  Peer& peer = _peers[request->peer];
+
+  // If the node's queue is full, make room by dropping its oldest request
+  // following a pop.  If there are none, drop this request instead.
+  // Replication is best effort, so the timers are left for anti-entropy to
+  // fix up.
+  if (peer.high_priority.size() + peer.low_priority.size() >= REPLICATOR_MAX_QUEUED_PER_PEER)
+  {
+    ReplicationRequest* dropped = request;
+    if (!peer.low_priority.empty())
+    {
+      dropped = peer.low_priority.front();
+      peer.low_priority.pop_front();
+    }
+
+    LOG_WARNING("Replication queue for %s is full, dropping request to %s",
+                dropped->peer.c_str(),
+                dropped->url.c_str());
+    delete dropped;
+
+    if (dropped == request)
+    {
+      pthread_mutex_unlock(&_mutex);
+      return;
+    }
+  }
+
+  if (request->high_priority)
+  {
+    peer.high_priority.push_back(request);
+  }
+  else
+  {
+    peer.low_priority.push_back(request);
+  }
+  pthread_cond_signal(&_cond);
+  pthread_mutex_unlock(&_mutex);
+}
+
+bool ReplicationEngine::pop(ReplicationRequest*& request)
+{
+  pthread_mutex_lock(&_mutex);
+  while ((!take(request)) && (!_terminated))
+  {
+    pthread_cond_wait(&_cond, &_mutex);
+  }
+  bool rc = !_terminated;
+  pthread_mutex_unlock(&_mutex);
+
+  return rc;
+}
+
+bool ReplicationEngine::try_pop(ReplicationRequest*& request)
+{
+  pthread_mutex_lock(&_mutex);
+  bool rc = take(request);
+  pthread_mutex_unlock(&_mutex);
+
+  return rc;
+}
+
+void ReplicationEngine::complete(ReplicationRequest* request)
+{
+  pthread_mutex_lock(&_mutex);
+  auto it = _peers.find(request->peer);
+  if (it != _peers.end())
+  {
+    Peer& peer = it->second;
+    peer.in_flight--;
+
+    if ((peer.in_flight == 0) &&
+        (peer.high_priority.empty()) &&
+        (peer.low_priority.empty()))
+    {
+      _peers.erase(it);
+    }
+
+    // The node can take another request.
+    pthread_cond_signal(&_cond);
+  }
+  pthread_mutex_unlock(&_mutex);
+
+  delete request;
+}
+
+void ReplicationEngine::terminate()
+{
+  pthread_mutex_lock(&_mutex);
+  _terminated = true;
+  pthread_cond_broadcast(&_cond);
+  pthread_mutex_unlock(&_mutex);
+}
+
+/*****************************************************************************/
+/* Private functions.                                                        */
+/*****************************************************************************/
+
+void* ReplicationEngine::worker_thread_entry_point(void* arg)
+{
+  ReplicationEngine* engine = (ReplicationEngine*)arg;
+  engine->worker_thread_entry_point();
+  return NULL;
+}
+
+// The replication worker thread.  This loops, taking requests from the
+// queues and sending them synchronously.
+void ReplicationEngine::worker_thread_entry_point()
+{
+  CURL* curl = curl_easy_init();
+
+  // Tell cURL to perform a POST but to call it a PUT (or PATCH),
+  // this allows us to easily pass a JSON body as a string.
+  //
+  // http://curl.haxx.se/mail/lib-2009-11/0001.html
+  curl_easy_setopt(curl, CURLOPT_POST, 1);
+
+  // Set up the content type (as POSTFIELDS doesn't)
+  curl_easy_setopt(curl, CURLOPT_HTTPHEADER, _headers);
+
+  // Don't wait long for nodes that aren't responding.  cURL mustn't enforce
+  // the timeouts with signals as there are many worker threads.
+  curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+  curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, (long)REPLICATOR_CONNECT_TIMEOUT_MS);
+  curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, (long)REPLICATOR_TIMEOUT_MS);
+
+  ReplicationRequest* replication_request;
+  while (pop(replication_request))
+  {
+    // Fail straight away if the node isn't responding.  Replication is best
+    // effort (failed requests aren't retried) so this loses nothing that
+    // waiting for the request to fail wouldn't have.
+    if (!_breaker.allow(replication_request->peer))
+    {
+      LOG_DEBUG("Not replicating timer to %s as it isn't responding",
+                replication_request->url.c_str());
+      complete(replication_request);
+      continue;
+    }
+
+    // The customized bits of this request.
+    curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, replication_request->method);
+    curl_easy_setopt(curl, CURLOPT_URL, replication_request->url.c_str());
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, replication_request->body.data());
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, replication_request->body.length());
+
+    // Use the cached address for the node, if we have one.
+    struct curl_slist* resolve = NULL;
+    if (_dns_cache != NULL)
+    {
+      resolve = _dns_cache->resolve_list(replication_request->url);
+      curl_easy_setopt(curl, CURLOPT_RESOLVE, resolve);
+    }
+
+    // Send the request.
+    CURLcode rc = curl_easy_perform(curl);
+
+    // Any response means the node is up, even if it's an error.
+    _breaker.record(replication_request->peer,
+                    ((rc == CURLE_OK) || (rc == CURLE_HTTP_RETURNED_ERROR)));
+
+    if (rc == CURLE_HTTP_RETURNED_ERROR)
+    {
+      long http_rc;
+      curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_rc);
+      LOG_WARNING("Failed to replicate timer to %s, HTTP error was %d %s",
+                  replication_request->url.c_str(),
+                  http_rc,
+                  curl_easy_strerror(rc));
+    }
+
+    // Clean up
+    curl_easy_setopt(curl, CURLOPT_RESOLVE, NULL);
+    curl_slist_free_all(resolve);
+    complete(replication_request);
+  }
+
+  curl_easy_cleanup(curl);
+}
+
+// Take the next request from the next node (after the last one served) that
+// has requests waiting and is below its limit.  Must be called with the mutex
+// held.
+bool ReplicationEngine::take(ReplicationRequest*& request)
+{
+  if ((_terminated) || (_peers.empty()))
+  {
+    return false;
+  }
+
+  auto it = _peers.upper_bound(_last_peer);
+  for (size_t ii = 0; ii < _peers.size(); ++ii, ++it)
+  {
+    if (it == _peers.end())
+    {
+      it = _peers.begin();
+    }
+
+    Peer& peer = it->second;
+    if (peer.in_flight >= _max_in_flight_per_peer)
+    {
+      continue;
+    }
+
+    std::deque<ReplicationRequest*>& queue = (!peer.high_priority.empty()) ?
+                                             peer.high_priority :
+                                             peer.low_priority;
+    if (!queue.empty())
+    {
+      request = queue.front();
+      queue.pop_front();
+      peer.in_flight++;
+      _last_peer = it->first;
+      return true;
+    }
+  }
+
+  return false;
+}
@@ -1,134 +1,139 @@
 #include "replicator.h"
 #include "globals.h"
+#include "connection_pool.h"
 
-#include <cstring>
-#include <pthread.h>
+#include <map>
+#include <sstream>
 
-Replicator::Replicator() : _q(), _headers(NULL)
+Replicator::Replicator(ReplicationEngine* engine, bool high_priority) :
+  _engine(engine),
+  _high_priority(high_priority)
 {
-  // Create a pool of replicator threads
-  for (int ii = 0; ii < REPLICATOR_THREAD_COUNT; ++ii)
-  {
-    pthread_t thread;
-    int thread_rc = pthread_create(&thread,
-                                   NULL,
-                                   Replicator::worker_thread_entry_point,
-                                   (void*)this);
-    if (thread_rc != 0)
-    {
-      LOG_ERROR("Failed to start replicator thread: %s", strerror(thread_rc));
-    }
-
-    _worker_threads[ii] = thread;
-  }
-
-  // Set up a content type header descriptor to use for our requests.
-  _headers = curl_slist_append(_headers, "Content-Type: application/json");
 }
 
 Replicator::~Replicator()
 {
-  _q.terminate();
-  for (int ii = 0; ii < REPLICATOR_THREAD_COUNT; ++ii)
-  {
-    pthread_join(_worker_threads[ii], NULL);
-  }
-  curl_slist_free_all(_headers);
 }
 
 /*****************************************************************************/
-/* Static functions.                                                         */
+/* Public API functions.                                                     */
 /*****************************************************************************/
 
-void* Replicator::worker_thread_entry_point(void* arg)
+// Handle the replication of the given timer to its replicas.
+void Replicator::replicate(Timer* timer)
 {
-  Replicator* rep = (Replicator*)arg;
-  rep->worker_thread_entry_point();
-  return NULL;
+  // Only create the body once (as it's shared by the requests to each
+  // replica).
+  replicate_to_all(timer, "PUT", timer->to_json());
 }
 
-/*****************************************************************************/
-/* Public API functions.                                                     */
-/*****************************************************************************/
+// Replicate just the timing of the given timer to its replicas, for when only
+// the timing has changed since the timer was last replicated.
+void Replicator::replicate_timing(Timer* timer)
+{
+  replicate_to_all(timer, "PATCH", timer->timing_json());
+}
 
-// Handle the replication of the given timer to its replicas.
-void Replicator::replicate(Timer* timer)
+// Replicate the timer to one of its replicas, for when only that replica is
+// known to be out of date (see AntiEntropy).
+void Replicator::replicate_to(Timer* timer, NodeID node)
 {
-  std::string localhost;
-  __globals->get_cluster_local_ip(localhost);
+  replicate_int("PUT", timer->to_json(), timer->url(NodeTable::address(node)));
+}
 
-  // Only create the body once (as it's the same for each replica).
-  std::string body = timer->to_json();
+// Replicate many timers (for example, those created by a bulk request from a
+// client).  The timers are grouped by the nodes they are replicated to, and
+// each node is sent a single POST to its bulk API containing all of its
+// timers (each carrying its ID, so the node stores it as a replica).
+void Replicator::replicate_bulk(const std::vector<Timer*>& timers)
+{
+  ClusterViewPtr cluster = __globals->get_cluster_view();
+  NodeID localhost = cluster->local_id();
+  std::map<NodeID, std::string> bodies;
 
-  for (auto it = timer->replicas.begin(); it != timer->replicas.end(); ++it)
+  for (auto it = timers.begin(); it != timers.end(); ++it)
   {
-    if (*it != localhost)
+    Timer* timer = *it;
+    const ReplicaSet& replicas = *timer->replicas();
+    std::string json = timer->bulk_json();
+
+    std::vector<NodeID> nodes(replicas.replicas().begin(),
+                              replicas.replicas().end());
+    nodes.insert(nodes.end(),
+                 replicas.extra_replicas().begin(),
+                 replicas.extra_replicas().end());
+
+    for (auto node = nodes.begin(); node != nodes.end(); ++node)
     {
-      replicate_int(body, timer->url(*it));
+      if (*node != localhost)
+      {
+        std::string& body = bodies[*node];
+        body.append(body.empty() ? "[" : ",");
+        body.append(json);
+      }
     }
   }
 
-  for (auto it = timer->extra_replicas.begin(); it != timer->extra_replicas.end(); ++it)
+  int bind_port;
+  __globals->get_bind_port(bind_port);
+
+  for (auto it = bodies.begin(); it != bodies.end(); ++it)
   {
-    if (*it != localhost)
-    {
-      replicate_int(body, timer->url(*it));
-    }
+    std::stringstream url;
+    url << "http://" << NodeTable::address(it->first) << ":" << bind_port
+        << "/timers/_bulk";
+    it->second.append("]");
+    replicate_int("POST", SharedString(std::move(it->second)), url.str());
   }
 }
 
-// The replication worker thread.  This loops, receiving cURL handles off a queue
-// and handling them synchronously.  We run a pool of these threads to mitigate
-// starvation.
-void Replicator::worker_thread_entry_point()
-{
-  CURL* curl = curl_easy_init();
-
-  // Tell cURL to perform a POST but to call it a PUT, this allows
-  // us to easily pass a JSON body as a string.
-  //
-  // http://curl.haxx.se/mail/lib-2009-11/0001.html
-  curl_easy_setopt(curl, CURLOPT_POST, 1);
-  curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "PUT");
+/*****************************************************************************/
+/* Private functions.                                                        */
+/*****************************************************************************/
 
-  // Set up the content type (as POSTFIELDS doesn't)
-  curl_easy_setopt(curl, CURLOPT_HTTPHEADER, _headers);
+// Send the body to each of the timer's replicas (other than this node).
+void Replicator::replicate_to_all(Timer* timer,
+                                  const char* method,
+                                  const SharedString& body)
+{
+  ClusterViewPtr cluster = __globals->get_cluster_view();
+  NodeID localhost = cluster->local_id();
+  const ReplicaSet& replicas = *timer->replicas();
 
-  ReplicationRequest* replication_request;
-  while(_q.pop(replication_request))
+  for (auto it = replicas.replicas().begin(); it != replicas.replicas().end(); ++it)
   {
-    // The customized bits of this request.
-    curl_easy_setopt(curl, CURLOPT_URL, replication_request->url.c_str());
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, replication_request->body.data());
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, replication_request->body.length());
-
-    // Send the request.
-    CURLcode rc = curl_easy_perform(curl);
-    if (rc == CURLE_HTTP_RETURNED_ERROR)
+    if (*it != localhost)
     {
-      long http_rc;
-      curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_rc);
-      LOG_WARNING("Failed to replicate timer to %s, HTTP error was %d %s",
-                  replication_request->url.c_str(),
-                  http_rc,
-                  curl_easy_strerror(rc));
+      replicate_int(method, body, timer->url(NodeTable::address(*it)));
     }
-
-    // Clean up
-    delete replication_request;
   }
 
-  curl_easy_cleanup(curl);
+  for (auto it = replicas.extra_replicas().begin(); it != replicas.extra_replicas().end(); ++it)
+  {
+    if (*it != localhost)
+    {
+      replicate_int(method, body, timer->url(NodeTable::address(*it)));
+    }
+  }
 }
 
-/*****************************************************************************/
-/* Private functions.                                                        */
-/*****************************************************************************/
-
-void Replicator::replicate_int(const std::string& body, const std::string& url)
+void Replicator::replicate_int(const char* method,
+                               const SharedString& body,
+                               const std::string& url)
 {
   ReplicationRequest* replication_request = new ReplicationRequest();
+  replication_request->method = method;
   replication_request->url = url;
   replication_request->body = body;
-  _q.push(replication_request);
+  replication_request->peer = ConnectionPool::origin(url);
+  replication_request->high_priority = _high_priority;
+
+  if (_engine != NULL)
+  {
+    _engine->push(replication_request);
+  }
+  else
+  {
+    delete replication_request;
+  }
 }
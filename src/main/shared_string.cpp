@@ -0,0 +1,78 @@
+#include "shared_string.h"
+
+#include <algorithm>
+
+pthread_mutex_t SharedString::_lock = PTHREAD_MUTEX_INITIALIZER;
+std::map<std::string, std::weak_ptr<const std::string> > SharedString::_interned;
+size_t SharedString::_sweep_size = 64;
+
+// All empty strings share a single buffer.
+static const std::shared_ptr<const std::string>& empty_string()
+{
+  static std::shared_ptr<const std::string> empty =
+                                   std::make_shared<const std::string>();
+  return empty;
+}
+
+SharedString::SharedString() :
+  _str(empty_string())
+{
+}
+
+SharedString::SharedString(const char* str) :
+  _str((*str != '\0') ? std::make_shared<const std::string>(str) :
+                        empty_string())
+{
+}
+
+SharedString::SharedString(const std::string& str) :
+  _str(!str.empty() ? std::make_shared<const std::string>(str) :
+                      empty_string())
+{
+}
+
+SharedString::SharedString(std::string&& str) :
+  _str(!str.empty() ? std::make_shared<const std::string>(std::move(str)) :
+                      empty_string())
+{
+}
+
+SharedString SharedString::intern(const std::string& str)
+{
+  SharedString rc;
+  if (str.empty())
+  {
+    return rc;
+  }
+
+  pthread_mutex_lock(&_lock);
+
+  std::weak_ptr<const std::string>& entry = _interned[str];
+  rc._str = entry.lock();
+  if (!rc._str)
+  {
+    rc._str = std::make_shared<const std::string>(str);
+    entry = rc._str;
+
+    // Forget the strings that are no longer used whenever the table has
+    // doubled in size.
+    if (_interned.size() >= _sweep_size)
+    {
+      for (auto it = _interned.begin(); it != _interned.end(); )
+      {
+        if (it->second.expired())
+        {
+          _interned.erase(it++);
+        }
+        else
+        {
+          ++it;
+        }
+      }
+      _sweep_size = std::max((size_t)64, _interned.size() * 2);
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+  return rc;
+}
@@ -0,0 +1,610 @@
+#include "stream_callback.h"
+#include "log.h"
+
+#include "rapidjson/reader.h"
+#include "rapidjson/writer.h"
+#include "rapidjson/stringbuffer.h"
+
+#include <event2/buffer.h>
+#include <event2/keyvalq_struct.h>
+
+#include <cstring>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+StreamCallback::StreamCallback(Replicator* replicator,
+                               Alarm* timer_pop_alarm) :
+  _handler(NULL),
+  _replicator(replicator),
+  _timer_pop_alarm(timer_pop_alarm),
+  _consumers(),
+  _wake_event(NULL),
+  _tick_event(NULL)
+{
+  pthread_mutex_init(&_mutex, NULL);
+
+  if (pipe(_wake_pipe) != 0)
+  {
+    // LCOV_EXCL_START
+    LOG_ERROR("Failed to create stream callback wake pipe: %s", strerror(errno));
+    _wake_pipe[0] = -1;
+    _wake_pipe[1] = -1;
+    // LCOV_EXCL_STOP
+  }
+  else
+  {
+    fcntl(_wake_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(_wake_pipe[1], F_SETFL, O_NONBLOCK);
+  }
+}
+
+StreamCallback::~StreamCallback()
+{
+  stop();
+
+  // Any timers we're still holding can't be delivered now.
+  for (auto it = _consumers.begin(); it != _consumers.end(); ++it)
+  {
+    Consumer* consumer = it->second;
+    while (!consumer->pending.empty())
+    {
+      delete consumer->pending.pop();
+    }
+
+    for (auto unacked = consumer->unacked.begin();
+         unacked != consumer->unacked.end();
+         ++unacked)
+    {
+      delete unacked->second.timer;
+    }
+
+    delete consumer;
+  }
+  _consumers.clear();
+
+  close(_wake_pipe[0]);
+  close(_wake_pipe[1]);
+  pthread_mutex_destroy(&_mutex);
+}
+
+void StreamCallback::start(TimerHandler* handler, struct event_base* base)
+{
+  _handler = handler;
+
+  _wake_event = event_new(base,
+                          _wake_pipe[0],
+                          EV_READ | EV_PERSIST,
+                          StreamCallback::wake_cb,
+                          (void*)this);
+  event_add(_wake_event, NULL);
+
+  struct timeval tick;
+  tick.tv_sec = 0;
+  tick.tv_usec = STREAMCALLBACK_TICK_MS * 1000;
+  _tick_event = event_new(base,
+                          -1,
+                          EV_PERSIST,
+                          StreamCallback::tick_cb,
+                          (void*)this);
+  event_add(_tick_event, &tick);
+}
+
+void StreamCallback::stop()
+{
+  if (_wake_event != NULL)
+  {
+    event_free(_wake_event);
+    _wake_event = NULL;
+  }
+
+  if (_tick_event != NULL)
+  {
+    event_free(_tick_event);
+    _tick_event = NULL;
+  }
+}
+
+void StreamCallback::perform(Timer* timer)
+{
+  pthread_mutex_lock(&_mutex);
+  auto it = _consumers.find(timer->callback_url());
+  bool queued = ((it != _consumers.end()) &&
+                 (it->second->stream != NULL) &&
+                 (it->second->pending.push(timer)));
+  pthread_mutex_unlock(&_mutex);
+
+  if (!queued)
+  {
+    LOG_WARNING("Failed to process callback for %lu: consumer %s is not connected or is not keeping up",
+                timer->id,
+                timer->callback_url().c_str());
+    callback_failed(timer);
+  }
+}
+
+void StreamCallback::flush()
+{
+  // Wake the event loop to stream the timers passed to `perform()`.
+  char c = 0;
+  if (write(_wake_pipe[1], &c, 1) < 0)
+  {
+    // The pipe is full, so the event loop is going to wake up anyway.
+  }
+}
+
+void StreamCallback::pops_cb(struct evhttp_request* req, void* callback)
+{
+  ((StreamCallback*)callback)->handle_pops(req);
+}
+
+void StreamCallback::ack_cb(struct evhttp_request* req, void* callback)
+{
+  ((StreamCallback*)callback)->handle_ack(req);
+}
+
+// Build the record streamed to a consumer for a pop.  This takes the form:
+// {
+//     "id": Int,
+//     "sequence-number": Int,
+//     "opaque": "string"
+// }
+// on a single line, followed by a newline.
+std::string StreamCallback::record_json(uint64_t id, Timer* timer)
+{
+  rapidjson::StringBuffer sb;
+  rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+
+  writer.StartObject();
+  writer.Key("id");
+  writer.Uint64(id);
+  writer.Key("sequence-number");
+  writer.Int(timer->sequence_number);
+  writer.Key("opaque");
+  writer.String(timer->callback_body().data(), timer->callback_body().length());
+  writer.EndObject();
+
+  return std::string(sb.GetString(), sb.GetSize()) + "\n";
+}
+
+// SAX handler for an acknowledgement from a consumer, which acknowledges
+// every record up to and including the given ID, and may list the IDs of any
+// of those records that failed:
+// {
+//     "ack": Int,
+//     "failed": [Int, ...]
+// }
+class AckHandler :
+  public rapidjson::BaseReaderHandler<rapidjson::UTF8<>, AckHandler>
+{
+public:
+  AckHandler(uint64_t& ack, std::set<uint64_t>& failed) :
+    _ack(ack),
+    _failed(failed),
+    _depth(0),
+    _in_failed(false),
+    _has_ack(false),
+    _valid(true)
+  {}
+
+  bool valid() const { return _valid && _has_ack; }
+
+  bool Default() { return other(); }
+  bool Int(int i) { return (i >= 0) ? id(i) : other(); }
+  bool Uint(unsigned u) { return id(u); }
+  bool Int64(int64_t i) { return (i >= 0) ? id(i) : other(); }
+  bool Uint64(uint64_t u) { return id(u); }
+
+  bool Key(const char* str, rapidjson::SizeType length, bool)
+  {
+    _key.assign(str, length);
+    return true;
+  }
+
+  bool StartObject()
+  {
+    _valid = _valid && (_depth == 0);
+    _depth++;
+    return true;
+  }
+
+  bool StartArray()
+  {
+    _in_failed = ((_depth == 1) && (_key == "failed"));
+    _depth++;
+    return true;
+  }
+
+  bool EndObject(rapidjson::SizeType) { _depth--; return true; }
+  bool EndArray(rapidjson::SizeType) { _depth--; _in_failed = false; return true; }
+
+private:
+  bool id(uint64_t id)
+  {
+    if (_in_failed)
+    {
+      _failed.insert(id);
+    }
+    else if ((_depth == 1) && (_key == "ack"))
+    {
+      _ack = id;
+      _has_ack = true;
+    }
+    return true;
+  }
+
+  bool other()
+  {
+    if ((_in_failed) || ((_depth == 1) && (_key == "ack")))
+    {
+      _valid = false;
+    }
+    return true;
+  }
+
+  uint64_t& _ack;
+  std::set<uint64_t>& _failed;
+  int _depth;
+  bool _in_failed;
+  bool _has_ack;
+  bool _valid;
+  std::string _key;
+};
+
+// Parse an acknowledgement from a consumer.  Returns false if it can't be
+// parsed.
+bool StreamCallback::parse_ack(const std::string& body,
+                               uint64_t& ack,
+                               std::set<uint64_t>& failed)
+{
+  failed.clear();
+
+  AckHandler handler(ack, failed);
+  rapidjson::Reader reader;
+  rapidjson::StringStream stream(body.c_str());
+  reader.Parse<0>(stream, handler);
+  return ((!reader.HasParseError()) && (handler.valid()));
+}
+
+bool StreamCallback::TimerRing::push(Timer* timer)
+{
+  if (_count == _timers.size())
+  {
+    return false;
+  }
+
+  _timers[(_head + _count) % _timers.size()] = timer;
+  _count++;
+  return true;
+}
+
+Timer* StreamCallback::TimerRing::pop()
+{
+  if (_count == 0)
+  {
+    return NULL;
+  }
+
+  Timer* timer = _timers[_head];
+  _head = (_head + 1) % _timers.size();
+  _count--;
+  return timer;
+}
+
+/*****************************************************************************/
+/* Private functions.                                                        */
+/*****************************************************************************/
+
+// Handle a request to open a stream.
+void StreamCallback::handle_pops(struct evhttp_request* req)
+{
+  if (evhttp_request_get_command(req) != EVHTTP_REQ_GET)
+  {
+    evhttp_send_error(req, HTTP_BADMETHOD, NULL);
+    return;
+  }
+
+  std::string name;
+  if (!get_consumer(req, name))
+  {
+    evhttp_send_error(req, HTTP_BADREQUEST, "Missing consumer");
+    return;
+  }
+
+  pthread_mutex_lock(&_mutex);
+  auto it = _consumers.find(name);
+  bool in_use = (it != _consumers.end());
+  if (!in_use)
+  {
+    Consumer* consumer = new Consumer();
+    consumer->stream = req;
+    _consumers[name] = consumer;
+  }
+  pthread_mutex_unlock(&_mutex);
+
+  if (in_use)
+  {
+    // Each consumer can only have one stream open at a time.
+    evhttp_send_error(req, 409, "Consumer already has an open stream");
+    return;
+  }
+
+  LOG_STATUS("Opened stream for consumer %s", name.c_str());
+  evhttp_connection_set_closecb(evhttp_request_get_connection(req),
+                                StreamCallback::stream_closed_cb,
+                                (void*)this);
+  evhttp_add_header(evhttp_request_get_output_headers(req),
+                    "Content-Type", "application/x-ndjson");
+  evhttp_send_reply_start(req, 200, "OK");
+}
+
+// Handle an acknowledgement from a consumer.
+void StreamCallback::handle_ack(struct evhttp_request* req)
+{
+  if (evhttp_request_get_command(req) != EVHTTP_REQ_POST)
+  {
+    evhttp_send_error(req, HTTP_BADMETHOD, NULL);
+    return;
+  }
+
+  std::string name;
+  if (!get_consumer(req, name))
+  {
+    evhttp_send_error(req, HTTP_BADREQUEST, "Missing consumer");
+    return;
+  }
+
+  uint64_t ack;
+  std::set<uint64_t> failed;
+  if (!parse_ack(get_req_body(req), ack, failed))
+  {
+    evhttp_send_error(req, HTTP_BADREQUEST, "Invalid acknowledgement");
+    return;
+  }
+
+  std::unordered_set<Timer*> rearm_batch;
+  std::vector<Timer*> failed_timers;
+
+  pthread_mutex_lock(&_mutex);
+  auto it = _consumers.find(name);
+  bool found = (it != _consumers.end());
+  if (found)
+  {
+    std::map<uint64_t, Unacked>& unacked = it->second->unacked;
+    auto end = unacked.upper_bound(ack);
+    for (auto record = unacked.begin(); record != end; ++record)
+    {
+      if (failed.find(record->first) == failed.end())
+      {
+        rearm_batch.insert(record->second.timer);
+      }
+      else
+      {
+        failed_timers.push_back(record->second.timer);
+      }
+    }
+    unacked.erase(unacked.begin(), end);
+  }
+  pthread_mutex_unlock(&_mutex);
+
+  if (!found)
+  {
+    evhttp_send_error(req, HTTP_NOTFOUND, NULL);
+    return;
+  }
+
+  evhttp_send_reply(req, 200, "OK", NULL);
+
+  for (auto timer = rearm_batch.begin(); timer != rearm_batch.end(); ++timer)
+  {
+    callback_succeeded(*timer);
+  }
+
+  if (!rearm_batch.empty())
+  {
+    _handler->rearm_timers(rearm_batch);
+  }
+
+  for (auto timer = failed_timers.begin(); timer != failed_timers.end(); ++timer)
+  {
+    LOG_WARNING("Failed to process callback for %lu: consumer %s failed it",
+                (*timer)->id,
+                name.c_str());
+    callback_failed(*timer);
+  }
+}
+
+// Handle a consumer's stream closing.  Any timers waiting to be streamed or
+// acknowledged fail.
+void StreamCallback::stream_closed(struct evhttp_connection* conn)
+{
+  std::vector<Timer*> failed_timers;
+
+  pthread_mutex_lock(&_mutex);
+  for (auto it = _consumers.begin(); it != _consumers.end(); ++it)
+  {
+    Consumer* consumer = it->second;
+    if ((consumer->stream == NULL) ||
+        (evhttp_request_get_connection(consumer->stream) != conn))
+    {
+      continue;
+    }
+
+    LOG_STATUS("Closed stream for consumer %s", it->first.c_str());
+
+    while (!consumer->pending.empty())
+    {
+      failed_timers.push_back(consumer->pending.pop());
+    }
+
+    for (auto unacked = consumer->unacked.begin();
+         unacked != consumer->unacked.end();
+         ++unacked)
+    {
+      failed_timers.push_back(unacked->second.timer);
+    }
+
+    delete consumer;
+    _consumers.erase(it);
+    break;
+  }
+  pthread_mutex_unlock(&_mutex);
+
+  for (auto timer = failed_timers.begin(); timer != failed_timers.end(); ++timer)
+  {
+    callback_failed(*timer);
+  }
+}
+
+// Stream the timers waiting for each consumer.
+void StreamCallback::deliver()
+{
+  uint64_t deadline_ms = monotonic_time_ms() + STREAMCALLBACK_ACK_TIMEOUT_MS;
+
+  pthread_mutex_lock(&_mutex);
+  for (auto it = _consumers.begin(); it != _consumers.end(); ++it)
+  {
+    Consumer* consumer = it->second;
+    if ((consumer->stream == NULL) || (consumer->pending.empty()))
+    {
+      continue;
+    }
+
+    struct evbuffer* evbuf = evbuffer_new();
+    while (!consumer->pending.empty())
+    {
+      Unacked record;
+      record.timer = consumer->pending.pop();
+      record.deadline_ms = deadline_ms;
+
+      uint64_t id = consumer->next_id++;
+      std::string json = record_json(id, record.timer);
+      evbuffer_add(evbuf, json.data(), json.length());
+      consumer->unacked[id] = record;
+    }
+
+    evhttp_send_reply_chunk(consumer->stream, evbuf);
+    evbuffer_free(evbuf);
+  }
+  pthread_mutex_unlock(&_mutex);
+}
+
+// Fail any timers that haven't been acknowledged in time.
+void StreamCallback::expire()
+{
+  uint64_t now_ms = monotonic_time_ms();
+  std::vector<Timer*> failed_timers;
+
+  pthread_mutex_lock(&_mutex);
+  for (auto it = _consumers.begin(); it != _consumers.end(); ++it)
+  {
+    // Records are streamed in order, so the oldest are first.
+    std::map<uint64_t, Unacked>& unacked = it->second->unacked;
+    while ((!unacked.empty()) &&
+           (unacked.begin()->second.deadline_ms <= now_ms))
+    {
+      LOG_WARNING("Failed to process callback for %lu: consumer %s didn't acknowledge it",
+                  unacked.begin()->second.timer->id,
+                  it->first.c_str());
+      failed_timers.push_back(unacked.begin()->second.timer);
+      unacked.erase(unacked.begin());
+    }
+  }
+  pthread_mutex_unlock(&_mutex);
+
+  for (auto timer = failed_timers.begin(); timer != failed_timers.end(); ++timer)
+  {
+    callback_failed(*timer);
+  }
+}
+
+void StreamCallback::stream_closed_cb(struct evhttp_connection* conn,
+                                      void* callback)
+{
+  ((StreamCallback*)callback)->stream_closed(conn);
+}
+
+void StreamCallback::wake_cb(evutil_socket_t fd, short events, void* callback)
+{
+  char buf[64];
+  while (read(fd, buf, sizeof(buf)) > 0)
+  {
+  }
+
+  ((StreamCallback*)callback)->deliver();
+}
+
+void StreamCallback::tick_cb(evutil_socket_t fd, short events, void* callback)
+{
+  ((StreamCallback*)callback)->deliver();
+  ((StreamCallback*)callback)->expire();
+}
+
+// Get the name of the consumer from the request's query string.
+bool StreamCallback::get_consumer(struct evhttp_request* req, std::string& name)
+{
+  const char* query = evhttp_uri_get_query(evhttp_request_get_evhttp_uri(req));
+  if (query == NULL)
+  {
+    return false;
+  }
+
+  struct evkeyvalq params;
+  if (evhttp_parse_query_str(query, &params) != 0)
+  {
+    return false;
+  }
+
+  const char* consumer = evhttp_find_header(&params, "consumer");
+  if (consumer != NULL)
+  {
+    name = consumer;
+  }
+  evhttp_clear_headers(&params);
+
+  return ((consumer != NULL) && (!name.empty()));
+}
+
+std::string StreamCallback::get_req_body(struct evhttp_request* req)
+{
+  struct evbuffer* evbuf = evhttp_request_get_input_buffer(req);
+  std::string body(evbuffer_get_length(evbuf), '\0');
+  evbuffer_copyout(evbuf, &body[0], body.length());
+  return body;
+}
+
+// Handle a successful callback, before the timer is re-armed.
+void StreamCallback::callback_succeeded(Timer* timer)
+{
+  // Check if the next pop occurs before the repeat-for interval and,
+  // if not, convert to a tombstone to indicate the timer is dead.
+  if ((timer->sequence_number + 1) * timer->interval > timer->repeat_for)
+  {
+    timer->become_tombstone();
+  }
+  _replicator->replicate(timer);
+
+  if (_timer_pop_alarm)
+  {
+    _timer_pop_alarm->clear();
+  }
+}
+
+// Handle a failed callback.  This deletes the timer.
+void StreamCallback::callback_failed(Timer* timer)
+{
+  if (_timer_pop_alarm && timer->is_last_replica())
+  {
+    _timer_pop_alarm->set();
+  }
+
+  _handler->release_timer(timer->id);
+  delete timer;
+}
+
+uint64_t StreamCallback::monotonic_time_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
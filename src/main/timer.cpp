@@ -1,8 +1,9 @@
 #include "timer.h"
 #include "globals.h"
 #include "murmur/MurmurHash3.h"
-#include "rapidjson/document.h"
+#include "rapidjson/reader.h"
 #include "rapidjson/writer.h"
+#include "rapidjson/stringbuffer.h"
 #include "utils.h"
 #include "log.h"
 
@@ -12,16 +13,26 @@
 #include <boost/format.hpp>
 #include <map>
 #include <atomic>
+#include <climits>
+
+// The default callback protocol, shared by every timer that uses it.
+static const SharedString& http_protocol()
+{
+  static const SharedString protocol = SharedString::intern("http");
+  return protocol;
+}
 
 Timer::Timer(TimerID id, uint32_t interval, uint32_t repeat_for) :
   id(id),
   interval(interval),
   repeat_for(repeat_for),
   sequence_number(0),
-  replicas(std::vector<std::string>()),
-  callback_url(""),
-  callback_body(""),
-  _replication_factor(0)
+  _replication_factor(0),
+  _replicas(ReplicaSet::empty_set()),
+  _callback_protocol(http_protocol()),
+  _callback_url(),
+  _callback_body(),
+  _callback_batch(false)
 {
   struct timespec ts;
   clock_gettime(CLOCK_REALTIME, &ts);
@@ -35,17 +46,8 @@ Timer::~Timer()
 // Returns the next pop time in ms.
 uint64_t Timer::next_pop_time()
 {
-  std::string localhost;
-  int replica_index = 0;
-  __globals->get_cluster_local_ip(localhost);
-
-  for (auto it = replicas.begin(); it != replicas.end(); ++it, ++replica_index)
-  {
-    if (*it == localhost)
-    {
-      break;
-    }
-  }
+  ClusterViewPtr cluster = __globals->get_cluster_view();
+  int replica_index = _replicas->index(cluster->local_id());
 
   return start_time + ((sequence_number + 1) * interval) + (replica_index * 2 * 1000);
 }
@@ -67,18 +69,53 @@ std::string Timer::url(std::string host)
 
   ss << "/timers/";
   ss << std::setfill('0') << std::setw(16) << std::hex << id;
-  uint64_t hash = 0;
-  std::map<std::string, uint64_t> cluster_hashes;
-  __globals->get_cluster_hashes(cluster_hashes);
-  for (auto it = replicas.begin(); it != replicas.end(); ++it)
+  ClusterViewPtr cluster = __globals->get_cluster_view();
+  ReplicaFilter filter = cluster->empty_filter();
+  for (auto it = _replicas->replicas().begin(); it != _replicas->replicas().end(); ++it)
   {
-    hash |= cluster_hashes[*it];
+    filter.add(cluster->filter(*it));
   }
-  ss << std::setfill('0') << std::setw(16) << std::hex << hash;
+  ss << filter.to_hex();
 
   return ss.str();
 }
 
+// Write the reliability block of the timer's JSON representation (see
+// `to_json()`), which lists the timer's replicas.
+static void write_reliability(rapidjson::Writer<rapidjson::StringBuffer>& writer,
+                              const ReplicaSet& replicas)
+{
+  writer.Key("reliability");
+  writer.StartObject();
+  writer.Key("replicas");
+  writer.StartArray();
+  for (auto it = replicas.replicas().begin(); it != replicas.replicas().end(); ++it)
+  {
+    const std::string& address = NodeTable::address(*it);
+    writer.String(address.data(), address.length());
+  }
+  writer.EndArray();
+  writer.EndObject();
+}
+
+// Write the timing block of the timer's JSON representation (see
+// `to_json()`).
+static void write_timing(rapidjson::Writer<rapidjson::StringBuffer>& writer,
+                         const Timer& timer)
+{
+  writer.Key("timing");
+  writer.StartObject();
+  writer.Key("start-time");
+  writer.Uint64(timer.start_time);
+  writer.Key("sequence-number");
+  writer.Uint(timer.sequence_number);
+  writer.Key("interval");
+  writer.Uint(timer.interval / 1000);
+  writer.Key("repeat-for");
+  writer.Uint(timer.repeat_for / 1000);
+  writer.EndObject();
+}
+
 // Render the timer as JSON to be used in an HTTP request body.
 // The JSON should take the form:
 // {
@@ -89,9 +126,10 @@ std::string Timer::url(std::string host)
 //         "repeat-for": Int
 //     },
 //     "callback": {
-//         "http": {
+//         "http" (or "zmq" or "stream"): {
 //             "uri": "string",
-//             "opaque": "string"
+//             "opaque": "string",
+//             "batch": Bool (http only, and only if true)
 //         }
 //     },
 //     "reliability": {
@@ -102,153 +140,228 @@ std::string Timer::url(std::string host)
 // }
 std::string Timer::to_json()
 {
-  rapidjson::Document doc;
-  doc.SetObject();
-
-  rapidjson::Value timing(rapidjson::kObjectType);
-  timing.AddMember("start-time", start_time, doc.GetAllocator());
-  timing.AddMember("sequence-number", sequence_number, doc.GetAllocator());
-  timing.AddMember("interval", interval/1000, doc.GetAllocator());
-  timing.AddMember("repeat-for", repeat_for/1000, doc.GetAllocator());
-
-  rapidjson::Value http(rapidjson::kObjectType);
-  rapidjson::Value val;
-  val.SetString(callback_url.c_str(), doc.GetAllocator());
-  http.AddMember("uri", val, doc.GetAllocator());
-  val.SetString(callback_body.c_str(), doc.GetAllocator());
-  http.AddMember("opaque", val, doc.GetAllocator());
+  return render_json(false);
+}
 
-  rapidjson::Value callback(rapidjson::kObjectType);
-  callback.AddMember("http", http, doc.GetAllocator());
+std::string Timer::bulk_json()
+{
+  return render_json(true);
+}
 
-  rapidjson::Value replicas_array(rapidjson::kArrayType);
-  for (auto it = replicas.begin(); it != replicas.end(); ++it)
+std::string Timer::render_json(bool include_id)
+{
+  // The callback and reliability blocks don't change as the timer pops, so
+  // render them once and reuse them.
+  if (_static_json.empty())
   {
-    val.SetString((*it).c_str(), doc.GetAllocator());
-    replicas_array.PushBack(val, doc.GetAllocator());
+    _static_json = static_json();
   }
 
-  rapidjson::Value reliability(rapidjson::kObjectType);
-  reliability.AddMember("replicas", replicas_array, doc.GetAllocator());
+  rapidjson::StringBuffer sb;
+  rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
 
-  // Create the document.
-  doc.AddMember("timing", timing, doc.GetAllocator());
-  doc.AddMember("callback", callback, doc.GetAllocator());
-  doc.AddMember("reliability", reliability, doc.GetAllocator());
+  // Open the document and write the timing block, the document is closed by
+  // the cached blocks.
+  writer.StartObject();
+  if (include_id)
+  {
+    std::stringstream ss;
+    ss << std::setfill('0') << std::setw(16) << std::hex << id;
+    writer.Key("id");
+    writer.String(ss.str().c_str());
+  }
+  write_timing(writer, *this);
 
-  rapidjson::StringBuffer s;
-  rapidjson::Writer<rapidjson::StringBuffer> w(s);
-  doc.Accept(w);
-  std::string body = s.GetString();
+  std::string body;
+  body.reserve(sb.GetSize() + _static_json.size());
+  body.append(sb.GetString(), sb.GetSize());
+  body.append(_static_json);
 
   LOG_DEBUG("Built replication body: %s", body.c_str());
 
   return body;
 }
 
-bool Timer::is_local(std::string host)
+// Render just the timing of the timer as JSON, to be used in the body of a
+// timing update (PATCH) to the replicas.  This takes the form:
+// {
+//     "timing": {
+//         "start-time": Int64,
+//         "sequence-number": Int,
+//         "interval": Int,
+//         "repeat-for": Int
+//     }
+// }
+std::string Timer::timing_json()
 {
-  return (std::find(replicas.begin(), replicas.end(), host) != replicas.end());
+  rapidjson::StringBuffer sb;
+  rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+
+  // The replicas mark the update as replicated (as for the full timer).
+  writer.StartObject();
+  write_timing(writer, *this);
+  write_reliability(writer, *_replicas);
+  writer.EndObject();
+
+  return std::string(sb.GetString(), sb.GetSize());
+}
+
+void Timer::set_timing(const TimerTiming& timing)
+{
+  start_time = timing.start_time;
+  sequence_number = timing.sequence_number;
+  interval = timing.interval;
+  repeat_for = timing.repeat_for;
+}
+
+// Render the parts of the JSON representation of the timer that don't change
+// when the timer pops.  The returned string carries on from the timing block
+// and closes the document:
+//
+//     ,"callback":{...},"reliability":{...}}
+std::string Timer::static_json()
+{
+  rapidjson::StringBuffer sb;
+  rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+
+  writer.StartObject();
+  writer.Key("callback");
+  writer.StartObject();
+  writer.Key(_callback_protocol.data(), _callback_protocol.length());
+  writer.StartObject();
+  writer.Key("uri");
+  writer.String(_callback_url.data(), _callback_url.length());
+  writer.Key("opaque");
+  writer.String(_callback_body.data(), _callback_body.length());
+  if (_callback_batch)
+  {
+    writer.Key("batch");
+    writer.Bool(true);
+  }
+  writer.EndObject();
+  writer.EndObject();
+
+  write_reliability(writer, *_replicas);
+  writer.EndObject();
+
+  // Swap the opening brace of this object for the separator from the timing
+  // block.
+  std::string rc(sb.GetString(), sb.GetSize());
+  rc[0] = ',';
+  return rc;
+}
+
+bool Timer::is_local(NodeID node)
+{
+  return _replicas->contains(node);
 }
 
 bool Timer::is_last_replica()
 {
-  std::string localhost;
-  __globals->get_cluster_local_ip(localhost);
-  return ((!replicas.empty()) ? replicas.back() == localhost : true);
+  ClusterViewPtr cluster = __globals->get_cluster_view();
+  return ((!_replicas->empty()) ?
+          _replicas->replicas().back() == cluster->local_id() : true);
 }
 
 bool Timer::is_tombstone()
 {
-  return ((callback_url == "") && (callback_body == ""));
+  return ((_callback_url.empty()) && (_callback_body.empty()));
 }
 
 void Timer::become_tombstone()
 {
-  callback_url = "";
-  callback_body = "";
+  _callback_url = SharedString();
+  _callback_body = SharedString();
+  _callback_batch = false;
+  _static_json.clear();
 
   // Since we're not bringing the start-time forward we have to extend the
   // repeat-for to ensure the tombstone gets added to the replica's store.
   repeat_for = interval * (sequence_number + 1);
 }
 
-void Timer::calculate_replicas(uint64_t replica_hash)
+void Timer::calculate_replicas(const ReplicaFilter& replica_hash)
 {
-  std::vector<std::string> hash_replicas;
-  if (replica_hash)
+  // Use a single view of the cluster throughout, in case the config changes.
+  // Nodes are handled by their index in the view until the replica set is
+  // looked up at the end.
+  ClusterViewPtr view = __globals->get_cluster_view();
+
+  std::vector<ClusterView::NodeIndex> hash_nodes;
+  if (!replica_hash.empty())
   {
     // Compare the hash to all the known replicas looking for matches.
-    std::map<std::string, uint64_t> cluster_hashes;
-    __globals->get_cluster_hashes(cluster_hashes);
-
-    for (auto it = cluster_hashes.begin();
-         it != cluster_hashes.end();
-         ++it)
-    {
-      // Quickly check if this replica might be one of the replicas for the
-      // given timer (i.e. if the replica's individual hash collides with the
-      // bloom filter we calculated when we created the hash (see `url()`).
-      if ((replica_hash & it->second) == it->second)
-      {
-        // This is probably a replica.
-        hash_replicas.push_back(it->first);
-      }
-    }
+    view->match_hash(replica_hash, hash_nodes);
 
     // Recreate the vector of replicas. Use the replication factor if it's set,
-    // otherwise use the size of the existing replicas.
+    // otherwise use the number of replicas that matched.
     _replication_factor = _replication_factor > 0 ?
-                          _replication_factor : hash_replicas.size();
-    uint32_t hash;
-    MurmurHash3_x86_32(&id, sizeof(TimerID), 0x0, &hash);
-    std::vector<std::string> cluster;
-    __globals->get_cluster_addresses(cluster);
-    unsigned int first_replica = hash % cluster.size();
-
-    for (unsigned int ii = 0;
-         ii < _replication_factor && ii < cluster.size();
-         ++ii)
-    {
-      replicas.push_back(cluster[(first_replica + ii) % cluster.size()]);
-    }
+                          _replication_factor : hash_nodes.size();
+  }
 
-    // Finally, add any replicas that were in hash_replicas but aren't in
-    // replicas to the extra_replicas vector.
-    for (unsigned int ii = 0;
-         ii < hash_replicas.size();
-         ++ii)
-    {
-      if (std::find(replicas.begin(), replicas.end(), hash_replicas[ii]) == replicas.end())
-      {
-        extra_replicas.push_back(hash_replicas[ii]);
-      }
-    }
+  // Pick replication-factor replicas from the cluster, using a hash of the ID
+  // to balance the choices.
+  uint32_t hash;
+  MurmurHash3_x86_32(&id, sizeof(TimerID), 0x0, &hash);
+  std::vector<ClusterView::NodeIndex> nodes;
+  view->place(hash, _replication_factor, nodes);
+
+  std::vector<NodeID> replica_ids;
+  for (auto it = nodes.begin(); it != nodes.end(); ++it)
+  {
+    replica_ids.push_back(view->node_id(*it));
   }
-  else
+
+  // Finally, add any nodes that matched the replica hash but aren't replicas
+  // to the extra replicas.
+  std::vector<NodeID> extra_replica_ids;
+  for (auto it = hash_nodes.begin(); it != hash_nodes.end(); ++it)
   {
-    // Pick replication-factor replicas from the cluster, using a hash of the ID
-    // to balance the choices.
-    uint32_t hash;
-    MurmurHash3_x86_32(&id, sizeof(TimerID), 0x0, &hash);
-    std::vector<std::string> cluster;
-    __globals->get_cluster_addresses(cluster);
-    unsigned int first_replica = hash % cluster.size();
-    for (unsigned int ii = 0;
-         ii < _replication_factor && ii < cluster.size();
-         ++ii)
+    if (std::find(nodes.begin(), nodes.end(), *it) == nodes.end())
     {
-      replicas.push_back(cluster[(first_replica + ii) % cluster.size()]);
+      extra_replica_ids.push_back(view->node_id(*it));
     }
   }
 
+  set_replicas(ReplicaSet::get(replica_ids, extra_replica_ids));
+
   LOG_DEBUG("Replicas calculated:");
-  for (auto it = replicas.begin(); it != replicas.end(); ++it)
+  for (auto it = replica_ids.begin(); it != replica_ids.end(); ++it)
   {
-    LOG_DEBUG(" - %s", it->c_str());
+    LOG_DEBUG(" - %s", NodeTable::address(*it).c_str());
   }
 }
 
+void Timer::set_replicas(const ReplicaSetPtr& replicas)
+{
+  _replicas = replicas;
+  _static_json.clear();
+}
+
+void Timer::set_callback_protocol(const SharedString& protocol)
+{
+  _callback_protocol = protocol;
+  _static_json.clear();
+}
+
+void Timer::set_callback_url(const SharedString& url)
+{
+  _callback_url = url;
+  _static_json.clear();
+}
+
+void Timer::set_callback_body(const SharedString& body)
+{
+  _callback_body = body;
+  _static_json.clear();
+}
+
+void Timer::set_callback_batch(bool batch)
+{
+  _callback_batch = batch;
+  _static_json.clear();
+}
+
 uint32_t Timer::deployment_id = 0;
 uint32_t Timer::instance_id = 0;
 
@@ -268,7 +381,7 @@ TimerID Timer::generate_timer_id()
 // default expires of 10 seconds, if they're found to be
 // deleting an existing tombstone, they'll use that timer's
 // interval as an expiry.
-Timer* Timer::create_tombstone(TimerID id, uint64_t replica_hash)
+Timer* Timer::create_tombstone(TimerID id, const ReplicaFilter& replica_hash)
 {
   // Create a tombstone record that will last for 10 seconds.
   Timer* tombstone = new Timer(id, 10000, 10000);
@@ -276,176 +389,751 @@ Timer* Timer::create_tombstone(TimerID id, uint64_t replica_hash)
   return tombstone;
 }
 
+// A single JSON value captured while parsing a timer definition.  Only the
+// information needed to validate the value and populate the Timer is kept.
+struct TimerJSONValue
+{
+  enum Type { OBJECT, ARRAY, STRING, INT, INT64, BOOL, OTHER };
+
+  TimerJSONValue() : present(false), type(OTHER), int_value(0) {}
+
+  bool is_object() const { return (type == OBJECT); }
+  bool is_array() const { return (type == ARRAY); }
+  bool is_string() const { return (type == STRING); }
+  bool is_int() const { return (type == INT); }
+  bool is_int64() const { return ((type == INT) || (type == INT64)); }
+  bool is_bool() const { return (type == BOOL); }
+
+  bool present;
+  Type type;
+  int64_t int_value;
+  std::string string_value;
+};
+
+// The nodes of a timer definition that we care about, as captured by the
+// TimerJSONHandler.
+struct TimerJSON
+{
+  TimerJSON() : replica_count(0), replicas_all_strings(true) {}
+
+  TimerJSONValue id;
+  TimerJSONValue timing;
+  TimerJSONValue interval;
+  TimerJSONValue repeat_for;
+  TimerJSONValue start_time;
+  TimerJSONValue sequence_number;
+  TimerJSONValue callback;
+  TimerJSONValue transport;
+  TimerJSONValue uri;
+  TimerJSONValue opaque;
+  TimerJSONValue batch;
+  TimerJSONValue reliability;
+  TimerJSONValue cancel;
+  TimerJSONValue replicas;
+  TimerJSONValue replication_factor;
+
+  // The callback protocol, named by the key of the transport node.
+  std::string protocol;
+
+  unsigned int replica_count;
+  bool replicas_all_strings;
+  std::vector<std::string> replica_addresses;
+};
+
+// SAX handler that fills in a TimerJSON in a single pass over the body,
+// without building a DOM.  No validation is done here (beyond recording the
+// type of each node) so that `from_json` can check the nodes in the same order
+// it always has and report the same errors.  If a member appears more than
+// once, the first occurrence wins (as it would for a DOM lookup).
+//
+// In bulk mode the body is an array of timer definitions, and a TimerJSON is
+// captured for each element.
+class TimerJSONHandler :
+  public rapidjson::BaseReaderHandler<rapidjson::UTF8<>, TimerJSONHandler>
+{
+public:
+  TimerJSONHandler(std::vector<TimerJSON>& timers, bool bulk) :
+    _timers(timers),
+    _bulk(bulk),
+    _valid_root(false),
+    _json(NULL)
+  {}
+
+  // Whether the body was of the expected type (an object, or an array in bulk
+  // mode).
+  bool valid_root() const { return _valid_root; }
+
+  // Values of any other type (null and doubles) are recorded as OTHER.
+  bool Default() { return scalar(TimerJSONValue::OTHER); }
+  bool Bool(bool b) { return scalar(TimerJSONValue::BOOL, b); }
+  bool Int(int i) { return scalar(TimerJSONValue::INT, i); }
+  bool Int64(int64_t i) { return scalar(TimerJSONValue::INT64, i); }
+
+  bool Uint(unsigned u)
+  {
+    return scalar((u <= INT_MAX) ? TimerJSONValue::INT : TimerJSONValue::INT64, u);
+  }
+
+  bool Uint64(uint64_t u)
+  {
+    return (u <= INT64_MAX) ? scalar(TimerJSONValue::INT64, u) :
+                              scalar(TimerJSONValue::OTHER);
+  }
+
+  bool String(const char* str, rapidjson::SizeType length, bool)
+  {
+    if (_frames.back() == BULK)
+    {
+      new_timer();
+      return true;
+    }
+
+    if (_frames.back() == REPLICAS)
+    {
+      _json->replica_count++;
+      _json->replica_addresses.push_back(std::string(str, length));
+      return true;
+    }
+
+    TimerJSONValue* value = member();
+    if (value != NULL)
+    {
+      value->present = true;
+      value->type = TimerJSONValue::STRING;
+      value->string_value.assign(str, length);
+    }
+    return true;
+  }
+
+  bool Key(const char* str, rapidjson::SizeType length, bool)
+  {
+    _key.assign(str, length);
+    return true;
+  }
+
+  bool StartObject() { return start(TimerJSONValue::OBJECT); }
+  bool StartArray() { return start(TimerJSONValue::ARRAY); }
+  bool EndObject(rapidjson::SizeType) { _frames.pop_back(); return true; }
+  bool EndArray(rapidjson::SizeType) { _frames.pop_back(); return true; }
+
+private:
+  // The nodes of the document we're interested in.  Anything else is
+  // parsed but ignored (SKIP).
+  enum Frame { BULK, ROOT, TIMING, CALLBACK, TRANSPORT, RELIABILITY, REPLICAS, SKIP };
+
+  // Start capturing a new timer definition.
+  void new_timer()
+  {
+    _timers.push_back(TimerJSON());
+    _json = &_timers.back();
+  }
+
+  // Find where to record the value for the current key, or NULL if the value
+  // should be ignored.
+  TimerJSONValue* member()
+  {
+    TimerJSONValue* value = NULL;
+
+    switch (_frames.back())
+    {
+    case ROOT:
+      value = (_key == "id") ? &_json->id :
+              (_key == "timing") ? &_json->timing :
+              (_key == "callback") ? &_json->callback :
+              (_key == "reliability") ? &_json->reliability :
+              (_key == "cancel") ? &_json->cancel : NULL;
+      break;
+
+    case TIMING:
+      value = (_key == "interval") ? &_json->interval :
+              (_key == "repeat-for") ? &_json->repeat_for :
+              (_key == "start-time") ? &_json->start_time :
+              (_key == "sequence-number") ? &_json->sequence_number : NULL;
+      break;
+
+    case CALLBACK:
+      value = ((_key == "http") || (_key == "zmq") || (_key == "stream")) ?
+              &_json->transport : NULL;
+      break;
+
+    case TRANSPORT:
+      value = (_key == "uri") ? &_json->uri :
+              (_key == "opaque") ? &_json->opaque :
+              (_key == "batch") ? &_json->batch : NULL;
+      break;
+
+    case RELIABILITY:
+      value = (_key == "replicas") ? &_json->replicas :
+              (_key == "replication-factor") ? &_json->replication_factor : NULL;
+      break;
+
+    default:
+      break;
+    }
+
+    // Only the first occurrence of a member is used.
+    return ((value != NULL) && !value->present) ? value : NULL;
+  }
+
+  bool scalar(TimerJSONValue::Type type, int64_t int_value = 0)
+  {
+    if (_frames.back() == BULK)
+    {
+      new_timer();
+      return true;
+    }
+
+    if (_frames.back() == REPLICAS)
+    {
+      _json->replica_count++;
+      _json->replicas_all_strings = false;
+      return true;
+    }
+
+    TimerJSONValue* value = member();
+    if (value != NULL)
+    {
+      value->present = true;
+      value->type = type;
+      value->int_value = int_value;
+    }
+    return true;
+  }
+
+  bool start(TimerJSONValue::Type type)
+  {
+    if (_frames.empty())
+    {
+      // This is the document itself, which must be an object holding a timer
+      // (or, in bulk mode, an array of them).
+      if (_bulk)
+      {
+        _valid_root = (type == TimerJSONValue::ARRAY);
+        _frames.push_back(_valid_root ? BULK : SKIP);
+      }
+      else
+      {
+        _valid_root = (type == TimerJSONValue::OBJECT);
+        if (_valid_root)
+        {
+          new_timer();
+        }
+        _frames.push_back(_valid_root ? ROOT : SKIP);
+      }
+      return true;
+    }
+
+    if (_frames.back() == BULK)
+    {
+      // A new timer definition.
+      new_timer();
+      _frames.push_back((type == TimerJSONValue::OBJECT) ? ROOT : SKIP);
+      return true;
+    }
+
+    if (_frames.back() == REPLICAS)
+    {
+      _json->replica_count++;
+      _json->replicas_all_strings = false;
+      _frames.push_back(SKIP);
+      return true;
+    }
+
+    Frame frame = SKIP;
+    TimerJSONValue* value = member();
+    if (value != NULL)
+    {
+      value->present = true;
+      value->type = type;
+
+      if (value == &_json->transport)
+      {
+        _json->protocol = _key;
+      }
+
+      if (type == TimerJSONValue::OBJECT)
+      {
+        frame = (value == &_json->timing) ? TIMING :
+                (value == &_json->callback) ? CALLBACK :
+                (value == &_json->transport) ? TRANSPORT :
+                (value == &_json->reliability) ? RELIABILITY : SKIP;
+      }
+      else if (value == &_json->replicas)
+      {
+        frame = REPLICAS;
+      }
+    }
+
+    _frames.push_back(frame);
+    return true;
+  }
+
+  std::vector<TimerJSON>& _timers;
+  bool _bulk;
+  bool _valid_root;
+  TimerJSON* _json;
+  std::vector<Frame> _frames;
+  std::string _key;
+};
+
 #define JSON_PARSE_ERROR(STR) {                                               \
   error = (STR);                                                              \
-  delete timer;                                                               \
-  return NULL;                                                                \
+  return false;                                                               \
 }
 
 #define JSON_ASSERT_OBJECT(NODE, NODE_NAME) {                                 \
-  if (!(NODE).IsObject())                                                     \
+  if (!(NODE).is_object())                                                    \
     JSON_PARSE_ERROR((NODE_NAME " should be an object"));                     \
 }
 
 #define JSON_ASSERT_INTEGER(NODE, NODE_NAME) {                                \
-  if (!(NODE).IsInt())                                                        \
+  if (!(NODE).is_int())                                                       \
     JSON_PARSE_ERROR((NODE_NAME " should be an integer"));                    \
 }
 
 #define JSON_ASSERT_INTEGER_64(NODE, NODE_NAME) {                             \
-  if (!(NODE).IsInt64())                                                      \
+  if (!(NODE).is_int64())                                                     \
     JSON_PARSE_ERROR((NODE_NAME " should be an 64bit integer"));              \
 }
 
 #define JSON_ASSERT_STRING(NODE, NODE_NAME) {                                 \
-  if (!(NODE).IsString())                                                     \
+  if (!(NODE).is_string())                                                    \
     JSON_PARSE_ERROR((NODE_NAME " should be a string"));                      \
 }
 
+#define JSON_ASSERT_BOOL(NODE, NODE_NAME) {                                   \
+  if (!(NODE).is_bool())                                                      \
+    JSON_PARSE_ERROR((NODE_NAME " should be a boolean"));                     \
+}
+
 #define JSON_ASSERT_ARRAY(NODE, NODE_NAME) {                                  \
-  if (!(NODE).IsArray())                                                      \
+  if (!(NODE).is_array())                                                     \
     JSON_PARSE_ERROR((NODE_NAME " should be an array"));                      \
 }
 
 #define JSON_ASSERT_CONTAINS(NODE, NODE_NAME, ELEM) {                         \
-  if (!(NODE).HasMember(ELEM))                                                \
+  if (!(NODE).present)                                                        \
     JSON_PARSE_ERROR(("Couldn't find '" ELEM "' in '" NODE_NAME "'"));        \
 }
 
-// Create a Timer object from the JSON representation.
-//
-// @param id - The unique identity for the timer (see generate_timer_id() above).
-// @param replica_hash - The replica hash extracted from the timer URL (or 0 for new timer).
-// @param json - The JSON representation of the timer.
-// @param error - This will be populated with a descriptive error string if required.
-// @param replicated - This will be set to true if this is a replica of a timer.
-Timer* Timer::from_json(TimerID id, uint64_t replica_hash, std::string json, std::string& error, bool& replicated)
+// Parse the body of a request into its captured nodes.  Returns false (and
+// sets the error) if the body isn't valid JSON.
+static bool parse_json(const std::string& json,
+                       bool bulk,
+                       std::vector<TimerJSON>& docs,
+                       bool& valid_root,
+                       std::string& error)
 {
-  Timer* timer = NULL;
-  rapidjson::Document doc;
-  doc.Parse<0>(json.c_str());
-  if (doc.HasParseError())
+  TimerJSONHandler handler(docs, bulk);
+  rapidjson::Reader reader;
+  rapidjson::StringStream stream(json.c_str());
+  reader.Parse<0>(stream, handler);
+  if (reader.HasParseError())
   {
-    JSON_PARSE_ERROR(boost::str(boost::format("Failed to parse JSON body, offset: %lu - %s. JSON is: %s") % doc.GetErrorOffset() % doc.GetParseError() % json));
+    JSON_PARSE_ERROR(boost::str(boost::format("Failed to parse JSON body, offset: %lu - %s. JSON is: %s") % reader.GetErrorOffset() % reader.GetParseErrorCode() % json));
   }
 
-  if (!doc.HasMember("timing"))
-    JSON_PARSE_ERROR(("Couldn't find the 'timing' node in the JSON"));
-  if (!doc.HasMember("callback"))
-    JSON_PARSE_ERROR(("Couldn't find the 'callback' node in the JSON"));
+  valid_root = handler.valid_root();
+  return true;
+}
 
-  // Parse out the timing block
-  rapidjson::Value& timing = doc["timing"];
-  JSON_ASSERT_OBJECT(timing, "timing");
+// Validate the captured timing block, filling in the timing.  An absent
+// start-time means now, and an absent sequence-number means 0.
+static bool validate_timing(TimerJSON& doc,
+                            TimerTiming& timing,
+                            std::string& error)
+{
+  JSON_ASSERT_OBJECT(doc.timing, "timing");
 
-  JSON_ASSERT_CONTAINS(timing, "timing", "interval");
-  rapidjson::Value& interval = timing["interval"];
-  JSON_ASSERT_INTEGER(interval, "interval");
+  JSON_ASSERT_CONTAINS(doc.interval, "timing", "interval");
+  JSON_ASSERT_INTEGER(doc.interval, "interval");
+  int interval_int = doc.interval.int_value;
 
   // Extract the repeat-for parameter, if it's absent, set it to the interval
   // instead.
   int repeat_for_int;
-  if (timing.HasMember("repeat-for"))
+  if (doc.repeat_for.present)
   {
-    rapidjson::Value& repeat_for = timing["repeat-for"];
-    JSON_ASSERT_INTEGER(repeat_for, "repeat-for");
-    repeat_for_int = repeat_for.GetInt();
+    JSON_ASSERT_INTEGER(doc.repeat_for, "repeat-for");
+    repeat_for_int = doc.repeat_for.int_value;
   }
   else
   {
-    repeat_for_int = interval.GetInt();
+    repeat_for_int = interval_int;
   }
 
-  if ((interval.GetInt() == 0) && (repeat_for_int != 0))
+  if ((interval_int == 0) && (repeat_for_int != 0))
   {
     // If the interval time is 0 and the repeat_for_int isn't then reject the timer. 
     JSON_PARSE_ERROR(boost::str(boost::format("Can't have a zero interval time with a non-zero (%d) repeat-for time") % repeat_for_int));
   }
 
-  timer = new Timer(id, (interval.GetInt() * 1000), (repeat_for_int * 1000));
+  timing.interval = interval_int * 1000;
+  timing.repeat_for = repeat_for_int * 1000;
 
-  if (timing.HasMember("start-time"))
+  if (doc.start_time.present)
   {
     // Timer JSON specifies a start-time, use that instead of now.
-    rapidjson::Value& start_time = timing["start-time"];
-    JSON_ASSERT_INTEGER_64(start_time, "start-time");
-    timer->start_time = start_time.GetInt64();
+    JSON_ASSERT_INTEGER_64(doc.start_time, "start-time");
+    timing.start_time = doc.start_time.int_value;
   }
-
-  if (timing.HasMember("sequence-number"))
+  else
   {
-    rapidjson::Value& sequence_number = timing["sequence-number"];
-    JSON_ASSERT_INTEGER(sequence_number, "sequence-number");
-    timer->sequence_number = sequence_number.GetInt();
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    timing.start_time = (ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
   }
 
-  // Parse out the 'callback' block
-  rapidjson::Value& callback = doc["callback"];
-
-  JSON_ASSERT_OBJECT(callback, "callback");
-  JSON_ASSERT_CONTAINS(callback, "callback", "http");
-
-  rapidjson::Value& http = callback["http"];
+  timing.sequence_number = 0;
+  if (doc.sequence_number.present)
+  {
+    JSON_ASSERT_INTEGER(doc.sequence_number, "sequence-number");
+    timing.sequence_number = doc.sequence_number.int_value;
+  }
 
-  JSON_ASSERT_OBJECT(http, "http");
-  JSON_ASSERT_CONTAINS(http, "http", "uri");
-  JSON_ASSERT_CONTAINS(http, "http", "opaque");
+  return true;
+}
 
-  rapidjson::Value& uri = http["uri"];
-  rapidjson::Value& opaque = http["opaque"];
+// Validate a complete timer definition, filling in the timing.  The callback
+// and reliability nodes can be used directly once this has passed.
+static bool validate_timer(TimerJSON& doc,
+                           TimerTiming& timing,
+                           std::string& error)
+{
+  if (!doc.timing.present)
+    JSON_PARSE_ERROR(("Couldn't find the 'timing' node in the JSON"));
+  if (!doc.callback.present)
+    JSON_PARSE_ERROR(("Couldn't find the 'callback' node in the JSON"));
 
-  JSON_ASSERT_STRING(uri, "uri");
-  JSON_ASSERT_STRING(opaque, "opaque");
+  // Parse out the timing block
+  if (!validate_timing(doc, timing, error))
+  {
+    return false;
+  }
 
-  timer->callback_url = std::string(uri.GetString(), uri.GetStringLength());
-  timer->callback_body = std::string(opaque.GetString(), opaque.GetStringLength());
+  // Parse out the 'callback' block
+  JSON_ASSERT_OBJECT(doc.callback, "callback");
+  JSON_ASSERT_CONTAINS(doc.transport, "callback", "http");
+
+  // The transport node is named after the callback protocol (http, zmq or
+  // stream).
+  if (!doc.transport.is_object())
+    JSON_PARSE_ERROR(doc.protocol + " should be an object");
+  if (!doc.uri.present)
+    JSON_PARSE_ERROR("Couldn't find 'uri' in '" + doc.protocol + "'");
+  if (!doc.opaque.present)
+    JSON_PARSE_ERROR("Couldn't find 'opaque' in '" + doc.protocol + "'");
+
+  JSON_ASSERT_STRING(doc.uri, "uri");
+  JSON_ASSERT_STRING(doc.opaque, "opaque");
+
+  // Only HTTP callbacks can be batched.
+  if ((doc.protocol == "http") && (doc.batch.present))
+  {
+    JSON_ASSERT_BOOL(doc.batch, "batch");
+  }
 
-  if (doc.HasMember("reliability"))
+  if (doc.reliability.present)
   {
     // Parse out the 'reliability' block
-    rapidjson::Value& reliability = doc["reliability"];
-
-    JSON_ASSERT_OBJECT(reliability, "reliability");
+    JSON_ASSERT_OBJECT(doc.reliability, "reliability");
 
-    if (reliability.HasMember("replicas"))
+    if (doc.replicas.present)
     {
-      rapidjson::Value& replicas = reliability["replicas"];
-      JSON_ASSERT_ARRAY(replicas, "replicas");
+      JSON_ASSERT_ARRAY(doc.replicas, "replicas");
 
-      if (replicas.Size() == 0)
+      if (doc.replica_count == 0)
       {
         JSON_PARSE_ERROR("If replicas is specified it must be non-empty");
       }
 
-      timer->_replication_factor = replicas.Size();
-      for (auto it = replicas.Begin(); it != replicas.End(); ++it)
+      if (!doc.replicas_all_strings)
       {
-        JSON_ASSERT_STRING(*it, "replica address");
-        timer->replicas.push_back(std::string(it->GetString(), it->GetStringLength()));
+        JSON_PARSE_ERROR("replica address should be a string");
       }
     }
-    else
+    else if (doc.replication_factor.present)
     {
-      if (reliability.HasMember("replication-factor"))
-      {
-        rapidjson::Value& replication_factor = reliability["replication-factor"];
-        JSON_ASSERT_INTEGER(replication_factor, "replication-factor");
-        timer->_replication_factor = replication_factor.GetInt();
-      }
-      else
+      JSON_ASSERT_INTEGER(doc.replication_factor, "replication-factor");
+    }
+  }
+
+  return true;
+}
+
+// Create a Timer object from the JSON representation.
+//
+// The body is parsed in a single pass with a SAX handler (see
+// TimerJSONHandler above) and the captured nodes are then validated in turn.
+//
+// @param id - The unique identity for the timer (see generate_timer_id() above).
+// @param replica_hash - The replica filter extracted from the timer URL (or 0 for new timer).
+// @param json - The JSON representation of the timer.
+// @param error - This will be populated with a descriptive error string if required.
+// @param replicated - This will be set to true if this is a replica of a timer.
+Timer* Timer::from_json(TimerID id,
+                        const ReplicaFilter& replica_hash,
+                        const std::string& json,
+                        std::string& error,
+                        bool& replicated)
+{
+  std::vector<TimerJSON> docs;
+  bool valid_root;
+  if (!parse_json(json, false, docs, valid_root, error))
+  {
+    return NULL;
+  }
+
+  if (docs.empty())
+  {
+    // The body wasn't an object, so contains none of the required nodes.
+    docs.push_back(TimerJSON());
+  }
+
+  return from_parsed_json(id, replica_hash, docs.front(), error, replicated);
+}
+
+// Get the ID of a timer defined in a bulk request.  A definition sent by
+// another replica (see `Replicator::replicate_bulk()`) carries the ID of the
+// timer and its replicas, the timers from a client are given a new ID.
+static bool parse_bulk_id(TimerJSON& doc, TimerID& id, std::string& error)
+{
+  if (!doc.id.present)
+  {
+    id = Timer::generate_timer_id();
+    return true;
+  }
+
+  JSON_ASSERT_STRING(doc.id, "id");
+
+  const std::string& str = doc.id.string_value;
+  if ((str.length() != 16) ||
+      (str.find_first_not_of("0123456789abcdefABCDEF") != std::string::npos))
+  {
+    JSON_PARSE_ERROR("id should be a 16 digit hex string");
+  }
+
+  if (!doc.reliability.present || !doc.replicas.present)
+  {
+    JSON_PARSE_ERROR("id is only valid for a timer with replicas");
+  }
+
+  id = std::stoull(str, NULL, 16);
+  return true;
+}
+
+// Create Timer objects from a JSON array of timer definitions (as sent to the
+// bulk API).  Each definition takes the same form as the body of a single
+// timer request.  A definition may also carry the timer's ID, in which case
+// it is a replica of an existing timer (sent by another node), otherwise it
+// is a new timer from a client and is given a new ID.
+//
+// @param json - The JSON array of timer definitions.
+// @param timers - Populated with the new timers (which the caller then owns).
+// @param replicated - Populated with whether each timer is a replica sent by
+//                     another node.
+// @param error - This will be populated with a descriptive error string if required.
+//
+// Returns false (and creates no timers) if any of the definitions is invalid.
+bool Timer::from_json_array(const std::string& json,
+                            std::vector<Timer*>& timers,
+                            std::vector<bool>& replicated,
+                            std::string& error)
+{
+  std::vector<TimerJSON> docs;
+  bool valid_root;
+  if (!parse_json(json, true, docs, valid_root, error))
+  {
+    return false;
+  }
+
+  if (!valid_root)
+  {
+    error = "Bulk request body should be an array of timers";
+    return false;
+  }
+
+  if (docs.empty())
+  {
+    error = "Bulk request body should contain at least one timer";
+    return false;
+  }
+
+  for (unsigned int ii = 0; ii < docs.size(); ++ii)
+  {
+    std::string timer_error;
+    TimerID id;
+    Timer* timer = NULL;
+    if (parse_bulk_id(docs[ii], id, timer_error))
+    {
+      bool timer_replicated;
+      timer = from_parsed_json(id, 0, docs[ii], timer_error, timer_replicated);
+    }
+
+    if (timer == NULL)
+    {
+      error = boost::str(boost::format("Timer %d: %s") % ii % timer_error);
+      for (auto it = timers.begin(); it != timers.end(); ++it)
       {
-        // Default replication factor is 2.
-        timer->_replication_factor = 2;
+        delete *it;
       }
+      timers.clear();
+      replicated.clear();
+      return false;
+    }
+
+    timers.push_back(timer);
+    replicated.push_back(docs[ii].id.present);
+  }
+
+  return true;
+}
+
+// Extract the timing of a timer from the JSON body of a timing update.  The
+// body is a JSON object containing a timing block (as described in
+// `to_json()`), where only the interval is mandatory.  An update replicated
+// from another node also carries the timer's replicas in a reliability block
+// (see `timing_json()`).
+//
+// @param json - The JSON representation of the update.
+// @param timing - Populated with the new timing of the timer.
+// @param replicas - Populated with the replicas carried by a replicated
+//                   update, or the empty set for an update from a client.
+// @param error - This will be populated with a descriptive error string if required.
+// @param replicated - This will be set to true if this update was replicated
+//                     from another node (as for `from_json()`, this is
+//                     decided by the presence of the replicas).
+bool Timer::timing_from_json(const std::string& json,
+                             TimerTiming& timing,
+                             ReplicaSetPtr& replicas,
+                             std::string& error,
+                             bool& replicated)
+{
+  std::vector<TimerJSON> docs;
+  bool valid_root;
+  if (!parse_json(json, false, docs, valid_root, error))
+  {
+    return false;
+  }
+
+  if ((docs.empty()) || (!docs.front().timing.present))
+  {
+    JSON_PARSE_ERROR(("Couldn't find the 'timing' node in the JSON"));
+  }
+
+  TimerJSON& doc = docs.front();
+  replicated = (doc.reliability.present && (doc.replica_count > 0));
+  replicas = ReplicaSet::empty_set();
+  if ((replicated) && (!ReplicaSet::find(doc.replica_addresses, replicas)))
+  {
+    JSON_PARSE_ERROR(("Replicas should be nodes in the cluster"));
+  }
+
+  return validate_timing(doc, timing, error);
+}
+
+// Extract the changes a client asks for in the JSON response to a callback.
+// The response may contain a timing block (as for a timing update) to
+// restart the timer from now with new timing, or `"cancel": true` to stop the
+// timer popping.
+//
+// @param json - The JSON body of the callback response.
+// @param timing - Populated with the new timing of the timer, if any.
+// @param reschedule - This will be set to true if the timer has new timing.
+// @param cancel - This will be set to true if the timer should be cancelled.
+// @param error - This will be populated with a descriptive error string if required.
+bool Timer::callback_response_from_json(const std::string& json,
+                                        TimerTiming& timing,
+                                        bool& reschedule,
+                                        bool& cancel,
+                                        std::string& error)
+{
+  std::vector<TimerJSON> docs;
+  bool valid_root;
+  if (!parse_json(json, false, docs, valid_root, error))
+  {
+    return false;
+  }
+
+  if (!valid_root)
+  {
+    JSON_PARSE_ERROR(("Callback response should be an object"));
+  }
+
+  TimerJSON& doc = docs.front();
+
+  cancel = false;
+  if (doc.cancel.present)
+  {
+    JSON_ASSERT_BOOL(doc.cancel, "cancel");
+    cancel = doc.cancel.int_value;
+  }
+
+  reschedule = doc.timing.present;
+  if (reschedule)
+  {
+    if (!validate_timing(doc, timing, error))
+    {
+      return false;
     }
+
+    // The timer starts its new sequence of pops now.
+    timing.sequence_number = 0;
+  }
+
+  return true;
+}
+
+// Create a Timer object from the nodes captured from its JSON representation.
+// The parameters are as for `from_json()`.
+Timer* Timer::from_parsed_json(TimerID id,
+                               const ReplicaFilter& replica_hash,
+                               TimerJSON& doc,
+                               std::string& error,
+                               bool& replicated)
+{
+  TimerTiming timing;
+  if (!validate_timer(doc, timing, error))
+  {
+    return NULL;
+  }
+
+  // Replicated timers name their replicas by address.  Only accept nodes we
+  // already know, so that a peer can't make us intern arbitrary addresses.
+  ReplicaSetPtr replicas = ReplicaSet::empty_set();
+  if ((doc.reliability.present) &&
+      (doc.replicas.present) &&
+      (!ReplicaSet::find(doc.replica_addresses, replicas)))
+  {
+    error = "Replicas should be nodes in the cluster";
+    return NULL;
+  }
+
+  Timer* timer = new Timer(id, timing.interval, timing.repeat_for);
+  timer->set_timing(timing);
+  timer->set_callback_url(SharedString::intern(doc.uri.string_value));
+  timer->set_callback_body(std::move(doc.opaque.string_value));
+  timer->set_callback_protocol(SharedString::intern(doc.protocol));
+  timer->set_callback_batch((doc.protocol == "http") &&
+                            (doc.batch.present) &&
+                            (doc.batch.int_value));
+
+  if (doc.reliability.present && doc.replicas.present)
+  {
+    timer->_replication_factor = doc.replica_count;
+    timer->set_replicas(replicas);
+  }
+  else if (doc.reliability.present && doc.replication_factor.present)
+  {
+    timer->_replication_factor = doc.replication_factor.int_value;
   }
   else
   {
-    // Default to 2 replicas
+    // Default replication factor is 2.
     timer->_replication_factor = 2;
   }
 
-  if (timer->replicas.empty())
+  if (timer->replicas()->empty())
   {
     // Replicas not determined above, determine them now.  Note that this implies
     // the request is from a client, not another replica.
@@ -0,0 +1,151 @@
+#include "timer_digest.h"
+
+#include <algorithm>
+
+TimerDigest::TimerDigest() :
+  _entries(),
+  _leaves(TIMER_DIGEST_LEAVES),
+  _trees()
+{
+}
+
+TimerDigest::~TimerDigest()
+{
+}
+
+void TimerDigest::add(TimerID id,
+                      uint64_t start_time,
+                      const ReplicaSetPtr& replicas)
+{
+  auto it = _entries.find(id);
+  if (it != _entries.end())
+  {
+    // Replica sets are shared, so can be compared by pointer.
+    if ((it->second.start_time == start_time) &&
+        (it->second.replicas == replicas))
+    {
+      return;
+    }
+
+    // Take the old version out of the trees.
+    update(it->second, id);
+    it->second.start_time = start_time;
+    it->second.replicas = replicas;
+  }
+  else
+  {
+    Entry entry;
+    entry.start_time = start_time;
+    entry.replicas = replicas;
+    it = _entries.insert(std::make_pair(id, entry)).first;
+    _leaves[leaf(id)].insert(id);
+  }
+
+  update(it->second, id);
+}
+
+void TimerDigest::remove(TimerID id)
+{
+  auto it = _entries.find(id);
+  if (it != _entries.end())
+  {
+    update(it->second, id);
+    _leaves[leaf(id)].erase(id);
+    _entries.erase(it);
+  }
+}
+
+void TimerDigest::hashes(NodeID node,
+                         int level,
+                         uint32_t first,
+                         uint32_t count,
+                         std::vector<uint64_t>& hashes) const
+{
+  hashes.clear();
+  if ((level < 0) || (level > TIMER_DIGEST_DEPTH))
+  {
+    return;
+  }
+
+  uint32_t width = (1 << level);
+  if (first >= width)
+  {
+    return;
+  }
+  count = std::min(count, width - first);
+
+  auto it = _trees.find(node);
+  if (it == _trees.end())
+  {
+    hashes.resize(count, 0);
+    return;
+  }
+
+  const Tree& tree = it->second;
+  hashes.assign(tree.begin() + width + first,
+                tree.begin() + width + first + count);
+}
+
+void TimerDigest::timers(NodeID node,
+                         uint32_t leaf,
+                         std::map<TimerID, uint64_t>& timers) const
+{
+  timers.clear();
+  if (leaf >= TIMER_DIGEST_LEAVES)
+  {
+    return;
+  }
+
+  const std::unordered_set<TimerID>& ids = _leaves[leaf];
+  for (auto it = ids.begin(); it != ids.end(); ++it)
+  {
+    const Entry& entry = _entries.find(*it)->second;
+    if (entry.replicas->contains(node))
+    {
+      timers[*it] = entry.start_time;
+    }
+  }
+}
+
+uint32_t TimerDigest::leaf(TimerID id)
+{
+  // Timer IDs are partly sequential, so mix them up before picking a leaf.
+  return (uint32_t)(hash(id, 0) >> (64 - TIMER_DIGEST_DEPTH));
+}
+
+/*****************************************************************************/
+/* Private functions.                                                        */
+/*****************************************************************************/
+
+// Toggle a timer in the trees for each of its replicas.  As the trees are
+// built with XOR, this adds the timer if it's not in the trees and removes it
+// if it is.
+void TimerDigest::update(const Entry& entry, TimerID id)
+{
+  uint64_t h = hash(id, entry.start_time);
+  uint32_t leaf_index = TIMER_DIGEST_LEAVES + leaf(id);
+  const std::vector<NodeID>& replicas = entry.replicas->replicas();
+
+  for (auto it = replicas.begin(); it != replicas.end(); ++it)
+  {
+    Tree& tree = _trees[*it];
+    if (tree.empty())
+    {
+      tree.resize(2 * TIMER_DIGEST_LEAVES, 0);
+    }
+
+    for (uint32_t ii = leaf_index; ii >= 1; ii /= 2)
+    {
+      tree[ii] ^= h;
+    }
+  }
+}
+
+// Hash a version of a timer, using the SplitMix64 finalizer.
+uint64_t TimerDigest::hash(TimerID id, uint64_t start_time)
+{
+  uint64_t h = id ^ (start_time * 0x9e3779b97f4a7c15ULL);
+  h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+  return h ^ (h >> 31);
+}
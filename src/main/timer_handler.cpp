@@ -4,6 +4,7 @@
 
 #include "timer_handler.h"
 #include "log.h"
+#include "globals.h"
 
 void* TimerHandler::timer_handler_entry_func(void* arg)
 {
@@ -64,6 +65,112 @@ void TimerHandler::add_timer(Timer* timer)
   pthread_mutex_unlock(&_mutex);
 }
 
+// Add a collection of timers to the store, taking the lock once for the whole
+// collection.  The collection is emptied, as the store now owns the timers.
+void TimerHandler::add_timers(std::unordered_set<Timer*>& timers)
+{
+  LOG_DEBUG("Adding %lu timers", timers.size());
+  pthread_mutex_lock(&_mutex);
+  _store->add_timers(timers);
+  pthread_mutex_unlock(&_mutex);
+}
+
+// Update the timing and replicas of a stored timer (see
+// `TimerStore::update_timer()`).  Returns a copy of the updated timer (which
+// the caller then owns) or NULL if the store doesn't hold a live timer that
+// this update applies to.  If this node is no longer one of the timer's
+// replicas, the stored timer becomes a tombstone (as a new timer for other
+// nodes does).
+Timer* TimerHandler::update_timer(TimerID id,
+                                  const TimerTiming& timing,
+                                  const ReplicaSetPtr& replicas,
+                                  const ReplicaFilter& replica_hash,
+                                  bool& popping)
+{
+  LOG_DEBUG("Updating timer:  %lu", id);
+  ClusterViewPtr cluster = __globals->get_cluster_view();
+  Timer* timer = NULL;
+  pthread_mutex_lock(&_mutex);
+  Timer* stored = _store->update_timer(id, timing, replicas, replica_hash, popping);
+  if (stored != NULL)
+  {
+    timer = new Timer(*stored);
+
+    if (!stored->is_local(cluster->local_id()))
+    {
+      Timer* tombstone = new Timer(*stored);
+      tombstone->become_tombstone();
+      _store->add_timer(tombstone);
+    }
+  }
+  pthread_mutex_unlock(&_mutex);
+  return timer;
+}
+
+// Re-arm timers that have popped, passing ownership back to the store.  The
+// callback engine should use these (rather than `add_timer()`) for timers it
+// has been given, as the store can skip most of the work of adding a timer.
+void TimerHandler::rearm_timer(Timer* timer)
+{
+  LOG_DEBUG("Re-arming timer:  %lu", timer->id);
+  pthread_mutex_lock(&_mutex);
+  _store->rearm_timer(timer);
+  pthread_mutex_unlock(&_mutex);
+}
+
+void TimerHandler::rearm_timers(std::unordered_set<Timer*>& timers)
+{
+  LOG_DEBUG("Re-arming %lu timers", timers.size());
+  pthread_mutex_lock(&_mutex);
+  _store->rearm_timers(timers);
+  pthread_mutex_unlock(&_mutex);
+}
+
+// Tell the store that a timer that has popped won't be re-armed.
+void TimerHandler::release_timer(TimerID id)
+{
+  LOG_DEBUG("Releasing timer:  %lu", id);
+  pthread_mutex_lock(&_mutex);
+  _store->release_timer(id);
+  pthread_mutex_unlock(&_mutex);
+}
+
+// Get a copy of a live timer (which the caller then owns), or NULL if the
+// store doesn't hold one with this ID.
+Timer* TimerHandler::get_timer(TimerID id)
+{
+  Timer* timer = NULL;
+  pthread_mutex_lock(&_mutex);
+  Timer* stored = _store->get_timer(id);
+  if (stored != NULL)
+  {
+    timer = new Timer(*stored);
+  }
+  pthread_mutex_unlock(&_mutex);
+  return timer;
+}
+
+// Read parts of the store's digest (see `TimerDigest`).
+void TimerHandler::get_digest_hashes(NodeID node,
+                                     int level,
+                                     uint32_t first,
+                                     uint32_t count,
+                                     std::vector<uint64_t>& hashes)
+{
+  pthread_mutex_lock(&_mutex);
+  _store->digest().hashes(node, level, first, count, hashes);
+  pthread_mutex_unlock(&_mutex);
+}
+
+void TimerHandler::get_digest_timers(NodeID node,
+                                     uint32_t leaf,
+                                     std::map<TimerID, uint64_t>& timers)
+{
+  pthread_mutex_lock(&_mutex);
+  _store->digest().timers(node, leaf, timers);
+  pthread_mutex_unlock(&_mutex);
+}
+
 // The core function in the timer handler, basic principle is to loop around repeatedly
 // retrieving timers from the store, waiting until they need to pop and popping them.
 //
@@ -136,6 +243,7 @@ void TimerHandler::pop(std::unordered_set<Timer*>& timers)
     pop(*it);
   }
   timers.clear();
+  _callback->flush();
 }
 
 // Pop a specific timer, if required pass the timer on to the replication layer to
@@ -146,6 +254,7 @@ void TimerHandler::pop(Timer* timer)
   if (timer->is_tombstone())
   {
     LOG_DEBUG("Discarding expired tombstone");
+    release_timer(timer->id);
     delete timer;
     return;
   }
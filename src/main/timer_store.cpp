@@ -19,12 +19,13 @@
                             (T)->interval,                                     \
                             (T)->repeat_for,                                   \
                             (T)->sequence_number,                              \
-                            (T)->callback_url.c_str(),                         \
-                            (T)->callback_body.c_str()
+                            (T)->callback_url().c_str(),                       \
+                            (T)->callback_body().c_str()
 
 TimerStore::TimerStore()
 {
   _tick_timestamp = to_short_wheel_resolution(wall_time_ms());
+  _tombstone_tick = _tick_timestamp / 1000;
 }
 
 TimerStore::~TimerStore()
@@ -51,16 +52,17 @@ TimerStore::~TimerStore()
 // may delete it at any time).
 void TimerStore::add_timer(Timer* t)
 {
-  // First check if this timer already exists.
+  // First check if this timer already exists.  (A NULL entry means the
+  // previous version of the timer has popped and is being processed, so this
+  // version replaces it.)
   auto map_it = _timer_lookup_table.find(t->id);
-  if (map_it != _timer_lookup_table.end())
+  if ((map_it != _timer_lookup_table.end()) && (map_it->second != NULL))
   {
     Timer* existing = map_it->second;
 
     // Compare timers for precedence, start-time then sequence-number.
-    if ((t->start_time < existing->start_time) ||
-        ((t->start_time == existing->start_time) &&
-         (t->sequence_number < existing->sequence_number)))
+    if (is_older(t->start_time, t->sequence_number,
+                 existing->start_time, existing->sequence_number))
     {
       // Existing timer is more recent
       delete t;
@@ -79,58 +81,45 @@ void TimerStore::add_timer(Timer* t)
       delete_timer(t->id);
     }
   }
+  else if (map_it == _timer_lookup_table.end())
+  {
+    // The timer may have been deleted already, in which case it must be more
+    // recent than the tombstone.
+    auto tombstone_it = _tombstone_table.find(t->id);
+    if (tombstone_it != _tombstone_table.end())
+    {
+      const Tombstone& existing = tombstone_it->second;
 
-  // Work out where to store the timer (overdue bucket, short wheel, long wheel,
-  // or heap).
-  //
-  // Note that these if tests MUST use less than. For example if _tick_time is
-  // 20,330 a 1s timer will pop at 21,330. When in the short wheel the timer
-  // will live in bucket 33. But this is the bucket that is about to pop, so the
-  // timer must actually go in to the long wheel.  The same logic applies for
-  // the 1s buckets (where timers due to pop in >=1hr need to go into the heap).
-  uint64_t next_pop_time = t->next_pop_time();
-  Bucket* bucket;
+      if (is_older(t->start_time, t->sequence_number,
+                   existing.start_time, existing.sequence_number))
+      {
+        // Tombstone is more recent
+        delete t;
+        return;
+      }
 
-  if (next_pop_time < _tick_timestamp)
-  {
-    // The timer should have already popped so put it in the overdue timers,
-    // and warn the user.
-    //
-    // We can't just put the timer in the next bucket to pop.  We need to know
-    // what bucket to look in when deleting timers, and this is derived from
-    // the pop time. So if we put the timer in the wrong bucket we can't find
-    // it to delete it.
-    LOG_WARNING("Modifying timer after pop time (current time is %lu). "
-                "Window condition detected.\n" TIMER_LOG_FMT,
-                _tick_timestamp,
-                TIMER_LOG_PARAMS(t));
-    _overdue_timers.insert(t);
+      // A new tombstone updates the existing record (see `add_tombstone()`).
+      if (!t->is_tombstone())
+      {
+        _tombstone_table.erase(tombstone_it);
+      }
+    }
   }
-  else if (to_short_wheel_resolution(next_pop_time) <
-           to_short_wheel_resolution(_tick_timestamp + SHORT_WHEEL_PERIOD_MS))
-  {
 
-    bucket = short_wheel_bucket(next_pop_time);
-    bucket->insert(t);
-  }
-  else if (to_long_wheel_resolution(next_pop_time) <
-           to_long_wheel_resolution(_tick_timestamp + LONG_WHEEL_PERIOD_MS))
+  if (t->is_tombstone())
   {
-    bucket = long_wheel_bucket(next_pop_time);
-    bucket->insert(t);
-  }
-  else
-  {
-    // Timer is too far in the future to be handled by the wheels, put it in
-    // the extra heap.
-    LOG_WARNING("Adding timer to extra heap, consider re-building with a larger "
-                "LONG_WHEEL_NUM_BUCKETS constant");
-    _extra_heap.push_back(t);
-    std::push_heap(_extra_heap.begin(), _extra_heap.end());
+    _timer_lookup_table.erase(t->id);
+    _digest.remove(t->id);
+    add_tombstone(t);
+    return;
   }
 
-  // Finally, add the timer to the lookup table.
-  _timer_lookup_table.insert(std::pair<TimerID, Timer*>(t->id, t));
+  insert_timer(t);
+
+  // Finally, add the timer to the lookup table (reusing the entry if the timer
+  // is being processed).
+  _timer_lookup_table[t->id] = t;
+  _digest.add(t->id, t->start_time, t->replicas());
 }
 
 // Add a collection of timers to the data store.  The collection is emptied by
@@ -151,63 +140,72 @@ void TimerStore::delete_timer(TimerID id)
   it = _timer_lookup_table.find(id);
   if (it != _timer_lookup_table.end())
   {
-    // The timer is still present in the store, delete it.
+    // The timer is still present in the store, delete it (unless it has
+    // popped, in which case it's owned by whoever is processing it).
     Timer* timer = it->second;
-    Bucket* bucket;
-    size_t num_erased;
-
-    // Delete the timer from the overdue buckets / timer wheels / heap. Try the
-    // overdue bucket first, then the short wheel then the long wheel, then
-    // finally the heap.
-    num_erased = _overdue_timers.erase(timer);
+    _timer_lookup_table.erase(it);
+    _digest.remove(id);
 
-    if (num_erased == 0)
+    if (timer != NULL)
     {
-      bucket = short_wheel_bucket(timer);
-      num_erased = bucket->erase(timer);
+      unlink_timer(timer);
+      delete timer;
+    }
+  }
+}
 
-      if (num_erased == 0)
-      {
-        bucket = long_wheel_bucket(timer);
-        num_erased = bucket->erase(timer);
+// Update the timing and replicas of a timer in the store (leaving its
+// callback alone).  An update replicated from another node carries the
+// timer's replicas, otherwise (when `replicas` is empty) they're recalculated
+// from the replica hash, as for a new timer from a client.  Returns the
+// updated timer, which is still owned by the store, or NULL if there's no
+// live timer with this ID (tombstones included) or the store already holds a
+// more recent version of the timer.  A timer that has popped can't be
+// updated until it is re-armed, in which case `popping` is set.
+Timer* TimerStore::update_timer(TimerID id,
+                                const TimerTiming& timing,
+                                const ReplicaSetPtr& replicas,
+                                const ReplicaFilter& replica_hash,
+                                bool& popping)
+{
+  auto map_it = _timer_lookup_table.find(id);
+  popping = ((map_it != _timer_lookup_table.end()) && (map_it->second == NULL));
+  if ((map_it == _timer_lookup_table.end()) || (map_it->second == NULL))
+  {
+    return NULL;
+  }
 
-        if (num_erased == 0)
-        {
-          std::vector<Timer*>::iterator heap_it;
-          heap_it = std::find(_extra_heap.begin(), _extra_heap.end(), timer);
-          if (heap_it != _extra_heap.end())
-          {
-            // Timer is in heap, remove it.
-            _extra_heap.erase(heap_it, heap_it + 1);
-            std::make_heap(_extra_heap.begin(), _extra_heap.end());
-          }
-          else
-          {
-            // We failed to remove the timer from any data structure.  Try and
-            // purge the timer from all the timer wheels (we're already sure
-            // that it's not in the heap).
-
-            // LCOV_EXCL_START
-            LOG_ERROR("Failed to remove timer consistently");
-            purge_timer_from_wheels(timer);
-
-            // Assert after purging, so we get a nice log detailing how the
-            // purge went.
-            assert(!"Failed to remove timer consistently");
-            // LCOV_EXCL_STOP
-          }
-        }
-      }
-    }
+  Timer* timer = map_it->second;
 
-    _timer_lookup_table.erase(id);
-    delete timer;
+  // Compare timers for precedence, start-time then sequence-number (as in
+  // `add_timer()`).
+  if (is_older(timing.start_time, timing.sequence_number,
+               timer->start_time, timer->sequence_number))
+  {
+    return NULL;
   }
+
+  // The timer's position in the store depends on its timing and replicas, so
+  // move it.
+  unlink_timer(timer);
+  timer->set_timing(timing);
+  if (replicas->empty())
+  {
+    timer->calculate_replicas(replica_hash);
+  }
+  else
+  {
+    timer->set_replicas(replicas);
+  }
+  insert_timer(timer);
+  _digest.add(id, timer->start_time, timer->replicas());
+
+  return timer;
 }
 
 // Retrieve the set of timers to pop.  The timers returned are disowned by the
-// store and must be freed by the caller or returned to the store through
-// `add_timer()`.
+// store and must either be returned to the store through `rearm_timer()`, or
+// freed by the caller (who should then call `release_timer()`).
 //
 // If the returned set is empty, there are no timers in the store and the caller
 // will try again later (after a signal that a new timer has been added).
@@ -233,12 +231,276 @@ void TimerStore::get_next_timers(std::unordered_set<Timer*>& set)
     _tick_timestamp += SHORT_WHEEL_RESOLUTION_MS;
     maybe_refill_wheels();
   }
+
+  expire_tombstones(current_timestamp / 1000);
+}
+
+// Re-arm a timer returned by `get_next_timers()`.  This takes ownership of the
+// timer, as `add_timer()` does.  If nothing has happened to the timer since it
+// popped, its lookup table entry is reused and no precedence checks are
+// needed, otherwise the timer is added as normal.
+void TimerStore::rearm_timer(Timer* t)
+{
+  auto map_it = _timer_lookup_table.find(t->id);
+  if ((map_it == _timer_lookup_table.end()) || (map_it->second != NULL))
+  {
+    // The timer has been deleted or replaced while it was being processed.
+    add_timer(t);
+    return;
+  }
+
+  if (t->is_tombstone())
+  {
+    _timer_lookup_table.erase(map_it);
+    _digest.remove(t->id);
+    add_tombstone(t);
+    return;
+  }
+
+  // The timer's callback may have moved it (see
+  // `HTTPCallback::apply_response()`), which changes its start time.
+  insert_timer(t);
+  map_it->second = t;
+  _digest.add(t->id, t->start_time, t->replicas());
+}
+
+// Re-arm a collection of timers.  The collection is emptied by this operation,
+// since the timers are now owned by the store.
+void TimerStore::rearm_timers(std::unordered_set<Timer*>& set)
+{
+  for (auto it = set.begin(); it != set.end(); ++it)
+  {
+    rearm_timer(*it);
+  }
+  set.clear();
+}
+
+// Forget a timer returned by `get_next_timers()` that won't be re-armed (for
+// example because its callback failed).
+void TimerStore::release_timer(TimerID id)
+{
+  auto map_it = _timer_lookup_table.find(id);
+  if ((map_it != _timer_lookup_table.end()) && (map_it->second == NULL))
+  {
+    _timer_lookup_table.erase(map_it);
+    _digest.remove(id);
+  }
+}
+
+Timer* TimerStore::get_timer(TimerID id)
+{
+  auto map_it = _timer_lookup_table.find(id);
+  return (map_it != _timer_lookup_table.end()) ? map_it->second : NULL;
 }
 
 /*****************************************************************************/
 /* Private functions.                                                        */
 /*****************************************************************************/
 
+// Record a tombstone so that it takes precedence over older versions of the
+// timer until it would have popped.  Only the timer's ID and precedence are
+// kept so the tombstone itself is freed.  A tombstone that replaces an
+// earlier one never shortens its life.
+void TimerStore::add_tombstone(Timer* t)
+{
+  // Round the expiry up to the next second.
+  uint64_t expiry = (t->next_pop_time() + 999) / 1000;
+  bool queued = false;
+
+  auto existing = _tombstone_table.find(t->id);
+  if (existing != _tombstone_table.end())
+  {
+    uint64_t old_expiry = existing->second.expiry;
+    expiry = std::max(expiry, old_expiry);
+
+    // If the existing record is due to be processed in the bucket for the
+    // new expiry, it's already queued there.
+    queued = ((old_expiry >= _tombstone_tick) &&
+              ((old_expiry % TOMBSTONE_WHEEL_NUM_BUCKETS) ==
+               (expiry % TOMBSTONE_WHEEL_NUM_BUCKETS)));
+  }
+
+  Tombstone& tombstone = _tombstone_table[t->id];
+  tombstone.start_time = t->start_time;
+  tombstone.sequence_number = t->sequence_number;
+  tombstone.expiry = expiry;
+
+  if (!queued)
+  {
+    // Make sure the tombstone is put in a bucket that has yet to be
+    // processed.
+    uint64_t bucket_time = std::max(expiry, _tombstone_tick);
+    _tombstone_wheel[bucket_time % TOMBSTONE_WHEEL_NUM_BUCKETS].push_back(t->id);
+  }
+
+  delete t;
+}
+
+// Process the tombstone wheel up to (and including) the given second.  If the
+// store has been idle for longer than a rotation of the wheel, every bucket is
+// processed once.
+void TimerStore::expire_tombstones(uint64_t now_s)
+{
+  if (now_s < _tombstone_tick)
+  {
+    return;
+  }
+
+  uint64_t num_ticks = std::min(now_s - _tombstone_tick + 1,
+                                (uint64_t)TOMBSTONE_WHEEL_NUM_BUCKETS);
+
+  for (uint64_t ii = 0; ii < num_ticks; ++ii)
+  {
+    size_t index = (_tombstone_tick + ii) % TOMBSTONE_WHEEL_NUM_BUCKETS;
+    std::vector<TimerID>& bucket = _tombstone_wheel[index];
+    std::vector<TimerID> remaining;
+
+    for (auto it = bucket.begin(); it != bucket.end(); ++it)
+    {
+      auto tombstone_it = _tombstone_table.find(*it);
+      if (tombstone_it == _tombstone_table.end())
+      {
+        // The tombstone has already been replaced by a live timer or expired.
+        continue;
+      }
+
+      uint32_t expiry = tombstone_it->second.expiry;
+      if (expiry <= now_s)
+      {
+        _tombstone_table.erase(tombstone_it);
+      }
+      else if ((expiry % TOMBSTONE_WHEEL_NUM_BUCKETS) == index)
+      {
+        // Expires on a later rotation of the wheel.  (If the tombstone has
+        // been replaced by a later one it's tracked by a different bucket.)
+        remaining.push_back(*it);
+      }
+    }
+
+    bucket.swap(remaining);
+  }
+
+  _tombstone_tick = now_s + 1;
+}
+
+// Returns whether a timer with the first start time and sequence number should
+// give way to a timer with the second.
+bool TimerStore::is_older(uint64_t start_time,
+                          uint32_t sequence_number,
+                          uint64_t other_start_time,
+                          uint32_t other_sequence_number)
+{
+  return ((start_time < other_start_time) ||
+          ((start_time == other_start_time) &&
+           (sequence_number < other_sequence_number)));
+}
+
+// Place a timer in the overdue bucket, timer wheels or heap, based on its next
+// pop time.  This doesn't add the timer to the lookup table.
+void TimerStore::insert_timer(Timer* t)
+{
+  // Work out where to store the timer (overdue bucket, short wheel, long wheel,
+  // or heap).
+  //
+  // Note that these if tests MUST use less than. For example if _tick_time is
+  // 20,330 a 1s timer will pop at 21,330. When in the short wheel the timer
+  // will live in bucket 33. But this is the bucket that is about to pop, so the
+  // timer must actually go in to the long wheel.  The same logic applies for
+  // the 1s buckets (where timers due to pop in >=1hr need to go into the heap).
+  uint64_t next_pop_time = t->next_pop_time();
+  Bucket* bucket;
+
+  if (next_pop_time < _tick_timestamp)
+  {
+    // The timer should have already popped so put it in the overdue timers,
+    // and warn the user.
+    //
+    // We can't just put the timer in the next bucket to pop.  We need to know
+    // what bucket to look in when deleting timers, and this is derived from
+    // the pop time. So if we put the timer in the wrong bucket we can't find
+    // it to delete it.
+    LOG_WARNING("Modifying timer after pop time (current time is %lu). "
+                "Window condition detected.\n" TIMER_LOG_FMT,
+                _tick_timestamp,
+                TIMER_LOG_PARAMS(t));
+    _overdue_timers.insert(t);
+  }
+  else if (to_short_wheel_resolution(next_pop_time) <
+           to_short_wheel_resolution(_tick_timestamp + SHORT_WHEEL_PERIOD_MS))
+  {
+
+    bucket = short_wheel_bucket(next_pop_time);
+    bucket->insert(t);
+  }
+  else if (to_long_wheel_resolution(next_pop_time) <
+           to_long_wheel_resolution(_tick_timestamp + LONG_WHEEL_PERIOD_MS))
+  {
+    bucket = long_wheel_bucket(next_pop_time);
+    bucket->insert(t);
+  }
+  else
+  {
+    // Timer is too far in the future to be handled by the wheels, put it in
+    // the extra heap.
+    LOG_WARNING("Adding timer to extra heap, consider re-building with a larger "
+                "LONG_WHEEL_NUM_BUCKETS constant");
+    _extra_heap.push_back(t);
+    std::push_heap(_extra_heap.begin(), _extra_heap.end());
+  }
+}
+
+// Remove a timer from the overdue bucket, timer wheels or heap.  This doesn't
+// remove the timer from the lookup table.
+void TimerStore::unlink_timer(Timer* timer)
+{
+  Bucket* bucket;
+  size_t num_erased;
+
+  // Delete the timer from the overdue buckets / timer wheels / heap. Try the
+  // overdue bucket first, then the short wheel then the long wheel, then
+  // finally the heap.
+  num_erased = _overdue_timers.erase(timer);
+
+  if (num_erased == 0)
+  {
+    bucket = short_wheel_bucket(timer);
+    num_erased = bucket->erase(timer);
+
+    if (num_erased == 0)
+    {
+      bucket = long_wheel_bucket(timer);
+      num_erased = bucket->erase(timer);
+
+      if (num_erased == 0)
+      {
+        std::vector<Timer*>::iterator heap_it;
+        heap_it = std::find(_extra_heap.begin(), _extra_heap.end(), timer);
+        if (heap_it != _extra_heap.end())
+        {
+          // Timer is in heap, remove it.
+          _extra_heap.erase(heap_it, heap_it + 1);
+          std::make_heap(_extra_heap.begin(), _extra_heap.end());
+        }
+        else
+        {
+          // We failed to remove the timer from any data structure.  Try and
+          // purge the timer from all the timer wheels (we're already sure
+          // that it's not in the heap).
+
+          // LCOV_EXCL_START
+          LOG_ERROR("Failed to remove timer consistently");
+          purge_timer_from_wheels(timer);
+
+          // Assert after purging, so we get a nice log detailing how the
+          // purge went.
+          assert(!"Failed to remove timer consistently");
+          // LCOV_EXCL_STOP
+        }
+      }
+    }
+  }
+}
+
 uint64_t TimerStore::wall_time_ms()
 {
   uint64_t wall_time;
@@ -296,7 +558,9 @@ void TimerStore::pop_bucket(TimerStore::Bucket* bucket,
 {
   for(auto it = bucket->begin(); it != bucket->end(); ++it)
   {
-    _timer_lookup_table.erase((*it)->id);
+    // Keep the timer's lookup table entry, marked as popped, so it can be
+    // reused when the timer is re-armed.
+    _timer_lookup_table[(*it)->id] = NULL;
     set.insert(*it);
   }
   bucket->clear();
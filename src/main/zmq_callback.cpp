@@ -0,0 +1,234 @@
+#include "zmq_callback.h"
+#include "log.h"
+
+#include <cstring>
+#include <time.h>
+#include <zmq.h>
+
+ZmqCallback::ZmqCallback(Replicator* replicator,
+                         Alarm* timer_pop_alarm) :
+  _q(),
+  _running(false),
+  _replicator(replicator),
+  _timer_pop_alarm(timer_pop_alarm),
+  _context(NULL),
+  _sockets()
+{
+  _context = zmq_ctx_new();
+}
+
+ZmqCallback::~ZmqCallback()
+{
+  if (_running)
+  {
+    stop();
+  }
+
+  zmq_ctx_destroy(_context);
+  _context = NULL;
+}
+
+void ZmqCallback::start(TimerHandler* handler)
+{
+  _handler = handler;
+  _running = true;
+
+  int thread_rc = pthread_create(&_worker_thread,
+                                 NULL,
+                                 ZmqCallback::worker_thread_entry_point,
+                                 (void*)this);
+  if (thread_rc != 0)
+  {
+    LOG_ERROR("Failed to start ZeroMQ callback thread: %s", strerror(thread_rc));
+  }
+}
+
+void ZmqCallback::stop()
+{
+  _q.terminate();
+  pthread_join(_worker_thread, NULL);
+  _running = false;
+}
+
+void ZmqCallback::perform(Timer* timer)
+{
+  _q.push(timer);
+}
+
+void* ZmqCallback::worker_thread_entry_point(void* arg)
+{
+  ZmqCallback* callback = (ZmqCallback*)arg;
+  callback->worker_thread_entry_point();
+  return NULL;
+}
+
+void ZmqCallback::worker_thread_entry_point()
+{
+  // Timers to return to the store, and when the oldest of them was added.
+  std::unordered_set<Timer*> rearm_batch;
+  uint64_t batch_start_ms = 0;
+
+  while (true)
+  {
+    Timer* timer = NULL;
+
+    if (rearm_batch.empty())
+    {
+      if (!_q.pop(timer))
+      {
+        break;
+      }
+    }
+    else
+    {
+      // Don't wait for more work while holding timers that need re-arming.
+      _q.pop(timer, 0);
+      if (timer == NULL)
+      {
+        rearm_timers(rearm_batch);
+        continue;
+      }
+    }
+
+    if (send(timer))
+    {
+      callback_succeeded(timer);
+
+      if (rearm_batch.empty())
+      {
+        batch_start_ms = monotonic_time_ms();
+      }
+      rearm_batch.insert(timer);
+
+      if ((rearm_batch.size() >= ZMQCALLBACK_REARM_BATCH_SIZE) ||
+          (monotonic_time_ms() >= batch_start_ms + ZMQCALLBACK_REARM_DELAY_MS))
+      {
+        rearm_timers(rearm_batch);
+      }
+    }
+    else
+    {
+      callback_failed(timer);
+    }
+  }
+
+  // Return any timers still waiting to be re-armed.
+  rearm_timers(rearm_batch);
+
+  // Tidy up the sockets.
+  for (auto it = _sockets.begin(); it != _sockets.end(); ++it)
+  {
+    zmq_close(it->second);
+  }
+  _sockets.clear();
+}
+
+/*****************************************************************************/
+/* Private functions.                                                        */
+/*****************************************************************************/
+
+// Queue the callback message for the timer's endpoint.  Returns false if the
+// message can't be queued (e.g. because too many messages are already queued
+// for the endpoint).
+bool ZmqCallback::send(Timer* timer)
+{
+  void* socket = get_socket(timer->callback_url());
+  if (socket == NULL)
+  {
+    return false;
+  }
+
+  std::string sequence_number = std::to_string(timer->sequence_number);
+  if ((zmq_send(socket,
+                sequence_number.data(),
+                sequence_number.length(),
+                ZMQ_SNDMORE | ZMQ_DONTWAIT) < 0) ||
+      (zmq_send(socket,
+                timer->callback_body().data(),
+                timer->callback_body().length(),
+                ZMQ_DONTWAIT) < 0))
+  {
+    LOG_WARNING("Failed to process callback for %lu: URI %s, ZeroMQ error was: %s",
+                timer->id,
+                timer->callback_url().c_str(),
+                zmq_strerror(zmq_errno()));
+    return false;
+  }
+
+  return true;
+}
+
+// Get the socket for an endpoint, connecting to it if this is the first
+// callback for the endpoint.  Returns NULL if the endpoint is invalid.
+void* ZmqCallback::get_socket(const std::string& uri)
+{
+  auto it = _sockets.find(uri);
+  if (it != _sockets.end())
+  {
+    return it->second;
+  }
+
+  void* socket = zmq_socket(_context, ZMQ_PUSH);
+  int linger = 0;
+  int hwm = ZMQCALLBACK_SEND_HWM;
+  zmq_setsockopt(socket, ZMQ_LINGER, &linger, sizeof(linger));
+  zmq_setsockopt(socket, ZMQ_SNDHWM, &hwm, sizeof(hwm));
+
+  if (zmq_connect(socket, uri.c_str()) != 0)
+  {
+    LOG_WARNING("Failed to connect to ZeroMQ callback endpoint %s: %s",
+                uri.c_str(),
+                zmq_strerror(zmq_errno()));
+    zmq_close(socket);
+    return NULL;
+  }
+
+  _sockets[uri] = socket;
+  return socket;
+}
+
+// Handle a successful callback, before the timer is re-armed.
+void ZmqCallback::callback_succeeded(Timer* timer)
+{
+  // Check if the next pop occurs before the repeat-for interval and,
+  // if not, convert to a tombstone to indicate the timer is dead.
+  if ((timer->sequence_number + 1) * timer->interval > timer->repeat_for)
+  {
+    timer->become_tombstone();
+  }
+  _replicator->replicate(timer);
+
+  if (_timer_pop_alarm)
+  {
+    _timer_pop_alarm->clear();
+  }
+}
+
+// Handle a failed callback.  This deletes the timer.
+void ZmqCallback::callback_failed(Timer* timer)
+{
+  if (_timer_pop_alarm && timer->is_last_replica())
+  {
+    _timer_pop_alarm->set();
+  }
+
+  _handler->release_timer(timer->id);
+  delete timer;
+}
+
+// Return a batch of timers to the store.  The batch is emptied, as the store
+// now owns the timers.
+void ZmqCallback::rearm_timers(std::unordered_set<Timer*>& timers)
+{
+  if (!timers.empty())
+  {
+    _handler->rearm_timers(timers);
+  }
+}
+
+uint64_t ZmqCallback::monotonic_time_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
@@ -9,6 +9,8 @@ class MockReplicator : public Replicator
 {
 public:
   MOCK_METHOD1(replicate, void(Timer*));
+  MOCK_METHOD1(replicate_timing, void(Timer*));
+  MOCK_METHOD1(replicate_bulk, void(const std::vector<Timer*>&));
 };
 
 #endif
@@ -11,7 +11,12 @@ public:
   MOCK_METHOD1(add_timer, void(Timer*));
   MOCK_METHOD1(add_timers, void(std::unordered_set<Timer*>&));
   MOCK_METHOD1(delete_timer, void(TimerID));
+  MOCK_METHOD5(update_timer, Timer*(TimerID, const TimerTiming&, const ReplicaSetPtr&, const ReplicaFilter&, bool&));
   MOCK_METHOD1(get_next_timers, void(std::unordered_set<Timer*>&));
+  MOCK_METHOD1(rearm_timer, void(Timer*));
+  MOCK_METHOD1(rearm_timers, void(std::unordered_set<Timer*>&));
+  MOCK_METHOD1(release_timer, void(TimerID));
+  MOCK_METHOD1(get_timer, Timer*(TimerID));
 };
 
 #endif
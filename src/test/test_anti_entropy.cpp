@@ -0,0 +1,76 @@
+#include "anti_entropy.h"
+#include "base.h"
+
+#include <gtest/gtest.h>
+
+class TestAntiEntropy : public Base
+{
+};
+
+TEST_F(TestAntiEntropy, Differing)
+{
+  std::vector<uint64_t> local;
+  local.push_back(1);
+  local.push_back(2);
+  local.push_back(3);
+  std::vector<uint64_t> remote;
+  remote.push_back(1);
+  remote.push_back(5);
+
+  // Missing hashes count as zeros.
+  std::vector<uint32_t> indexes;
+  AntiEntropy::differing(local, remote, 32, indexes);
+  ASSERT_EQ(2u, indexes.size());
+  EXPECT_EQ(33u, indexes[0]);
+  EXPECT_EQ(34u, indexes[1]);
+}
+
+TEST_F(TestAntiEntropy, NewerTimers)
+{
+  std::map<TimerID, uint64_t> local;
+  local[1] = 1000;
+  local[2] = 2000;
+  local[3] = 3000;
+  local[5] = 5000;
+  std::map<TimerID, uint64_t> remote;
+  remote[1] = 1000;
+  remote[2] = 1500;
+  remote[3] = 3500;
+  remote[4] = 4000;
+
+  // Only timers that the other node is missing, or has an older version of,
+  // are sent.
+  std::vector<TimerID> ids;
+  AntiEntropy::newer_timers(local, remote, ids);
+  ASSERT_EQ(2u, ids.size());
+  EXPECT_EQ(2u, ids[0]);
+  EXPECT_EQ(5u, ids[1]);
+}
+
+TEST_F(TestAntiEntropy, ParseDigest)
+{
+  std::vector<uint64_t> values;
+  EXPECT_TRUE(AntiEntropy::parse_digest("{\"hashes\": [0, 18446744073709551615]}",
+                                        "hashes",
+                                        values));
+  ASSERT_EQ(2u, values.size());
+  EXPECT_EQ(0u, values[0]);
+  EXPECT_EQ(18446744073709551615ULL, values[1]);
+
+  EXPECT_TRUE(AntiEntropy::parse_digest("{\"timers\": [[1, 1000], [2, 2000]]}",
+                                        "timers",
+                                        values));
+  ASSERT_EQ(4u, values.size());
+  EXPECT_EQ(2u, values[2]);
+  EXPECT_EQ(2000u, values[3]);
+
+  EXPECT_TRUE(AntiEntropy::parse_digest("{\"timers\": []}", "timers", values));
+  EXPECT_TRUE(values.empty());
+
+  // Invalid bodies.
+  EXPECT_FALSE(AntiEntropy::parse_digest("{\"hashes\": [1]}", "timers", values));
+  EXPECT_FALSE(AntiEntropy::parse_digest("{\"hashes\": [\"1\"]}", "hashes", values));
+  EXPECT_FALSE(AntiEntropy::parse_digest("{\"hashes\": [-1]}", "hashes", values));
+  EXPECT_FALSE(AntiEntropy::parse_digest("[1, 2]", "hashes", values));
+  EXPECT_FALSE(AntiEntropy::parse_digest("{\"hashes\": [1,", "hashes", values));
+}
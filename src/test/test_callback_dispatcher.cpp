@@ -0,0 +1,41 @@
+#include "callback_dispatcher.h"
+#include "mock_callback.h"
+#include "timer_helper.h"
+#include "base.h"
+
+#include <gtest/gtest.h>
+
+using ::testing::Return;
+
+class TestCallbackDispatcher : public Base
+{
+};
+
+TEST_F(TestCallbackDispatcher, DispatchByProtocol)
+{
+  MockCallback* http = new MockCallback();
+  MockCallback* zmq = new MockCallback();
+  EXPECT_CALL(*http, protocol()).WillRepeatedly(Return("http"));
+  EXPECT_CALL(*zmq, protocol()).WillRepeatedly(Return("zmq"));
+
+  CallbackDispatcher dispatcher;
+  dispatcher.add_callback(http);
+  dispatcher.add_callback(zmq);
+
+  Timer* http_timer = default_timer(1);
+  Timer* zmq_timer = default_timer(2);
+  zmq_timer->set_callback_protocol("zmq");
+
+  EXPECT_CALL(*http, perform(http_timer));
+  EXPECT_CALL(*zmq, perform(zmq_timer));
+  dispatcher.perform(http_timer);
+  dispatcher.perform(zmq_timer);
+
+  // Timers for protocols without a callback are dropped.
+  Timer* unknown_timer = default_timer(3);
+  unknown_timer->set_callback_protocol("smtp");
+  dispatcher.perform(unknown_timer);
+
+  delete http_timer;
+  delete zmq_timer;
+}
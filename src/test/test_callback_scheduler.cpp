@@ -0,0 +1,329 @@
+#include "callback_scheduler.h"
+#include "timer_helper.h"
+#include "base.h"
+#include "test_interposer.hpp"
+
+#include <gtest/gtest.h>
+
+class TestCallbackScheduler : public Base
+{
+protected:
+  virtual void SetUp()
+  {
+    Base::SetUp();
+    cwtest_completely_control_time();
+  }
+
+  virtual void TearDown()
+  {
+    cwtest_reset_time();
+    Base::TearDown();
+  }
+
+  // The origins the scheduler is keeping a record of.
+  size_t num_origins(CallbackScheduler& scheduler)
+  {
+    return scheduler._origins.size();
+  }
+
+  // A deadline the given time from now.
+  uint64_t in_ms(uint64_t ms)
+  {
+    return CallbackScheduler::wall_time_ms() + ms;
+  }
+};
+
+TEST_F(TestCallbackScheduler, EarliestDeadlineFirst)
+{
+  CallbackScheduler scheduler(10);
+  Timer* timer1 = default_timer(1);
+  Timer* timer2 = default_timer(2);
+  Timer* timer3 = default_timer(3);
+
+  scheduler.push("http://host1", timer1, in_ms(3000));
+  scheduler.push("http://host1", timer2, in_ms(1000));
+  scheduler.push("http://host1", timer3, in_ms(3000));
+
+  // Timers come out in deadline order, and in the order they were added if
+  // their deadlines are the same.
+  std::string origin;
+  Timer* timer;
+  std::vector<Timer*>* batch;
+  uint64_t deadline_ms;
+  bool expired;
+  EXPECT_TRUE(scheduler.pop(origin, timer, batch, deadline_ms, expired));
+  EXPECT_EQ("http://host1", origin);
+  EXPECT_EQ(timer2, timer);
+  EXPECT_EQ(in_ms(1000), deadline_ms);
+  EXPECT_TRUE(scheduler.try_pop(origin, timer, batch, deadline_ms, expired));
+  EXPECT_EQ(timer1, timer);
+  EXPECT_TRUE(scheduler.pop(origin, timer, batch, deadline_ms, expired));
+  EXPECT_EQ(timer3, timer);
+  EXPECT_FALSE(scheduler.try_pop(origin, timer, batch, deadline_ms, expired));
+
+  delete timer1;
+  delete timer2;
+  delete timer3;
+}
+
+TEST_F(TestCallbackScheduler, TakeOriginsInTurn)
+{
+  CallbackScheduler scheduler(10);
+  Timer* timers[4];
+  for (int ii = 0; ii < 4; ++ii)
+  {
+    timers[ii] = default_timer(ii + 1);
+  }
+
+  // Host 1's timers are all due before host 2's, but the hosts take turns.
+  scheduler.push("http://host1", timers[0], in_ms(1000));
+  scheduler.push("http://host1", timers[1], in_ms(1001));
+  scheduler.push("http://host2", timers[2], in_ms(2000));
+  scheduler.push("http://host2", timers[3], in_ms(2001));
+
+  std::string origin;
+  Timer* timer;
+  std::vector<Timer*>* batch;
+  uint64_t deadline_ms;
+  bool expired;
+  EXPECT_TRUE(scheduler.try_pop(origin, timer, batch, deadline_ms, expired));
+  EXPECT_EQ(timers[0], timer);
+  EXPECT_TRUE(scheduler.try_pop(origin, timer, batch, deadline_ms, expired));
+  EXPECT_EQ(timers[2], timer);
+  EXPECT_TRUE(scheduler.try_pop(origin, timer, batch, deadline_ms, expired));
+  EXPECT_EQ(timers[1], timer);
+  EXPECT_TRUE(scheduler.try_pop(origin, timer, batch, deadline_ms, expired));
+  EXPECT_EQ(timers[3], timer);
+
+  for (int ii = 0; ii < 4; ++ii)
+  {
+    delete timers[ii];
+  }
+}
+
+TEST_F(TestCallbackScheduler, Batches)
+{
+  CallbackScheduler scheduler(1);
+  Timer* timer1 = default_timer(1);
+  std::vector<Timer*>* batch1 = new std::vector<Timer*>(1, default_timer(2));
+
+  scheduler.push("http://host1", timer1, in_ms(2000));
+  scheduler.push("http://host1", batch1, in_ms(1000));
+
+  // A batch is scheduled by its deadline along with the single timers for
+  // its origin.
+  std::string origin;
+  Timer* timer;
+  std::vector<Timer*>* batch;
+  uint64_t deadline_ms;
+  bool expired;
+  EXPECT_TRUE(scheduler.try_pop(origin, timer, batch, deadline_ms, expired));
+  EXPECT_EQ("http://host1", origin);
+  EXPECT_EQ(NULL, timer);
+  EXPECT_EQ(batch1, batch);
+  EXPECT_EQ(in_ms(1000), deadline_ms);
+
+  // The batch counts against the origin's limit.
+  EXPECT_FALSE(scheduler.try_pop(origin, timer, batch, deadline_ms, expired));
+  scheduler.complete("http://host1", 10, true);
+  EXPECT_TRUE(scheduler.try_pop(origin, timer, batch, deadline_ms, expired));
+  EXPECT_EQ(timer1, timer);
+  EXPECT_EQ(NULL, batch);
+
+  delete timer1;
+  delete batch1->front();
+  delete batch1;
+}
+
+TEST_F(TestCallbackScheduler, AdaptiveLimit)
+{
+  CallbackScheduler scheduler(10);
+  std::vector<Timer*> timers;
+  for (int ii = 0; ii < 6; ++ii)
+  {
+    timers.push_back(default_timer(ii + 1));
+    scheduler.push("http://slow", timers.back(), in_ms(10000));
+  }
+  timers.push_back(default_timer(7));
+  scheduler.push("http://fast", timers.back(), in_ms(20000));
+
+  // Only the initial number of callbacks to the slow host can be in progress,
+  // but that doesn't hold up the fast host.
+  std::string origin;
+  Timer* timer;
+  std::vector<Timer*>* batch;
+  uint64_t deadline_ms;
+  bool expired;
+  int slow = 0;
+  int fast = 0;
+  while (scheduler.try_pop(origin, timer, batch, deadline_ms, expired))
+  {
+    (origin == "http://slow") ? slow++ : fast++;
+  }
+  EXPECT_EQ(CALLBACK_SCHEDULER_INITIAL_LIMIT, slow);
+  EXPECT_EQ(1, fast);
+
+  // A slow callback halves the limit.  The other callbacks that were in
+  // progress at the same time don't halve it again.
+  cwtest_advance_time_ms(1000);
+  scheduler.complete("http://slow", CALLBACK_SCHEDULER_LATENCY_TARGET_MS + 1, true);
+  EXPECT_EQ(CALLBACK_SCHEDULER_INITIAL_LIMIT / 2, scheduler.limit("http://slow"));
+  scheduler.complete("http://slow", 1000, false);
+  EXPECT_EQ(CALLBACK_SCHEDULER_INITIAL_LIMIT / 2, scheduler.limit("http://slow"));
+
+  // A failure of a callback sent since then halves it again, but it never
+  // drops below 1.
+  cwtest_advance_time_ms(10);
+  scheduler.complete("http://slow", 10, false);
+  EXPECT_EQ(CALLBACK_SCHEDULER_INITIAL_LIMIT / 4, scheduler.limit("http://slow"));
+  cwtest_advance_time_ms(10);
+  scheduler.complete("http://slow", 10, false);
+  EXPECT_EQ(1, scheduler.limit("http://slow"));
+
+  // With nothing in progress, one more callback can be sent.
+  EXPECT_TRUE(scheduler.try_pop(origin, timer, batch, deadline_ms, expired));
+  EXPECT_EQ("http://slow", origin);
+  EXPECT_FALSE(scheduler.try_pop(origin, timer, batch, deadline_ms, expired));
+
+  // Fast successes grow the limit by one per window of callbacks.
+  scheduler.complete("http://slow", 10, true);
+  EXPECT_EQ(2, scheduler.limit("http://slow"));
+
+  // Clean up the timers still queued.
+  while (scheduler.try_pop(origin, timer, batch, deadline_ms, expired))
+  {
+  }
+  for (auto it = timers.begin(); it != timers.end(); ++it)
+  {
+    delete *it;
+  }
+}
+
+TEST_F(TestCallbackScheduler, MissedDeadline)
+{
+  CallbackScheduler scheduler(1);
+  Timer* timers[3];
+  for (int ii = 0; ii < 3; ++ii)
+  {
+    timers[ii] = default_timer(ii + 1);
+  }
+  scheduler.push("http://host1", timers[0], in_ms(1000));
+  scheduler.push("http://host1", timers[1], in_ms(1000));
+  scheduler.push("http://host1", timers[2], in_ms(5000));
+
+  std::string origin;
+  Timer* timer;
+  std::vector<Timer*>* batch;
+  uint64_t deadline_ms;
+  bool expired;
+  EXPECT_TRUE(scheduler.try_pop(origin, timer, batch, deadline_ms, expired));
+  EXPECT_EQ(timers[0], timer);
+  EXPECT_FALSE(expired);
+
+  // The host is at its limit, but callbacks that have missed their deadline
+  // are still handed out, to be failed, and don't take up a slot.
+  cwtest_advance_time_ms(1000);
+  EXPECT_TRUE(scheduler.try_pop(origin, timer, batch, deadline_ms, expired));
+  EXPECT_EQ(timers[1], timer);
+  EXPECT_TRUE(expired);
+  EXPECT_FALSE(scheduler.try_pop(origin, timer, batch, deadline_ms, expired));
+
+  scheduler.complete("http://host1", 10, true);
+  EXPECT_TRUE(scheduler.try_pop(origin, timer, batch, deadline_ms, expired));
+  EXPECT_EQ(timers[2], timer);
+  EXPECT_FALSE(expired);
+
+  for (int ii = 0; ii < 3; ++ii)
+  {
+    delete timers[ii];
+  }
+}
+
+TEST_F(TestCallbackScheduler, QueueLimit)
+{
+  // The scheduler deletes the timers still queued when it's destroyed.
+  CallbackScheduler scheduler(10);
+  for (int ii = 0; ii < CALLBACK_SCHEDULER_MAX_QUEUED; ++ii)
+  {
+    EXPECT_TRUE(scheduler.push("http://host1", default_timer(ii + 1), in_ms(1000)));
+  }
+
+  // The host's queue is full, so its callbacks are refused (and stay with
+  // the caller), but other hosts' callbacks aren't.
+  Timer* timer1 = default_timer(CALLBACK_SCHEDULER_MAX_QUEUED + 1);
+  EXPECT_FALSE(scheduler.push("http://host1", timer1, in_ms(1000)));
+  std::vector<Timer*>* batch1 = new std::vector<Timer*>(1, timer1);
+  EXPECT_FALSE(scheduler.push("http://host1", batch1, in_ms(1000)));
+  delete batch1;
+  EXPECT_TRUE(scheduler.push("http://host2", timer1, in_ms(1000)));
+}
+
+TEST_F(TestCallbackScheduler, Abandon)
+{
+  CallbackScheduler scheduler(10);
+  Timer* timer1 = default_timer(1);
+  scheduler.push("http://host1", timer1, in_ms(1000));
+
+  std::string origin;
+  Timer* timer;
+  std::vector<Timer*>* batch;
+  uint64_t deadline_ms;
+  bool expired;
+  EXPECT_TRUE(scheduler.try_pop(origin, timer, batch, deadline_ms, expired));
+
+  // A callback that was never sent doesn't change the limit.
+  scheduler.abandon("http://host1");
+  EXPECT_EQ(CALLBACK_SCHEDULER_INITIAL_LIMIT, scheduler.limit("http://host1"));
+
+  // The origin is kept until it's been idle for a while.
+  EXPECT_EQ(1u, num_origins(scheduler));
+
+  delete timer1;
+}
+
+TEST_F(TestCallbackScheduler, ExpireIdleOrigins)
+{
+  CallbackScheduler scheduler(10);
+  Timer* timer1 = default_timer(1);
+  Timer* timer2 = default_timer(2);
+
+  // A failing origin keeps its lower limit while it has nothing to do.
+  scheduler.push("http://host1", timer1, in_ms(1000));
+  std::string origin;
+  Timer* timer;
+  std::vector<Timer*>* batch;
+  uint64_t deadline_ms;
+  bool expired;
+  EXPECT_TRUE(scheduler.try_pop(origin, timer, batch, deadline_ms, expired));
+  scheduler.complete("http://host1", 10, false);
+  EXPECT_EQ(CALLBACK_SCHEDULER_INITIAL_LIMIT / 2, scheduler.limit("http://host1"));
+  EXPECT_EQ(1u, num_origins(scheduler));
+
+  // Once it's been idle for long enough it's forgotten about.
+  cwtest_advance_time_ms(CALLBACK_SCHEDULER_IDLE_EXPIRY_MS);
+  scheduler.push("http://host2", timer2, in_ms(1000));
+  EXPECT_EQ(CALLBACK_SCHEDULER_INITIAL_LIMIT, scheduler.limit("http://host1"));
+  EXPECT_EQ(1u, num_origins(scheduler));
+
+  EXPECT_TRUE(scheduler.try_pop(origin, timer, batch, deadline_ms, expired));
+  delete timer1;
+  delete timer2;
+}
+
+TEST_F(TestCallbackScheduler, Terminate)
+{
+  CallbackScheduler scheduler(10);
+
+  // Once terminated, the scheduler stops handing out timers (and deletes any
+  // left in it).
+  scheduler.push("http://host1", default_timer(1), in_ms(1000));
+  scheduler.terminate();
+
+  std::string origin;
+  Timer* timer;
+  std::vector<Timer*>* batch;
+  uint64_t deadline_ms;
+  bool expired;
+  EXPECT_FALSE(scheduler.pop(origin, timer, batch, deadline_ms, expired));
+  EXPECT_FALSE(scheduler.try_pop(origin, timer, batch, deadline_ms, expired));
+}
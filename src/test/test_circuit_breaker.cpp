@@ -0,0 +1,46 @@
+#include "circuit_breaker.h"
+
+#include <gtest/gtest.h>
+
+TEST(TestCircuitBreaker, OpenAfterFailures)
+{
+  CircuitBreaker breaker(3, 60000);
+
+  // The circuit stays closed until enough requests in a row have failed.
+  breaker.record("http://10.0.0.1:7253", false);
+  breaker.record("http://10.0.0.1:7253", false);
+  breaker.record("http://10.0.0.1:7253", true);
+  breaker.record("http://10.0.0.1:7253", false);
+  breaker.record("http://10.0.0.1:7253", false);
+  EXPECT_FALSE(breaker.is_open("http://10.0.0.1:7253"));
+  EXPECT_TRUE(breaker.allow("http://10.0.0.1:7253"));
+
+  breaker.record("http://10.0.0.1:7253", false);
+  EXPECT_TRUE(breaker.is_open("http://10.0.0.1:7253"));
+  EXPECT_FALSE(breaker.allow("http://10.0.0.1:7253"));
+
+  // Other peers are unaffected.
+  EXPECT_TRUE(breaker.allow("http://10.0.0.2:7253"));
+}
+
+TEST(TestCircuitBreaker, Probe)
+{
+  CircuitBreaker breaker(1, 0);
+  breaker.record("http://10.0.0.1:7253", false);
+  EXPECT_TRUE(breaker.is_open("http://10.0.0.1:7253"));
+
+  // Once the probe interval has passed a single request is let through.
+  EXPECT_TRUE(breaker.allow("http://10.0.0.1:7253"));
+  EXPECT_FALSE(breaker.allow("http://10.0.0.1:7253"));
+
+  // If it fails, the circuit stays open until the next probe.
+  breaker.record("http://10.0.0.1:7253", false);
+  EXPECT_TRUE(breaker.is_open("http://10.0.0.1:7253"));
+  EXPECT_TRUE(breaker.allow("http://10.0.0.1:7253"));
+
+  // If it succeeds, the circuit closes.
+  breaker.record("http://10.0.0.1:7253", true);
+  EXPECT_FALSE(breaker.is_open("http://10.0.0.1:7253"));
+  EXPECT_TRUE(breaker.allow("http://10.0.0.1:7253"));
+  EXPECT_TRUE(breaker.allow("http://10.0.0.1:7253"));
+}
@@ -0,0 +1,241 @@
+#include "cluster_view.h"
+#include "murmur/MurmurHash3.h"
+
+#include <algorithm>
+#include <gtest/gtest.h>
+
+/*****************************************************************************/
+/* Test fixture                                                              */
+/*****************************************************************************/
+
+class TestClusterView : public ::testing::Test
+{
+protected:
+  virtual void SetUp()
+  {
+    std::vector<std::string> addresses;
+    std::map<std::string, uint64_t> hashes;
+    addresses.push_back("10.0.0.1");
+    addresses.push_back("10.0.0.2");
+    addresses.push_back("10.0.0.3");
+    hashes["10.0.0.1"] = 0x00010000010001;
+    hashes["10.0.0.2"] = 0x10001000001000;
+    hashes["10.0.0.3"] = 0x01000100000100;
+    view = new ClusterView("10.0.0.1", addresses, hashes);
+  }
+
+  virtual void TearDown()
+  {
+    delete view; view = NULL;
+  }
+
+  ClusterView* view;
+};
+
+/*****************************************************************************/
+/* Instance Functions                                                        */
+/*****************************************************************************/
+
+TEST_F(TestClusterView, Accessors)
+{
+  EXPECT_EQ("10.0.0.1", view->local_ip());
+  EXPECT_EQ(3, view->size());
+  EXPECT_EQ("10.0.0.3", view->address(2));
+  EXPECT_EQ(0x10001000001000, view->hash("10.0.0.2"));
+  EXPECT_EQ(0, view->hash("10.0.0.4"));
+}
+
+TEST_F(TestClusterView, MatchHash)
+{
+  std::vector<ClusterView::NodeIndex> nodes;
+
+  // The filter for nodes 1 and 3 (in config order).
+  view->match_hash(0x01010100010101, nodes);
+  ASSERT_EQ(2, nodes.size());
+  EXPECT_EQ(0, nodes[0]);
+  EXPECT_EQ(2, nodes[1]);
+
+  // Partial matches don't count.
+  nodes.clear();
+  view->match_hash(0x00010000000001, nodes);
+  EXPECT_TRUE(nodes.empty());
+}
+
+TEST_F(TestClusterView, Place)
+{
+  std::vector<ClusterView::NodeIndex> nodes;
+
+  // Replicas are consecutive nodes, wrapping round the cluster.
+  view->place(5, 2, nodes);
+  ASSERT_EQ(2, nodes.size());
+  EXPECT_EQ(2, nodes[0]);
+  EXPECT_EQ(0, nodes[1]);
+
+  // There can't be more replicas than nodes.
+  nodes.clear();
+  view->place(5, 5, nodes);
+  EXPECT_EQ(3, nodes.size());
+}
+
+/*****************************************************************************/
+/* Placement across cluster changes                                          */
+/*****************************************************************************/
+
+// Build a view of a cluster of `size` nodes.
+static ClusterView* cluster_of(int size,
+                               ClusterView::Placement placement,
+                               const std::map<std::string, double>& weights =
+                                              std::map<std::string, double>())
+{
+  std::vector<std::string> addresses;
+  std::map<std::string, uint64_t> hashes;
+  for (int ii = 0; ii < size; ++ii)
+  {
+    std::string address = "10.0.1." + std::to_string(ii + 1);
+    addresses.push_back(address);
+    hashes[address] = (uint64_t)1 << ii;
+  }
+  return new ClusterView(addresses[0], addresses, hashes, placement, weights);
+}
+
+// Place `num_timers` timers with `replication_factor` replicas on a cluster,
+// and again after scaling the cluster from `before` to `after` nodes.
+//
+// Returns the fraction of replicas that moved to a different node.  Also
+// counts the replication messages generated when each timer is next
+// refreshed (sent to the union of old and new replicas, since the timer's
+// replica hash still covers the old ones) and at steady state (just to the
+// new replicas), not counting the node that receives the refresh.
+static double scale(int before,
+                    int after,
+                    ClusterView::Placement placement,
+                    int num_timers,
+                    unsigned int replication_factor,
+                    uint64_t& scale_messages,
+                    uint64_t& steady_messages)
+{
+  ClusterView* old_view = cluster_of(before, placement);
+  ClusterView* new_view = cluster_of(after, placement);
+  uint64_t moved = 0;
+  scale_messages = 0;
+  steady_messages = 0;
+
+  for (int ii = 0; ii < num_timers; ++ii)
+  {
+    uint32_t hash;
+    MurmurHash3_x86_32(&ii, sizeof(ii), 0x0, &hash);
+
+    std::vector<ClusterView::NodeIndex> old_nodes;
+    std::vector<ClusterView::NodeIndex> new_nodes;
+    old_view->place(hash, replication_factor, old_nodes);
+    new_view->place(hash, replication_factor, new_nodes);
+
+    // Node indexes are stable when adding nodes at the end of the config.
+    size_t extra = 0;
+    for (auto it = old_nodes.begin(); it != old_nodes.end(); ++it)
+    {
+      if (std::find(new_nodes.begin(), new_nodes.end(), *it) == new_nodes.end())
+      {
+        ++extra;
+      }
+    }
+
+    moved += extra;
+    scale_messages += new_nodes.size() + extra - 1;
+    steady_messages += new_nodes.size() - 1;
+  }
+
+  delete old_view;
+  delete new_view;
+  return (double)moved / (num_timers * replication_factor);
+}
+
+TEST(TestClusterPlacement, RendezvousMinimisesMovement)
+{
+  uint64_t scale_messages;
+  uint64_t steady_messages;
+
+  // Adding a 5th node should move about a fifth of the replicas with
+  // rendezvous placement, but most of them with modulo placement.
+  double rendezvous = scale(4, 5, ClusterView::RENDEZVOUS, 10000, 2,
+                            scale_messages, steady_messages);
+  double modulo = scale(4, 5, ClusterView::MODULO, 10000, 2,
+                        scale_messages, steady_messages);
+  EXPECT_LT(rendezvous, 0.25);
+  EXPECT_GT(modulo, 0.5);
+}
+
+TEST(TestClusterPlacement, RendezvousIsStable)
+{
+  ClusterView* view = cluster_of(5, ClusterView::RENDEZVOUS);
+  std::vector<ClusterView::NodeIndex> nodes;
+  std::vector<ClusterView::NodeIndex> again;
+
+  // Placement is deterministic and picks distinct nodes.
+  view->place(1234, 3, nodes);
+  view->place(1234, 3, again);
+  ASSERT_EQ(3, nodes.size());
+  EXPECT_EQ(nodes, again);
+  EXPECT_NE(nodes[0], nodes[1]);
+  EXPECT_NE(nodes[1], nodes[2]);
+  EXPECT_NE(nodes[0], nodes[2]);
+
+  delete view;
+}
+
+TEST(TestClusterPlacement, RendezvousWeights)
+{
+  // Node 1 has twice the weight of the other 3 nodes, so should hold about
+  // 2/5 of the timers.
+  std::map<std::string, double> weights;
+  weights["10.0.1.1"] = 2.0;
+  ClusterView* view = cluster_of(4, ClusterView::RENDEZVOUS, weights);
+
+  int num_timers = 10000;
+  int on_node_1 = 0;
+  for (int ii = 0; ii < num_timers; ++ii)
+  {
+    uint32_t hash;
+    MurmurHash3_x86_32(&ii, sizeof(ii), 0x0, &hash);
+    std::vector<ClusterView::NodeIndex> nodes;
+    view->place(hash, 1, nodes);
+    on_node_1 += (nodes[0] == 0) ? 1 : 0;
+  }
+
+  EXPECT_NEAR(0.4, (double)on_node_1 / num_timers, 0.03);
+
+  delete view;
+}
+
+// Simulation of the replication messages generated as a cluster scales out
+// one node at a time, comparing the placement modes.  This is disabled by
+// default, run it with
+// --gtest_also_run_disabled_tests --gtest_filter=*ScaleOutSimulation.
+TEST(TestClusterPlacement, DISABLED_ScaleOutSimulation)
+{
+  const int num_timers = 100000;
+  const unsigned int replication_factor = 2;
+
+  for (int size = 2; size < 16; ++size)
+  {
+    for (int mode = 0; mode < 2; ++mode)
+    {
+      ClusterView::Placement placement = (mode == 0) ? ClusterView::MODULO :
+                                                       ClusterView::RENDEZVOUS;
+      uint64_t scale_messages;
+      uint64_t steady_messages;
+      double moved = scale(size, size + 1, placement, num_timers,
+                           replication_factor, scale_messages, steady_messages);
+
+      printf("%2d -> %2d nodes, %-10s: %5.1f%% of replicas moved, "
+             "%lu replication messages on refresh (%lu at steady state, +%.1f%%)\n",
+             size,
+             size + 1,
+             (mode == 0) ? "modulo" : "rendezvous",
+             moved * 100,
+             scale_messages,
+             steady_messages,
+             ((double)scale_messages / steady_messages - 1) * 100);
+    }
+  }
+}
@@ -0,0 +1,94 @@
+#include "connection_pool.h"
+#include "test_interposer.hpp"
+
+#include <gtest/gtest.h>
+
+class TestConnectionPool : public ::testing::Test
+{
+protected:
+  virtual void SetUp()
+  {
+    cwtest_completely_control_time();
+  }
+
+  virtual void TearDown()
+  {
+    cwtest_reset_time();
+  }
+
+  // The origins the pool is keeping a record of.
+  size_t num_origins(ConnectionPool& pool)
+  {
+    return pool._origins.size();
+  }
+
+  // The number of idle handles the pool holds for an origin.
+  size_t num_idle(ConnectionPool& pool, const std::string& origin)
+  {
+    auto it = pool._origins.find(origin);
+    return (it != pool._origins.end()) ? it->second.idle.size() : 0;
+  }
+};
+
+TEST_F(TestConnectionPool, Origin)
+{
+  EXPECT_EQ("http://10.0.0.1:80", ConnectionPool::origin("http://10.0.0.1:80/callback"));
+  EXPECT_EQ("http://10.0.0.1", ConnectionPool::origin("http://10.0.0.1"));
+  EXPECT_EQ("localhost:80", ConnectionPool::origin("localhost:80/callback1"));
+}
+
+TEST_F(TestConnectionPool, ReuseHandles)
+{
+  ConnectionPool pool(2, 60);
+
+  // Handles are only shared within an origin.
+  CURL* curl1 = pool.acquire("http://10.0.0.1:80");
+  CURL* curl2 = pool.acquire("http://10.0.0.2:80");
+  EXPECT_NE(curl1, curl2);
+
+  // A returned handle is reused for the next request to the same origin.
+  pool.release("http://10.0.0.1:80", curl1, true);
+  EXPECT_EQ(curl1, pool.acquire("http://10.0.0.1:80"));
+
+  // The pool can hand out as many handles as the limit allows.
+  CURL* curl3 = pool.acquire("http://10.0.0.1:80");
+  EXPECT_NE(curl1, curl3);
+
+  pool.release("http://10.0.0.1:80", curl1, true);
+  pool.release("http://10.0.0.1:80", curl3, false);
+  pool.release("http://10.0.0.2:80", curl2, true);
+}
+
+TEST_F(TestConnectionPool, AcquireTimeout)
+{
+  ConnectionPool pool(1, 60);
+
+  // Once the limit is reached, acquiring with a timeout gives up.
+  CURL* curl = pool.acquire("http://10.0.0.1:80", 10);
+  EXPECT_NE((CURL*)NULL, curl);
+  EXPECT_EQ(NULL, pool.acquire("http://10.0.0.1:80", 10));
+
+  pool.release("http://10.0.0.1:80", curl, true);
+  EXPECT_EQ(curl, pool.acquire("http://10.0.0.1:80", 10));
+  pool.release("http://10.0.0.1:80", curl, true);
+}
+
+TEST_F(TestConnectionPool, SweepIdleHandles)
+{
+  ConnectionPool pool(2, 60);
+
+  CURL* curl1 = pool.acquire("http://10.0.0.1:80");
+  CURL* curl2 = pool.acquire("http://10.0.0.2:80");
+  CURL* curl3 = pool.acquire("http://10.0.0.3:80");
+  pool.release("http://10.0.0.1:80", curl1, true);
+  pool.release("http://10.0.0.2:80", curl2, false);
+  EXPECT_EQ(1, num_idle(pool, "http://10.0.0.1:80"));
+
+  // Returning a handle after the keepalive period discards the idle handles
+  // for every origin, and forgets the origins with no handles left.
+  cwtest_advance_time_ms(61000);
+  pool.release("http://10.0.0.3:80", curl3, true);
+  EXPECT_EQ(0, num_idle(pool, "http://10.0.0.1:80"));
+  EXPECT_EQ(1, num_idle(pool, "http://10.0.0.3:80"));
+  EXPECT_EQ(1, num_origins(pool));
+}
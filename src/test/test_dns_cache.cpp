@@ -0,0 +1,96 @@
+#include "dns_cache.h"
+#include "test_interposer.hpp"
+
+#include <gtest/gtest.h>
+
+TEST(TestDnsCache, ParseURL)
+{
+  std::string host;
+  int port;
+
+  EXPECT_TRUE(DnsCache::parse_url("http://client.example.com:8080/callback", host, port));
+  EXPECT_EQ("client.example.com", host);
+  EXPECT_EQ(8080, port);
+
+  // The port defaults from the scheme, which defaults to HTTP.
+  EXPECT_TRUE(DnsCache::parse_url("https://client.example.com/callback", host, port));
+  EXPECT_EQ("client.example.com", host);
+  EXPECT_EQ(443, port);
+  EXPECT_TRUE(DnsCache::parse_url("localhost/callback", host, port));
+  EXPECT_EQ("localhost", host);
+  EXPECT_EQ(80, port);
+
+  EXPECT_TRUE(DnsCache::parse_url("http://[::1]:7253/timers", host, port));
+  EXPECT_EQ("[::1]", host);
+  EXPECT_EQ(7253, port);
+
+  EXPECT_FALSE(DnsCache::parse_url("http:///callback", host, port));
+}
+
+TEST(TestDnsCache, ResolveList)
+{
+  DnsCache cache;
+  cache.add("client.example.com", "10.0.0.1", 60);
+
+  // Cached hosts are resolved to their address, replacing any address cURL
+  // already has.
+  struct curl_slist* resolve = cache.resolve_list("http://client.example.com:8080/callback");
+  ASSERT_NE((struct curl_slist*)NULL, resolve);
+  EXPECT_STREQ("-client.example.com:8080", resolve->data);
+  ASSERT_NE((struct curl_slist*)NULL, resolve->next);
+  EXPECT_STREQ("client.example.com:8080:10.0.0.1", resolve->next->data);
+  EXPECT_EQ(NULL, resolve->next->next);
+  curl_slist_free_all(resolve);
+
+  // IP addresses aren't looked up.
+  EXPECT_EQ(NULL, cache.resolve_list("http://10.0.0.2:8080/callback"));
+  EXPECT_EQ(NULL, cache.resolve_list("http://[::1]:8080/callback"));
+}
+
+TEST(TestDnsCache, LookupDoesntBlock)
+{
+  DnsCache cache;
+  std::string address;
+
+  // A host that isn't cached is looked up in the background.  If that doesn't
+  // find it quickly, the request is left to resolve it itself.
+  EXPECT_FALSE(cache.lookup("client.invalid", address));
+  EXPECT_EQ(NULL, cache.resolve_list("http://client.invalid/callback"));
+
+  // Expired addresses are used until they've been looked up again.
+  cache.add("client.invalid", "10.0.0.1", 0);
+  EXPECT_TRUE(cache.lookup("client.invalid", address));
+  EXPECT_EQ("10.0.0.1", address);
+}
+
+TEST(TestDnsCache, HostsFile)
+{
+  DnsCache cache;
+
+  // Hosts in the hosts file are found without going to DNS, and a request
+  // for a host that isn't cached yet waits for it to be looked up.
+  struct curl_slist* resolve = cache.resolve_list("http://localhost:7253/timers");
+  ASSERT_NE((struct curl_slist*)NULL, resolve);
+  ASSERT_NE((struct curl_slist*)NULL, resolve->next);
+  EXPECT_STREQ("localhost:7253:127.0.0.1", resolve->next->data);
+  curl_slist_free_all(resolve);
+}
+
+TEST(TestDnsCache, ForgetUnusedHosts)
+{
+  cwtest_completely_control_time();
+  DnsCache cache;
+  std::string address;
+  cache.add("client1.invalid", "10.0.0.1", DNS_CACHE_IDLE_EXPIRY_S * 2);
+  cache.add("client2.invalid", "10.0.0.2", DNS_CACHE_IDLE_EXPIRY_S * 2);
+
+  // Hosts that are still being asked for are kept, even once the others have
+  // been forgotten.
+  cwtest_advance_time_ms((DNS_CACHE_IDLE_EXPIRY_S / 2) * 1000);
+  EXPECT_TRUE(cache.lookup("client1.invalid", address));
+  cwtest_advance_time_ms((DNS_CACHE_IDLE_EXPIRY_S / 2) * 1000);
+  EXPECT_TRUE(cache.lookup("client1.invalid", address));
+  EXPECT_FALSE(cache.lookup("client2.invalid", address));
+
+  cwtest_reset_time();
+}
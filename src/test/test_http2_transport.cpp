@@ -0,0 +1,266 @@
+#include "http2_transport.h"
+
+#include <gtest/gtest.h>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+// A minimal h2c server, just capable enough to answer requests sent with
+// prior knowledge.  It accepts a single connection and answers each request
+// on it with an empty 200 OK, until it has answered the given number of
+// requests.  Any other connection is left unanswered (and is recorded).
+class H2CServer
+{
+public:
+  H2CServer(int num_requests) :
+    _num_requests(num_requests),
+    _extra_connection(false)
+  {
+    _listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    bind(_listen_fd, (struct sockaddr*)&addr, sizeof(addr));
+    listen(_listen_fd, 8);
+
+    socklen_t len = sizeof(addr);
+    getsockname(_listen_fd, (struct sockaddr*)&addr, &len);
+    _port = ntohs(addr.sin_port);
+
+    pthread_create(&_thread, NULL, &H2CServer::thread_entry_point, this);
+  }
+
+  ~H2CServer()
+  {
+    close(_listen_fd);
+  }
+
+  // Wait for the client to finish with the server.
+  void wait()
+  {
+    pthread_join(_thread, NULL);
+  }
+
+  std::string url() const
+  {
+    return "http://127.0.0.1:" + std::to_string(_port) + "/callback";
+  }
+
+  // Whether another connection was made to the server while it was
+  // answering the requests.
+  bool extra_connection() const { return _extra_connection; }
+
+private:
+  static void* thread_entry_point(void* arg)
+  {
+    ((H2CServer*)arg)->run();
+    return NULL;
+  }
+
+  // Read exactly `len` bytes, giving up after a few seconds of silence.
+  static bool read_all(int fd, unsigned char* buf, size_t len)
+  {
+    while (len > 0)
+    {
+      struct pollfd pfd = { fd, POLLIN, 0 };
+      if (poll(&pfd, 1, 5000) <= 0)
+      {
+        return false;
+      }
+
+      ssize_t rc = read(fd, buf, len);
+      if (rc <= 0)
+      {
+        return false;
+      }
+      buf += rc;
+      len -= rc;
+    }
+    return true;
+  }
+
+  static void write_frame(int fd,
+                          unsigned char type,
+                          unsigned char flags,
+                          uint32_t stream,
+                          const std::string& payload)
+  {
+    unsigned char header[9] = { (unsigned char)(payload.length() >> 16),
+                                (unsigned char)(payload.length() >> 8),
+                                (unsigned char)payload.length(),
+                                type,
+                                flags,
+                                (unsigned char)(stream >> 24),
+                                (unsigned char)(stream >> 16),
+                                (unsigned char)(stream >> 8),
+                                (unsigned char)stream };
+    std::string frame((char*)header, sizeof(header));
+    frame.append(payload);
+    if (write(fd, frame.data(), frame.length()) < 0)
+    {
+      // The client has gone away, it'll see the request fail.
+    }
+  }
+
+  void run()
+  {
+    const int DATA = 0x0;
+    const int HEADERS = 0x1;
+    const int SETTINGS = 0x4;
+    const int END_STREAM = 0x1;
+    const int END_HEADERS = 0x4;
+    const int ACK = 0x1;
+
+    int fd = accept(_listen_fd, NULL, NULL);
+    if (fd < 0)
+    {
+      return;
+    }
+
+    // The client connection preface, which we answer with our (empty)
+    // settings.
+    unsigned char preface[24];
+    if (read_all(fd, preface, sizeof(preface)))
+    {
+      write_frame(fd, SETTINGS, 0, 0, "");
+    }
+
+    // Answer every request with an empty 200 OK (0x88 is ":status: 200" from
+    // the HPACK static table).
+    int answered = 0;
+    unsigned char header[9];
+    while ((answered < _num_requests) &&
+           (read_all(fd, header, sizeof(header))))
+    {
+      size_t length = (header[0] << 16) | (header[1] << 8) | header[2];
+      int type = header[3];
+      int flags = header[4];
+      uint32_t stream = ((header[5] & 0x7f) << 24) | (header[6] << 16) |
+                        (header[7] << 8) | header[8];
+
+      std::vector<unsigned char> payload(length + 1);
+      if (!read_all(fd, payload.data(), length))
+      {
+        break;
+      }
+
+      if ((type == SETTINGS) && !(flags & ACK))
+      {
+        write_frame(fd, SETTINGS, ACK, 0, "");
+      }
+      else if (((type == HEADERS) || (type == DATA)) && (flags & END_STREAM))
+      {
+        write_frame(fd, HEADERS, END_STREAM | END_HEADERS, stream, "\x88");
+        answered++;
+      }
+    }
+
+    // Check no other connection was opened for the requests.
+    fcntl(_listen_fd, F_SETFL, O_NONBLOCK);
+    int extra_fd = accept(_listen_fd, NULL, NULL);
+    if (extra_fd >= 0)
+    {
+      _extra_connection = true;
+      close(extra_fd);
+    }
+
+    // Wait for the client to close the connection.
+    unsigned char buf[1024];
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    while ((poll(&pfd, 1, 5000) > 0) && (read(fd, buf, sizeof(buf)) > 0))
+    {
+    }
+    close(fd);
+  }
+
+  int _num_requests;
+  bool _extra_connection;
+  int _listen_fd;
+  int _port;
+  pthread_t _thread;
+};
+
+// Requests are driven by the transport's thread and the result handed back to
+// the caller.
+TEST(TestHttp2Transport, RequestCompletes)
+{
+  Http2Transport transport;
+
+  CURL* curl = curl_easy_init();
+  curl_easy_setopt(curl, CURLOPT_URL, "http://127.0.0.1:1/callback");
+  EXPECT_EQ(CURLE_COULDNT_CONNECT, transport.perform(curl));
+
+  // The handle can be used again.
+  EXPECT_EQ(CURLE_COULDNT_CONNECT, transport.perform(curl));
+  curl_easy_cleanup(curl);
+}
+
+struct ConcurrentRequest
+{
+  Http2Transport* transport;
+  std::string url;
+  CURLcode rc;
+  long http_rc;
+};
+
+static void* send_request(void* arg)
+{
+  ConcurrentRequest* request = (ConcurrentRequest*)arg;
+  CURL* curl = curl_easy_init();
+  curl_easy_setopt(curl, CURLOPT_URL, request->url.c_str());
+  curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, 5000L);
+  request->rc = request->transport->perform(curl);
+  curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &request->http_rc);
+  curl_easy_cleanup(curl);
+  return NULL;
+}
+
+// Concurrent requests to an h2c server share one connection.
+TEST(TestHttp2Transport, MultiplexRequests)
+{
+  if (!Http2Transport::supported())
+  {
+    // The transport isn't used with this version of cURL.
+    return;
+  }
+
+  const int NUM_REQUESTS = 3;
+  H2CServer* server = new H2CServer(NUM_REQUESTS);
+  Http2Transport* transport = new Http2Transport();
+
+  ConcurrentRequest requests[NUM_REQUESTS];
+  pthread_t threads[NUM_REQUESTS];
+  for (int ii = 0; ii < NUM_REQUESTS; ++ii)
+  {
+    requests[ii].transport = transport;
+    requests[ii].url = server->url();
+    requests[ii].rc = CURLE_OK;
+    requests[ii].http_rc = 0;
+    pthread_create(&threads[ii], NULL, &send_request, &requests[ii]);
+  }
+
+  for (int ii = 0; ii < NUM_REQUESTS; ++ii)
+  {
+    pthread_join(threads[ii], NULL);
+    EXPECT_EQ(CURLE_OK, requests[ii].rc);
+    EXPECT_EQ(200, requests[ii].http_rc);
+  }
+
+  // Closing the transport closes its connection, which lets the server
+  // finish.
+  delete transport;
+  server->wait();
+  EXPECT_FALSE(server->extra_connection());
+  delete server;
+}
@@ -0,0 +1,123 @@
+#include "http_callback.h"
+#include "timer_helper.h"
+#include "base.h"
+
+#include <gtest/gtest.h>
+
+class TestHTTPCallback : public Base
+{
+};
+
+TEST_F(TestHTTPCallback, BatchJSON)
+{
+  std::vector<Timer*> timers;
+  timers.push_back(default_timer(1));
+  timers.push_back(default_timer(2));
+  timers[1]->sequence_number = 3;
+  timers[1]->set_callback_body("\"quoted\"");
+
+  EXPECT_EQ("[{\"sequence-number\":0,\"opaque\":\"stuff stuff stuff\"},"
+             "{\"sequence-number\":3,\"opaque\":\"\\\"quoted\\\"\"}]",
+            HTTPCallback::batch_json(timers));
+
+  delete timers[0];
+  delete timers[1];
+}
+
+TEST_F(TestHTTPCallback, ParseBatchResponse)
+{
+  std::vector<bool> succeeded(3, false);
+
+  // An empty response means everything succeeded.
+  EXPECT_TRUE(HTTPCallback::parse_batch_response("", succeeded));
+  EXPECT_EQ(std::vector<bool>(3, true), succeeded);
+
+  // Otherwise the failed items are listed.
+  EXPECT_TRUE(HTTPCallback::parse_batch_response("{\"failed\": [0, 2]}", succeeded));
+  EXPECT_FALSE(succeeded[0]);
+  EXPECT_TRUE(succeeded[1]);
+  EXPECT_FALSE(succeeded[2]);
+
+  EXPECT_TRUE(HTTPCallback::parse_batch_response("{\"failed\": []}", succeeded));
+  EXPECT_EQ(std::vector<bool>(3, true), succeeded);
+
+  // An invalid response fails everything.
+  EXPECT_FALSE(HTTPCallback::parse_batch_response("{\"failed\": [3]}", succeeded));
+  EXPECT_EQ(std::vector<bool>(3, false), succeeded);
+  EXPECT_FALSE(HTTPCallback::parse_batch_response("{\"failed\": [\"0\"]}", succeeded));
+  EXPECT_FALSE(HTTPCallback::parse_batch_response("not json", succeeded));
+  EXPECT_EQ(std::vector<bool>(3, false), succeeded);
+}
+
+TEST_F(TestHTTPCallback, ParseUnixURI)
+{
+  std::string socket_path;
+  std::string url;
+
+  EXPECT_TRUE(HTTPCallback::parse_unix_uri("unix:/var/run/client.sock:/callback", socket_path, url));
+  EXPECT_EQ("/var/run/client.sock", socket_path);
+  EXPECT_EQ("http://localhost/callback", url);
+
+  // The request path defaults to the root.
+  EXPECT_TRUE(HTTPCallback::parse_unix_uri("unix:/var/run/client.sock", socket_path, url));
+  EXPECT_EQ("/var/run/client.sock", socket_path);
+  EXPECT_EQ("http://localhost/", url);
+
+  EXPECT_FALSE(HTTPCallback::parse_unix_uri("http://localhost:80/callback", socket_path, url));
+}
+
+TEST_F(TestHTTPCallback, ApplyResponse)
+{
+  Timer* timer = default_timer(1);
+  timer->sequence_number = 1;
+  uint32_t interval = timer->interval;
+
+  // Empty, non-JSON and invalid responses leave the timer alone.
+  HTTPCallback::apply_response(timer, "", "");
+  HTTPCallback::apply_response(timer, "text/plain", "OK");
+  HTTPCallback::apply_response(timer, "", "[\"timing\"]");
+  HTTPCallback::apply_response(timer, "text/plain", "[{\"timing\": {\"interval\": 5}}]");
+  HTTPCallback::apply_response(timer, "application/json", "OK");
+  HTTPCallback::apply_response(timer, "", "{\"timing\": ");
+  EXPECT_EQ(1u, timer->sequence_number);
+  EXPECT_EQ(interval, timer->interval);
+
+  // JSON responses are recognised by their Content-Type...
+  HTTPCallback::apply_response(timer, "Application/JSON; charset=utf-8", " {\"timing\": {\"interval\": 3}}");
+  EXPECT_EQ(0u, timer->sequence_number);
+  EXPECT_EQ(3000u, timer->interval);
+
+  // ...or by being an object.  New timing restarts the timer.
+  timer->sequence_number = 1;
+  HTTPCallback::apply_response(timer, "text/plain", "{\"timing\": {\"interval\": 5}}");
+  EXPECT_EQ(0u, timer->sequence_number);
+  EXPECT_EQ(5000u, timer->interval);
+  EXPECT_EQ(5000u, timer->repeat_for);
+  EXPECT_FALSE(timer->is_tombstone());
+
+  // Cancelling the timer turns it into a tombstone.
+  HTTPCallback::apply_response(timer, "", "{\"cancel\": true}");
+  EXPECT_TRUE(timer->is_tombstone());
+
+  delete timer;
+}
+
+TEST_F(TestHTTPCallback, RequestTimeout)
+{
+  // Requests time out at their deadline, but late requests get a minimum
+  // time to complete.
+  EXPECT_EQ(1500, HTTPCallback::request_timeout_ms(11500, 10000));
+  EXPECT_EQ(HTTPCALLBACK_MIN_TIMEOUT_MS, HTTPCallback::request_timeout_ms(10100, 10000));
+  EXPECT_EQ(HTTPCALLBACK_MIN_TIMEOUT_MS, HTTPCallback::request_timeout_ms(9000, 10000));
+  EXPECT_EQ(HTTPCALLBACK_DEADLINE_MS, HTTPCallback::request_timeout_ms(20000, 10000));
+}
+
+TEST_F(TestHTTPCallback, CallbackDeadline)
+{
+  // The deadline is when the next replica pops the timer, 2s after the
+  // first pop (at 1000100ms).
+  Timer* timer = default_timer(1);
+  timer->sequence_number = 1;
+  EXPECT_EQ(1002100u, HTTPCallback::callback_deadline(timer));
+  delete timer;
+}
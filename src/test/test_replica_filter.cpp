@@ -0,0 +1,196 @@
+#include "replica_filter.h"
+#include "murmur/MurmurHash3.h"
+
+#include <gtest/gtest.h>
+
+/*****************************************************************************/
+/* Encoding                                                                  */
+/*****************************************************************************/
+
+TEST(TestReplicaFilter, LegacyNodeFilter)
+{
+  // The legacy node filter sets the bits picked by 3 128-bit hashes.
+  std::string address = "10.0.0.1";
+  uint64_t hash[2];
+  uint64_t expected = 0;
+  for (int ii = 0; ii < 3; ++ii)
+  {
+    MurmurHash3_x86_128(address.c_str(), address.length(), ii, (void*)hash);
+    expected |= ((uint64_t)1 << (hash[0] % 64));
+    expected |= ((uint64_t)1 << (hash[1] % 64));
+  }
+
+  ReplicaFilter filter = ReplicaFilter::for_node(address);
+  EXPECT_TRUE(filter.is_legacy());
+  EXPECT_EQ(expected, filter.low_word());
+}
+
+TEST(TestReplicaFilter, LegacyHex)
+{
+  ReplicaFilter filter(0x0010011000011001);
+  EXPECT_EQ("0010011000011001", filter.to_hex());
+
+  ReplicaFilter parsed;
+  EXPECT_TRUE(ReplicaFilter::from_hex("0010011000011001", parsed));
+  EXPECT_TRUE(parsed.is_legacy());
+  EXPECT_EQ(filter, parsed);
+}
+
+TEST(TestReplicaFilter, WideHex)
+{
+  ReplicaFilter filter = ReplicaFilter::for_node("10.0.0.1", 256, 8);
+  filter.add(ReplicaFilter::for_node("10.0.0.2", 256, 8));
+  std::string hex = filter.to_hex();
+  ASSERT_EQ(66, hex.length());
+  EXPECT_EQ("08", hex.substr(0, 2));
+
+  ReplicaFilter parsed;
+  EXPECT_TRUE(ReplicaFilter::from_hex(hex, parsed));
+  EXPECT_EQ(256, parsed.bits());
+  EXPECT_EQ(8, parsed.num_hashes());
+  EXPECT_EQ(filter, parsed);
+  EXPECT_TRUE(parsed.contains(ReplicaFilter::for_node("10.0.0.2", 256, 8)));
+
+  // 128-bit filters.
+  filter = ReplicaFilter::for_node("10.0.0.1", 128, 4);
+  EXPECT_EQ(34, filter.to_hex().length());
+  EXPECT_TRUE(ReplicaFilter::from_hex(filter.to_hex(), parsed));
+  EXPECT_EQ(filter, parsed);
+
+  // Invalid encodings.
+  EXPECT_FALSE(ReplicaFilter::from_hex("00" + std::string(32, '0'), parsed));
+  EXPECT_FALSE(ReplicaFilter::from_hex(std::string(20, '0'), parsed));
+}
+
+TEST(TestReplicaFilter, EveryValidFormatRoundTrips)
+{
+  // Every format accepted in the configuration must survive the trip through
+  // a timer URL, which only has room for 16, 34 or 66 hex digits.
+  int formats = 0;
+  for (int bits = 0; bits <= 320; ++bits)
+  {
+    for (int num_hashes = 0; num_hashes <= 256; ++num_hashes)
+    {
+      if (!ReplicaFilter::valid_format(bits, num_hashes))
+      {
+        continue;
+      }
+
+      formats++;
+      ReplicaFilter filter = ReplicaFilter::for_node("10.0.0.1", bits, num_hashes);
+      filter.add(ReplicaFilter::for_node("10.0.0.2", bits, num_hashes));
+      std::string hex = filter.to_hex();
+      EXPECT_TRUE((hex.length() == 16) ||
+                  (hex.length() == 34) ||
+                  (hex.length() == 66)) << bits << " bits, " << num_hashes << " hashes";
+
+      ReplicaFilter parsed;
+      ASSERT_TRUE(ReplicaFilter::from_hex(hex, parsed)) << hex;
+      EXPECT_EQ(bits, parsed.bits());
+      EXPECT_EQ(num_hashes, parsed.num_hashes());
+      EXPECT_EQ(filter, parsed) << hex;
+    }
+  }
+
+  // The legacy format, plus 255 numbers of hashes for each wider filter.
+  EXPECT_EQ(1 + (2 * 255), formats);
+
+  // 64-bit filters can't record a different number of hashes.
+  EXPECT_FALSE(ReplicaFilter::valid_format(64, 8));
+  EXPECT_FALSE(ReplicaFilter::valid_format(128, 0));
+  EXPECT_FALSE(ReplicaFilter::valid_format(192, 6));
+}
+
+TEST(TestReplicaFilter, Empty)
+{
+  ReplicaFilter filter(128, 4);
+  EXPECT_TRUE(filter.empty());
+  EXPECT_TRUE(ReplicaFilter(0).empty());
+  filter.add(ReplicaFilter::for_node("10.0.0.1", 128, 4));
+  EXPECT_FALSE(filter.empty());
+}
+
+/*****************************************************************************/
+/* False positives                                                           */
+/*****************************************************************************/
+
+// Work out the fraction of nodes wrongly matched by the filters of timers
+// with the given number of replicas in a cluster of the given size.
+static double false_positive_rate(int cluster_size,
+                                  int replication_factor,
+                                  int bits,
+                                  int num_hashes)
+{
+  std::vector<ReplicaFilter> nodes;
+  for (int ii = 0; ii < cluster_size; ++ii)
+  {
+    nodes.push_back(ReplicaFilter::for_node("10.0.1." + std::to_string(ii / 250) +
+                                            "." + std::to_string(ii % 250),
+                                            bits,
+                                            num_hashes));
+  }
+
+  // Try every run of consecutive nodes as the replicas.
+  int false_positives = 0;
+  int checks = 0;
+  for (int ii = 0; ii < cluster_size; ++ii)
+  {
+    ReplicaFilter filter(bits, num_hashes);
+    for (int jj = 0; jj < replication_factor; ++jj)
+    {
+      filter.add(nodes[(ii + jj) % cluster_size]);
+    }
+
+    for (int kk = replication_factor; kk < cluster_size; ++kk)
+    {
+      false_positives += filter.contains(nodes[(ii + kk) % cluster_size]) ? 1 : 0;
+      ++checks;
+    }
+  }
+
+  return (double)false_positives / checks;
+}
+
+TEST(TestReplicaFilter, WideFilterFalsePositives)
+{
+  // Wider filters give far fewer spurious extra replicas in large clusters.
+  double legacy = false_positive_rate(200, 4, 64, 6);
+  double wide = false_positive_rate(200, 4, 256, 6);
+  EXPECT_GT(legacy, 0.0);
+  EXPECT_LT(wide, legacy / 10);
+}
+
+// Measurement of the false positive rate of the replica filter (i.e. the
+// fraction of other nodes that get pointless replication requests for a
+// timer) as the cluster grows.  This is disabled by default, run it with
+// --gtest_also_run_disabled_tests --gtest_filter=*FalsePositiveMeasurement.
+TEST(TestReplicaFilter, DISABLED_FalsePositiveMeasurement)
+{
+  int formats[][2] = {{64, 6}, {128, 6}, {128, 10}, {256, 6}, {256, 12}};
+  int num_formats = sizeof(formats) / sizeof(formats[0]);
+
+  for (int replication_factor = 2; replication_factor <= 4; ++replication_factor)
+  {
+    printf("%d replicas, false positives per million checks\n", replication_factor);
+    printf("nodes");
+    for (int ff = 0; ff < num_formats; ++ff)
+    {
+      printf("  %3d bits/%2d hashes", formats[ff][0], formats[ff][1]);
+    }
+    printf("\n");
+
+    for (int size = 25; size <= 400; size *= 2)
+    {
+      printf("%5d", size);
+      for (int ff = 0; ff < num_formats; ++ff)
+      {
+        printf("  %18.1f",
+               false_positive_rate(size,
+                                   replication_factor,
+                                   formats[ff][0],
+                                   formats[ff][1]) * 1000000);
+      }
+      printf("\n");
+    }
+  }
+}
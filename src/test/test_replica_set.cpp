@@ -0,0 +1,94 @@
+#include "replica_set.h"
+
+#include <gtest/gtest.h>
+
+TEST(TestReplicaSet, InternNodes)
+{
+  NodeID id = NodeTable::intern("10.0.2.1");
+  EXPECT_EQ(id, NodeTable::intern("10.0.2.1"));
+  EXPECT_NE(id, NodeTable::intern("10.0.2.2"));
+  EXPECT_EQ("10.0.2.1", NodeTable::address(id));
+
+  // Finding an address doesn't intern it.
+  NodeID found;
+  EXPECT_TRUE(NodeTable::find("10.0.2.1", found));
+  EXPECT_EQ(id, found);
+  EXPECT_FALSE(NodeTable::find("10.0.2.99", found));
+  EXPECT_FALSE(NodeTable::find("10.0.2.99", found));
+}
+
+TEST(TestReplicaSet, SharedSets)
+{
+  std::vector<std::string> addresses;
+  addresses.push_back("10.0.2.1");
+  addresses.push_back("10.0.2.2");
+  NodeTable::intern("10.0.2.1");
+  NodeTable::intern("10.0.2.2");
+
+  // Equal replica sets are the same object.
+  ReplicaSetPtr set;
+  ASSERT_TRUE(ReplicaSet::find(addresses, set));
+  ReplicaSetPtr again;
+  ASSERT_TRUE(ReplicaSet::find(addresses, again));
+  EXPECT_EQ(set, again);
+  EXPECT_EQ(set, ReplicaSet::get(set->replicas()));
+
+  // But the order of the replicas and the extra replicas matter.
+  std::vector<NodeID> reversed(set->replicas().rbegin(), set->replicas().rend());
+  EXPECT_NE(set, ReplicaSet::get(reversed));
+  std::vector<NodeID> extra(1, NodeTable::intern("10.0.2.3"));
+  ReplicaSetPtr with_extra = ReplicaSet::get(set->replicas(), extra);
+  EXPECT_NE(set, with_extra);
+  EXPECT_EQ(extra, with_extra->extra_replicas());
+
+  EXPECT_EQ(addresses, set->addresses());
+  EXPECT_TRUE(ReplicaSet::empty_set()->empty());
+}
+
+TEST(TestReplicaSet, Membership)
+{
+  std::vector<std::string> addresses;
+  addresses.push_back("10.0.2.1");
+  addresses.push_back("10.0.2.2");
+  NodeTable::intern("10.0.2.1");
+  NodeTable::intern("10.0.2.2");
+  ReplicaSetPtr set;
+  ASSERT_TRUE(ReplicaSet::find(addresses, set));
+
+  EXPECT_EQ(0, set->index(NodeTable::intern("10.0.2.1")));
+  EXPECT_EQ(1, set->index(NodeTable::intern("10.0.2.2")));
+  EXPECT_EQ(2, set->index(NodeTable::intern("10.0.2.3")));
+  EXPECT_TRUE(set->contains(NodeTable::intern("10.0.2.2")));
+  EXPECT_FALSE(set->contains(NodeTable::intern("10.0.2.3")));
+}
+
+TEST(TestReplicaSet, UnknownAddresses)
+{
+  // Finding a set with an address that isn't a known node fails, and doesn't
+  // intern the address.
+  std::vector<std::string> addresses;
+  addresses.push_back("10.0.2.1");
+  addresses.push_back("10.0.2.98");
+  NodeTable::intern("10.0.2.1");
+  ReplicaSetPtr set;
+  EXPECT_FALSE(ReplicaSet::find(addresses, set));
+  EXPECT_EQ(nullptr, set);
+
+  NodeID id;
+  EXPECT_FALSE(NodeTable::find("10.0.2.98", id));
+}
+
+TEST(TestReplicaSet, UnusedSetsAreFreed)
+{
+  // Create and drop lots of replica sets, the sets that are still in use
+  // survive the table being swept.
+  ReplicaSetPtr kept = ReplicaSet::get(std::vector<NodeID>(1, 1));
+  std::weak_ptr<const ReplicaSet> dropped = ReplicaSet::get(std::vector<NodeID>(1, 2));
+  for (NodeID ii = 0; ii < 1000; ++ii)
+  {
+    ReplicaSet::get(std::vector<NodeID>(2, ii));
+  }
+
+  EXPECT_TRUE(dropped.expired());
+  EXPECT_EQ(kept, ReplicaSet::get(std::vector<NodeID>(1, 1)));
+}
@@ -0,0 +1,141 @@
+#include "replication_engine.h"
+#include "base.h"
+
+#include <gtest/gtest.h>
+
+class TestReplicationEngine : public Base
+{
+};
+
+static ReplicationRequest* request(const std::string& peer,
+                                   const std::string& path,
+                                   bool high_priority)
+{
+  ReplicationRequest* req = new ReplicationRequest();
+  req->method = "PUT";
+  req->url = peer + path;
+  req->peer = peer;
+  req->high_priority = high_priority;
+  return req;
+}
+
+TEST_F(TestReplicationEngine, ClientRequestsFirst)
+{
+  ReplicationEngine engine(0, 10, NULL);
+  engine.push(request("http://node1", "/timers/1", false));
+  engine.push(request("http://node1", "/timers/2", true));
+  engine.push(request("http://node1", "/timers/3", false));
+
+  // The request from a client jumps the queue, and the others are sent in
+  // order.
+  ReplicationRequest* req;
+  ASSERT_TRUE(engine.try_pop(req));
+  EXPECT_EQ("http://node1/timers/2", req->url);
+  engine.complete(req);
+  ASSERT_TRUE(engine.pop(req));
+  EXPECT_EQ("http://node1/timers/1", req->url);
+  engine.complete(req);
+  ASSERT_TRUE(engine.try_pop(req));
+  EXPECT_EQ("http://node1/timers/3", req->url);
+  engine.complete(req);
+  EXPECT_FALSE(engine.try_pop(req));
+}
+
+TEST_F(TestReplicationEngine, TakePeersInTurn)
+{
+  ReplicationEngine engine(0, 10, NULL);
+  engine.push(request("http://node1", "/timers/1", false));
+  engine.push(request("http://node1", "/timers/2", false));
+  engine.push(request("http://node2", "/timers/3", false));
+  engine.push(request("http://node2", "/timers/4", false));
+
+  // Node 1's requests were all queued first, but the nodes take turns.
+  std::vector<std::string> urls;
+  std::vector<ReplicationRequest*> reqs;
+  ReplicationRequest* req;
+  while (engine.try_pop(req))
+  {
+    urls.push_back(req->url);
+    reqs.push_back(req);
+  }
+
+  ASSERT_EQ(4u, urls.size());
+  EXPECT_EQ("http://node1/timers/1", urls[0]);
+  EXPECT_EQ("http://node2/timers/3", urls[1]);
+  EXPECT_EQ("http://node1/timers/2", urls[2]);
+  EXPECT_EQ("http://node2/timers/4", urls[3]);
+
+  for (auto it = reqs.begin(); it != reqs.end(); ++it)
+  {
+    engine.complete(*it);
+  }
+}
+
+TEST_F(TestReplicationEngine, MaxInFlightPerPeer)
+{
+  ReplicationEngine engine(0, 1, NULL);
+  engine.push(request("http://node1", "/timers/1", false));
+  engine.push(request("http://node1", "/timers/2", false));
+  engine.push(request("http://node2", "/timers/3", false));
+
+  // Only one request to each node is allowed at a time, so node 1's second
+  // request waits even though node 2 is idle.
+  ReplicationRequest* req1;
+  ReplicationRequest* req2;
+  ReplicationRequest* req;
+  ASSERT_TRUE(engine.try_pop(req1));
+  EXPECT_EQ("http://node1/timers/1", req1->url);
+  ASSERT_TRUE(engine.try_pop(req2));
+  EXPECT_EQ("http://node2/timers/3", req2->url);
+  EXPECT_FALSE(engine.try_pop(req));
+
+  // Completing node 1's request frees it up for the next one.
+  engine.complete(req1);
+  ASSERT_TRUE(engine.try_pop(req));
+  EXPECT_EQ("http://node1/timers/2", req->url);
+  engine.complete(req);
+  engine.complete(req2);
+}
+
+TEST_F(TestReplicationEngine, DropWhenFull)
+{
+  ReplicationEngine engine(0, REPLICATOR_MAX_QUEUED_PER_PEER + 1, NULL);
+  engine.push(request("http://node1", "/timers/low", false));
+  for (int ii = 1; ii < REPLICATOR_MAX_QUEUED_PER_PEER; ++ii)
+  {
+    engine.push(request("http://node1", "/timers/high", true));
+  }
+
+  // Once the queue is full, the request following a pop is dropped to make
+  // room for a client request.  With nothing left to drop, a new request
+  // following a pop is itself dropped.
+  engine.push(request("http://node1", "/timers/last", true));
+  engine.push(request("http://node1", "/timers/low", false));
+
+  ReplicationRequest* req;
+  std::vector<ReplicationRequest*> reqs;
+  while (engine.try_pop(req))
+  {
+    EXPECT_NE("http://node1/timers/low", req->url);
+    reqs.push_back(req);
+  }
+  ASSERT_EQ((size_t)REPLICATOR_MAX_QUEUED_PER_PEER, reqs.size());
+  EXPECT_EQ("http://node1/timers/last", reqs.back()->url);
+
+  for (auto it = reqs.begin(); it != reqs.end(); ++it)
+  {
+    engine.complete(*it);
+  }
+}
+
+TEST_F(TestReplicationEngine, Terminate)
+{
+  ReplicationEngine engine(0, 10, NULL);
+  engine.push(request("http://node1", "/timers/1", false));
+  engine.terminate();
+
+  // Nothing more is taken, and the queued request is freed by the engine.
+  ReplicationRequest* req;
+  EXPECT_FALSE(engine.pop(req));
+  EXPECT_FALSE(engine.try_pop(req));
+}
@@ -0,0 +1,70 @@
+#include "stream_callback.h"
+#include "timer_helper.h"
+#include "base.h"
+
+#include <gtest/gtest.h>
+
+class TestStreamCallback : public Base
+{
+};
+
+TEST_F(TestStreamCallback, RecordJSON)
+{
+  Timer* timer = default_timer(1);
+  timer->sequence_number = 3;
+  timer->set_callback_body("\"quoted\"");
+
+  EXPECT_EQ("{\"id\":7,\"sequence-number\":3,\"opaque\":\"\\\"quoted\\\"\"}\n",
+            StreamCallback::record_json(7, timer));
+
+  delete timer;
+}
+
+TEST_F(TestStreamCallback, ParseAck)
+{
+  uint64_t ack = 0;
+  std::set<uint64_t> failed;
+
+  EXPECT_TRUE(StreamCallback::parse_ack("{\"ack\": 12}", ack, failed));
+  EXPECT_EQ(12u, ack);
+  EXPECT_TRUE(failed.empty());
+
+  EXPECT_TRUE(StreamCallback::parse_ack("{\"ack\": 20, \"failed\": [14, 17]}", ack, failed));
+  EXPECT_EQ(20u, ack);
+  EXPECT_EQ(2u, failed.size());
+  EXPECT_EQ(1u, failed.count(14));
+  EXPECT_EQ(1u, failed.count(17));
+
+  // The acknowledged ID is required, and IDs must be numbers.
+  EXPECT_FALSE(StreamCallback::parse_ack("{\"failed\": [1]}", ack, failed));
+  EXPECT_FALSE(StreamCallback::parse_ack("{\"ack\": \"12\"}", ack, failed));
+  EXPECT_FALSE(StreamCallback::parse_ack("{\"ack\": 12, \"failed\": [\"1\"]}", ack, failed));
+  EXPECT_FALSE(StreamCallback::parse_ack("[12]", ack, failed));
+  EXPECT_FALSE(StreamCallback::parse_ack("not json", ack, failed));
+}
+
+TEST_F(TestStreamCallback, TimerRing)
+{
+  StreamCallback::TimerRing ring(2);
+  Timer* timer1 = default_timer(1);
+  Timer* timer2 = default_timer(2);
+  Timer* timer3 = default_timer(3);
+
+  EXPECT_TRUE(ring.empty());
+  EXPECT_EQ(NULL, ring.pop());
+
+  // Timers come out in the order they went in, and the ring wraps round.
+  EXPECT_TRUE(ring.push(timer1));
+  EXPECT_TRUE(ring.push(timer2));
+  EXPECT_FALSE(ring.push(timer3));
+  EXPECT_EQ(2u, ring.size());
+  EXPECT_EQ(timer1, ring.pop());
+  EXPECT_TRUE(ring.push(timer3));
+  EXPECT_EQ(timer2, ring.pop());
+  EXPECT_EQ(timer3, ring.pop());
+  EXPECT_TRUE(ring.empty());
+
+  delete timer1;
+  delete timer2;
+  delete timer3;
+}
@@ -1,6 +1,8 @@
 #include "timer.h"
 #include "globals.h"
 #include "base.h"
+#include "test_interposer.hpp"
+#include "rapidjson/document.h"
 
 #include <gtest/gtest.h>
 #include <map>
@@ -25,9 +27,11 @@ protected:
     t1 = new Timer(id, interval, repeat_for);
     t1->start_time = 1000000;
     t1->sequence_number = 0;
-    t1->replicas = replicas;
-    t1->callback_url = "http://localhost:80/callback";
-    t1->callback_body = "stuff stuff stuff";
+    ReplicaSetPtr replica_set;
+    ASSERT_TRUE(ReplicaSet::find(replicas, replica_set));
+    t1->set_replicas(replica_set);
+    t1->set_callback_url("http://localhost:80/callback");
+    t1->set_callback_body("stuff stuff stuff");
   }
 
   virtual void TearDown()
@@ -124,14 +128,14 @@ TEST_F(TestTimer, FromJSONTests)
   EXPECT_EQ("", err);
   EXPECT_FALSE(replicated);
   EXPECT_EQ(2, get_replication_factor(timer));
-  EXPECT_EQ(2, timer->replicas.size());
+  EXPECT_EQ(2, timer->replicas()->size());
   delete timer;
   timer = Timer::from_json(1, 0, default_repl_factor2, err, replicated);
   EXPECT_NE((void*)NULL, timer);
   EXPECT_EQ("", err);
   EXPECT_FALSE(replicated);
   EXPECT_EQ(2, get_replication_factor(timer));
-  EXPECT_EQ(2, timer->replicas.size());
+  EXPECT_EQ(2, timer->replicas()->size());
   delete timer;
 
   // If you do specify a replication-factor, use that.
@@ -140,7 +144,7 @@ TEST_F(TestTimer, FromJSONTests)
   EXPECT_EQ("", err);
   EXPECT_FALSE(replicated);
   EXPECT_EQ(3, get_replication_factor(timer));
-  EXPECT_EQ(3, timer->replicas.size());
+  EXPECT_EQ(3, timer->replicas()->size());
   delete timer;
 
   // Get the replicas from the bloom filter if given
@@ -174,6 +178,255 @@ TEST_F(TestTimer, FromJSONTests)
   delete timer;
 }
 
+TEST_F(TestTimer, FromJSONErrors)
+{
+  // Check that validation errors are reported in the same order as the nodes
+  // are checked, regardless of where they appear in the body.
+  std::map<std::string, std::string> errors;
+  errors["{\"callback\": {}}"] =
+    "Couldn't find the 'timing' node in the JSON";
+  errors["{\"timing\": {}}"] =
+    "Couldn't find the 'callback' node in the JSON";
+  errors["{\"callback\": {}, \"timing\": []}"] =
+    "timing should be an object";
+  errors["{\"callback\": {}, \"timing\": {\"repeat-for\": 10}}"] =
+    "Couldn't find 'interval' in 'timing'";
+  errors["{\"callback\": {}, \"timing\": {\"interval\": 5000000000}}"] =
+    "interval should be an integer";
+  errors["{\"callback\": {}, \"timing\": {\"interval\": 1, \"repeat-for\": 1.5}}"] =
+    "repeat-for should be an integer";
+  errors["{\"callback\": {}, \"timing\": {\"interval\": 1, \"start-time\": \"now\"}}"] =
+    "start-time should be an 64bit integer";
+  errors["{\"callback\": {\"http\": {}}, \"timing\": {\"interval\": 1}}"] =
+    "Couldn't find 'uri' in 'http'";
+  errors["{\"callback\": {\"http\": {\"uri\": \"localhost\"}}, \"timing\": {\"interval\": 1}}"] =
+    "Couldn't find 'opaque' in 'http'";
+  errors["{\"callback\": {\"http\": {\"opaque\": 1, \"uri\": 1}}, \"timing\": {\"interval\": 1}}"] =
+    "uri should be a string";
+  errors["{\"reliability\": {\"replicas\": [\"10.0.0.1\", 1]}, \"callback\": {\"http\": {\"uri\": \"localhost\", \"opaque\": \"\"}}, \"timing\": {\"interval\": 1}}"] =
+    "replica address should be a string";
+
+  for (auto it = errors.begin(); it != errors.end(); ++it)
+  {
+    std::string err;
+    bool replicated;
+    EXPECT_EQ((void*)NULL, Timer::from_json(1, 0, it->first, err, replicated)) << it->first;
+    EXPECT_EQ(it->second, err) << it->first;
+  }
+
+  // Repeated members use the first occurrence and unknown members (including
+  // nested ones) are ignored.
+  std::string err;
+  bool replicated;
+  Timer* timer = Timer::from_json(1, 0, "{\"timing\": { \"interval\": 100, \"interval\": \"x\", \"extra\": { \"interval\": 5 } }, \"callback\": { \"http\": { \"uri\": \"localhost\", \"opaque\": \"stuff\", \"extra\": [ {} ] }}, \"extra\": [1, {\"timing\": 2}]}", err, replicated);
+  ASSERT_NE((void*)NULL, timer) << err;
+  EXPECT_EQ(100000, timer->interval);
+  EXPECT_EQ("localhost", timer->callback_url());
+  EXPECT_EQ("stuff", timer->callback_body());
+  delete timer;
+}
+
+TEST_F(TestTimer, FromJSONArray)
+{
+  std::string timer1 = "{\"timing\": { \"interval\": 100 }, \"callback\": { \"http\": { \"uri\": \"localhost\", \"opaque\": \"one\" }}}";
+  std::string timer2 = "{\"timing\": { \"interval\": 200 }, \"callback\": { \"http\": { \"uri\": \"localhost\", \"opaque\": \"two\" }}, \"reliability\": { \"replication-factor\": 3 }}";
+  std::string invalid = "{\"timing\": { \"interval\": \"hello\" }, \"callback\": { \"http\": { \"uri\": \"localhost\", \"opaque\": \"two\" }}}";
+
+  std::string err;
+  std::vector<Timer*> timers;
+  std::vector<bool> replicated;
+
+  EXPECT_TRUE(Timer::from_json_array("[" + timer1 + ", " + timer2 + "]", timers, replicated, err));
+  EXPECT_EQ("", err);
+  ASSERT_EQ(2, timers.size());
+  EXPECT_FALSE(replicated[0]);
+  EXPECT_FALSE(replicated[1]);
+  EXPECT_NE(timers[0]->id, timers[1]->id);
+  EXPECT_EQ(100000, timers[0]->interval);
+  EXPECT_EQ("one", timers[0]->callback_body());
+  EXPECT_EQ(2, timers[0]->replicas()->size());
+  EXPECT_EQ(200000, timers[1]->interval);
+  EXPECT_EQ("two", timers[1]->callback_body());
+  EXPECT_EQ(3, timers[1]->replicas()->size());
+  delete timers[0];
+  delete timers[1];
+  timers.clear();
+  replicated.clear();
+
+  // Any invalid definition fails the whole request.
+  EXPECT_FALSE(Timer::from_json_array("[" + timer1 + ", " + invalid + "]", timers, replicated, err));
+  EXPECT_EQ("Timer 1: interval should be an integer", err);
+  EXPECT_TRUE(timers.empty());
+
+  EXPECT_FALSE(Timer::from_json_array("[" + timer1 + ", 7]", timers, replicated, err));
+  EXPECT_EQ("Timer 1: Couldn't find the 'timing' node in the JSON", err);
+  EXPECT_TRUE(timers.empty());
+
+  EXPECT_FALSE(Timer::from_json_array(timer1, timers, replicated, err));
+  EXPECT_EQ("Bulk request body should be an array of timers", err);
+
+  EXPECT_FALSE(Timer::from_json_array("[]", timers, replicated, err));
+  EXPECT_EQ("Bulk request body should contain at least one timer", err);
+
+  EXPECT_FALSE(Timer::from_json_array("[", timers, replicated, err));
+  EXPECT_TRUE(timers.empty());
+  EXPECT_TRUE(replicated.empty());
+}
+
+TEST_F(TestTimer, FromJSONArrayReplicas)
+{
+  // A bulk replication request carries the timers' IDs and replicas.
+  std::string timer1 = "{\"timing\": { \"interval\": 100 }, \"callback\": { \"http\": { \"uri\": \"localhost\", \"opaque\": \"one\" }}}";
+  std::string err;
+  std::vector<Timer*> timers;
+  std::vector<bool> replicated;
+
+  EXPECT_TRUE(Timer::from_json_array("[" + timer1 + ", " + t1->bulk_json() + "]", timers, replicated, err));
+  EXPECT_EQ("", err);
+  ASSERT_EQ(2, timers.size());
+  EXPECT_FALSE(replicated[0]);
+  EXPECT_TRUE(replicated[1]);
+  EXPECT_EQ(t1->id, timers[1]->id);
+  EXPECT_EQ(t1->to_json(), timers[1]->to_json());
+  delete timers[0];
+  delete timers[1];
+  timers.clear();
+  replicated.clear();
+
+  // The ID must be a full hex timer ID, and is only valid with replicas.
+  std::string bad_id = "{\"id\": \"12345\", \"timing\": { \"interval\": 100 }, \"callback\": { \"http\": { \"uri\": \"localhost\", \"opaque\": \"one\" }}, \"reliability\": { \"replicas\": [ \"10.0.0.1\" ]}}";
+  EXPECT_FALSE(Timer::from_json_array("[" + bad_id + "]", timers, replicated, err));
+  EXPECT_EQ("Timer 0: id should be a 16 digit hex string", err);
+
+  std::string no_replicas = "{\"id\": \"0000000000000001\", \"timing\": { \"interval\": 100 }, \"callback\": { \"http\": { \"uri\": \"localhost\", \"opaque\": \"one\" }}}";
+  EXPECT_FALSE(Timer::from_json_array("[" + timer1 + ", " + no_replicas + "]", timers, replicated, err));
+  EXPECT_EQ("Timer 1: id is only valid for a timer with replicas", err);
+  EXPECT_TRUE(timers.empty());
+  EXPECT_TRUE(replicated.empty());
+}
+
+TEST_F(TestTimer, TimingFromJSON)
+{
+  TimerTiming timing;
+  ReplicaSetPtr replicas;
+  std::string err;
+  bool replicated;
+
+  // A client update, timed from now.
+  cwtest_completely_control_time();
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  uint64_t now = (ts.tv_sec * 1000) + (ts.tv_nsec / (1000 * 1000));
+  EXPECT_TRUE(Timer::timing_from_json("{\"timing\": {\"interval\": 20}}", timing, replicas, err, replicated));
+  cwtest_reset_time();
+  EXPECT_FALSE(replicated);
+  EXPECT_TRUE(replicas->empty());
+  EXPECT_EQ(now, timing.start_time);
+  EXPECT_EQ(0, timing.sequence_number);
+  EXPECT_EQ(20000, timing.interval);
+  EXPECT_EQ(20000, timing.repeat_for);
+
+  // A replicated update round-trips the timer's timing.
+  t1->sequence_number = 3;
+  t1->interval = 100000;
+  t1->repeat_for = 200000;
+  EXPECT_EQ("{\"timing\":{\"start-time\":1000000,\"sequence-number\":3,\"interval\":100,\"repeat-for\":200},\"reliability\":{\"replicas\":[\"10.0.0.1\",\"10.0.0.2\"]}}", t1->timing_json());
+  EXPECT_TRUE(Timer::timing_from_json(t1->timing_json(), timing, replicas, err, replicated));
+  EXPECT_TRUE(replicated);
+  EXPECT_EQ(t1->replicas()->replicas(), replicas->replicas());
+  EXPECT_EQ(1000000, timing.start_time);
+  EXPECT_EQ(3, timing.sequence_number);
+  EXPECT_EQ(100000, timing.interval);
+  EXPECT_EQ(200000, timing.repeat_for);
+
+  // A client can't pass its update off as a replica by giving the
+  // sequence-number, only the replicas mark an update as replicated.
+  EXPECT_TRUE(Timer::timing_from_json("{\"timing\": {\"interval\": 20, \"start-time\": 1000000, \"sequence-number\": 3}}", timing, replicas, err, replicated));
+  EXPECT_FALSE(replicated);
+
+  // Errors are reported as for a full timer definition.
+  EXPECT_FALSE(Timer::timing_from_json("{\"callback\": {}}", timing, replicas, err, replicated));
+  EXPECT_EQ("Couldn't find the 'timing' node in the JSON", err);
+  EXPECT_FALSE(Timer::timing_from_json("{\"timing\": {\"repeat-for\": 20}}", timing, replicas, err, replicated));
+  EXPECT_EQ("Couldn't find 'interval' in 'timing'", err);
+  EXPECT_FALSE(Timer::timing_from_json("{\"timing\": {\"interval\": 0, \"repeat-for\": 20}}", timing, replicas, err, replicated));
+  EXPECT_EQ("Can't have a zero interval time with a non-zero (20) repeat-for time", err);
+
+  // Replicas that aren't nodes in the cluster are rejected.
+  EXPECT_FALSE(Timer::timing_from_json("{\"timing\": {\"interval\": 20}, \"reliability\": {\"replicas\": [\"10.0.0.1\", \"10.9.9.9\"]}}", timing, replicas, err, replicated));
+  EXPECT_EQ("Replicas should be nodes in the cluster", err);
+}
+
+// Replicated timers can only name nodes in the cluster as replicas, and the
+// unknown addresses aren't remembered.
+TEST_F(TestTimer, FromJSONUnknownReplicas)
+{
+  std::string err;
+  bool replicated;
+  EXPECT_EQ((void*)NULL, Timer::from_json(1, 0, "{\"timing\": {\"interval\": 100}, \"callback\": {\"http\": {\"uri\": \"localhost\", \"opaque\": \"stuff\"}}, \"reliability\": {\"replicas\": [\"10.0.0.1\", \"10.9.9.8\"]}}", err, replicated));
+  EXPECT_EQ("Replicas should be nodes in the cluster", err);
+
+  NodeID id;
+  EXPECT_FALSE(NodeTable::find("10.9.9.8", id));
+}
+
+// Microbenchmark comparing the SAX parser used by from_json against parsing
+// the same bodies into a DOM and looking up the members (as from_json used to
+// do).  This is disabled by default, run it with
+// --gtest_also_run_disabled_tests --gtest_filter=*FromJSONBenchmark.
+TEST_F(TestTimer, DISABLED_FromJSONBenchmark)
+{
+  const int iterations = 100000;
+  std::vector<std::string> bodies;
+
+  // A typical client request.
+  bodies.push_back("{\"timing\": { \"interval\": 30, \"repeat-for\": 3600 }, \"callback\": { \"http\": { \"uri\": \"http://sprout.example.com:9888/timers\", \"opaque\": \"{\\\"dialog_id\\\": \\\"a0d1e7f2c7-1234@10.0.0.1\\\", \\\"aor\\\": \\\"sip:6505550001@example.com\\\"}\" }}, \"reliability\": { \"replication-factor\": 2 }}");
+
+  // A typical replication request.
+  Timer* replica = new Timer(1, 30000, 3600000);
+  replica->set_replicas(t1->replicas());
+  replica->set_callback_url("http://sprout.example.com:9888/timers");
+  replica->set_callback_body("{\"dialog_id\": \"a0d1e7f2c7-1234@10.0.0.1\", \"aor\": \"sip:6505550001@example.com\"}");
+  bodies.push_back(replica->to_json());
+  delete replica;
+
+  for (auto it = bodies.begin(); it != bodies.end(); ++it)
+  {
+    struct timespec start;
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int ii = 0; ii < iterations; ++ii)
+    {
+      rapidjson::Document doc;
+      doc.Parse<0>(it->c_str());
+      rapidjson::Value& timing = doc["timing"];
+      rapidjson::Value& http = doc["callback"]["http"];
+      if (timing.HasMember("interval") && timing.HasMember("repeat-for") &&
+          http.HasMember("uri") && http.HasMember("opaque"))
+      {
+        std::string uri(http["uri"].GetString(), http["uri"].GetStringLength());
+        std::string opaque(http["opaque"].GetString(), http["opaque"].GetStringLength());
+      }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    uint64_t dom_ns = ((end.tv_sec - start.tv_sec) * 1000000000ULL) + end.tv_nsec - start.tv_nsec;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int ii = 0; ii < iterations; ++ii)
+    {
+      std::string err;
+      bool replicated;
+      delete Timer::from_json(1, 0, *it, err, replicated);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    uint64_t sax_ns = ((end.tv_sec - start.tv_sec) * 1000000000ULL) + end.tv_nsec - start.tv_nsec;
+
+    printf("%s\n  DOM: %lu ns/body, from_json: %lu ns/body\n",
+           it->c_str(), dom_ns / iterations, sax_ns / iterations);
+  }
+}
+
 // Utility thread function to test thread-safeness of the unique generation
 // algorithm.
 void* generate_ids(void* arg)
@@ -234,6 +487,38 @@ TEST_F(TestTimer, URL)
   EXPECT_EQ("http://hostname:9999/timers/00000001000000090010011000011001", t1->url("hostname"));
 }
 
+TEST_F(TestTimer, WideFilterURL)
+{
+  // Switch the cluster to 256-bit replica filters.
+  ClusterViewPtr legacy = __globals->get_cluster_view();
+  __globals->set_cluster_view(ClusterViewPtr(new ClusterView(legacy->local_ip(),
+                                                             legacy->addresses(),
+                                                             legacy->hashes(),
+                                                             ClusterView::MODULO,
+                                                             std::map<std::string, double>(),
+                                                             256,
+                                                             8)));
+
+  // The URL carries the hash count and the filter.
+  std::string url = t1->url();
+  ASSERT_EQ(std::string("/timers/").length() + 16 + 66, url.length());
+  EXPECT_EQ("/timers/000000010000000908", url.substr(0, 26));
+
+  // The replicas can be recovered from the filter.
+  ReplicaFilter filter;
+  ASSERT_TRUE(ReplicaFilter::from_hex(url.substr(24), filter));
+  std::vector<ClusterView::NodeIndex> nodes;
+  __globals->get_cluster_view()->match_hash(filter, nodes);
+  ASSERT_EQ(2, nodes.size());
+  EXPECT_EQ(0, nodes[0]);
+  EXPECT_EQ(1, nodes[1]);
+
+  // Legacy filters are still understood.
+  nodes.clear();
+  __globals->get_cluster_view()->match_hash(0x0010011000011001, nodes);
+  EXPECT_EQ(2, nodes.size());
+}
+
 TEST_F(TestTimer, ToJSON)
 {
   // Test this by rendering as JSON, then parsing back to a timer
@@ -248,9 +533,9 @@ TEST_F(TestTimer, ToJSON)
   Timer* t2 = new Timer(1, interval, repeat_for);
   t2->start_time = 1000000;
   t2->sequence_number = 0;
-  t2->replicas = t1->replicas;
-  t2->callback_url = "http://localhost:80/callback";
-  t2->callback_body = "{\"stuff\": \"stuff\"}";
+  t2->set_replicas(t1->replicas());
+  t2->set_callback_url("http://localhost:80/callback");
+  t2->set_callback_body("{\"stuff\": \"stuff\"}");
 
   std::string json = t2->to_json();
   std::string err;
@@ -266,17 +551,193 @@ TEST_F(TestTimer, ToJSON)
   EXPECT_EQ(t2->interval, t3->interval) << json;
   EXPECT_EQ(t2->repeat_for, t3->repeat_for) << json;
   EXPECT_EQ(2, get_replication_factor(t3)) << json;
-  EXPECT_EQ(t2->replicas, t3->replicas) << json;
-  EXPECT_EQ("http://localhost:80/callback", t3->callback_url) << json;
-  EXPECT_EQ("{\"stuff\": \"stuff\"}", t3->callback_body) << json;
+  EXPECT_EQ(t2->replicas(), t3->replicas()) << json;
+  EXPECT_EQ("http://localhost:80/callback", t3->callback_url()) << json;
+  EXPECT_EQ("{\"stuff\": \"stuff\"}", t3->callback_body()) << json;
+  delete t2;
+  delete t3;
+}
+
+TEST_F(TestTimer, SharedCallback)
+{
+  std::string json = "{\"timing\": { \"interval\": 100 }, \"callback\": { \"http\": { \"uri\": \"http://localhost:80/callback\", \"opaque\": \"stuff\" }}}";
+  std::string err;
+  bool replicated;
+  Timer* timer1 = Timer::from_json(1, 0, json, err, replicated);
+  Timer* timer2 = Timer::from_json(2, 0, json, err, replicated);
+  ASSERT_NE((void*)NULL, timer1);
+  ASSERT_NE((void*)NULL, timer2);
+
+  // Timers with the same callback URL share it.
+  EXPECT_EQ("http://localhost:80/callback", timer1->callback_url());
+  EXPECT_TRUE(timer1->callback_url().shares(timer2->callback_url()));
+  EXPECT_FALSE(timer1->callback_body().shares(timer2->callback_body()));
+
+  // Copies of a timer share the callback body.
+  Timer copy(*timer1);
+  EXPECT_TRUE(copy.callback_body().shares(timer1->callback_body()));
+
+  // Tombstones have an empty callback.
+  timer1->become_tombstone();
+  EXPECT_TRUE(timer1->is_tombstone());
+  EXPECT_EQ("stuff", copy.callback_body());
+
+  delete timer1;
+  delete timer2;
+}
+
+TEST_F(TestTimer, BatchCallback)
+{
+  std::string err;
+  bool replicated;
+
+  // Callbacks aren't batched by default.
+  std::string json = "{\"timing\": { \"interval\": 100 }, \"callback\": { \"http\": { \"uri\": \"http://localhost:80/callback\", \"opaque\": \"stuff\" }}}";
+  Timer* timer = Timer::from_json(1, 0, json, err, replicated);
+  ASSERT_NE((void*)NULL, timer);
+  EXPECT_FALSE(timer->callback_batch());
+  EXPECT_EQ(std::string::npos, timer->to_json().find("batch"));
+  delete timer;
+
+  json = "{\"timing\": { \"interval\": 100 }, \"callback\": { \"http\": { \"uri\": \"http://localhost:80/callback\", \"opaque\": \"stuff\", \"batch\": true }}}";
+  timer = Timer::from_json(1, 0, json, err, replicated);
+  ASSERT_NE((void*)NULL, timer);
+  EXPECT_TRUE(timer->callback_batch());
+
+  // The setting is replicated.
+  Timer* replica = Timer::from_json(1, 0, timer->to_json(), err, replicated);
+  ASSERT_NE((void*)NULL, replica);
+  EXPECT_TRUE(replica->callback_batch());
+  delete replica;
+  delete timer;
+
+  json = "{\"timing\": { \"interval\": 100 }, \"callback\": { \"http\": { \"uri\": \"http://localhost:80/callback\", \"opaque\": \"stuff\", \"batch\": 1 }}}";
+  EXPECT_EQ(NULL, Timer::from_json(1, 0, json, err, replicated));
+  EXPECT_EQ("batch should be a boolean", err);
+}
+
+TEST_F(TestTimer, ZmqCallback)
+{
+  std::string err;
+  bool replicated;
+
+  std::string json = "{\"timing\": { \"interval\": 100 }, \"callback\": { \"zmq\": { \"uri\": \"ipc:///tmp/callback\", \"opaque\": \"stuff\" }}}";
+  Timer* timer = Timer::from_json(1, 0, json, err, replicated);
+  ASSERT_NE((void*)NULL, timer) << err;
+  EXPECT_EQ("zmq", timer->callback_protocol());
+  EXPECT_EQ("ipc:///tmp/callback", timer->callback_url());
+  EXPECT_EQ("stuff", timer->callback_body());
+
+  // The protocol is replicated.
+  Timer* replica = Timer::from_json(1, 0, timer->to_json(), err, replicated);
+  ASSERT_NE((void*)NULL, replica) << err;
+  EXPECT_EQ("zmq", replica->callback_protocol());
+  delete replica;
+  delete timer;
+
+  // Errors refer to the protocol used.
+  json = "{\"timing\": { \"interval\": 100 }, \"callback\": { \"zmq\": { \"uri\": \"ipc:///tmp/callback\" }}}";
+  EXPECT_EQ(NULL, Timer::from_json(1, 0, json, err, replicated));
+  EXPECT_EQ("Couldn't find 'opaque' in 'zmq'", err);
+
+  // Unknown protocols are rejected.
+  json = "{\"timing\": { \"interval\": 100 }, \"callback\": { \"smtp\": { \"uri\": \"ipc:///tmp/callback\", \"opaque\": \"stuff\" }}}";
+  EXPECT_EQ(NULL, Timer::from_json(1, 0, json, err, replicated));
+  EXPECT_EQ("Couldn't find 'http' in 'callback'", err);
+
+  // HTTP is the default.
+  EXPECT_EQ("http", t1->callback_protocol());
+}
+
+TEST_F(TestTimer, StreamCallback)
+{
+  std::string err;
+  bool replicated;
+
+  std::string json = "{\"timing\": { \"interval\": 100 }, \"callback\": { \"stream\": { \"uri\": \"consumer1\", \"opaque\": \"stuff\" }}}";
+  Timer* timer = Timer::from_json(1, 0, json, err, replicated);
+  ASSERT_NE((void*)NULL, timer) << err;
+  EXPECT_EQ("stream", timer->callback_protocol());
+  EXPECT_EQ("consumer1", timer->callback_url());
+  EXPECT_EQ("stuff", timer->callback_body());
+  delete timer;
+}
+
+TEST_F(TestTimer, CallbackResponse)
+{
+  std::string err;
+  TimerTiming timing;
+  bool reschedule;
+  bool cancel;
+
+  EXPECT_TRUE(Timer::callback_response_from_json("{\"timing\": {\"interval\": 5, \"repeat-for\": 20}}", timing, reschedule, cancel, err)) << err;
+  EXPECT_TRUE(reschedule);
+  EXPECT_FALSE(cancel);
+  EXPECT_EQ(5000u, timing.interval);
+  EXPECT_EQ(20000u, timing.repeat_for);
+  EXPECT_EQ(0u, timing.sequence_number);
+
+  EXPECT_TRUE(Timer::callback_response_from_json("{\"cancel\": true}", timing, reschedule, cancel, err)) << err;
+  EXPECT_FALSE(reschedule);
+  EXPECT_TRUE(cancel);
+
+  // Other members are ignored.
+  EXPECT_TRUE(Timer::callback_response_from_json("{\"result\": \"ok\"}", timing, reschedule, cancel, err)) << err;
+  EXPECT_FALSE(reschedule);
+  EXPECT_FALSE(cancel);
+
+  EXPECT_FALSE(Timer::callback_response_from_json("{\"cancel\": \"yes\"}", timing, reschedule, cancel, err));
+  EXPECT_EQ("cancel should be a boolean", err);
+  EXPECT_FALSE(Timer::callback_response_from_json("{\"timing\": {}}", timing, reschedule, cancel, err));
+  EXPECT_EQ("Couldn't find 'interval' in 'timing'", err);
+  EXPECT_FALSE(Timer::callback_response_from_json("[]", timing, reschedule, cancel, err));
+  EXPECT_FALSE(Timer::callback_response_from_json("OK", timing, reschedule, cancel, err));
+}
+
+TEST_F(TestTimer, ToJSONAfterPop)
+{
+  // Rendering the timer again after it pops only changes the timing block.
+  Timer* t2 = new Timer(1, 1000, 3000);
+  t2->start_time = 1000000;
+  t2->set_replicas(t1->replicas());
+  t2->set_callback_url("http://localhost:80/callback");
+  t2->set_callback_body("stuff");
+
+  std::string first = t2->to_json();
+  t2->sequence_number++;
+  std::string second = t2->to_json();
+  EXPECT_EQ("{\"timing\":{\"start-time\":1000000,\"sequence-number\":1,\"interval\":1,\"repeat-for\":3},"
+            "\"callback\":{\"http\":{\"uri\":\"http://localhost:80/callback\",\"opaque\":\"stuff\"}},"
+            "\"reliability\":{\"replicas\":[\"10.0.0.1\",\"10.0.0.2\"]}}", second);
+  EXPECT_EQ(first.substr(first.find("\"callback\"")),
+            second.substr(second.find("\"callback\"")));
+
+  // Changing the callback or replicas changes the rendered blocks.
+  t2->set_callback_url("http://localhost:80/other");
+  t2->set_callback_batch(true);
+  t2->set_replicas(ReplicaSet::get(std::vector<NodeID>(1, NodeTable::intern("10.0.0.3"))));
+  EXPECT_EQ("{\"timing\":{\"start-time\":1000000,\"sequence-number\":1,\"interval\":1,\"repeat-for\":3},"
+            "\"callback\":{\"http\":{\"uri\":\"http://localhost:80/other\",\"opaque\":\"stuff\",\"batch\":true}},"
+            "\"reliability\":{\"replicas\":[\"10.0.0.3\"]}}", t2->to_json());
+
+  // Becoming a tombstone changes the callback.
+  t2->become_tombstone();
+  std::string json = t2->to_json();
+  std::string err;
+  bool replicated;
+  Timer* t3 = Timer::from_json(1, 0, json, err, replicated);
+  ASSERT_NE((void*)NULL, t3) << err;
+  EXPECT_TRUE(t3->is_tombstone()) << json;
+  EXPECT_EQ(1, t3->sequence_number) << json;
+
   delete t2;
   delete t3;
 }
 
 TEST_F(TestTimer, IsLocal)
 {
-  EXPECT_TRUE(t1->is_local("10.0.0.1"));
-  EXPECT_FALSE(t1->is_local("20.0.0.1"));
+  EXPECT_TRUE(t1->is_local(NodeTable::intern("10.0.0.1")));
+  EXPECT_FALSE(t1->is_local(NodeTable::intern("20.0.0.1")));
 }
 
 TEST_F(TestTimer, IsTombstone)
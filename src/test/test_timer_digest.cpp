@@ -0,0 +1,137 @@
+#include "timer_digest.h"
+#include "base.h"
+
+#include <gtest/gtest.h>
+
+class TestTimerDigest : public Base
+{
+protected:
+  virtual void SetUp()
+  {
+    Base::SetUp();
+
+    std::vector<std::string> ab;
+    ab.push_back("10.0.0.1");
+    ab.push_back("10.0.0.2");
+    ASSERT_TRUE(ReplicaSet::find(ab, replicas_ab));
+
+    std::vector<std::string> ac;
+    ac.push_back("10.0.0.1");
+    ac.push_back("10.0.0.3");
+    ASSERT_TRUE(ReplicaSet::find(ac, replicas_ac));
+
+    node_a = NodeTable::intern("10.0.0.1");
+    node_b = NodeTable::intern("10.0.0.2");
+    node_c = NodeTable::intern("10.0.0.3");
+  }
+
+  uint64_t root(const TimerDigest& digest, NodeID node)
+  {
+    std::vector<uint64_t> hashes;
+    digest.hashes(node, 0, 0, 1, hashes);
+    EXPECT_EQ(1u, hashes.size());
+    return hashes[0];
+  }
+
+  ReplicaSetPtr replicas_ab;
+  ReplicaSetPtr replicas_ac;
+  NodeID node_a;
+  NodeID node_b;
+  NodeID node_c;
+};
+
+TEST_F(TestTimerDigest, SameTimersSameRoot)
+{
+  TimerDigest digest1;
+  TimerDigest digest2;
+
+  // The order the timers are added in doesn't matter.
+  digest1.add(1, 1000, replicas_ab);
+  digest1.add(2, 2000, replicas_ab);
+  digest2.add(2, 2000, replicas_ab);
+  digest2.add(1, 1000, replicas_ab);
+  EXPECT_NE(0u, root(digest1, node_b));
+  EXPECT_EQ(root(digest1, node_b), root(digest2, node_b));
+
+  // A different version of a timer changes the root.
+  digest2.add(1, 1500, replicas_ab);
+  EXPECT_NE(root(digest1, node_b), root(digest2, node_b));
+
+  // Going back to the same version restores it.
+  digest2.add(1, 1000, replicas_ab);
+  EXPECT_EQ(root(digest1, node_b), root(digest2, node_b));
+}
+
+TEST_F(TestTimerDigest, Remove)
+{
+  TimerDigest digest;
+  digest.add(1, 1000, replicas_ab);
+  uint64_t one_timer = root(digest, node_b);
+  digest.add(2, 2000, replicas_ab);
+  digest.remove(2);
+  EXPECT_EQ(one_timer, root(digest, node_b));
+  digest.remove(1);
+  EXPECT_EQ(0u, root(digest, node_b));
+
+  // Removing an unknown timer does nothing.
+  digest.remove(3);
+  EXPECT_EQ(0u, root(digest, node_b));
+}
+
+TEST_F(TestTimerDigest, TreePerReplica)
+{
+  TimerDigest digest;
+  digest.add(1, 1000, replicas_ab);
+  digest.add(2, 2000, replicas_ac);
+
+  // Each node's tree only holds the timers it's a replica for.
+  std::map<TimerID, uint64_t> timers;
+  digest.timers(node_b, TimerDigest::leaf(1), timers);
+  ASSERT_EQ(1u, timers.size());
+  EXPECT_EQ(1000u, timers[1]);
+  digest.timers(node_b, TimerDigest::leaf(2), timers);
+  EXPECT_EQ(0u, timers.count(2));
+  digest.timers(node_c, TimerDigest::leaf(2), timers);
+  EXPECT_EQ(1u, timers.count(2));
+
+  // Moving a timer to other replicas moves it between the trees.
+  digest.add(1, 1000, replicas_ac);
+  EXPECT_EQ(0u, root(digest, node_b));
+  digest.timers(node_c, TimerDigest::leaf(1), timers);
+  EXPECT_EQ(1u, timers.count(1));
+}
+
+TEST_F(TestTimerDigest, Levels)
+{
+  TimerDigest digest;
+  for (TimerID id = 1; id <= 100; ++id)
+  {
+    digest.add(id, id * 1000, replicas_ab);
+  }
+
+  // Each level of the tree XORs to the root.
+  uint64_t expected = root(digest, node_b);
+  for (int level = 1; level <= TIMER_DIGEST_DEPTH; ++level)
+  {
+    std::vector<uint64_t> hashes;
+    digest.hashes(node_b, level, 0, TIMER_DIGEST_LEAVES, hashes);
+    ASSERT_EQ((size_t)(1 << level), hashes.size());
+
+    uint64_t combined = 0;
+    for (auto it = hashes.begin(); it != hashes.end(); ++it)
+    {
+      combined ^= *it;
+    }
+    EXPECT_EQ(expected, combined);
+  }
+
+  // Ranges are truncated at the end of the level, and nodes with no tree get
+  // zeros.
+  std::vector<uint64_t> hashes;
+  digest.hashes(node_b, 1, 1, 5, hashes);
+  EXPECT_EQ(1u, hashes.size());
+  digest.hashes(node_b, TIMER_DIGEST_DEPTH + 1, 0, 1, hashes);
+  EXPECT_TRUE(hashes.empty());
+  digest.hashes(NodeTable::intern("10.0.0.4"), 2, 0, 4, hashes);
+  EXPECT_EQ(std::vector<uint64_t>(4, 0), hashes);
+}
@@ -222,6 +222,101 @@ TEST_F(TestTimerHandler, AddTimer)
   delete timer;
 }
 
+TEST_F(TestTimerHandler, AddTimers)
+{
+  std::unordered_set<Timer*> timers;
+  timers.insert(default_timer(1));
+  timers.insert(default_timer(2));
+  std::unordered_set<Timer*> expected = timers;
+
+  EXPECT_CALL(*_store, get_next_timers(_)).
+                       WillOnce(SetArgReferee<0>(std::unordered_set<Timer*>())).
+                       WillOnce(SetArgReferee<0>(std::unordered_set<Timer*>()));
+  EXPECT_CALL(*_store, add_timers(expected)).Times(1);
+  _th = new TimerHandler(_store, _callback);
+  _cond()->block_till_waiting();
+
+  _th->add_timers(timers);
+  _cond()->block_till_waiting();
+
+  for (auto it = expected.begin(); it != expected.end(); ++it)
+  {
+    delete *it;
+  }
+}
+
+TEST_F(TestTimerHandler, UpdateTimer)
+{
+  Timer* stored = default_timer(1);
+  TimerTiming timing;
+
+  EXPECT_CALL(*_store, get_next_timers(_)).
+                       WillOnce(SetArgReferee<0>(std::unordered_set<Timer*>())).
+                       WillOnce(SetArgReferee<0>(std::unordered_set<Timer*>()));
+  EXPECT_CALL(*_store, update_timer(1, _, _, _, _)).
+                       WillOnce(DoAll(SetArgReferee<4>(false), Return(stored)));
+  EXPECT_CALL(*_store, update_timer(2, _, _, _, _)).
+                       WillOnce(DoAll(SetArgReferee<4>(true), Return((Timer*)NULL)));
+  _th = new TimerHandler(_store, _callback);
+  _cond()->block_till_waiting();
+
+  // The handler returns a copy of the updated timer, since the store still
+  // owns the original.
+  bool popping;
+  ReplicaSetPtr replicas = ReplicaSet::empty_set();
+  Timer* updated = _th->update_timer(1, timing, replicas, 0, popping);
+  ASSERT_NE((Timer*)NULL, updated);
+  EXPECT_NE(stored, updated);
+  EXPECT_EQ(1, updated->id);
+  EXPECT_FALSE(popping);
+  EXPECT_EQ(NULL, _th->update_timer(2, timing, replicas, 0, popping));
+  EXPECT_TRUE(popping);
+  _cond()->block_till_waiting();
+
+  delete updated;
+  delete stored;
+}
+
+// An update that moves the timer off this node (here a replicated update
+// with replicas that don't include this node) leaves a tombstone in the
+// store, but still returns the updated timer.
+TEST_F(TestTimerHandler, UpdateTimerNoLongerReplica)
+{
+  Timer* stored = default_timer(1);
+  std::vector<std::string> addresses;
+  addresses.push_back("10.0.0.2");
+  addresses.push_back("10.0.0.3");
+  ReplicaSetPtr replicas;
+  ASSERT_TRUE(ReplicaSet::find(addresses, replicas));
+  stored->set_replicas(replicas);
+  TimerTiming timing;
+  Timer* tombstone = NULL;
+
+  EXPECT_CALL(*_store, get_next_timers(_)).
+                       WillOnce(SetArgReferee<0>(std::unordered_set<Timer*>())).
+                       WillOnce(SetArgReferee<0>(std::unordered_set<Timer*>()));
+  EXPECT_CALL(*_store, update_timer(1, _, replicas, _, _)).
+                       WillOnce(DoAll(SetArgReferee<4>(false), Return(stored)));
+  EXPECT_CALL(*_store, add_timer(IsTombstone())).
+                       WillOnce(SaveArg<0>(&tombstone));
+  _th = new TimerHandler(_store, _callback);
+  _cond()->block_till_waiting();
+
+  bool popping;
+  Timer* updated = _th->update_timer(1, timing, replicas, 0, popping);
+  ASSERT_NE((Timer*)NULL, updated);
+  EXPECT_FALSE(updated->is_tombstone());
+  EXPECT_EQ(replicas, updated->replicas());
+  ASSERT_NE((Timer*)NULL, tombstone);
+  EXPECT_EQ(1, tombstone->id);
+  EXPECT_EQ(replicas, tombstone->replicas());
+  _cond()->block_till_waiting();
+
+  delete tombstone;
+  delete updated;
+  delete stored;
+}
+
 TEST_F(TestTimerHandler, LeakTest)
 {
   Timer* timer = default_timer(1);
@@ -2,8 +2,10 @@
 #include "timer_helper.h"
 #include "test_interposer.hpp"
 #include "base.h"
+#include "globals.h"
 
 #include <gtest/gtest.h>
+#include <algorithm>
 
 // The timer store has a granularity of 10ms. This means that timers may pop up
 // to 10ms late. As a result the timer store tests often add this granularity
@@ -59,6 +61,19 @@ protected:
     Base::TearDown();
   }
 
+  // Count the entries for a tombstone on the store's tombstone wheel.
+  size_t tombstone_wheel_entries(TimerID id)
+  {
+    size_t entries = 0;
+    for (int ii = 0; ii < TimerStore::TOMBSTONE_WHEEL_NUM_BUCKETS; ++ii)
+    {
+      entries += std::count(ts->_tombstone_wheel[ii].begin(),
+                            ts->_tombstone_wheel[ii].end(),
+                            id);
+    }
+    return entries;
+  }
+
   // Variables under test.
   TimerStore* ts;
   Timer* timers[3];
@@ -431,35 +446,84 @@ TEST_F(TestTimerStore, AddTombstone)
 {
   ts->add_timer(tombstone);
 
+  // The tombstone takes precedence over older versions of the timer.
+  ts->add_timer(timers[0]);
+
+  // Tombstones are never returned by the store.
   std::unordered_set<Timer*> next_timers;
   cwtest_advance_time_ms(1000000);
   ts->get_next_timers(next_timers);
-  EXPECT_EQ(1, next_timers.size());
+  EXPECT_TRUE(next_timers.empty());
 
-  delete timers[0];
   delete timers[1];
   delete timers[2];
-  delete tombstone;
 }
 
 TEST_F(TestTimerStore, OverwriteWithTombstone)
 {
+  Timer* old_timer = new Timer(*timers[0]);
   ts->add_timer(timers[0]);
   ts->add_timer(tombstone);
 
+  // Neither the timer nor the tombstone pop.
   std::unordered_set<Timer*> next_timers;
   cwtest_advance_time_ms(1000000);
   ts->get_next_timers(next_timers);
+  EXPECT_TRUE(next_timers.empty());
+
+  // The tombstone has now expired, so an old version of the timer can be
+  // added again.
+  ts->add_timer(old_timer);
+  ts->get_next_timers(next_timers);
   ASSERT_EQ(1, next_timers.size());
+  EXPECT_EQ(old_timer, *next_timers.begin());
 
-  Timer* extracted = *next_timers.begin();
-  EXPECT_TRUE(extracted->is_tombstone());
-  EXPECT_EQ(100, extracted->interval);
-  EXPECT_EQ(100, extracted->repeat_for);
+  delete old_timer;
+  delete timers[1];
+  delete timers[2];
+}
+
+TEST_F(TestTimerStore, ReplaceTombstone)
+{
+  // A more recent tombstone that would expire sooner doesn't shorten the life
+  // of the existing one (and isn't queued to expire a second time).
+  Timer* short_tombstone = Timer::create_tombstone(1, 0);
+  short_tombstone->start_time = tombstone->start_time + 1;
+  short_tombstone->interval = 1000;
+  ts->add_timer(tombstone);
+  ts->add_timer(short_tombstone);
+  EXPECT_EQ(1, tombstone_wheel_entries(1));
+
+  // After the shorter tombstone would have expired, an old version of the
+  // timer is still rejected.
+  std::unordered_set<Timer*> next_timers;
+  cwtest_advance_time_ms(5000);
+  ts->get_next_timers(next_timers);
+  ts->add_timer(timers[0]);
+  cwtest_advance_time_ms(100);
+  ts->get_next_timers(next_timers);
+  EXPECT_TRUE(next_timers.empty());
 
   delete timers[1];
   delete timers[2];
-  delete tombstone;
+}
+
+TEST_F(TestTimerStore, OverwriteTombstone)
+{
+  // A more recent version of the timer replaces the tombstone.
+  timers[0]->start_time = tombstone->start_time + 1;
+  ts->add_timer(tombstone);
+  ts->add_timer(timers[0]);
+
+  std::unordered_set<Timer*> next_timers;
+  cwtest_advance_time_ms(200);
+  ts->get_next_timers(next_timers);
+  ASSERT_EQ(1, next_timers.size());
+  EXPECT_EQ(timers[0], *next_timers.begin());
+
+  delete timers[0];
+  delete timers[1];
+  delete timers[2];
 }
 
 // Test for issue #19, even if time is moving in non-10ms steps
@@ -489,11 +553,11 @@ TEST_F(TestTimerStore, Non10msShortTimerUpdate)
   ts->get_next_timers(next_timers);
   EXPECT_EQ(0, next_timers.size());
 
-  // Move on till the tombstone should pop (50 ms offset from timer[0])
+  // Move on past the timer's pop time.  The timer was replaced so doesn't
+  // pop, and tombstones are never returned by the store.
   cwtest_advance_time_ms(150 + TIMER_GRANULARITY_MS);
   ts->get_next_timers(next_timers);
-  EXPECT_EQ(1, next_timers.size());
-  next_timers.clear();
+  EXPECT_EQ(0, next_timers.size());
 
   // Move on again to ensure there are no more timers in the store.
   cwtest_advance_time_ms(100000);
@@ -503,7 +567,6 @@ TEST_F(TestTimerStore, Non10msShortTimerUpdate)
   // timer[0] was deleted when it was updated in the timer store.
   delete timers[1];
   delete timers[2];
-  delete tombstone;
 }
 
 // Test for issue #19
@@ -533,11 +596,11 @@ TEST_F(TestTimerStore, Non10msMediumTimerUpdate)
   ts->get_next_timers(next_timers);
   EXPECT_EQ(0, next_timers.size());
 
-  // Move on till the timer should pop
+  // Move on past the timer's pop time.  The timer was replaced so doesn't
+  // pop, and tombstones are never returned by the store.
   cwtest_advance_time_ms(100000);
   ts->get_next_timers(next_timers);
-  EXPECT_EQ(1, next_timers.size());
-  next_timers.clear();
+  EXPECT_EQ(0, next_timers.size());
 
   // Move on again to ensure there are no more timers in the store.
   cwtest_advance_time_ms(100000);
@@ -547,7 +610,6 @@ TEST_F(TestTimerStore, Non10msMediumTimerUpdate)
   // timer[1] was deleted when it was updated in the timer store.
   delete timers[0];
   delete timers[2];
-  delete tombstone;
 }
 
 TEST_F(TestTimerStore, MixtureOfTimerLengths)
@@ -653,3 +715,260 @@ TEST_F(TestTimerStore, DeleteOverdueTimer)
   delete timers[2];
   delete tombstone;
 }
+
+TEST_F(TestTimerStore, UpdateTimerTiming)
+{
+  ts->add_timer(timers[0]);
+
+  // Move timer one from the short wheel out to 2 seconds.
+  TimerTiming timing;
+  timing.start_time = timers[0]->start_time + 1;
+  timing.sequence_number = 0;
+  timing.interval = 2000;
+  timing.repeat_for = 2000;
+  bool popping;
+  Timer* updated = ts->update_timer(1, timing, ReplicaSet::empty_set(), 0, popping);
+  ASSERT_EQ(timers[0], updated);
+  EXPECT_FALSE(popping);
+  EXPECT_EQ(2000, updated->interval);
+
+  // The timer no longer pops at its original time.
+  std::unordered_set<Timer*> next_timers;
+  cwtest_advance_time_ms(100 + TIMER_GRANULARITY_MS);
+  ts->get_next_timers(next_timers);
+  EXPECT_TRUE(next_timers.empty());
+
+  // But does pop at its new time.
+  cwtest_advance_time_ms(2000);
+  ts->get_next_timers(next_timers);
+  ASSERT_EQ(1, next_timers.size());
+  EXPECT_EQ(timers[0], *next_timers.begin());
+
+  delete timers[0];
+  delete timers[1];
+  delete timers[2];
+  delete tombstone;
+}
+
+TEST_F(TestTimerStore, UpdateTimerReplicas)
+{
+  ts->add_timer(timers[0]);
+
+  TimerTiming timing;
+  timing.start_time = timers[0]->start_time + 1;
+  timing.sequence_number = 0;
+  timing.interval = 100;
+  timing.repeat_for = 100;
+
+  // A replicated update brings the timer's replicas with it.
+  std::vector<std::string> addresses;
+  addresses.push_back("10.0.0.2");
+  addresses.push_back("10.0.0.1");
+  ReplicaSetPtr replicas;
+  ASSERT_TRUE(ReplicaSet::find(addresses, replicas));
+  bool popping;
+  Timer* updated = ts->update_timer(1, timing, replicas, 0, popping);
+  ASSERT_EQ(timers[0], updated);
+  EXPECT_EQ(replicas, updated->replicas());
+
+  // An update from a client works the replicas out again from the replica
+  // hash, as for a new timer.  (This timer has no replication factor, so
+  // takes it from the hash.)
+  timing.start_time++;
+  NodeID node;
+  ASSERT_TRUE(NodeTable::find("10.0.0.3", node));
+  ReplicaFilter hash = __globals->get_cluster_view()->filter(node);
+  updated = ts->update_timer(1, timing, ReplicaSet::empty_set(), hash, popping);
+  ASSERT_EQ(timers[0], updated);
+  EXPECT_NE(replicas, updated->replicas());
+  EXPECT_EQ(1, updated->replicas()->size());
+  EXPECT_TRUE(updated->replicas()->contains(node) ||
+              (updated->replicas()->extra_replicas() == std::vector<NodeID>(1, node)));
+
+  delete timers[1];
+  delete timers[2];
+  delete tombstone;
+}
+
+TEST_F(TestTimerStore, DontUpdateTimerTiming)
+{
+  TimerTiming timing;
+  timing.start_time = timers[0]->start_time;
+  timing.sequence_number = 0;
+  timing.interval = 2000;
+  timing.repeat_for = 2000;
+
+  // No such timer.
+  bool popping;
+  EXPECT_EQ(NULL, ts->update_timer(1, timing, ReplicaSet::empty_set(), 0, popping));
+  EXPECT_FALSE(popping);
+
+  // The stored timer is more recent than the update.
+  timers[0]->sequence_number++;
+  ts->add_timer(timers[0]);
+  EXPECT_EQ(NULL, ts->update_timer(1, timing, ReplicaSet::empty_set(), 0, popping));
+  EXPECT_FALSE(popping);
+  EXPECT_EQ(100, timers[0]->interval);
+
+  // Tombstones aren't brought back to life by an update.
+  ts->add_timer(tombstone);
+  timing.start_time = tombstone->start_time + 1;
+  EXPECT_EQ(NULL, ts->update_timer(1, timing, ReplicaSet::empty_set(), 0, popping));
+  EXPECT_FALSE(popping);
+
+  delete timers[1];
+  delete timers[2];
+}
+
+TEST_F(TestTimerStore, RearmTimer)
+{
+  ts->add_timer(timers[0]);
+
+  std::unordered_set<Timer*> next_timers;
+  cwtest_advance_time_ms(100 + TIMER_GRANULARITY_MS);
+  ts->get_next_timers(next_timers);
+  ASSERT_EQ(1, next_timers.size());
+
+  // While the timer is being processed the store doesn't hold it, and
+  // reports that the timer is popping.
+  TimerTiming timing;
+  timing.start_time = timers[0]->start_time;
+  timing.sequence_number = 1;
+  timing.interval = 100;
+  timing.repeat_for = 200;
+  bool popping;
+  EXPECT_EQ(NULL, ts->update_timer(1, timing, ReplicaSet::empty_set(), 0, popping));
+  EXPECT_TRUE(popping);
+
+  // Re-arm the timer for its next pop.
+  timers[0]->sequence_number++;
+  ts->rearm_timers(next_timers);
+  EXPECT_TRUE(next_timers.empty());
+
+  cwtest_advance_time_ms(100);
+  ts->get_next_timers(next_timers);
+  ASSERT_EQ(1, next_timers.size());
+  EXPECT_EQ(timers[0], *next_timers.begin());
+
+  delete timers[0];
+  delete timers[1];
+  delete timers[2];
+  delete tombstone;
+}
+
+TEST_F(TestTimerStore, RearmReplacedTimer)
+{
+  ts->add_timer(timers[0]);
+
+  std::unordered_set<Timer*> next_timers;
+  cwtest_advance_time_ms(100 + TIMER_GRANULARITY_MS);
+  ts->get_next_timers(next_timers);
+  ASSERT_EQ(1, next_timers.size());
+  next_timers.clear();
+
+  // The timer is replaced by a client while it's being processed.
+  Timer* replacement = new Timer(*timers[0]);
+  replacement->start_time += 100;
+  replacement->interval = 1000;
+  ts->add_timer(replacement);
+
+  // Re-arming the popped timer loses to the replacement.
+  timers[0]->sequence_number++;
+  ts->rearm_timer(timers[0]);
+
+  cwtest_advance_time_ms(1000);
+  ts->get_next_timers(next_timers);
+  ASSERT_EQ(1, next_timers.size());
+  EXPECT_EQ(replacement, *next_timers.begin());
+
+  delete replacement;
+  delete timers[1];
+  delete timers[2];
+  delete tombstone;
+}
+
+TEST_F(TestTimerStore, RearmAsTombstone)
+{
+  ts->add_timer(timers[0]);
+
+  std::unordered_set<Timer*> next_timers;
+  cwtest_advance_time_ms(100 + TIMER_GRANULARITY_MS);
+  ts->get_next_timers(next_timers);
+  ASSERT_EQ(1, next_timers.size());
+  next_timers.clear();
+
+  // The timer has finished, so is re-armed as a tombstone, which blocks older
+  // versions of the timer.
+  Timer* old_timer = new Timer(*timers[0]);
+  timers[0]->sequence_number++;
+  timers[0]->become_tombstone();
+  ts->rearm_timer(timers[0]);
+  ts->add_timer(old_timer);
+
+  cwtest_advance_time_ms(1000);
+  ts->get_next_timers(next_timers);
+  EXPECT_TRUE(next_timers.empty());
+
+  delete timers[1];
+  delete timers[2];
+  delete tombstone;
+}
+
+TEST_F(TestTimerStore, ReleaseTimer)
+{
+  ts->add_timer(timers[0]);
+
+  std::unordered_set<Timer*> next_timers;
+  cwtest_advance_time_ms(100 + TIMER_GRANULARITY_MS);
+  ts->get_next_timers(next_timers);
+  ASSERT_EQ(1, next_timers.size());
+  ts->release_timer(1);
+  next_timers.clear();
+
+  // A released timer is re-added as normal.
+  ts->rearm_timer(timers[0]);
+  cwtest_advance_time_ms(100);
+  ts->get_next_timers(next_timers);
+  ASSERT_EQ(1, next_timers.size());
+  EXPECT_EQ(timers[0], *next_timers.begin());
+
+  delete timers[0];
+  delete timers[1];
+  delete timers[2];
+  delete tombstone;
+}
+
+TEST_F(TestTimerStore, Digest)
+{
+  NodeID node = NodeTable::intern("10.0.0.1");
+  std::vector<uint64_t> root;
+
+  ts->add_timer(timers[0]);
+  ts->digest().hashes(node, 0, 0, 1, root);
+  uint64_t added = root[0];
+  EXPECT_NE(0u, added);
+  EXPECT_EQ(timers[0], ts->get_timer(1));
+
+  // Popping and re-arming the timer doesn't change the digest, even though the
+  // store doesn't hold the timer while it's popped.
+  std::unordered_set<Timer*> next_timers;
+  cwtest_advance_time_ms(100 + TIMER_GRANULARITY_MS);
+  ts->get_next_timers(next_timers);
+  ASSERT_EQ(1, next_timers.size());
+  EXPECT_EQ(NULL, ts->get_timer(1));
+  ts->digest().hashes(node, 0, 0, 1, root);
+  EXPECT_EQ(added, root[0]);
+
+  timers[0]->sequence_number++;
+  ts->rearm_timers(next_timers);
+  ts->digest().hashes(node, 0, 0, 1, root);
+  EXPECT_EQ(added, root[0]);
+
+  // Deleting the timer removes it from the digest.
+  ts->add_timer(tombstone);
+  ts->digest().hashes(node, 0, 0, 1, root);
+  EXPECT_EQ(0u, root[0]);
+
+  delete timers[1];
+  delete timers[2];
+}